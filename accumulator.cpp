@@ -0,0 +1,214 @@
+#include "accumulator.h"
+#include "log.h"
+
+#include <algorithm>
+#include <memory>
+
+#include <errno.h>
+#include <string.h>
+#include <linux/random.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    EntropyAccumulator::EntropyAccumulator(int randomfd, unsigned int flushSize, chrono::seconds flushInterval, unsigned int minSources)
+        : m_randomfd(randomfd),
+        m_flushSize(flushSize),
+        m_flushInterval(flushInterval),
+        m_pendingBytes(0),
+        m_pendingCredit(0),
+        m_minSources(max(minSources, 1u)),
+        m_creditSupported(true),
+        m_lastFlushTime(chrono::steady_clock::now())
+    {
+        m_context = EVP_MD_CTX_new();
+
+        if(m_context == nullptr || EVP_DigestInit_ex(m_context, EVP_sha256(), nullptr) != 1)
+        {
+            // Add() and Flush() will fail, and the client will report it.
+            NrpdLog::LogString("Accumulator: failed to initialize hash");
+        }
+    }
+
+
+    EntropyAccumulator::~EntropyAccumulator()
+    {
+        // Don't throw away what has been gathered so far
+        if(m_pendingBytes > 0)
+        {
+            Flush();
+        }
+
+        if(m_context != nullptr)
+        {
+            EVP_MD_CTX_free(m_context);
+        }
+    }
+
+
+    bool EntropyAccumulator::Add(const void* data, size_t size, unsigned int creditBits, size_t source)
+    {
+        unsigned int credit;
+
+        if(data == nullptr || m_context == nullptr)
+        {
+            return false;
+        }
+
+        if(EVP_DigestUpdate(m_context, data, size) != 1)
+        {
+            return false;
+        }
+
+        m_pendingBytes += size;
+
+        // Never credit more than 8 bits per byte of input
+        credit = min<size_t>(creditBits, size * 8);
+        m_pendingCredit += credit;
+        m_sourceCredit[source] += credit;
+
+        if(m_pendingBytes >= m_flushSize && PendingServers() >= m_minSources)
+        {
+            return Flush();
+        }
+
+        return true;
+    }
+
+
+    unsigned int EntropyAccumulator::PendingServers() const
+    {
+        return m_sourceCredit.size() - m_sourceCredit.count(ACCUMULATOR_LOCAL_SOURCE);
+    }
+
+
+    unsigned int EntropyAccumulator::FlushCredit() const
+    {
+        unsigned int largest = 0;
+
+        if(m_minSources == 1)
+        {
+            return m_pendingCredit;
+        }
+
+        for(auto const& source : m_sourceCredit)
+        {
+            largest = max(largest, source.second);
+        }
+
+        return m_pendingCredit - largest;
+    }
+
+
+    bool EntropyAccumulator::FlushIfDue()
+    {
+        if(m_pendingBytes == 0)
+        {
+            return true;
+        }
+
+        if(chrono::steady_clock::now() < (m_lastFlushTime + m_flushInterval))
+        {
+            return true;
+        }
+
+        return Flush();
+    }
+
+
+    bool EntropyAccumulator::Flush()
+    {
+        unsigned char digest[ACCUMULATOR_DIGEST_SIZE];
+        unsigned int digestSize = 0;
+        unsigned int credit;
+        bool success;
+
+        if(m_context == nullptr)
+        {
+            return false;
+        }
+
+        if(m_pendingBytes == 0)
+        {
+            return true;
+        }
+
+        if(EVP_DigestFinal_ex(m_context, digest, &digestSize) != 1)
+        {
+            return false;
+        }
+
+        // The digest can't hold more entropy than its own size
+        credit = min<unsigned int>(FlushCredit(), digestSize * 8);
+
+        success = WriteBlock(digest, digestSize, credit);
+
+        // Clear secret memory
+        memset(digest, 0, sizeof(digest));
+
+        // Start a new block, whether or not the write succeeded; the inputs
+        // can't be recovered from a finalized context.
+        EVP_DigestInit_ex(m_context, EVP_sha256(), nullptr);
+        m_pendingBytes = 0;
+        m_pendingCredit = 0;
+        m_sourceCredit.clear();
+        m_lastFlushTime = chrono::steady_clock::now();
+
+        return success;
+    }
+
+
+    void EntropyAccumulator::SetFlushPolicy(unsigned int flushSize, chrono::seconds flushInterval, unsigned int minSources)
+    {
+        m_flushSize = flushSize;
+        m_flushInterval = flushInterval;
+        m_minSources = max(minSources, 1u);
+    }
+
+
+    bool EntropyAccumulator::WriteBlock(unsigned char* block, int size, unsigned int creditBits)
+    {
+        if(m_creditSupported)
+        {
+            // rand_pool_info ends in a flexible array of the block to add
+            unique_ptr<unsigned char[]> buffer = make_unique<unsigned char[]>(sizeof(rand_pool_info) + size);
+            rand_pool_info* info = (rand_pool_info*) buffer.get();
+
+            info->entropy_count = creditBits;
+            info->buf_size = size;
+            memcpy(info->buf, block, size);
+
+            int result = ioctl(m_randomfd, RNDADDENTROPY, info);
+
+            // Clear secret memory
+            memset(info->buf, 0, size);
+
+            if(result == 0)
+            {
+                return true;
+            }
+
+            if(errno != EPERM && errno != ENOTTY && errno != EINVAL)
+            {
+                NrpdLog::LogString("Accumulator: failed to add entropy to random device");
+                return false;
+            }
+
+            // Not privileged, or not a random device: stop trying to credit
+            // and just mix the data in.
+            NrpdLog::LogString("Accumulator: can't credit entropy; writing without credit");
+            m_creditSupported = false;
+        }
+
+        if(write(m_randomfd, block, size) != size)
+        {
+            NrpdLog::LogString("Accumulator: failed to write to random device");
+            return false;
+        }
+
+        return true;
+    }
+}
@@ -0,0 +1,85 @@
+#include <chrono>
+#include <unordered_map>
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+#pragma once
+
+#define ACCUMULATOR_DIGEST_SIZE (32) // SHA-256
+#define ACCUMULATOR_DEFAULT_FLUSH_SIZE (512) // input bytes per flush
+#define ACCUMULATOR_DEFAULT_FLUSH_SECONDS (60)
+#define ACCUMULATOR_DEFAULT_MIN_SOURCES (3) // distinct servers per flush
+#define ACCUMULATOR_LOCAL_SOURCE (0) // the source of locally gathered entropy
+
+using namespace std;
+
+namespace nrpd
+{
+    // Collects entropy from many sources, conditions it with SHA-256, and
+    // hands it to the kernel in large blocks.
+    //
+    // Each flush writes one digest to the random device with RNDADDENTROPY,
+    // crediting the kernel with the sum of the credits of the inputs,
+    // capped at the size of the digest. If the process lacks the privilege
+    // to credit entropy, the digest is written to the device uncredited,
+    // which still mixes it into the pool.
+    //
+    // Unless minSources is 1, a block isn't flushed for its size until
+    // that many distinct servers contributed to it, and the credit leaves
+    // out the largest contribution of any one source. So no single server,
+    // lying or compromised, decides a block or accounts for its credit.
+    class EntropyAccumulator
+    {
+    public:
+        // randomfd must be open for writing; it is not owned by the
+        // accumulator.
+        EntropyAccumulator(int randomfd, unsigned int flushSize, chrono::seconds flushInterval, unsigned int minSources);
+        ~EntropyAccumulator();
+
+        // Mix size bytes of data from source into the pool, crediting them
+        // with at most creditBits of entropy. source identifies a server,
+        // e.g. by the hash of its record, or is ACCUMULATOR_LOCAL_SOURCE.
+        // Flushes if flushSize bytes have accumulated from enough servers.
+        // Returns false if a flush failed.
+        bool Add(const void* data, size_t size, unsigned int creditBits, size_t source);
+
+        // Flush if the flush interval has elapsed since the last flush and
+        // there is pending input, from however many servers.
+        // Returns false if a flush failed.
+        bool FlushIfDue();
+
+        // Condition all pending input and write it to the random device.
+        // Returns false on failure. Pending input is dropped either way,
+        // since it can't be recovered once conditioned.
+        bool Flush();
+
+        // Change the flush thresholds
+        void SetFlushPolicy(unsigned int flushSize, chrono::seconds flushInterval, unsigned int minSources);
+
+        size_t PendingBytes() const { return m_pendingBytes; }
+        unsigned int PendingCredit() const { return m_pendingCredit; }
+
+        // Distinct servers that contributed to the pending block
+        unsigned int PendingServers() const;
+
+        // What a flush would credit now, before capping at the digest size
+        unsigned int FlushCredit() const;
+
+    private:
+        int m_randomfd;
+        EVP_MD_CTX* m_context;
+        unsigned int m_flushSize;
+        chrono::seconds m_flushInterval;
+        size_t m_pendingBytes;
+        unsigned int m_pendingCredit; // bits
+        unsigned int m_minSources;
+        unordered_map<size_t, unsigned int> m_sourceCredit; // bits, by source
+        bool m_creditSupported; // false once RNDADDENTROPY has been refused
+        chrono::steady_clock::time_point m_lastFlushTime;
+
+        // Write a conditioned block to the random device, crediting
+        // creditBits of entropy if possible.
+        bool WriteBlock(unsigned char* block, int size, unsigned int creditBits);
+    };
+}
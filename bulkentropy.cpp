@@ -0,0 +1,169 @@
+#include "bulkentropy.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    int BuildEntropyTrain(int randomfd, int segmentSize, int segments, unsigned char* buffer)
+    {
+        int contentSize = segmentSize - NRP_PACKET_HEADER_SIZE;
+        int msgCount = (contentSize + BULK_MAX_MESSAGE_SIZE - 1) / BULK_MAX_MESSAGE_SIZE;
+        int total = segmentSize * segments;
+
+        if(buffer == nullptr || segments <= 0 || contentSize <= NRP_MESSAGE_HEADER_SIZE || msgCount > MAX_BYTE)
+        {
+            return 0;
+        }
+
+        // Read the entropy for every segment at once; the headers then
+        // overwrite their share of it.
+        if(read(randomfd, buffer, total) != total)
+        {
+            return 0;
+        }
+
+        for(int segment = 0; segment < segments; segment++)
+        {
+            pNrp_Header_Message msg = GeneratePacketHeader(segmentSize, response, msgCount, (pNrp_Header_Packet) (buffer + (segment * segmentSize)));
+
+            for(int index = 0; index < msgCount; index++)
+            {
+                // Spread the content evenly, so no message is left too
+                // small to hold any entropy.
+                int size = (contentSize / msgCount) + ((index < contentSize % msgCount) ? 1 : 0);
+
+                msg->length = htons(size);
+                msg->msgType = entropy;
+                msg->countOrSize = size - NRP_MESSAGE_HEADER_SIZE;
+
+                msg = NextMessage(msg);
+            }
+        }
+
+        return total;
+    }
+
+
+    int SendSegments(int socketfd, const unsigned char* buffer, int size, int segmentSize, const sockaddr* addr, socklen_t addrSize, bool& useGso, int& outSyscalls)
+    {
+        int segmentsPerSend = min(BULK_MAX_SEGMENTS, MAX_RESPONSE_MESSAGE_SIZE / segmentSize);
+        int offset = 0;
+
+        if(buffer == nullptr || segmentSize <= 0 || segmentsPerSend <= 0)
+        {
+            return EINVAL;
+        }
+
+        while(offset < size)
+        {
+            int chunk = min(size - offset, segmentsPerSend * segmentSize);
+
+            if(useGso)
+            {
+                char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+                iovec iov = { (void*) (buffer + offset), (size_t) chunk };
+                msghdr msg = {0};
+                cmsghdr* cmsg;
+
+                msg.msg_name = (void*) addr;
+                msg.msg_namelen = addrSize;
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                *((uint16_t*) CMSG_DATA(cmsg)) = segmentSize;
+
+                outSyscalls++;
+
+                if(sendmsg(socketfd, &msg, 0) >= 0)
+                {
+                    offset += chunk;
+                    continue;
+                }
+
+                if(errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+                {
+                    return errno;
+                }
+
+                // No segmentation offload here; fall back for good
+                useGso = false;
+            }
+
+            for(int sent = 0; sent < chunk; sent += segmentSize)
+            {
+                outSyscalls++;
+
+                if(sendto(socketfd, buffer + offset + sent, min(segmentSize, chunk - sent), 0, addr, addrSize) < 0)
+                {
+                    return errno;
+                }
+            }
+
+            offset += chunk;
+        }
+
+        return 0;
+    }
+
+
+    int ReceiveSegments(int socketfd, unsigned char* buffer, int size, int flags, int& outSegmentSize, sockaddr_storage* outFromAddr)
+    {
+        char control[CMSG_SPACE(sizeof(int))] = {0};
+        iovec iov = { buffer, (size_t) size };
+        msghdr msg = {0};
+        int count;
+
+        msg.msg_name = outFromAddr;
+        msg.msg_namelen = (outFromAddr != nullptr) ? sizeof(sockaddr_storage) : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if((count = recvmsg(socketfd, &msg, flags)) < 0)
+        {
+            return count;
+        }
+
+        outSegmentSize = count;
+
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int segmentSize;
+
+                memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+
+                if(segmentSize > 0)
+                {
+                    outSegmentSize = segmentSize;
+                }
+            }
+        }
+
+        return count;
+    }
+
+
+    bool EnableGro(int socketfd)
+    {
+        int enable = 1;
+
+        return setsockopt(socketfd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+    }
+}
@@ -0,0 +1,44 @@
+#include <sys/socket.h>
+
+#include "protocol.h"
+
+#pragma once
+
+#define BULK_MAX_SEGMENTS (64) // the kernel's limit of segments per GSO send
+#define BULK_MAX_MESSAGE_SIZE (NRP_MESSAGE_HEADER_SIZE + MAX_BYTE)
+
+using namespace std;
+
+namespace nrpd
+{
+    // A bulk entropy response is a train of response packets, each exactly
+    // segmentSize bytes (the path MTU) and full of entropy messages.
+    // Because every segment is a complete packet, the server can hand the
+    // whole train to the kernel in one UDP_SEGMENT (GSO) send, and a client
+    // with UDP_GRO enabled may receive many of them in one read, without
+    // either side parsing or building them one datagram at a time.
+
+    // Fill buffer with segments packets of entropy, of segmentSize bytes
+    // each, reading all of the entropy with one read from randomfd.
+    // buffer must hold segments * segmentSize bytes.
+    // Returns the number of bytes written, or 0 on failure.
+    int BuildEntropyTrain(int randomfd, int segmentSize, int segments, unsigned char* buffer);
+
+    // Send size bytes of segmentSize-byte datagrams to addr, with as few
+    // UDP_SEGMENT sends as the kernel allows. If the socket or device can't
+    // segment, useGso is cleared and datagrams are sent one at a time.
+    // outSyscalls is increased by the number of sends made.
+    // Returns 0 on success, or errno on failure.
+    int SendSegments(int socketfd, const unsigned char* buffer, int size, int segmentSize, const sockaddr* addr, socklen_t addrSize, bool& useGso, int& outSyscalls);
+
+    // Receive into buffer; with UDP_GRO enabled, several datagrams of the
+    // same size may arrive at once. outSegmentSize is set to the size of
+    // each datagram, which is the whole result if they weren't coalesced.
+    // If outFromAddr isn't nullptr, it's set to the sender's address.
+    // Returns the number of bytes received, or -1 and errno on failure.
+    int ReceiveSegments(int socketfd, unsigned char* buffer, int size, int flags, int& outSegmentSize, sockaddr_storage* outFromAddr = nullptr);
+
+    // Let the kernel coalesce datagrams received on socketfd.
+    // Returns false if it isn't supported.
+    bool EnableGro(int socketfd);
+}
@@ -0,0 +1,162 @@
+#include "certchain.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    CertChainBlob::~CertChainBlob()
+    {
+        if(m_blob != nullptr)
+        {
+            munmap(m_blob, m_blobSize);
+        }
+    }
+
+
+    unique_ptr<CertChainBlob> CertChainBlob::Load(const char* path)
+    {
+        unique_ptr<CertChainBlob> blob;
+        vector<unsigned char> chain;
+        FILE* file = fopen(path, "r");
+        X509* cert;
+        void* mapping;
+        unsigned long error;
+
+        if(file == nullptr)
+        {
+            NrpdLog::LogString("CertChain: failed to open certificate chain");
+            return nullptr;
+        }
+
+        // Only errors from reading this file count below
+        ERR_clear_error();
+
+        // Concatenate the DER of each certificate, leaf first
+        while((cert = PEM_read_X509(file, nullptr, nullptr, nullptr)) != nullptr)
+        {
+            int size = i2d_X509(cert, nullptr);
+            unsigned char* der;
+
+            if(size <= 0 || chain.size() + size > CERTCHAIN_MAX_SIZE)
+            {
+                X509_free(cert);
+                fclose(file);
+                NrpdLog::LogString("CertChain: certificate chain too large");
+                return nullptr;
+            }
+
+            chain.resize(chain.size() + size);
+            der = chain.data() + chain.size() - size;
+            i2d_X509(cert, &der);
+            X509_free(cert);
+        }
+
+        fclose(file);
+
+        // PEM_read_X509 returns nullptr for a malformed certificate too; only
+        // a missing start line means the file ended
+        error = ERR_peek_last_error();
+        ERR_clear_error();
+
+        if(ERR_GET_LIB(error) != ERR_LIB_PEM || ERR_GET_REASON(error) != PEM_R_NO_START_LINE)
+        {
+            NrpdLog::LogString("CertChain: malformed certificate in chain");
+            return nullptr;
+        }
+
+        if(chain.empty())
+        {
+            NrpdLog::LogString("CertChain: no certificates in chain");
+            return nullptr;
+        }
+
+        blob = unique_ptr<CertChainBlob>(new CertChainBlob());
+        blob->m_chainSize = chain.size();
+        blob->m_chunkCount[false] = (chain.size() + sizeof(Nrp_Message_CertChain_Response4::data) - 1) / sizeof(Nrp_Message_CertChain_Response4::data);
+        blob->m_chunkCount[true] = (chain.size() + sizeof(Nrp_Message_CertChain_Response6::data) - 1) / sizeof(Nrp_Message_CertChain_Response6::data);
+        blob->m_offset[false] = 0;
+        blob->m_offset[true] = blob->m_chunkCount[false] * CERTCHAIN_IP4_MESSAGE_SIZE;
+        blob->m_blobSize = blob->m_offset[true] + (blob->m_chunkCount[true] * CERTCHAIN_IP6_MESSAGE_SIZE);
+
+        // Anonymous and zeroed, which pads the last chunks
+        mapping = mmap(nullptr, blob->m_blobSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(mapping == MAP_FAILED)
+        {
+            NrpdLog::LogString("CertChain: failed to map chunks");
+            return nullptr;
+        }
+
+        blob->m_blob = (unsigned char*) mapping;
+
+        if(!blob->BuildChunks(false, chain.data(), blob->m_offset[false])
+           || !blob->BuildChunks(true, chain.data(), blob->m_offset[true]))
+        {
+            NrpdLog::LogString("CertChain: failed to hash chunks");
+            return nullptr;
+        }
+
+        // Nothing changes it from here on
+        if(mprotect(blob->m_blob, blob->m_blobSize, PROT_READ) != 0)
+        {
+            NrpdLog::LogString("CertChain: failed to protect chunks");
+            return nullptr;
+        }
+
+        return blob;
+    }
+
+
+    bool CertChainBlob::BuildChunks(bool ipv6, const unsigned char* chain, size_t offset)
+    {
+        size_t messageSize = ChunkMessageSize(ipv6);
+        size_t dataSize = (ipv6) ? sizeof(Nrp_Message_CertChain_Response6::data) : sizeof(Nrp_Message_CertChain_Response4::data);
+
+        for(unsigned short index = 0; index < m_chunkCount[ipv6]; index++)
+        {
+            pNrp_Header_Message hdr = (pNrp_Header_Message) (m_blob + offset + (index * messageSize));
+            // The families share their layout up to data
+            pNrp_Message_CertChain_Response4 chunk = (pNrp_Message_CertChain_Response4) hdr->content;
+            size_t start = index * dataSize;
+            unsigned char* hash = chunk->data + dataSize;
+
+            hdr->length = htons(messageSize);
+            hdr->msgType = nrpd_msg_type::certchain;
+            hdr->countOrSize = 1;
+
+            chunk->chunk = htons(index);
+            chunk->totalChunks = htons(m_chunkCount[ipv6]);
+            memcpy(chunk->data, chain + start, min(dataSize, m_chainSize - start));
+
+            if(EVP_Digest(chunk, hash - (unsigned char*) chunk, hash, nullptr, EVP_sha256(), nullptr) != 1)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    const unsigned char* CertChainBlob::ChunkMessage(bool ipv6, unsigned short index) const
+    {
+        if(index >= m_chunkCount[ipv6])
+        {
+            return nullptr;
+        }
+
+        return m_blob + m_offset[ipv6] + (index * ChunkMessageSize(ipv6));
+    }
+}
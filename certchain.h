@@ -0,0 +1,59 @@
+#include <memory>
+#include <stddef.h>
+
+#include "protocol.h"
+
+#pragma once
+
+#define CERTCHAIN_MAX_SIZE (64 * 1024) // of the DER chain
+#define CERTCHAIN_IP4_MESSAGE_SIZE (sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_CertChain_Response4))
+#define CERTCHAIN_IP6_MESSAGE_SIZE (sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_CertChain_Response6))
+
+using namespace std;
+
+namespace nrpd
+{
+    // A server's certificate chain, cut into chunks for each address
+    // family, and hashed, once when it's loaded.
+    //
+    // Every chunk's whole message, header included, sits in one read-only
+    // mapping, so a response can send a chunk straight from it, and serving
+    // one costs no more than finding it.
+    class CertChainBlob
+    {
+    public:
+        ~CertChainBlob();
+
+        CertChainBlob(CertChainBlob const&) = delete;
+        CertChainBlob& operator=(CertChainBlob const&) = delete;
+
+        // Load the PEM certificates in the file at path, in order, and
+        // build their chunks. Returns nullptr on failure, including if any
+        // certificate is malformed.
+        static unique_ptr<CertChainBlob> Load(const char* path);
+
+        // The message of chunk index for clients of the family, or nullptr
+        // if there's no such chunk. It lives as long as the blob.
+        const unsigned char* ChunkMessage(bool ipv6, unsigned short index) const;
+
+        // Size of each of the family's chunk messages
+        int ChunkMessageSize(bool ipv6) const { return (ipv6) ? CERTCHAIN_IP6_MESSAGE_SIZE : CERTCHAIN_IP4_MESSAGE_SIZE; }
+
+        unsigned short ChunkCount(bool ipv6) const { return m_chunkCount[ipv6]; }
+
+        // Size of the DER chain, without padding
+        size_t ChainSize() const { return m_chainSize; }
+
+    private:
+        CertChainBlob() : m_blob(nullptr), m_blobSize(0), m_offset{0}, m_chunkCount{0}, m_chainSize(0) {}
+
+        // Write the family's chunks of chain at offset into the blob
+        bool BuildChunks(bool ipv6, const unsigned char* chain, size_t offset);
+
+        unsigned char* m_blob;
+        size_t m_blobSize;
+        size_t m_offset[2];             // of each family's first chunk, by ipv6
+        unsigned short m_chunkCount[2];
+        size_t m_chainSize;
+    };
+}
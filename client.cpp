@@ -2,12 +2,17 @@
 #include "protocol.h"
 #include "stdhelpers.h"
 #include "log.h"
+#include "scramble.h"
+#include "bulkentropy.h"
+#include <array>
 #include <memory>
 #include <chrono>
 #include <ratio>
 #include <cmath>
+#include <thread>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -25,7 +30,7 @@ namespace nrpd
     }
 
 
-    NrpdClient::NrpdClient(shared_ptr<NrpdConfig> conf) : m_config(conf), m_state(notinitialized)
+    NrpdClient::NrpdClient(shared_ptr<NrpdConfig> conf) : m_config(conf), m_socketfd4(-1), m_socketfd6(-1), m_connected4(false), m_connected6(false), m_randomfd(-1), m_demandLevel(demand_normal), m_demandEnabled(false), m_state(notinitialized), m_keyJobPending(false), m_securePending(false), m_healthPruneSize(CLIENT_HEALTH_PRUNE_SIZE), m_healthStats(), m_healthFailed(false)
     {
     }
 
@@ -34,6 +39,9 @@ namespace nrpd
     {
         m_state = destroying;
 
+        // Flush what's been accumulated while the random device is still open
+        m_accumulator.reset();
+
         if(m_socketfd4 > 0)
         {
             close(m_socketfd4);
@@ -74,6 +82,12 @@ namespace nrpd
                 return errno;
             }
 
+            // Receive bulk entropy trains in as few reads as possible
+            if(!EnableGro(m_socketfd6))
+            {
+                NrpdLog::LogString("Client: UDP GRO unavailable for IPv6");
+            }
+
             // Bind to the socket
             hostAddr6.sin6_addr = IN6ADDR_ANY_INIT;
             hostAddr6.sin6_family = AF_INET6;
@@ -101,6 +115,12 @@ namespace nrpd
                 return errno;
             }
 
+            // Receive bulk entropy trains in as few reads as possible
+            if(!EnableGro(m_socketfd4))
+            {
+                NrpdLog::LogString("Client: UDP GRO unavailable for IPv4");
+            }
+
             // Bind to the socket
             hostAddr.sin_addr.s_addr = INADDR_ANY;
             hostAddr.sin_family = AF_INET;
@@ -119,6 +139,24 @@ namespace nrpd
             return errno;
         }
 
+        m_randomBuffer = make_unique<RandomBuffer>(m_randomfd);
+        m_accumulator = make_unique<EntropyAccumulator>(m_randomfd, m_config->entropyFlushSize(), chrono::seconds(m_config->entropyFlushInterval()), m_config->entropyMinSources());
+
+        if(m_config->demandMode())
+        {
+            if(m_demand.Initialize() == 0)
+            {
+                m_demandEnabled = true;
+            }
+            else
+            {
+                // Not fatal; poll at the configured rate instead.
+                NrpdLog::LogString("Client: can't read kernel entropy level; demand mode disabled");
+            }
+        }
+
+        m_verifier = make_unique<KeyVerifier>(CLIENT_VERIFY_WORKERS);
+
         m_state = initialized;
 
         return 0;
@@ -153,40 +191,62 @@ namespace nrpd
 
         // Calculate maximum request message for this server
         int serverMsgSupportCount = 2; // For the packet and entropy headers
-        serverMsgSupportCount += ((server.signkey) ? 1 : 0);
+        serverMsgSupportCount += ((server.signkey) ? 2 : 0); // sign and encryption keys
         serverMsgSupportCount += ((server.ip4Peers) ? 1 : 0);
         serverMsgSupportCount += ((server.ip6Peers) ? 1 : 0);
+        serverMsgSupportCount += ((server.receiveSize) ? 1 : 0);
+        serverMsgSupportCount += ((server.bulkEntropy) ? 1 : 0);
+        serverMsgSupportCount += ((server.transactionId) ? 1 : 0);
         // Check size of the buffer is large enough to hold the request
-        if(bufSize < (sizeof(Nrp_Header_Message) * serverMsgSupportCount))
+        if(bufSize < (sizeof(Nrp_Header_Message) * serverMsgSupportCount) + sizeof(Nrp_Message_ReceiveSize_Request)
+                     + sizeof(Nrp_Message_TransactionId) + sizeof(Nrp_Message_SecureEntropy_Request))
         {
             // TODO: log here
             return false;
         }
 
 
-        // 1. request signing cert info or secure entropy from the server
-        // (if signing cert info is already obtained)
+        // 0.a. Identify the request, so the response can be told apart from
+        // late or forged ones without connecting to the server.
+        if(server.transactionId)
+        {
+            msg = GenerateTransactionIdMessage(m_transactionId, msg);
+            msgCount++;
+            msgSize += sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_TransactionId);
+        }
+
+        // 0.b. Tell the server how much the response may hold, so it isn't
+        // limited to what every client can receive.
+        if(server.receiveSize)
+        {
+            msg = GenerateRequestReceiveSizeMessage(min<unsigned int>(bufSize, MAX_RESPONSE_MESSAGE_SIZE), PreferredEntropySize(), msg);
+            msgCount++;
+            msgSize += sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_ReceiveSize_Request);
+        }
+
+        // 1. request the server's keys, or secure entropy from the server
+        // (if its keys are already obtained)
+        // TODO: request the certchain, to vouch for the pinned identity
+        m_securePending = false;
+
         if(server.signkey)
         {
-            // if server has signkey info
-                //if server.cert->NearExpiration()
-                    // TODO: construct new signkey request message
-                // if server has certchain info
-                    // if server has encryption key info
-                        // TODO: construct a secureentropy request message
-                    // else
-                        // TODO: construct encryptionkey request message
-                // else
-                    // TODO: construct a certchain request message
-            // else
-                // TODO: Construct a signkey request message
+            msg = GenerateSecureRequest(server, msg, msgCount, msgSize);
         }
 
         // 2. Request entropy from the server
-        msg = GenerateRequestEntropyMessage(m_config->defaultEntropySize(), msg);
+        msg = GenerateRequestEntropyMessage(RequestEntropySize(), msg);
         msgCount++;
         msgSize += sizeof(Nrp_Header_Message);
 
+        // 2.a. Request a bulk entropy train, if the kernel is short
+        if(WantBulkEntropy(server))
+        {
+            msg = GenerateRequestBulkEntropyMessage(CLIENT_BULK_ENTROPY_SEGMENTS, msg);
+            msgCount++;
+            msgSize += sizeof(Nrp_Header_Message);
+        }
+
         // 3.a. Request ip4 peers (only if the client is configured for ipv4)
         if(server.ip4Peers && m_config->enableClientIp4())
         {
@@ -220,51 +280,369 @@ namespace nrpd
     }
 
 
-    bool NrpdClient::ConnectServer(ServerRecord const& server)
+    NrpdClient::ServerKeys* NrpdClient::FindServerKeys(ServerRecord const& server)
     {
-        sockaddr_storage sendServerAddr;
-        bool result = true;
-        int error = 0;
+        auto keys = m_serverKeys.find(server);
+
+        if(keys == m_serverKeys.end())
+        {
+            return nullptr;
+        }
+
+        // The identity stays pinned when the epoch's keys expire
+        if(keys->second.hasSignKey && time(nullptr) >= keys->second.expiry)
+        {
+            keys->second.hasSignKey = false;
+            keys->second.hasSession = false;
+        }
+
+        return &keys->second;
+    }
+
+
+    void NrpdClient::ApplyVerifiedKeys()
+    {
+        vector<VerifiedKeys> results;
+
+        m_verifier->Collect(results);
+
+        for(VerifiedKeys const& result : results)
+        {
+            auto keys = m_serverKeys.find(result.server);
+
+            m_verifying.erase(result.server);
+
+            if(!result.hasSignKey)
+            {
+                NrpdLog::LogString("Client: server keys failed verification");
+                continue;
+            }
+
+            // Checked again, in case the identity was pinned meanwhile
+            if(keys == m_serverKeys.end())
+            {
+                keys = m_serverKeys.emplace(result.server, ServerKeys()).first;
+                memcpy(keys->second.identity, result.identity, SECURE_PUBLIC_KEY_SIZE);
+            }
+            else if(memcmp(keys->second.identity, result.identity, SECURE_PUBLIC_KEY_SIZE) != 0)
+            {
+                NrpdLog::LogString("Client: sign key is from a different identity than the one pinned");
+                continue;
+            }
+
+            memcpy(keys->second.signKey, result.signKey, SECURE_PUBLIC_KEY_SIZE);
+            keys->second.keyId = result.keyId;
+            keys->second.expiry = result.expiry;
+            keys->second.hasSignKey = true;
+            keys->second.hasSession = result.hasSession;
+
+            if(result.hasSession)
+            {
+                keys->second.secureRequest = result.secureRequest;
+                keys->second.session = result.session;
+            }
+        }
+    }
+
+
+    pNrp_Header_Message NrpdClient::GenerateSecureRequest(ServerRecord const& server, pNrp_Header_Message msg, int& msgCount, int& msgSize)
+    {
+        ServerKeys* keys = FindServerKeys(server);
+
+        // Plain entropy only, until the keys it sent are verified
+        if(m_verifying.count(server) > 0)
+        {
+            return msg;
+        }
+
+        // The session was agreed when the keys were verified
+        if(keys != nullptr && keys->hasSession)
+        {
+            m_secureRequest = keys->secureRequest;
+            m_secureSession = keys->session;
+            m_securePending = true;
+
+            msgCount++;
+            msgSize += sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_SecureEntropy_Request);
+            return GenerateRequestSecureEntropyMessage(&m_secureRequest, msg);
+        }
+
+        // The sign key is needed to verify the encryption key, and the
+        // server sends them in the order asked for.
+        if(keys == nullptr || !keys->hasSignKey)
+        {
+            msg = GenerateRequestKeyMessage(signkey, msg);
+            msgCount++;
+            msgSize += sizeof(Nrp_Header_Message);
+        }
+
+        msgCount++;
+        msgSize += sizeof(Nrp_Header_Message);
+        return GenerateRequestKeyMessage(encryptionkey, msg);
+    }
+
+
+    void NrpdClient::ApplyTuning()
+    {
+        shared_ptr<const NrpdTuning> tuning = m_config->Tuning();
+
+        if(tuning == m_tuning)
+        {
+            return;
+        }
+
+        m_tuning = tuning;
+
+        timeval timeout = { (__time_t) (tuning->clientReceiveTimeoutSeconds), 0};
+
+        if(m_socketfd4 > 0 && setsockopt(m_socketfd4, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeval)) < 0)
+        {
+            NrpdLog::LogString("Client: failed to update receive timeout");
+        }
+
+        if(m_socketfd6 > 0 && setsockopt(m_socketfd6, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeval)) < 0)
+        {
+            NrpdLog::LogString("Client: failed to update receive timeout");
+        }
+
+        m_accumulator->SetFlushPolicy(tuning->entropyFlushSize, chrono::seconds(tuning->entropyFlushIntervalSeconds), tuning->entropyMinSources);
+    }
+
+
+    bool NrpdClient::UpdateDemand()
+    {
+        nrpd_demand_level level = m_demand.Level();
+
+        if(level == m_demandLevel)
+        {
+            return false;
+        }
+
+        m_demandLevel = level;
+
+        switch(level)
+        {
+        case demand_high:
+            NrpdLog::LogString("Client: kernel entropy is low; requesting more");
+            m_config->SetRetryScale(1.0f / DEMAND_SPEEDUP_FACTOR);
+            break;
+        case demand_low:
+            NrpdLog::LogString("Client: kernel entropy is full; backing off");
+            m_config->SetRetryScale(DEMAND_BACKOFF_FACTOR);
+            break;
+        default:
+            m_config->SetRetryScale(1.0f);
+            break;
+        }
+
+        return true;
+    }
+
+
+    unsigned char NrpdClient::RequestEntropySize()
+    {
+        if(m_demandEnabled && m_demandLevel == demand_high)
+        {
+            // Ask for as much as a message can hold
+            return MAX_BYTE;
+        }
+
+        return m_config->defaultEntropySize();
+    }
+
+
+    bool NrpdClient::WantBulkEntropy(ServerRecord const& server)
+    {
+        return server.bulkEntropy && m_demandEnabled && m_demandLevel == demand_high;
+    }
+
+
+    unsigned short NrpdClient::PreferredEntropySize()
+    {
+        if(m_demandEnabled && m_demandLevel == demand_high)
+        {
+            // Refill the kernel in as few round trips as possible
+            return CLIENT_HIGH_DEMAND_ENTROPY_SIZE;
+        }
+
+        return RequestEntropySize();
+    }
+
+
+    // Socket address of server; returns its size
+    static socklen_t ServerAddress(ServerRecord const& server, sockaddr_storage& outAddr)
+    {
+        memset(&outAddr, 0, sizeof(outAddr));
 
         if(server.ipv6)
         {
-            sendServerAddr.ss_family = AF_INET6;
-            sockaddr_in6& servAddr6 = (sockaddr_in6&) sendServerAddr;
+            sockaddr_in6& servAddr6 = (sockaddr_in6&) outAddr;
+            servAddr6.sin6_family = AF_INET6;
             servAddr6.sin6_port = server.port;
             memcpy(&(servAddr6.sin6_addr), server.host6, sizeof(servAddr6.sin6_addr));
 
-            if((error = connect(m_socketfd6, (sockaddr*) &sendServerAddr, sizeof(sockaddr_in6))) < 0)
-            {
-                // TODO: log error
-                NrpdLog::LogString("Client: failed to connect IPv6 server");
-                error = errno;
-                result = false;
-            }
+            return sizeof(sockaddr_in6);
         }
         else
         {
-            sendServerAddr.ss_family = AF_INET;
-            sockaddr_in& servAddr4 = (sockaddr_in&) sendServerAddr;
+            sockaddr_in& servAddr4 = (sockaddr_in&) outAddr;
+            servAddr4.sin_family = AF_INET;
             servAddr4.sin_port = server.port;
             memcpy(&(servAddr4.sin_addr), server.host4, sizeof(servAddr4.sin_addr));
 
-            if((error = connect(m_socketfd4, (sockaddr*) &sendServerAddr, sizeof(sockaddr_in))) < 0)
+            return sizeof(sockaddr_in);
+        }
+    }
+
+
+    // Compare address and port; operator== only compares addresses
+    static bool SameEndpoint(sockaddr_storage const& lhs, sockaddr_storage const& rhs)
+    {
+        if(lhs != rhs)
+        {
+            return false;
+        }
+
+        if(lhs.ss_family == AF_INET6)
+        {
+            return ((sockaddr_in6 const&) lhs).sin6_port == ((sockaddr_in6 const&) rhs).sin6_port;
+        }
+
+        return ((sockaddr_in const&) lhs).sin_port == ((sockaddr_in const&) rhs).sin_port;
+    }
+
+
+    bool NrpdClient::ConnectServer(ServerRecord const& server)
+    {
+        sockaddr_storage sendServerAddr;
+        socklen_t addrSize = ServerAddress(server, sendServerAddr);
+        int socketfd = (server.ipv6) ? m_socketfd6 : m_socketfd4;
+
+        if(connect(socketfd, (sockaddr*) &sendServerAddr, addrSize) < 0)
+        {
+            // TODO: log error
+            NrpdLog::LogString(server.ipv6 ? "Client: failed to connect IPv6 server" : "Client: failed to connect IPv4 server");
+            return false;
+        }
+
+        (server.ipv6 ? m_connected6 : m_connected4) = true;
+
+        return true;
+    }
+
+
+    bool NrpdClient::DisconnectSocket(bool ipv6)
+    {
+        bool& connected = (ipv6) ? m_connected6 : m_connected4;
+        sockaddr unspecified = {0};
+
+        if(!connected)
+        {
+            return true;
+        }
+
+        unspecified.sa_family = AF_UNSPEC;
+
+        if(connect((ipv6) ? m_socketfd6 : m_socketfd4, &unspecified, sizeof(unspecified)) < 0)
+        {
+            NrpdLog::LogString("Client: failed to disconnect socket");
+            return false;
+        }
+
+        connected = false;
+
+        return true;
+    }
+
+
+    int NrpdClient::ReceiveResponse(ServerRecord const& server, int socketfd, sockaddr_storage const& serverAddr, int bufSize, unsigned char* buffer, int& outSegmentSize, PacketView& outResponse)
+    {
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(m_config->receiveTimeout());
+        pollfd waitfd = { socketfd, POLLIN, 0 };
+        sockaddr_storage fromAddr;
+        int count;
+        int ready;
+
+        while(true)
+        {
+            auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+
+            if(remaining.count() <= 0)
             {
-                // TODO: log error
-                NrpdLog::LogString("Client: failed to connect IPv4 server");
-                error = errno;
-                result = false;
+                errno = EAGAIN;
+                return -1;
             }
+
+            if((ready = poll(&waitfd, 1, remaining.count())) < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            else if(ready <= 0)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+
+            if((count = ReceiveSegments(socketfd, buffer, bufSize, MSG_DONTWAIT, outSegmentSize, &fromAddr)) < 0)
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    continue;
+                }
+
+                return count;
+            }
+
+            // Anything coalesced after the first segment is a bulk train
+            outResponse = PacketView(buffer, min(count, outSegmentSize), false);
+
+            if(MatchResponse(server, serverAddr, fromAddr, outResponse))
+            {
+                return count;
+            }
+
+            // A late response to an earlier request, or not from a server
+            // asked at all
+            NrpdLog::LogString("Client: dropped unsolicited response");
         }
+    }
+
 
-        return result;
+    bool NrpdClient::MatchResponse(ServerRecord const& server, sockaddr_storage const& serverAddr, sockaddr_storage const& fromAddr, PacketView const& response)
+    {
+        pNrp_Message_TransactionId echoed;
+
+        // Cheapest test first
+        if(!SameEndpoint(fromAddr, serverAddr))
+        {
+            return false;
+        }
+
+        if(!server.transactionId)
+        {
+            return true;
+        }
+
+        // A malformed response from the server is still its response; the
+        // caller counts it against the server.
+        if(!response.Valid())
+        {
+            return true;
+        }
+
+        if((echoed = response.TransactionId()) != nullptr)
+        {
+            return memcmp(echoed->id, m_transactionId, sizeof(m_transactionId)) == 0;
+        }
+
+        // Only a server that doesn't support IDs may answer without one
+        return response.Rejects(transactionid);
     }
 
 
     bool NrpdClient::ScrambleEntropy(size_t bufSize, unsigned char* entropy)
     {
-        array<unsigned char, 64> secret;
-        int count = 0;
+        array<unsigned char, (MAX_ENTROPY_SIZE / 8)> secret;
         bool success = true;
 
         if(entropy == nullptr || bufSize > MAX_ENTROPY_SIZE)
@@ -283,13 +661,13 @@ namespace nrpd
         // collected, this becomes cumbersome for attackers to keep track of.
         //
         // We try to minimize the amount of entropy used for this by only
-        // reading as many bits as there are bytes of entropy in the response
-        // from the random device. A 1 will allow us to keep that byte, and a 0
-        // will be zeroed out.
+        // taking as many bits as there are bytes of entropy in the response
+        // from the random buffer. A 1 will allow us to keep that byte, and a
+        // 0 will be zeroed out.
 
         int bytes = std::ceil(bufSize / 8.0f);
 
-        if( (count = read(m_randomfd, secret.data(), bytes)) <= 0)
+        if(!m_randomBuffer->Read(secret.data(), bytes))
         {
             // Error reading from random device.
             // TODO: log error
@@ -300,10 +678,7 @@ namespace nrpd
         else
         {
             // Actually do the work of zeroing out parts of the entropy
-            for(unsigned int idx = 0; idx < bufSize; idx++)
-            {
-                entropy[idx] *= ((secret[idx / 8] >> (idx % 8)) & 0x1);
-            }
+            MaskEntropy(bufSize, entropy, secret.data());
         }
 
         // Clear secret memory
@@ -313,10 +688,8 @@ namespace nrpd
     }
 
 
-    bool NrpdClient::ConsumeEntropy(size_t bufSize, unsigned char* entropy)
+    bool NrpdClient::ConsumeEntropy(ServerRecord const& server, size_t bufSize, unsigned char* entropy)
     {
-        // Allocated on the stack so it gets overwritten naturally
-        int count = 0;
         bool success = true;
 
         if(entropy == nullptr || bufSize > MAX_ENTROPY_SIZE)
@@ -324,8 +697,10 @@ namespace nrpd
             return false;
         }
 
-        // write entropy to random device.
-        if( (count = write(m_randomfd, entropy, bufSize)) <= 0)
+        // Add entropy to the accumulator, which writes it to the random
+        // device in conditioned blocks mixed from several servers. Server
+        // entropy is credited conservatively, since the server may be lying.
+        if(!m_accumulator->Add(entropy, bufSize, bufSize * CLIENT_ENTROPY_CREDIT_BITS_PER_BYTE, hash<ServerRecord>()(server)))
         {
             // Error writing entropy
             // TODO: log error
@@ -338,18 +713,82 @@ namespace nrpd
     }
 
 
-    bool NrpdClient::ParseRejectMessage(ServerRecord& server, pNrp_Header_Message msg)
+    bool NrpdClient::TestEntropyHealth(ServerRecord const& server, size_t bufSize, const unsigned char* entropy)
     {
-        if(msg == nullptr)
+        int failed;
+
+        if(m_healthFailed)
         {
             return false;
         }
 
-        pNrp_Message_Reject rej = (pNrp_Message_Reject) msg->content;
+        if(m_health.size() >= m_healthPruneSize && m_health.find(server) == m_health.end())
+        {
+            PruneHealthTests();
+        }
+
+        failed = m_health[server].Test(entropy, bufSize);
+        m_healthStats.bytesTested += bufSize;
+
+        if(failed == health_ok)
+        {
+            return true;
+        }
+
+        m_healthStats.repetitionFailures += ((failed & health_repetition) != 0);
+        m_healthStats.proportionFailures += ((failed & health_proportion) != 0);
+        m_healthStats.frequencyFailures += ((failed & health_frequency) != 0);
+
+        NrpdLog::LogString("Client: server entropy failed health tests ("
+                           + to_string(m_healthStats.repetitionFailures) + " repetition, "
+                           + to_string(m_healthStats.proportionFailures) + " proportion, "
+                           + to_string(m_healthStats.frequencyFailures) + " frequency failures in "
+                           + to_string(m_healthStats.bytesTested) + " bytes)");
+
+        // If the server recovers, it starts over
+        m_health.erase(server);
+        m_healthFailed = true;
+
+        return false;
+    }
+
+
+    void NrpdClient::PruneHealthTests()
+    {
+        auto health = m_health.begin();
+
+        // Servers are removed and evicted by the config, without telling
+        // the client, so their state would otherwise be kept forever
+        while(health != m_health.end())
+        {
+            if(!m_config->IsKnownServer(health->first))
+            {
+                health = m_health.erase(health);
+            }
+            else
+            {
+                health = next(health);
+            }
+        }
+
+        // Grow the threshold with the servers still known, so pruning
+        // costs O(1) per server added
+        m_healthPruneSize = max((size_t) CLIENT_HEALTH_PRUNE_SIZE, m_health.size() * 2);
+    }
+
+
+    bool NrpdClient::ParseRejectMessage(ServerRecord& server, MessageView const& msg)
+    {
+        pNrp_Message_Reject rej = msg.Records<Nrp_Message_Reject>(msg.CountOrSize());
         int rejCount = 0;
 
+        if(rej == nullptr)
+        {
+            return false;
+        }
+
         // Iterate through rejection messages
-        while(rejCount < msg->countOrSize)
+        while(rejCount < msg.CountOrSize())
         {
             switch(rej->reason)
             {
@@ -370,7 +809,21 @@ namespace nrpd
                             server.ip6Peers = false;
                             break;
                         case signkey:
+                        case encryptionkey:
+                        case secureentropy:
                             server.signkey = false;
+                            m_serverKeys.erase(server);
+                            break;
+                        case receivesize:
+                            // Older server; it sizes responses on its own
+                            server.receiveSize = false;
+                            break;
+                        case bulkentropy:
+                            server.bulkEntropy = false;
+                            break;
+                        case transactionid:
+                            // Older server; connect to it from now on
+                            server.transactionId = false;
                             break;
                         default:
                             // server rejected an unknown message type as unsupported
@@ -381,6 +834,14 @@ namespace nrpd
                             break;
                     }
                     break;
+                case stalekey:
+                    // The server moved on to a new epoch; fetch its keys again
+                    if(m_serverKeys.count(server) > 0)
+                    {
+                        m_serverKeys[server].hasSignKey = false;
+                        m_serverKeys[server].hasSession = false;
+                    }
+                    break;
                 default:
                     // TODO: log here. Server used an unrecognized rejection
                     // This is weird.
@@ -395,71 +856,252 @@ namespace nrpd
     }
 
 
-    bool NrpdClient::ParseResponse(ServerRecord& server, int bufSize, unsigned char* buffer)
+    // Indexed by message type; see c_messageDescriptors
+    const NrpdClient::ResponseHandler NrpdClient::s_responseHandlers[] =
     {
-        pNrp_Header_Message msg = ((pNrp_Header_Packet) buffer)->messages;
-        int msgCount = 0;
+        &NrpdClient::HandleIgnoredResponse,     // nrpd_msg_type_min
+        &NrpdClient::HandleIgnoredResponse,     // request
+        &NrpdClient::HandleIgnoredResponse,     // response
+        &NrpdClient::HandleRejectResponse,      // reject
+        &NrpdClient::HandlePeersResponse,       // ip4peers
+        &NrpdClient::HandleEntropyResponse,     // entropy
+        &NrpdClient::HandlePeersResponse,       // ip6peers
+        &NrpdClient::HandleIgnoredResponse,     // certchain; TODO: implement
+        &NrpdClient::HandleSignKeyResponse,     // signkey
+        &NrpdClient::HandleEncryptionKeyResponse, // encryptionkey
+        &NrpdClient::HandleSecureEntropyResponse, // secureentropy
+        &NrpdClient::HandleIgnoredResponse,     // receivesize
+        &NrpdClient::HandleIgnoredResponse,     // bulkentropy
+        &NrpdClient::HandleIgnoredResponse,     // transactionid; matched on receipt
+    };
+
+
+    bool NrpdClient::ParseResponse(ServerRecord& server, PacketView const& pkt)
+    {
+        static_assert(sizeof(s_responseHandlers) / sizeof(s_responseHandlers[0]) == nrpd_msg_type_max, "Every message type needs a response handler");
+
+        if(!pkt.Valid())
+        {
+            return false;
+        }
+
+        m_keyJobPending = false;
+
+        // Validation let through only known types
+        for(MessageView msg : pkt)
+        {
+            (this->*s_responseHandlers[msg.Type()])(server, msg);
+        }
+
+        // Keys are verified off the client loop, and used once they are
+        if(m_keyJobPending)
+        {
+            m_verifier->Submit(m_keyJob);
+            m_verifying.insert(server);
+            m_keyJobPending = false;
+        }
+
+        return true;
+    }
+
 
-        while((unsigned char*) msg < (buffer + bufSize)
-              && msg < EndOfPacket((pNrp_Header_Packet) buffer)
-              && msgCount < ((pNrp_Header_Packet) buffer)->msgCount)
+    void NrpdClient::HandleEntropyResponse(ServerRecord& server, MessageView const& msg)
+    {
+        NrpdLog::LogString("Client: entropy message");
+        // Test what the server sent, before scrambling zeroes any of it
+        if(!TestEntropyHealth(server, msg.CountOrSize(), msg.Content()))
+        {
+            return;
+        }
+        if(!ScrambleEntropy(msg.CountOrSize(), msg.Content()))
+        {
+            // Proceed with consuming the entropy without modification;
+            // this should almost never occur, and if it does, it's not
+            // serious enough to block consumption of entropy.
+            // TODO: log here
+        }
+        if(!ConsumeEntropy(server, msg.CountOrSize(), msg.Content()))
+        {
+            // TODO: log here
+        }
+    }
+
+
+    void NrpdClient::HandlePeersResponse(ServerRecord& server, MessageView const& msg)
+    {
+        if((msg.Type() == ip4peers) ? m_config->enableClientIp4() : m_config->enableClientIp6())
         {
-            switch(msg->msgType)
+            if(!m_config->AddServersFromMessage(msg.Header(), &server))
+            {
+                // TODO: log here
+            }
+        }
+    }
+
+
+    void NrpdClient::HandleRejectResponse(ServerRecord& server, MessageView const& msg)
+    {
+        NrpdLog::LogString("Client: received reject message");
+        if(!ParseRejectMessage(server, msg))
+        {
+            // TODO: log here
+        }
+    }
+
+
+    void NrpdClient::HandleSignKeyResponse(ServerRecord& server, MessageView const& msg)
+    {
+        pNrp_Message_SignKey_Response record = msg.Records<Nrp_Message_SignKey_Response>();
+        const unsigned char* identity;
+        ServerKeys* keys;
+        time_t expiry;
+
+        if(record == nullptr || !ParseExpiry(record->expiryTime, expiry) || time(nullptr) >= expiry)
+        {
+            NrpdLog::LogString("Client: sign key is malformed or expired");
+            return;
+        }
+
+        // The identity that signed it comes first, then its signature
+        identity = record->signature;
+        keys = FindServerKeys(server);
+
+        if(keys != nullptr && memcmp(keys->identity, identity, SECURE_PUBLIC_KEY_SIZE) != 0)
+        {
+            NrpdLog::LogString("Client: sign key is from a different identity than the one pinned");
+            return;
+        }
+
+        // Verified by m_verifier, along with the encryption key after it
+        m_keyJob = KeyJob();
+        m_keyJob.server = server;
+        memcpy(m_keyJob.identity, identity, SECURE_PUBLIC_KEY_SIZE);
+        memcpy(m_keyJob.signKeyRecord, record, sizeof(m_keyJob.signKeyRecord));
+        m_keyJob.hasSignKeyRecord = true;
+        m_keyJobPending = true;
+    }
+
+
+    void NrpdClient::HandleEncryptionKeyResponse(ServerRecord& server, MessageView const& msg)
+    {
+        ServerKeys* keys;
+
+        // Without a sign key in the same response, it's verified with the
+        // one already verified
+        if(!m_keyJobPending)
+        {
+            if((keys = FindServerKeys(server)) == nullptr || !keys->hasSignKey)
+            {
+                NrpdLog::LogString("Client: encryption key without a sign key to verify it");
+                return;
+            }
+
+            m_keyJob = KeyJob();
+            m_keyJob.server = server;
+            memcpy(m_keyJob.identity, keys->identity, SECURE_PUBLIC_KEY_SIZE);
+            memcpy(m_keyJob.signKey, keys->signKey, SECURE_PUBLIC_KEY_SIZE);
+            m_keyJob.keyId = keys->keyId;
+            m_keyJob.expiry = keys->expiry;
+        }
+
+        memcpy(m_keyJob.encryptionKeyRecord, msg.Content(), sizeof(m_keyJob.encryptionKeyRecord));
+        m_keyJob.hasEncryptionKeyRecord = true;
+        m_keyJobPending = true;
+    }
+
+
+    void NrpdClient::HandleSecureEntropyResponse(ServerRecord& server, MessageView const& msg)
+    {
+        pNrp_Message_SecureEntropy_Response response = msg.Records<Nrp_Message_SecureEntropy_Response>();
+        unsigned char entropy[sizeof(response->entropy)];
+
+        // Only the response to our own request can be opened
+        if(response == nullptr || !m_securePending)
+        {
+            return;
+        }
+
+        m_securePending = false;
+
+        if(!OpenEntropy(m_secureSession.key, &m_secureRequest, response, entropy))
+        {
+            NrpdLog::LogString("Client: secure entropy failed authentication");
+            return;
+        }
+
+        if(!TestEntropyHealth(server, sizeof(entropy), entropy))
+        {
+            memset(entropy, 0, sizeof(entropy));
+            return;
+        }
+
+        NrpdLog::LogString("Client: secure entropy message");
+        if(!ConsumeEntropy(server, sizeof(entropy), entropy))
+        {
+            // TODO: log here
+        }
+
+        memset(entropy, 0, sizeof(entropy));
+    }
+
+
+    void NrpdClient::HandleIgnoredResponse(ServerRecord& server, MessageView const& msg)
+    {
+    }
+
+
+    int NrpdClient::ParseSegments(ServerRecord& server, int bufSize, unsigned char* buffer, int segmentSize)
+    {
+        int parsed = 0;
+
+        for(int offset = 0; offset < bufSize; offset += segmentSize)
+        {
+            // Each segment must be a whole packet on its own
+            PacketView pkt(buffer + offset, min(segmentSize, bufSize - offset), false);
+
+            if(!pkt.Valid())
+            {
+                NrpdLog::LogString("Client: bulk entropy packet failed validation");
+                continue;
+            }
+
+            if(ParseResponse(server, pkt))
+            {
+                parsed++;
+            }
+        }
+
+        return parsed;
+    }
+
+
+    int NrpdClient::ReceiveBulkEntropy(ServerRecord& server, int socketfd, sockaddr_storage const& serverAddr, int bufSize, unsigned char* buffer)
+    {
+        pollfd waitfd = { socketfd, POLLIN, 0 };
+        sockaddr_storage fromAddr;
+        int received = 0;
+        int segmentSize;
+        int count;
+
+        // The train follows the response; stop when it's all here, or when
+        // the rest of it has been lost.
+        while(received < CLIENT_BULK_ENTROPY_SEGMENTS && poll(&waitfd, 1, CLIENT_BULK_TIMEOUT_MS) > 0)
+        {
+            if((count = ReceiveSegments(socketfd, buffer, bufSize, MSG_DONTWAIT, segmentSize, &fromAddr)) <= 0)
             {
-            case entropy:
-                NrpdLog::LogString("Client: entropy message");
-                if(!ScrambleEntropy(msg->countOrSize, msg->content))
-                {
-                    // Proceed with consuming the entropy without modification;
-                    // this should almost never occur, and if it does, it's not
-                    // serious enough to block consumption of entropy.
-                    // TODO: log here
-                }
-                if(!ConsumeEntropy(msg->countOrSize, msg->content))
-                {
-                    // TODO: log here
-                }
-                break;
-            case ip4peers:
-                if(m_config->enableClientIp4())
-                {
-                    if(!m_config->AddServersFromMessage(msg))
-                    {
-                        // TODO: log here
-                    }
-                }
-                break;
-            case ip6peers:
-                if(m_config->enableClientIp6())
-                {
-                    if(!m_config->AddServersFromMessage(msg))
-                    {
-                        // TODO: log here
-                    }
-                }
-                break;
-            case reject:
-                NrpdLog::LogString("Client: received reject message");
-                if(!ParseRejectMessage(server, msg))
-                {
-                    // TODO: log here
-                }
-                break;
-            case signkey:
-            case certchain:
-            case encryptionkey:
-            case secureentropy:
-                // TODO: implement these
                 break;
-            default:
-                    break;
             }
 
-            msgCount++;
-            msg = NextMessage(msg);
+            if(!SameEndpoint(fromAddr, serverAddr))
+            {
+                NrpdLog::LogString("Client: dropped unsolicited response");
+                continue;
+            }
+
+            received += ParseSegments(server, count, buffer, segmentSize);
         }
 
-        return true;
+        return received;
     }
 
 
@@ -469,9 +1111,15 @@ namespace nrpd
         ssize_t count;
         int error;
         unique_ptr<array<unsigned char, MAX_RESPONSE_MESSAGE_SIZE>> buffer = make_unique<array<unsigned char,MAX_RESPONSE_MESSAGE_SIZE>>();
-        pNrp_Header_Packet pkt = (pNrp_Header_Packet) buffer->data();
+        PacketView response;
         int requestSize;
+        int segmentSize;
         int socketfd;
+        bool wantBulk;
+        bool woken; // by the kernel, before the next server was due
+        sockaddr_storage serverAddr;
+        socklen_t serverAddrSize;
+        chrono::steady_clock::time_point dueTime;
 
         while(m_state == running)
         {
@@ -481,21 +1129,58 @@ namespace nrpd
             count = 0;
             requestSize = 0;
 
-            // Wait a second before trying the next server; don't use
-            // this loop as a busy wait and eat CPU for no reason.
-            this_thread::sleep_for(1s);
+            // Pick up settings from a config reload
+            ApplyTuning();
+
+            // Sleep until the next server is eligible to be contacted, rather
+            // than polling the server lists.
+            if(!m_config->NextServerDueTime(dueTime))
+            {
+                // No servers known yet; check again after a request interval.
+                this_thread::sleep_for(chrono::seconds(m_config->clientRequestInterval()));
+                continue;
+            }
+
+            woken = false;
+
+            if(m_demandEnabled)
+            {
+                // Wait for the next server, waking early if the kernel asks
+                // for entropy.
+                if((woken = m_demand.WaitUntil(dueTime)))
+                {
+                    NrpdLog::LogString("Client: woken by kernel demand for entropy");
+                }
+
+                if(UpdateDemand() && !woken)
+                {
+                    // The schedule was rescaled; find the next server again.
+                    continue;
+                }
+            }
+
+            // The kernel wants entropy now, so ask the soonest server now
+            if(!woken)
+            {
+                this_thread::sleep_until(dueTime);
+            }
 
             // Request next server from config
             ServerRecord& server = m_config->GetNextServer();
 
-            // Check that it's been enough time since the last request was made
-            // to this server
-            if(chrono::steady_clock::now() <= (server.lastaccessTime + server.retryTime))
+            // Decided before the request, since a rejection changes the answer
+            wantBulk = WantBulkEntropy(server);
+
+            // A fresh, unguessable ID for every request
+            if(server.transactionId && !m_randomBuffer->Read(m_transactionId, sizeof(m_transactionId)))
             {
-                // continue to next server. Don't update this one
+                NrpdLog::LogString("Client: failed to read from random device");
                 continue;
             }
 
+            // Keys verified while waiting are used from this request on
+            ApplyVerifiedKeys();
+
             // Build request based on configuration and known rejections from server (if any)
             if(!ConstructRequest(server, buffer->size(), buffer->data(), requestSize))
             {
@@ -503,8 +1188,12 @@ namespace nrpd
                 continue;
             }
 
-            // Connect() to the server to simplify communication
-            if(!ConnectServer(server))
+            serverAddrSize = ServerAddress(server, serverAddr);
+
+            // Servers that echo transaction IDs share the family's socket
+            // unconnected; the rest are connect()ed, so the kernel filters
+            // their responses instead.
+            if(server.transactionId ? !DisconnectSocket(server.ipv6) : !ConnectServer(server))
             {
                 // TODO: log error
                 // try again?
@@ -526,7 +1215,7 @@ namespace nrpd
             NrpdLog::LogString("Client: Sending request");
 
             // send request packet to server
-            if( (count = send(socketfd, buffer->data(), requestSize, 0)) < 0)
+            if( (count = sendto(socketfd, buffer->data(), requestSize, 0, (sockaddr*) &serverAddr, serverAddrSize)) < 0)
             {
                 // If packet exceeds MTU, reset MTU and continue
                 // TODO: log error
@@ -536,7 +1225,7 @@ namespace nrpd
             error = count;
 
             // receive response
-            if( (count = recv(socketfd, buffer->data(), buffer->size(), 0)) < 0)
+            if( (count = ReceiveResponse(server, socketfd, serverAddr, buffer->size(), buffer->data(), segmentSize, response)) < 0)
             {
                 error = errno;
                 // If an error occurred listening for a response
@@ -561,7 +1250,7 @@ namespace nrpd
             auto secondTimePoint = chrono::high_resolution_clock::now();
 
             // Validate received packet
-            if(!ValidateResponsePacket(pkt))
+            if(!response.Valid())
             {
                 // TODO: log error
                 NrpdLog::LogString("Client: Response failed validation");
@@ -570,11 +1259,13 @@ namespace nrpd
                 continue;
             }
 
+            m_healthFailed = false;
+
             // Parse received message and perform appropriate actions
             // based on received messages e.g.
             //   write received entropy to system RNG.
             //   add peers to config
-            if(!ParseResponse(server, buffer->size(), buffer->data()))
+            if(!ParseResponse(server, response))
             {
                 // TODO log here
                 NrpdLog::LogString("Client: Response failed parsing");
@@ -583,8 +1274,29 @@ namespace nrpd
 
             NrpdLog::LogString("Client: Response processed");
 
-            // Mark the server as successful
-            m_config->MarkServerSuccessful(server);
+            // The start of a bulk train may have been coalesced with the
+            // response; the rest follows in separate reads.
+            if(count > segmentSize)
+            {
+                ParseSegments(server, count - segmentSize, buffer->data() + segmentSize, segmentSize);
+            }
+
+            if(wantBulk && server.bulkEntropy)
+            {
+                NrpdLog::LogString("Client: receiving bulk entropy");
+                ReceiveBulkEntropy(server, socketfd, serverAddr, buffer->size(), buffer->data());
+            }
+
+            // A server whose entropy failed its health tests is demoted as
+            // if it hadn't answered. Don't use server after this.
+            if(m_healthFailed)
+            {
+                m_config->IncrementServerFailCount(server);
+                continue;
+            }
+
+            // Mark the server as successful, and record how quickly it responded
+            m_config->MarkServerSuccessful(server, chrono::duration_cast<chrono::microseconds>(secondTimePoint - firstTimePoint));
 
             // If the implementation-defined high-resolution clock offers
             // microsecond resolution or better, we can use the timing delays
@@ -628,12 +1340,19 @@ namespace nrpd
 
                     NrpdLog::LogString("Client: adding time entropy");
 
-                    // Write entropy to pool
-                    write(m_randomfd, &timeEntropy, sizeof(timeEntropy));
+                    // Add entropy to the accumulator
+                    m_accumulator->Add(&timeEntropy, sizeof(timeEntropy), CLIENT_TIMING_CREDIT_BITS, ACCUMULATOR_LOCAL_SOURCE);
 
                     timeEntropy = 0L;
                 }
             }
+
+            // Hand accumulated entropy to the kernel if it has been waiting
+            // too long for a full block.
+            if(!m_accumulator->FlushIfDue())
+            {
+                NrpdLog::LogString("Client: failed to flush accumulated entropy");
+            }
         }
 
         return 0;
@@ -1,5 +1,14 @@
 #include "config.h"
+#include "accumulator.h"
+#include "demand.h"
+#include "randombuffer.h"
+#include "packetview.h"
+#include "securekeys.h"
+#include "keyverifier.h"
+#include "health.h"
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 
@@ -25,12 +34,54 @@ namespace nrpd
         };
 
         shared_ptr<NrpdConfig> m_config;
+        shared_ptr<const NrpdTuning> m_tuning; // last tuning snapshot applied
         int m_socketfd4;
         int m_socketfd6;
+        bool m_connected4; // m_socketfd4 is connected to a server without transaction IDs
+        bool m_connected6;
+        unsigned char m_transactionId[sizeof(Nrp_Message_TransactionId)]; // of the outstanding request
         int m_randomfd;
+        unique_ptr<EntropyAccumulator> m_accumulator;
+        unique_ptr<RandomBuffer> m_randomBuffer;
+        EntropyDemand m_demand;
+        nrpd_demand_level m_demandLevel;
+        bool m_demandEnabled;
 
         NrpdClientState m_state;
 
+        // A server's keys for secure entropy, as far as they've been
+        // verified. The identity is pinned the first time it's seen, and
+        // must sign every sign key after.
+        struct ServerKeys
+        {
+            unsigned char identity[SECURE_PUBLIC_KEY_SIZE];
+            unsigned char signKey[SECURE_PUBLIC_KEY_SIZE];
+            unsigned char keyId;
+            time_t expiry;
+            // Our key for the epoch, in the request it's sent in, and the
+            // session key agreed with it; reused until the epoch ends
+            Nrp_Message_SecureEntropy_Request secureRequest;
+            SessionKey session;
+            bool hasSignKey;
+            bool hasSession; // the epoch's encryption key was verified, and a session agreed
+        };
+
+        unordered_map<ServerRecord, ServerKeys> m_serverKeys;
+        unique_ptr<KeyVerifier> m_verifier;
+        unordered_set<ServerRecord> m_verifying; // servers with keys in m_verifier
+        // Keys received in the response being parsed, for m_verifier
+        KeyJob m_keyJob;
+        bool m_keyJobPending;
+        // Of the outstanding request, if it asked for secure entropy
+        Nrp_Message_SecureEntropy_Request m_secureRequest;
+        SessionKey m_secureSession;
+        bool m_securePending;
+        // Health of each server's entropy, and totals across servers
+        unordered_map<ServerRecord, HealthTest> m_health;
+        size_t m_healthPruneSize; // prune m_health when it grows to this
+        HealthStats m_healthStats;
+        bool m_healthFailed; // entropy in the response being parsed failed
+
         // Construct a request packet in buffer, using server to determine
         // which message types are supported.
         //
@@ -40,7 +91,7 @@ namespace nrpd
         // while less important messages are ignored.
         // The recommended order is:
         //
-        // (pubkey/secureentropy) > entropy > (ip4peers,ip6peers)
+        // (signkey/encryptionkey/secureentropy) > entropy > (ip4peers,ip6peers)
         //
         // Reject messages will always be first in response packets, if the server
         // sends any. (clients cannot request reject messages, hence their omission
@@ -52,22 +103,100 @@ namespace nrpd
         // must support that message at a minimum.
         bool ConstructRequest(ServerRecord const& server, unsigned int bufSize, unsigned char* buffer, int& outPktSize);
 
+        // Apply the config's tuning settings, if they changed since they
+        // were last applied.
+        void ApplyTuning();
+
+        // Re-read the kernel's demand for entropy, and adjust the request
+        // schedule if it changed.
+        // Returns true if the demand level changed.
+        bool UpdateDemand();
+
+        // Size of entropy to request, based on the kernel's demand
+        unsigned char RequestEntropySize();
+
+        // Whether to ask server for a bulk entropy train
+        bool WantBulkEntropy(ServerRecord const& server);
+
+        // Total entropy to ask for in a receive size message, which servers
+        // may split across several entropy messages
+        unsigned short PreferredEntropySize();
+
         // Call Connect() on the address supplied by server.
         bool ConnectServer(ServerRecord const& server);
 
+        // Undo ConnectServer for a family, so its socket receives from any
+        // server again.
+        bool DisconnectSocket(bool ipv6);
+
+        // Wait, up to the receive timeout, for the response to the
+        // outstanding request to server, dropping anything else received.
+        // outResponse views the first segment of what was received, which
+        // may not be valid if the server sent a malformed response.
+        // Returns the number of bytes received, or -1 and errno on failure
+        // (EAGAIN if it timed out).
+        int ReceiveResponse(ServerRecord const& server, int socketfd, sockaddr_storage const& serverAddr, int bufSize, unsigned char* buffer, int& outSegmentSize, PacketView& outResponse);
+
+        // Test if a packet from fromAddr answers the outstanding request to
+        // server: it must come from the server, and echo the request's
+        // transaction ID unless the server doesn't support them.
+        bool MatchResponse(ServerRecord const& server, sockaddr_storage const& serverAddr, sockaddr_storage const& fromAddr, PacketView const& response);
+
         // Zero out part of the entropy, in place, so an eavesdropper
         // doesn't know which entropy was consumed.
         bool ScrambleEntropy(size_t bufSize, unsigned char* entropy);
 
-        // Parse entropy response message and write obtained entropy to system
-        // PRNG to increase system entropy
-        bool ConsumeEntropy(size_t bufSize, unsigned char* entropy);
+        // Parse entropy response message and add obtained entropy to the
+        // accumulator, which conditions and credits it to the system PRNG
+        // along with other servers' entropy
+        bool ConsumeEntropy(ServerRecord const& server, size_t bufSize, unsigned char* entropy);
+
+        // Run server's health tests on its entropy, before it's used.
+        // Returns false if it fails any, or if earlier entropy in the
+        // response did; the server is demoted once the response is parsed.
+        bool TestEntropyHealth(ServerRecord const& server, size_t bufSize, const unsigned char* entropy);
+
+        // Drop the health test state of servers the config no longer knows
+        void PruneHealthTests();
 
         // Parse reject message, and disable rejected capabilities in server
-        bool ParseRejectMessage(ServerRecord& server, pNrp_Header_Message msg);
+        bool ParseRejectMessage(ServerRecord& server, MessageView const& msg);
+
+        // The keys of server, if it has any unexpired ones
+        ServerKeys* FindServerKeys(ServerRecord const& server);
+
+        // Take in the keys m_verifier has finished with since the last call
+        void ApplyVerifiedKeys();
+
+        // Add a secure entropy request, or requests for the keys it needs
+        // first, to the request to server.
+        // Returns a pointer to the end of the messages added.
+        pNrp_Header_Message GenerateSecureRequest(ServerRecord const& server, pNrp_Header_Message msg, int& msgCount, int& msgSize);
+
+        // Parse a valid response received from server
+        bool ParseResponse(ServerRecord& server, PacketView const& pkt);
+
+        // Handles one message of a response from server
+        typedef void (NrpdClient::*ResponseHandler)(ServerRecord& server, MessageView const& msg);
+
+        // Handler of each message type, indexed by type
+        static const ResponseHandler s_responseHandlers[];
+
+        void HandleEntropyResponse(ServerRecord& server, MessageView const& msg);
+        void HandlePeersResponse(ServerRecord& server, MessageView const& msg);
+        void HandleRejectResponse(ServerRecord& server, MessageView const& msg);
+        void HandleSignKeyResponse(ServerRecord& server, MessageView const& msg);
+        void HandleEncryptionKeyResponse(ServerRecord& server, MessageView const& msg);
+        void HandleSecureEntropyResponse(ServerRecord& server, MessageView const& msg);
+        void HandleIgnoredResponse(ServerRecord& server, MessageView const& msg);
+
+        // Validate and parse each segmentSize-byte packet in buffer, as
+        // coalesced by UDP GRO. Returns the number of packets parsed.
+        int ParseSegments(ServerRecord& server, int bufSize, unsigned char* buffer, int segmentSize);
 
-        // Parse response message received from server
-        bool ParseResponse(ServerRecord& server, int bufSize, unsigned char* buffer);
+        // Receive and parse the bulk entropy train that follows a response.
+        // Returns the number of packets parsed.
+        int ReceiveBulkEntropy(ServerRecord& server, int socketfd, sockaddr_storage const& serverAddr, int bufSize, unsigned char* buffer);
 
     };
 }
@@ -1,7 +1,20 @@
 #include <string>
 #include <cstring>
+#include <array>
+#include <algorithm>
+#include <fstream>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
 #include "config.h"
 #include "protocol.h"
+#include "log.h"
+#include "fastrandom.h"
+#include "accumulator.h"
+#include "peerdatabase.h"
+#include "peerfamily.h"
+#include "certchain.h"
 
 using namespace std;
 
@@ -96,6 +109,14 @@ namespace nrpd
 
         retryTime = chrono::seconds(CLIENT_MIN_RETRY_SECONDS);
 
+        // Unmeasured servers start out assumed reliable
+        rttMs = 0.0f;
+        successRate = 1.0f;
+
+        reportCount = 0;
+        reporters = 0;
+        databaseSlot = -1;
+
         // initialize flags
         ipv6 = isIPv6;
         probationary = true;
@@ -103,6 +124,9 @@ namespace nrpd
         ip6Peers = true;
         signkey = true;
         shuttingdown = false;
+        receiveSize = true;
+        bulkEntropy = true;
+        transactionId = true;
     }
 
     ServerRecord::ServerRecord(initializer_list<unsigned char> l, unsigned short port)
@@ -124,13 +148,57 @@ namespace nrpd
 
         retryTime = chrono::seconds(CLIENT_MIN_RETRY_SECONDS);
 
+        rttMs = 0.0f;
+        successRate = 1.0f;
+
+        reportCount = 0;
+        reporters = 0;
+        databaseSlot = -1;
+
         // initialize flags
         probationary = true;
         ip4Peers = true;
         ip6Peers = true;
         signkey = true;
         shuttingdown = false;
+        receiveSize = true;
+        bulkEntropy = true;
+        transactionId = true;
+
+    }
+
+    void ServerRecord::RecordSuccess(chrono::microseconds roundTripTime)
+    {
+        if(roundTripTime > chrono::microseconds::zero())
+        {
+            float sample = roundTripTime.count() / 1000.0f;
+
+            if(rttMs <= 0.0f)
+            {
+                // First measurement seeds the average
+                rttMs = sample;
+            }
+            else
+            {
+                rttMs += CLIENT_RTT_EWMA_WEIGHT * (sample - rttMs);
+            }
+        }
 
+        successRate += CLIENT_SUCCESS_EWMA_WEIGHT * (1.0f - successRate);
+    }
+
+    void ServerRecord::RecordFailure()
+    {
+        successRate -= CLIENT_SUCCESS_EWMA_WEIGHT * successRate;
+    }
+
+    float ServerRecord::Score() const
+    {
+        float rtt = (rttMs > 0.0f) ? rttMs : CLIENT_DEFAULT_RTT_MS;
+
+        // Keep a small floor so a server that failed a few times in a row can
+        // still be chosen occasionally and recover its score.
+        return (successRate + 0.01f) / (rtt + 1.0f);
     }
 
     ServerRecord::ServerRecord(pNrp_Message_Ip4Peer peer) : ServerRecord(peer->ip, false, peer->port)
@@ -148,20 +216,40 @@ namespace nrpd
 
     NrpdConfig::NrpdConfig()
     {
+        shared_ptr<NrpdTuning> tuning = make_shared<NrpdTuning>();
+
         m_port = 8080;
         m_configPath = "";
         m_enableServer = true;
         m_enableClient = true;
-        m_clientRequestIntervalSeconds = CLIENT_MIN_RETRY_SECONDS;
-        m_clientReceiveTimeout = CLIENT_RESPONSE_TIMEOUT_SECONDS;
-        m_defaultEntropySize = DEFAULT_ENTROPY_SIZE;
+        tuning->clientRequestIntervalSeconds = CLIENT_MIN_RETRY_SECONDS;
+        tuning->clientReceiveTimeoutSeconds = CLIENT_RESPONSE_TIMEOUT_SECONDS;
+        tuning->defaultEntropySize = DEFAULT_ENTROPY_SIZE;
+        tuning->entropyFlushSize = ACCUMULATOR_DEFAULT_FLUSH_SIZE;
+        tuning->entropyFlushIntervalSeconds = ACCUMULATOR_DEFAULT_FLUSH_SECONDS;
+        tuning->entropyMinSources = ACCUMULATOR_DEFAULT_MIN_SOURCES;
+        tuning->enableIp4Peers = true;
+        tuning->enableIp6Peers = true;
+        tuning->probationaryBudgetPercent = CLIENT_PROBATIONARY_BUDGET_PERCENT;
+        tuning->probationaryCapacity = CLIENT_MAX_PROBATIONARY_SERVERS;
+        tuning->enableBulkEntropy = false;
+        tuning->enableSecureEntropy = false;
+        tuning->certChainPath = "";
+        m_tuning = tuning;
         // Bad servers are banned for 24hrs
         m_bannedServers = make_shared<MruCache<ServerRecord>>(60*60*24);
-        m_activeIterator = m_activeServers.end();
-        m_probationaryIterator = m_probationaryServers.end();
-        m_prevReturnedProbationary = true;
-        m_countIp6Servers = -1;
-        m_countIp4Servers = -1;
+        m_retryScale = 1.0f;
+        m_meanScore = 0.0f;
+        m_scoreRefreshCountdown = 0;
+        m_demandMode = true;
+        m_forkDaemon = false;
+        m_peerDatabasePath = PEER_DATABASE_DEFAULT_PATH;
+        m_identityKeyPath = "";
+        m_selectedServer = PEER_INVALID_HANDLE;
+        m_selectionCount = 0;
+        m_probationarySelectionCount = 0;
+        m_probationaryBudgetPercent = tuning->probationaryBudgetPercent;
+        m_probationaryCapacity = tuning->probationaryCapacity;
         m_clientEnableIp4 = true;
         m_clientEnableIp6 = true;
         m_serverEnableIp4 = true;
@@ -169,12 +257,20 @@ namespace nrpd
         //m_activeServers = {ServerRecord({0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1}, 8080),ServerRecord({127,0,0,1}, 8080)};
     }
 
-    NrpdConfig::NrpdConfig(string* path)
+    NrpdConfig::NrpdConfig(string* path) : NrpdConfig()
     {
-        m_port = 8080;
         m_configPath = *path;
     }
 
+    NrpdConfig::~NrpdConfig()
+    {
+    }
+
+    shared_ptr<const NrpdTuning> NrpdConfig::Tuning()
+    {
+        return atomic_load(&m_tuning);
+    }
+
     unsigned short NrpdConfig::serverPort()
     {
         return m_port;
@@ -182,7 +278,7 @@ namespace nrpd
 
     int NrpdConfig::defaultEntropySize()
     {
-        return m_defaultEntropySize;
+        return Tuning()->defaultEntropySize;
     }
 
     bool NrpdConfig::enableServer()
@@ -199,25 +295,75 @@ namespace nrpd
     {
         if(type == ip4peers)
         {
-            return m_enableIp4Peers;
+            return Tuning()->enableIp4Peers;
         }
 
         if(type == ip6peers)
         {
-            return m_enableIp6Peers;
+            return Tuning()->enableIp6Peers;
         }
 
         return false;
     }
 
+    bool NrpdConfig::enableBulkEntropy()
+    {
+        return Tuning()->enableBulkEntropy;
+    }
+
+    bool NrpdConfig::enableSecureEntropy()
+    {
+        return Tuning()->enableSecureEntropy;
+    }
+
     int NrpdConfig::clientRequestInterval()
     {
-        return m_clientRequestIntervalSeconds;
+        return Tuning()->clientRequestIntervalSeconds;
     }
 
     int NrpdConfig::receiveTimeout()
     {
-        return m_clientReceiveTimeout;
+        return Tuning()->clientReceiveTimeoutSeconds;
+    }
+
+    unsigned int NrpdConfig::entropyFlushSize()
+    {
+        return Tuning()->entropyFlushSize;
+    }
+
+    int NrpdConfig::entropyFlushInterval()
+    {
+        return Tuning()->entropyFlushIntervalSeconds;
+    }
+
+    unsigned int NrpdConfig::entropyMinSources()
+    {
+        return Tuning()->entropyMinSources;
+    }
+
+    bool NrpdConfig::demandMode()
+    {
+        return m_demandMode;
+    }
+
+    bool NrpdConfig::daemonize()
+    {
+        return m_forkDaemon;
+    }
+
+    string NrpdConfig::peerDatabasePath()
+    {
+        return m_peerDatabasePath;
+    }
+
+    string NrpdConfig::identityKeyPath()
+    {
+        return m_identityKeyPath;
+    }
+
+    string NrpdConfig::certChainPath()
+    {
+        return Tuning()->certChainPath;
     }
 
     bool NrpdConfig::enableClientIp4()
@@ -242,443 +388,984 @@ namespace nrpd
 
     int NrpdConfig::ActiveServerCount(nrpd_msg_type type)
     {
-        bool ipv6;
-        int count = 0;
-
         if(type != ip4peers && type != ip6peers)
         {
             return 0;
         }
 
-        ipv6 = (type == ip6peers) ? true : false;
+        lock_guard<mutex> lock(m_peerMutex);
 
-        // Optimization to use already-calculated value
-        if(ipv6 && (m_countIp6Servers > -1))
-        {
-            return m_countIp6Servers;
-        }
-        else if(!ipv6 && (m_countIp4Servers > -1))
-        {
-            return m_countIp4Servers;
-        }
+        return m_peers.Count(false, (type == ip6peers));
+    }
 
+    bool NrpdConfig::IsKnownServer(ServerRecord const& serv)
+    {
+        lock_guard<mutex> lock(m_peerMutex);
 
-        {
-            // Hold lock until done iterating over active server list
-            lock_guard<mutex> lock(m_activeMutex);
+        return m_peers.Find(serv) != PEER_INVALID_HANDLE;
+    }
 
-            // The list of servers should never get large enough that iterating
-            // to calculate this every call will be a burden.
-            for(auto& rec : m_activeServers)
-            {
-                if(rec.ipv6 == ipv6)
-                {
-                    count +=1;
-                }
-            }
-        } // end lock scope
 
-        if(ipv6)
+    unique_ptr<unsigned char[]> NrpdConfig::GetServerList(nrpd_msg_type type, int count, int& outSize)
+    {
+        if(count <= 0)
         {
-            m_countIp6Servers = count;
+            return nullptr;
         }
-        else
+
+        // Choose the family once, rather than for every server
+        if(type == ip4peers)
         {
-            m_countIp4Servers = count;
+            return GetFamilyServerList<ip4peers>(count, outSize);
+        }
+        else if(type == ip6peers)
+        {
+            return GetFamilyServerList<ip6peers>(count, outSize);
         }
 
-        return count;
+        return nullptr;
     }
 
 
-    unique_ptr<unsigned char[]> NrpdConfig::GetServerList(nrpd_msg_type type, int count, int& outSize)
+    template<nrpd_msg_type Type>
+    unique_ptr<unsigned char[]> NrpdConfig::GetFamilyServerList(int count, int& outSize)
     {
+        typedef PeerFamily<Type> Family;
         unique_ptr<unsigned char[]> srvlist;
-        pNrp_Message_Ip4Peer ip4Msg;
-        pNrp_Message_Ip6Peer ip6Msg;
-        int size;
-        int itr = 0;
+        typename Family::Message* peerMsg;
         int actualCount;
-        bool ipv6;
 
-        if((type != ip4peers && type != ip6peers) || count <= 0)
-        {
-            return nullptr;
-        }
+        // Hold lock until done copying from the active server list, so it
+        // can't shrink between counting and copying.
+        lock_guard<mutex> lock(m_peerMutex);
 
-        ipv6 = (type == ip6peers) ? true : false;
-
-        // Optimization: Is this calculation necessary?
-        actualCount = ActiveServerCount(type);
+        actualCount = min<int>(m_peers.Count(false, Family::ipv6), count);
 
         if(actualCount <= 0)
         {
             return nullptr;
         }
 
-        actualCount = min(actualCount, count);
+        srvlist = make_unique<unsigned char[]>(actualCount * Family::messageSize);
 
-        if(ipv6)
+        if(srvlist == nullptr)
         {
-            size = actualCount * sizeof(Nrp_Message_Ip6Peer);
+            return nullptr;
         }
-        else
+
+        outSize = actualCount * Family::messageSize;
+        peerMsg = (typename Family::Message*) srvlist.get();
+
+        // Return a different random sample every time, so gossip spreads
+        // load across all active servers instead of the same few.
+        m_peers.SampleToFront(false, Family::ipv6, actualCount, FastRandom::ThreadLocal());
+
+        for(int i = 0; i < actualCount; i++, peerMsg++)
         {
-            size = actualCount* sizeof(Nrp_Message_Ip4Peer);
+            EncodePeer<Type>(m_peers.At(false, Family::ipv6, i), peerMsg);
         }
 
-        srvlist = make_unique<unsigned char[]>(size);
+        return srvlist;
+    }
+
 
-        if(srvlist == nullptr)
+    ServerRecord& NrpdConfig::GetNextServer()
+    {
+        IndexedHeap<PeerHandle, chrono::steady_clock::time_point>* schedule = nullptr;
+        PeerHandle handle;
+        ServerRecord* serv;
+        auto now = chrono::steady_clock::now();
+
+        // Hold lock until the returned server is rescheduled
+        lock_guard<mutex> lock(m_peerMutex);
+
+        bool activeDue = !m_activeSchedule.Empty()
+                         && m_activeSchedule.Top().priority <= now;
+        bool probationaryDue = !m_probationarySchedule.Empty()
+                               && m_probationarySchedule.Top().priority <= now;
+
+        // Probationary servers may only take a bounded share of the requests
+        // while there are proven servers to ask instead.
+        bool probationaryAllowed = (m_probationarySelectionCount * 100)
+                                   < (m_probationaryBudgetPercent * (m_selectionCount + 1));
+
+        if(probationaryDue && (probationaryAllowed || !activeDue))
         {
-            return nullptr;
+            schedule = &m_probationarySchedule;
+        }
+        else if(activeDue)
+        {
+            schedule = &m_activeSchedule;
+        }
+        else if(!m_activeSchedule.Empty()
+                && (m_probationarySchedule.Empty()
+                    || m_activeSchedule.Top().priority <= m_probationarySchedule.Top().priority))
+        {
+            // Nothing is eligible yet; the caller is early. Return the server
+            // that will be eligible soonest.
+            schedule = &m_activeSchedule;
+        }
+        else if(!m_probationarySchedule.Empty())
+        {
+            schedule = &m_probationarySchedule;
         }
+        else
+        {
+            // There are no servers in either list; this shouldn't happen.
+            // There is guaranteed to be at least one server in the list
+            // of configured servers.
+            // TODO: log here
 
-        outSize = size;
+            m_selectedServer = PEER_INVALID_HANDLE;
+            return m_configuredServers.front();
+        }
 
-        if(ipv6)
+        if(schedule == &m_activeSchedule && activeDue)
         {
-            ip6Msg = (pNrp_Message_Ip6Peer) srvlist.get();
+            handle = SelectWeightedServer(now);
         }
         else
         {
-            ip4Msg = (pNrp_Message_Ip4Peer) srvlist.get();
+            // Probationary servers are explored in the order they became
+            // eligible; they have no history to weigh.
+            handle = schedule->Top().key;
         }
 
+        serv = m_peers.Get(handle);
+        m_selectedServer = handle;
+
+        // Age the selection counts so the budget tracks recent behavior
+        if(m_selectionCount >= 1000)
         {
-            // Hold lock until done iterating over active server list
-            lock_guard<mutex> lock(m_activeMutex);
+            m_selectionCount /= 2;
+            m_probationarySelectionCount /= 2;
+        }
 
-            // TODO: find a way to rotate through this list so as not to return
-            // the same servers every time.
-            for(auto& rec : m_activeServers)
-            {
-                if(rec.ipv6 == ipv6)
-                {
-                    if(ipv6)
-                    {
-                        memcpy(ip6Msg->ip, rec.host6, sizeof(ip6Msg->ip));
-                        ip6Msg->port = rec.port;
-                        ip6Msg++;
-                    }
-                    else
-                    {
-                        memcpy(ip4Msg->ip, rec.host4, sizeof(ip4Msg->ip));
-                        ip4Msg->port = rec.port;
-                        ip4Msg++;
-                    }
-                    itr++;
-                }
+        m_selectionCount += 1;
 
-                // Exit the loop when requested count of servers are copied
-                if(itr >= actualCount)
-                {
-                    break;
-                }
-            }
-        } // end lock scope
+        if(schedule == &m_probationarySchedule)
+        {
+            m_probationarySelectionCount += 1;
+        }
 
-        return srvlist;
+        // Push the server back by its retry interval, so it isn't returned
+        // again if the caller never reports success or failure for it.
+        schedule->Push(handle, now + ScaledRetryTime(*serv));
+
+        return *serv;
     }
 
 
-    ServerRecord& NrpdConfig::GetNextServer()
+    PeerHandle NrpdConfig::SelectWeightedServer(chrono::steady_clock::time_point now)
     {
-        // (Re-)Initialize or increment iterator
-        if(m_activeIterator == m_activeServers.end())
+        array<IndexedHeap<PeerHandle, chrono::steady_clock::time_point>::Entry, CLIENT_SELECTION_CANDIDATES> candidates;
+        array<float, CLIENT_SELECTION_CANDIDATES> scores;
+        unsigned int count = 0;
+        float totalScore = 0.0f;
+        float pick;
+        PeerHandle chosen = PEER_INVALID_HANDLE;
+
+        // Take the first few eligible servers off the schedule
+        while(count < candidates.size()
+              && !m_activeSchedule.Empty()
+              && m_activeSchedule.Top().priority <= now)
         {
-            m_activeIterator = m_activeServers.begin();
+            candidates[count] = m_activeSchedule.Pop();
+            scores[count] = m_peers.Get(candidates[count].key)->Score();
+            totalScore += scores[count];
+            count++;
         }
-        else
+
+        // Choose one with probability proportional to its score
+        pick = FastRandom::ThreadLocal().NextFloat() * totalScore;
+
+        for(unsigned int i = 0; i < count; i++)
         {
-            m_activeIterator = next(m_activeIterator);
+            pick -= scores[i];
 
-            if(m_activeIterator == m_activeServers.end())
+            if(chosen == PEER_INVALID_HANDLE && (pick < 0.0f || i == count - 1))
             {
-                m_activeIterator = m_activeServers.begin();
+                chosen = candidates[i].key;
             }
+
+            // Put every candidate back as it was; the caller reschedules the
+            // chosen one.
+            m_activeSchedule.Push(candidates[i].key, candidates[i].priority);
         }
 
-        // (Re-)Initialize or increment iterator
-        if(m_probationaryIterator == m_probationaryServers.end())
+        return chosen;
+    }
+
+
+    bool NrpdConfig::NextServerDueTime(chrono::steady_clock::time_point& outDueTime)
+    {
+        lock_guard<mutex> lock(m_peerMutex);
+
+        if(m_activeSchedule.Empty() && m_probationarySchedule.Empty())
+        {
+            return false;
+        }
+
+        if(m_probationarySchedule.Empty())
+        {
+            outDueTime = m_activeSchedule.Top().priority;
+        }
+        else if(m_activeSchedule.Empty())
         {
-            m_probationaryIterator = m_probationaryServers.begin();
+            outDueTime = m_probationarySchedule.Top().priority;
         }
         else
         {
-            m_probationaryIterator = next(m_probationaryIterator);
+            outDueTime = min(m_activeSchedule.Top().priority, m_probationarySchedule.Top().priority);
+        }
 
-            if(m_probationaryIterator == m_probationaryServers.end())
-            {
-                m_probationaryIterator = m_probationaryServers.begin();
-            }
+        return true;
+    }
+
+
+    void NrpdConfig::RescheduleServer(PeerHandle handle, ServerRecord& serv)
+    {
+        ScheduleFor(serv).Push(handle, serv.lastaccessTime + ScaledRetryTime(serv));
+    }
+
+
+    IndexedHeap<PeerHandle, chrono::steady_clock::time_point>& NrpdConfig::ScheduleFor(ServerRecord const& serv)
+    {
+        return serv.probationary ? m_probationarySchedule : m_activeSchedule;
+    }
+
+
+    PeerHandle NrpdConfig::FindServer(ServerRecord& serv)
+    {
+        PeerHandle handle = m_peers.Find(serv);
+
+        // Only the stored record itself counts; callers may pass a copy, or
+        // a configured server that was never added.
+        if(m_peers.Get(handle) != &serv)
+        {
+            return PEER_INVALID_HANDLE;
         }
 
-        // Return a server from either the active server list or probationary
-        // server list depending on which was returned last time and which
-        // has servers in it to return.
+        return handle;
+    }
+
 
-        if(m_prevReturnedProbationary)
+    chrono::steady_clock::duration NrpdConfig::ScaledRetryTime(ServerRecord const& serv)
+    {
+        float scale = m_retryScale;
+
+        // Ask fast, reliable servers more often, and the rest less, so
+        // they supply entropy in proportion to their scores
+        if(!serv.probationary)
         {
-            // Previously returned server was on the probationary server list.
-            // Try to return one from the active servers list now.
-            if(m_activeIterator != m_activeServers.end())
-            {
-                m_prevReturnedProbationary = !m_prevReturnedProbationary;
-                // Note: casting away the 'const' here, because the contract
-                // with the caller is that they wont change the IP address
-                return (ServerRecord&) *m_activeIterator;
-            }
-            else if(m_probationaryIterator != m_probationaryServers.end())
-            {
-                // There are no servers in the active list
-                // Try the probationary list
-                return *m_probationaryIterator;
-            }
-            else
-            {
-                // There are no servers in either list; this shouldn't happen
-                // There is guaranteed to be at least one server in the list
-                // of configured servers.
-                // TODO: Log here
+            float weight = MeanActiveScore() / serv.Score();
 
-                return m_configuredServers.front();
-            }
+            scale *= min(max(weight, 1.0f / CLIENT_SCORE_MAX_WEIGHT), CLIENT_SCORE_MAX_WEIGHT);
         }
-        else
+
+        return chrono::duration_cast<chrono::steady_clock::duration>(serv.retryTime * scale);
+    }
+
+
+    float NrpdConfig::MeanActiveScore()
+    {
+        size_t count = m_peers.Count(false, false) + m_peers.Count(false, true);
+        float total = 0.0f;
+
+        if(m_scoreRefreshCountdown > 0 && m_meanScore > 0.0f)
         {
-            // Previously returned a server from the active server list.
-            // Try to return one from the probationary list now.
-            if(m_probationaryIterator != m_probationaryServers.end())
-            {
-                m_prevReturnedProbationary = !m_prevReturnedProbationary;
-                return *m_probationaryIterator;
-            }
-            else if(m_activeIterator != m_activeServers.end())
+            m_scoreRefreshCountdown--;
+            return m_meanScore;
+        }
+
+        for(size_t position = 0; position < m_peers.Count(false, false); position++)
+        {
+            total += m_peers.At(false, false, position).Score();
+        }
+
+        for(size_t position = 0; position < m_peers.Count(false, true); position++)
+        {
+            total += m_peers.At(false, true, position).Score();
+        }
+
+        m_meanScore = (count > 0) ? (total / count) : 0.0f;
+        m_scoreRefreshCountdown = max<size_t>(count, CLIENT_SCORE_REFRESH_MIN);
+
+        return m_meanScore;
+    }
+
+
+    void NrpdConfig::SetRetryScale(float scale)
+    {
+        auto now = chrono::steady_clock::now();
+        float ratio;
+
+        lock_guard<mutex> lock(m_peerMutex);
+
+        if(scale <= 0.0f || scale == m_retryScale)
+        {
+            return;
+        }
+
+        ratio = scale / m_retryScale;
+        m_retryScale = scale;
+
+        // Stretch or shrink the wait of every server that isn't due yet.
+        // This is monotonic, so the schedules stay ordered without rebuilding.
+        auto rescale = [now, ratio](chrono::steady_clock::time_point due)
+        {
+            if(due <= now)
             {
-                // There are no probationary servers, so just return one
-                // from the active list.
-                // Note: casting away the 'const' here, because the contract
-                // with the caller is that they wont change the IP address
-                return (ServerRecord&) *m_activeIterator;
+                return due;
             }
-            else
-            {
-                // There are no server in either list; this shouldn't happen.
-                // There is guaranteed to be at least one server in the list
-                // of configured servers.
-                // TODO: log here
 
-                return m_configuredServers.front();
-            }
-        }
+            return now + chrono::duration_cast<chrono::steady_clock::duration>((due - now) * ratio);
+        };
+
+        m_activeSchedule.TransformPriorities(rescale);
+        m_probationarySchedule.TransformPriorities(rescale);
     }
 
 
     void NrpdConfig::IncrementServerFailCount(ServerRecord& serv)
     {
+        lock_guard<mutex> lock(m_peerMutex);
+        PeerHandle handle = FindServer(serv);
+
+        serv.RecordFailure();
         serv.failureCount += 1;
         serv.lastaccessTime = chrono::steady_clock::now();
         serv.retryTime *= 1.25;
 
+        if(handle == PEER_INVALID_HANDLE)
+        {
+            // serv isn't a record in the active or probationary lists;
+            // there's nothing to reschedule or remove.
+            return;
+        }
+
+        if(handle == m_selectedServer)
+        {
+            m_selectedServer = PEER_INVALID_HANDLE;
+        }
+
         // Server has failed too many times, remove it
         if(serv.failureCount + 1 >= CLIENT_MAX_SERVER_TIMEOUT_COUNT)
         {
             // Add server to banned list
             m_bannedServers->Add(serv);
 
-            // remove from probationary list
-            if(serv.probationary)
+            RemoveServer(handle, serv);
+        }
+        else
+        {
+            if(!serv.probationary && m_peerDatabase != nullptr)
             {
-                // Make sure the iterator matches before removal by iterator
-                if(serv == *m_probationaryIterator)
-                {
-                    lock_guard<mutex> lock(m_probationaryMutex);
-
-                    if(serv.ipv6)
-                    {
-                        m_countIp6Servers -= 1;
-                    }
-                    else
-                    {
-                        m_countIp4Servers -= 1;
-                    }
-
-                    auto tempIterator = prev(m_probationaryIterator);
-                    m_probationaryServers.erase(m_probationaryIterator);
-                    m_probationaryIterator = tempIterator;
-                }
-                else
-                {
-                    // Somehow the iterators got out of sync with parameter;
-                    // this shouldn't have happened.
-                    // Remove the server anyway.
-                    // TODO: Log here
-                    lock_guard<mutex> lock(m_probationaryMutex);
-
-                    m_probationaryServers.remove(serv);
-                }
+                m_peerDatabase->Store(serv, false);
             }
-            else // remove from active list
-            {
-                // Make sure the iterator matches before removal by iterator
-                if(serv == *m_activeIterator)
-                {
-                    lock_guard<mutex> lock(m_activeMutex);
-
-                    if(serv.ipv6)
-                    {
-                        m_countIp6Servers -= 1;
-                    }
-                    else
-                    {
-                        m_countIp4Servers -= 1;
-                    }
-                    auto tempIterator = prev(m_activeIterator);
-                    m_activeServers.erase(m_activeIterator);
-                    m_activeIterator = tempIterator;
-                }
-                else
-                {
-                    // Iterator out of sync with parameter;
-                    // this shouldn't have happened.
-                    // Remove the server anyway.
-                    // TODO: log here
-                    lock_guard<mutex> lock(m_activeMutex);
 
-                    m_activeServers.erase(serv);
-                }
-            }
+            RescheduleServer(handle, serv);
         }
     }
 
 
-    void NrpdConfig::MarkServerSuccessful(ServerRecord& serv)
+    void NrpdConfig::MarkServerSuccessful(ServerRecord& serv, chrono::microseconds roundTripTime)
     {
+        lock_guard<mutex> lock(m_peerMutex);
+        PeerHandle handle = FindServer(serv);
+
+        serv.RecordSuccess(roundTripTime);
+
         // Reset the server failure count
         serv.failureCount = 0;
         serv.lastaccessTime = chrono::steady_clock::now();
 
+        if(handle == PEER_INVALID_HANDLE)
+        {
+            return;
+        }
+
+        if(handle == m_selectedServer)
+        {
+            m_selectedServer = PEER_INVALID_HANDLE;
+        }
+
         // If on the probationary server list, move to the active server list
-        if(serv.probationary == true)
+        if(serv.probationary)
         {
-            serv.probationary = false;
+            m_probationarySchedule.Remove(handle);
+            m_probationaryRank.Remove(handle);
+            m_peers.SetProbationary(handle, false);
+        }
+
+        if(m_peerDatabase != nullptr)
+        {
+            m_peerDatabase->Store(serv, true);
+        }
+
+        RescheduleServer(handle, serv);
+    }
+
 
+    void NrpdConfig::RemoveServer(PeerHandle handle, ServerRecord& serv)
+    {
+        // Stop scheduling the server before its record goes away
+        ScheduleFor(serv).Remove(handle);
+
+        if(serv.probationary)
+        {
+            m_probationaryRank.Remove(handle);
+        }
+
+        if(m_peerDatabase != nullptr)
+        {
+            m_peerDatabase->Erase(serv);
+        }
+
+        m_peers.Remove(handle);
+    }
+
+
+    int NrpdConfig::OpenPeerDatabase(const char* path)
+    {
+        unique_ptr<PeerDatabase> database = make_unique<PeerDatabase>();
+        auto now = chrono::steady_clock::now();
+        PeerHandle handle;
+        int error;
+
+        if((error = database->Open(path)) != 0)
+        {
+            return error;
+        }
+
+        lock_guard<mutex> lock(m_peerMutex);
+
+        for(auto& rec : database->Load())
+        {
+            if(m_bannedServers->IsPresent(rec))
             {
-                lock_guard<mutex> lock(m_activeMutex);
-                // Add to the active server list under lock
-                auto res = m_activeServers.emplace(serv);
+                database->Erase(rec);
+                continue;
+            }
 
-                // If a new element was added successfully
-                if(res.second == true)
-                {
-                    if(serv.ipv6)
-                    {
-                        m_countIp6Servers += 1;
-                    }
-                    else
-                    {
-                        m_countIp4Servers += 1;
-                    }
-                }
+            rec.retryTime = chrono::seconds(clientRequestInterval());
 
-            } // end lock scope
+            if((handle = m_peers.Add(rec)) == PEER_INVALID_HANDLE)
+            {
+                // Already known; keep the existing record, which gets its
+                // own slot if it is proven.
+                database->Erase(rec);
+                continue;
+            }
 
+            // Known-good servers are worth asking right away
+            m_activeSchedule.Push(handle, now);
+        }
 
-            // Remove from the probationary server list
-            // First, check that the iterator points to the same object
-            if(serv == *m_probationaryIterator)
+        m_peerDatabase = move(database);
+
+        return 0;
+    }
+
+
+    uint64_t NrpdConfig::ReporterBits(ServerRecord const* reporter)
+    {
+        size_t hash;
+
+        if(reporter == nullptr)
+        {
+            return 0;
+        }
+
+        hash = std::hash<ServerRecord>()(*reporter) ^ reporter->port;
+
+        // Two bits per reporter keeps false matches rare for the few dozen
+        // reporters a peer is likely to have.
+        return (1ull << (hash & 63)) | (1ull << ((hash >> 6) & 63));
+    }
+
+
+    void NrpdConfig::AddProbationaryServer(ServerRecord const& rec, uint64_t reporterBits, ServerRecord const* reporter)
+    {
+        auto now = chrono::steady_clock::now();
+        ServerRecord probationary;
+        ServerRecord* serv;
+        PeerHandle handle;
+
+        lock_guard<mutex> lock(m_peerMutex);
+
+        if((handle = m_peers.Find(rec)) != PEER_INVALID_HANDLE)
+        {
+            serv = m_peers.Get(handle);
+
+            // Active servers have already proven themselves
+            if(serv->probationary)
             {
-                lock_guard<mutex> lock(m_probationaryMutex);
+                if((serv->reporters & reporterBits) != reporterBits)
+                {
+                    serv->reporters |= reporterBits;
+                    serv->reportCount += 1;
+                }
 
-                auto tempIterator = prev(m_probationaryIterator);
-                m_probationaryServers.erase(m_probationaryIterator);
-                m_probationaryIterator = tempIterator;
+                serv->lastReported = now;
+                m_probationaryRank.Push(handle, ProbationRank(serv->reportCount, serv->lastReported));
             }
-            else
+
+            return;
+        }
+
+        // When the list is full, replace the weakest candidate, but only
+        // with one that ranks higher.
+        if(m_probationaryRank.Size() >= m_probationaryCapacity)
+        {
+            if(m_probationaryRank.Empty()
+               || !(m_probationaryRank.Top().priority < ProbationRank(1, now)))
             {
-                // This shouldn't have happened.
-                // TODO: log here
-                lock_guard<mutex> lock(m_probationaryMutex);
+                return;
+            }
+
+            handle = m_probationaryRank.Top().key;
 
-                m_probationaryServers.remove(serv);
+            // The client holds a reference to the server it's talking to,
+            // and the freed slot would go straight to rec, so the
+            // reference would silently name rec instead. Drop rec.
+            if(handle == m_selectedServer || m_peers.Get(handle) == reporter)
+            {
+                return;
             }
+
+            RemoveServer(handle, *m_peers.Get(handle));
         }
+
+        probationary = rec;
+        probationary.probationary = true;
+        probationary.reportCount = 1;
+        probationary.reporters = reporterBits;
+        probationary.lastReported = now;
+
+        handle = m_peers.Add(probationary);
+
+        // New servers are eligible to be contacted immediately
+        m_probationarySchedule.Push(handle, now);
+        m_probationaryRank.Push(handle, ProbationRank(probationary.reportCount, probationary.lastReported));
     }
 
 
-    bool NrpdConfig::AddServersFromMessage(pNrp_Header_Message msg)
+    bool NrpdConfig::AddServersFromMessage(pNrp_Header_Message msg, ServerRecord const* reporter)
     {
-        ServerRecord rec;
+        uint64_t reporterBits = ReporterBits(reporter);
 
         if(msg == nullptr)
         {
             return false;
         }
 
-        if(msg->msgType != ip4peers && msg->msgType != ip6peers)
+        // Choose the family once, rather than for every server
+        if(msg->msgType == ip4peers)
+        {
+            AddFamilyServers<ip4peers>(msg, reporterBits, reporter);
+        }
+        else if(msg->msgType == ip6peers)
+        {
+            AddFamilyServers<ip6peers>(msg, reporterBits, reporter);
+        }
+        else
         {
             return false;
         }
 
-        if(msg->msgType == ip4peers)
-        {
-            pNrp_Message_Ip4Peer ip4Msg = (pNrp_Message_Ip4Peer) msg->content;
+        return true;
+    }
+
 
+    template<nrpd_msg_type Type>
+    void NrpdConfig::AddFamilyServers(pNrp_Header_Message msg, uint64_t reporterBits, ServerRecord const* reporter)
+    {
+        auto peerMsg = (typename PeerFamily<Type>::Message const*) msg->content;
+        auto retryTime = chrono::seconds(clientRequestInterval());
+        ServerRecord rec;
+
+        for(int i = 0; i < msg->countOrSize; i++, peerMsg++)
+        {
+            DecodePeer<Type>(peerMsg, rec);
+            rec.retryTime = retryTime;
 
-            for(int i = 0; i < msg->countOrSize; i++, ip4Msg++)
+            if(m_bannedServers->IsPresent(rec))
             {
-                // Create ServerRecord to test if the server already exists
-                rec = ServerRecord(ip4Msg);
-                rec.retryTime = chrono::seconds(m_clientRequestIntervalSeconds);
+                // Server is banned, don't add to the list
+                continue;
+            }
 
-                if(m_bannedServers->IsPresent(rec))
-                {
-                    // Server is banned, don't add to the list
-                    continue;
-                }
+            // Server is not banned; add it to the probationary list,
+            // unless it's already known.
+            AddProbationaryServer(rec, reporterBits, reporter);
+        }
+    }
 
-                if(m_activeServers.find(rec) != m_activeServers.end())
-                {
-                    // Server already in active servers list, don't add.
-                    continue;
-                }
 
-                // Server is not banned or already added, add it to
-                // probationary list.
-                m_probationaryServers.push_back(rec);
+/// Config file parsing ///
+
+    // Settings that only take effect at startup
+    struct StartupSettings
+    {
+        unsigned short port;
+        bool enableServer;
+        bool enableClient;
+        bool clientEnableIp4;
+        bool clientEnableIp6;
+        bool serverEnableIp4;
+        bool serverEnableIp6;
+        bool forkDaemon;
+        bool demandMode;
+        string peerDatabasePath;
+        string identityKeyPath;
+    };
+
+    static string Trim(string const& s)
+    {
+        size_t first = s.find_first_not_of(" \t\r");
+        size_t last = s.find_last_not_of(" \t\r");
+
+        if(first == string::npos)
+        {
+            return "";
+        }
+
+        return s.substr(first, last - first + 1);
+    }
+
+    static bool ParseBool(string const& value, bool& out)
+    {
+        if(value == "true" || value == "yes" || value == "on" || value == "1")
+        {
+            out = true;
+            return true;
+        }
+
+        if(value == "false" || value == "no" || value == "off" || value == "0")
+        {
+            out = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    static bool ParseInt(string const& value, long min, long max, long& out)
+    {
+        char* end = nullptr;
+
+        errno = 0;
+        out = strtol(value.c_str(), &end, 10);
+
+        if(errno != 0 || end == value.c_str() || *end != '\0')
+        {
+            return false;
+        }
+
+        return (out >= min && out <= max);
+    }
+
+    // Peers are written as "address port", e.g. "192.0.2.1 8080" or
+    // "2001:db8::1 8080".
+    static bool ParsePeer(string const& value, ServerRecord& out)
+    {
+        unsigned char address[sizeof(in6_addr)];
+        size_t split = value.find_last_of(" \t");
+        string host;
+        long port;
+
+        if(split == string::npos)
+        {
+            return false;
+        }
+
+        host = Trim(value.substr(0, split));
+
+        if(!ParseInt(Trim(value.substr(split + 1)), 1, 65535, port))
+        {
+            return false;
+        }
+
+        if(inet_pton(AF_INET, host.c_str(), address) == 1)
+        {
+            out = ServerRecord(address, false, htons(port));
+            return true;
+        }
+
+        if(inet_pton(AF_INET6, host.c_str(), address) == 1)
+        {
+            out = ServerRecord(address, true, htons(port));
+            return true;
+        }
+
+        return false;
+    }
+
+    static bool ParseSetting(string const& key, string const& value, StartupSettings& startup, NrpdTuning& tuning, list<ServerRecord>& seeds)
+    {
+        ServerRecord peer;
+        long number;
+
+        // Settings that only take effect at startup
+        if(key == "port")
+        {
+            if(!ParseInt(value, 1, 65535, number))
+            {
+                return false;
             }
+
+            startup.port = number;
+            return true;
+        }
+        else if(key == "server")
+        {
+            return ParseBool(value, startup.enableServer);
+        }
+        else if(key == "client")
+        {
+            return ParseBool(value, startup.enableClient);
         }
-        else // ip6 peers
+        else if(key == "client_ip4")
         {
-            pNrp_Message_Ip6Peer ip6Msg = (pNrp_Message_Ip6Peer) msg->content;
+            return ParseBool(value, startup.clientEnableIp4);
+        }
+        else if(key == "client_ip6")
+        {
+            return ParseBool(value, startup.clientEnableIp6);
+        }
+        else if(key == "server_ip4")
+        {
+            return ParseBool(value, startup.serverEnableIp4);
+        }
+        else if(key == "server_ip6")
+        {
+            return ParseBool(value, startup.serverEnableIp6);
+        }
+        else if(key == "daemonize")
+        {
+            return ParseBool(value, startup.forkDaemon);
+        }
+        else if(key == "demand_mode")
+        {
+            return ParseBool(value, startup.demandMode);
+        }
+        else if(key == "peer_database")
+        {
+            startup.peerDatabasePath = value;
+            return !value.empty();
+        }
+        else if(key == "identity_key")
+        {
+            startup.identityKeyPath = value;
+            return !value.empty();
+        }
 
-            for(int i = 0; i < msg->countOrSize; i++, ip6Msg++)
+        // Settings that can be reloaded
+        if(key == "peer")
+        {
+            if(!ParsePeer(value, peer))
             {
-                // Create ServerRecord to test if this server was already
-                // added to the client.
-                rec = ServerRecord(ip6Msg);
-                rec.retryTime = chrono::seconds(m_clientRequestIntervalSeconds);
+                return false;
+            }
 
-                if(m_bannedServers->IsPresent(rec))
-                {
-                    // Server is banned. Continue with the next one.
-                    continue;
-                }
+            seeds.push_back(peer);
+            return true;
+        }
+        else if(key == "ip4_peers")
+        {
+            return ParseBool(value, tuning.enableIp4Peers);
+        }
+        else if(key == "ip6_peers")
+        {
+            return ParseBool(value, tuning.enableIp6Peers);
+        }
+        else if(key == "bulk_entropy")
+        {
+            return ParseBool(value, tuning.enableBulkEntropy);
+        }
+        else if(key == "secure_entropy")
+        {
+            return ParseBool(value, tuning.enableSecureEntropy);
+        }
+        else if(key == "cert_chain")
+        {
+            tuning.certChainPath = value;
+            return !value.empty();
+        }
+
+        if(key == "request_interval" && ParseInt(value, 1, 24*60*60, number))
+        {
+            tuning.clientRequestIntervalSeconds = number;
+        }
+        else if(key == "receive_timeout" && ParseInt(value, 1, 60*60, number))
+        {
+            tuning.clientReceiveTimeoutSeconds = number;
+        }
+        else if(key == "entropy_size" && ParseInt(value, 1, MAX_BYTE, number))
+        {
+            tuning.defaultEntropySize = number;
+        }
+        else if(key == "entropy_flush_size" && ParseInt(value, 1, 1024*1024, number))
+        {
+            tuning.entropyFlushSize = number;
+        }
+        else if(key == "entropy_flush_interval" && ParseInt(value, 1, 24*60*60, number))
+        {
+            tuning.entropyFlushIntervalSeconds = number;
+        }
+        else if(key == "entropy_min_sources" && ParseInt(value, 1, MAX_BYTE, number))
+        {
+            tuning.entropyMinSources = number;
+        }
+        else if(key == "probationary_budget" && ParseInt(value, 0, 100, number))
+        {
+            tuning.probationaryBudgetPercent = number;
+        }
+        // With no room for probationary servers, the client would drop
+        // every seed and reported peer, and never find servers to prove
+        else if(key == "probationary_capacity" && ParseInt(value, 1, 1024*1024, number))
+        {
+            tuning.probationaryCapacity = number;
+        }
+        else
+        {
+            // Unknown key, or a value out of range
+            return false;
+        }
+
+        return true;
+    }
+
+
+    bool NrpdConfig::LoadConfigFile(bool initial)
+    {
+        shared_ptr<NrpdTuning> tuning = make_shared<NrpdTuning>(*Tuning());
+        unique_ptr<CertChainBlob> chain;
+        StartupSettings startup = {m_port, m_enableServer, m_enableClient,
+                                   m_clientEnableIp4, m_clientEnableIp6,
+                                   m_serverEnableIp4, m_serverEnableIp6,
+                                   m_forkDaemon, m_demandMode, m_peerDatabasePath,
+                                   m_identityKeyPath};
+        list<ServerRecord> seeds;
+        ifstream file(m_configPath);
+        string line;
+        int lineNumber = 0;
+
+        if(!file.is_open())
+        {
+            NrpdLog::LogString("Config: can't open " + m_configPath);
+            return false;
+        }
 
-                if(m_activeServers.find(rec) != m_activeServers.end())
+        // Parse the whole file before applying anything, so a bad file
+        // leaves the running settings alone.
+        while(getline(file, line))
+        {
+            size_t equals;
+
+            lineNumber++;
+            line = Trim(line.substr(0, line.find('#')));
+
+            if(line.empty())
+            {
+                continue;
+            }
+
+            equals = line.find('=');
+
+            if(equals == string::npos
+               || !ParseSetting(Trim(line.substr(0, equals)), Trim(line.substr(equals + 1)), startup, *tuning, seeds))
+            {
+                NrpdLog::LogString("Config: invalid setting on line " + to_string(lineNumber) + " of " + m_configPath);
+                return false;
+            }
+        }
+
+        // Chunk the chain here, once per load, rather than on the packet
+        // path of the first request for it
+        if(tuning->certChainPath.empty())
+        {
+            tuning->certChain = nullptr;
+        }
+        else if((chain = CertChainBlob::Load(tuning->certChainPath.c_str())) != nullptr)
+        {
+            tuning->certChain = move(chain);
+        }
+        else
+        {
+            // Keep serving the chain there was, if any
+            NrpdLog::LogString("Config: failed to load cert chain " + tuning->certChainPath);
+        }
+
+        if(initial)
+        {
+            m_port = startup.port;
+            m_enableServer = startup.enableServer;
+            m_enableClient = startup.enableClient;
+            m_clientEnableIp4 = startup.clientEnableIp4;
+            m_clientEnableIp6 = startup.clientEnableIp6;
+            m_serverEnableIp4 = startup.serverEnableIp4;
+            m_serverEnableIp6 = startup.serverEnableIp6;
+            m_forkDaemon = startup.forkDaemon;
+            m_demandMode = startup.demandMode;
+            m_peerDatabasePath = startup.peerDatabasePath;
+            m_identityKeyPath = startup.identityKeyPath;
+        }
+
+        {
+            lock_guard<mutex> lock(m_peerMutex);
+
+            m_probationaryBudgetPercent = tuning->probationaryBudgetPercent;
+            m_probationaryCapacity = tuning->probationaryCapacity;
+
+            // Seeds are also the servers of last resort, so they are never
+            // removed once configured; only new ones are added.
+            for(auto& seed : seeds)
+            {
+                if(find(m_configuredServers.begin(), m_configuredServers.end(), seed) == m_configuredServers.end())
                 {
-                    // Server already active in list; don't add it.
-                    continue;
+                    m_configuredServers.push_back(seed);
                 }
+            }
+        } // end lock scope
+
+        atomic_store(&m_tuning, shared_ptr<const NrpdTuning>(tuning));
 
-                // Server is not banned or already added, add it to
-                // probationary list
-                m_probationaryServers.push_back(rec);
+        // Contact seeds right away, unless they're already known
+        for(auto& seed : seeds)
+        {
+            if(m_bannedServers->IsPresent(seed))
+            {
+                continue;
             }
 
+            seed.retryTime = chrono::seconds(tuning->clientRequestIntervalSeconds);
+            AddProbationaryServer(seed);
         }
 
         return true;
     }
+
+
+    void NrpdConfig::ReloadThread(shared_ptr<NrpdConfig> target)
+    {
+        sigset_t signals;
+        int signal;
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGHUP);
+
+        while(sigwait(&signals, &signal) == 0)
+        {
+            if(target->LoadConfigFile(false))
+            {
+                NrpdLog::LogString("Config: reloaded " + target->m_configPath);
+            }
+            else
+            {
+                NrpdLog::LogString("Config: reload failed; keeping the previous settings");
+            }
+        }
+    }
 }
@@ -1,15 +1,18 @@
 #include <string>
 #include <netinet/in.h>
 #include <list>
-#include <set>
 #include <memory>
 #include <mutex>
 #include <atomic>
 #include <chrono>
 #include <initializer_list>
+#include <utility>
+#include <stdint.h>
 
 #include "protocol.h"
 #include "mrucache.h"
+#include "indexedheap.h"
+#include "peerstore.h"
 
 #pragma once
 
@@ -40,6 +43,12 @@ namespace nrpd
         int failureCount;
         chrono::steady_clock::time_point lastaccessTime;
         chrono::seconds retryTime; // how many seconds since lastaccessTime to wait
+        float rttMs; // smoothed round trip time in milliseconds; 0 if unmeasured
+        float successRate; // smoothed fraction of requests the server answered
+        unsigned int reportCount; // distinct servers that reported this one as a peer
+        uint64_t reporters; // bloom filter of the servers counted in reportCount
+        chrono::steady_clock::time_point lastReported;
+        int databaseSlot; // slot in the peer database, or -1 if not stored
 
         struct
         {
@@ -49,7 +58,10 @@ namespace nrpd
             unsigned short ip6Peers : 1; // does server support ipv6 peers?
             unsigned short signkey : 1; // does server support sign key?
             unsigned short shuttingdown : 1; // Server sent shutdown message.
-            unsigned short reserved : 10; // reserved for future flags.
+            unsigned short receiveSize : 1; // does server support receive size?
+            unsigned short bulkEntropy : 1; // does server support bulk entropy?
+            unsigned short transactionId : 1; // does server echo transaction IDs?
+            unsigned short reserved : 7; // reserved for future flags.
         };
 
 
@@ -57,6 +69,17 @@ namespace nrpd
         // fields set to zeroes.
         void Initialize();
 
+        // Fold a response's round trip time into the smoothed RTT and
+        // success rate.
+        void RecordSuccess(chrono::microseconds roundTripTime);
+
+        // Fold a failed or timed-out request into the success rate.
+        void RecordFailure();
+
+        // Selection weight of the server; fast, reliable servers score higher,
+        // and active servers are asked in proportion to it.
+        float Score() const;
+
         // Only compares ip addresses
         bool operator==(ServerRecord const& rhs) const;
 
@@ -76,21 +99,16 @@ namespace std
         typedef std::size_t result_type;
         result_type operator()(argument_type const& s) const
         {
-            result_type result = 0ull;
+            // FNV-1a; the peer store indexes tens of thousands of
+            // addresses, so every byte must affect every bit.
+            result_type result = 14695981039346656037ull;
+            const unsigned char* host = s.ipv6 ? s.host6 : s.host4;
+            unsigned int size = s.ipv6 ? sizeof(s.host6) : sizeof(s.host4);
+
             // Only hashes the address, no other fields
-            if(s.ipv6)
+            for(unsigned int i = 0; i < size; i++)
             {
-                for(unsigned int i = 0; i < sizeof(s.host6); i++)
-                {
-                    result = result ^ (std::hash<unsigned char>()(s.host6[i]) << i);
-                }
-            }
-            else
-            {
-                for(unsigned int i = 0; i < sizeof(s.host4); i++)
-                {
-                    result = result ^ (std::hash<unsigned char>()(s.host4[i]) << i);
-                }
+                result = (result ^ host[i]) * 1099511628211ull;
             }
 
             return result;
@@ -102,18 +120,45 @@ using namespace std;
 
 namespace nrpd
 {
+    class PeerDatabase;
+    class CertChainBlob;
+
+    // Settings that can change while running, when the config file is
+    // reloaded. Readers take a snapshot with NrpdConfig::Tuning(); a reload
+    // publishes a new snapshot, so it never blocks or tears a request in
+    // progress.
+    struct NrpdTuning
+    {
+        int clientRequestIntervalSeconds;
+        int clientReceiveTimeoutSeconds;
+        int defaultEntropySize;
+        unsigned int entropyFlushSize;
+        int entropyFlushIntervalSeconds;
+        unsigned int entropyMinSources; // distinct servers per accumulator flush
+        bool enableIp4Peers;
+        bool enableIp6Peers;
+        int probationaryBudgetPercent;
+        unsigned int probationaryCapacity;
+        bool enableBulkEntropy; // answer bulk entropy requests; amplifies spoofed requests
+        bool enableSecureEntropy; // serve keys and secure entropy
+        string certChainPath; // PEM chain to serve; empty for none
+        shared_ptr<const CertChainBlob> certChain; // chunks of certChainPath, built on load; or nullptr
+    };
 
     class NrpdConfig
     {
     public:
         NrpdConfig();
         NrpdConfig(string*);
+        ~NrpdConfig();
 
         unsigned short serverPort();
         int defaultEntropySize();
         bool enableServer();
         bool enableClient();
         bool enablePeersResponse(nrpd_msg_type type);
+        bool enableBulkEntropy();
+        bool enableSecureEntropy();
         bool enableClientIp4();
         bool enableClientIp6();
         bool enableServerIp4();
@@ -121,18 +166,66 @@ namespace nrpd
         bool daemonize();
         int clientRequestInterval();
         int receiveTimeout();
+        unsigned int entropyFlushSize();
+        int entropyFlushInterval();
+        unsigned int entropyMinSources();
+        bool demandMode();
+        string peerDatabasePath();
+        string identityKeyPath();
+        string certChainPath();
+
+        // The current tuning settings. The snapshot never changes; call
+        // again to see a reload.
+        shared_ptr<const NrpdTuning> Tuning();
+
+        // Read the config file given to the constructor.
+        // Settings that only take effect at startup (ports, address
+        // families, daemonizing, demand mode, the peer database, the
+        // identity key) are only
+        // applied when initial is true.
+        // Returns false, and changes nothing, if the file can't be read or
+        // has an invalid line.
+        bool LoadConfigFile(bool initial);
+
+        // Thread procedure that reloads the config file of target on every
+        // SIGHUP. SIGHUP must be blocked in every thread of the process.
+        static void ReloadThread(shared_ptr<NrpdConfig> target);
+
         int ActiveServerCount(nrpd_msg_type type);
+
+        // Whether serv is on the active or probationary server lists
+        bool IsKnownServer(ServerRecord const& serv);
         unique_ptr<unsigned char[]> GetServerList(nrpd_msg_type type, int count, int& outSize);
 
-        // Alternates between returning servers on the probationary and active
-        // server lists.
+        // Returns an eligible server from the active or probationary server
+        // lists.
+        // Active servers are rescheduled at intervals scaled by the mean
+        // score over their own, so each is asked in proportion to Score();
+        // among the first few that are eligible they're weighted by it too.
+        // Probationary servers are returned in the order they
+        // became eligible, for at most CLIENT_PROBATIONARY_BUDGET_PERCENT of
+        // selections while active servers are eligible.
+        // The returned server is rescheduled a full retry interval into the
+        // future, so it won't be returned again if the caller gives up on it.
         // Callers MUST indicate the failure or success of the server by
         // calling IncrementServerFailCount or MarkServerSuccessful after the
         // server responds or timesout.
         ServerRecord& GetNextServer();
 
-        // Adds servers to probationary list until they respond, or fail 5 times in a row
-        bool AddServersFromMessage(pNrp_Header_Message msg);
+        // Retrieves the time the next server becomes eligible to be contacted.
+        // Returns false if there are no servers to contact.
+        bool NextServerDueTime(chrono::steady_clock::time_point& outDueTime);
+
+        // Multiply the time between requests to each server by scale, relative
+        // to its retry time. Servers already scheduled are rescaled
+        // from now, so a lower scale takes effect immediately.
+        void SetRetryScale(float scale);
+
+        // Adds servers to probationary list until they respond, or fail 5 times in a row.
+        // reporter is the server that sent msg, if known; servers reported
+        // by more distinct reporters are kept in preference to others when
+        // the probationary list is full.
+        bool AddServersFromMessage(pNrp_Header_Message msg, ServerRecord const* reporter = nullptr);
 
         // Increments the fail count and may remove the server if it exceeds
         // the maximum fail count.
@@ -140,11 +233,18 @@ namespace nrpd
         // calling this function.
         void IncrementServerFailCount(ServerRecord& serv);
 
-        // Resets the fail count to 0, and may move the server to the active
+        // Resets the fail count to 0, and moves the server to the active
         // server list, if it's on the probationary list.
-        // May delete the server pointed to by serv. Do not use serv after
-        // calling this function.
-        void MarkServerSuccessful(ServerRecord& serv);
+        // roundTripTime is the client-measured time to receive the response,
+        // or zero if it wasn't measured.
+        void MarkServerSuccessful(ServerRecord& serv, chrono::microseconds roundTripTime = chrono::microseconds::zero());
+
+        // Open the database of proven servers at path, and make every
+        // server in it active and due to be contacted immediately.
+        // Servers are saved to it as they are proven, updated as they
+        // succeed or fail, and erased when banned.
+        // Returns 0 on success, or errno on failure.
+        int OpenPeerDatabase(const char* path);
 
     private:
         string m_configPath;
@@ -153,28 +253,89 @@ namespace nrpd
         bool m_enableClient;
         shared_ptr<MruCache<ServerRecord>> m_bannedServers;
         list<ServerRecord> m_configuredServers;
-        set<ServerRecord> m_activeServers;
-        list<ServerRecord> m_probationaryServers;
-        set<ServerRecord>::iterator m_activeIterator;
-        list<ServerRecord>::iterator m_probationaryIterator;
-        atomic<int> m_countIp6Servers;
-        atomic<int> m_countIp4Servers;
-        bool m_prevReturnedProbationary;
+        // Active and probationary servers
+        PeerStore<ServerRecord> m_peers;
+        // Servers keyed by the time they are next eligible to be contacted
+        IndexedHeap<PeerHandle, chrono::steady_clock::time_point> m_activeSchedule;
+        IndexedHeap<PeerHandle, chrono::steady_clock::time_point> m_probationarySchedule;
+        // Probationary servers ranked by (reportCount, lastReported); the
+        // least reported, least recently reported server is evicted first
+        // when the probationary list is full.
+        typedef pair<unsigned int, chrono::steady_clock::time_point> ProbationRank;
+        IndexedHeap<PeerHandle, ProbationRank> m_probationaryRank;
+        unsigned int m_probationaryCapacity;
+        unique_ptr<PeerDatabase> m_peerDatabase;
+        // Returned by GetNextServer, until its success or failure is
+        // reported. It's never evicted, since the client holds its record.
+        PeerHandle m_selectedServer;
+        // Selections made by GetNextServer, for the probationary budget
+        unsigned int m_selectionCount;
+        unsigned int m_probationarySelectionCount;
+        int m_probationaryBudgetPercent;
+        float m_retryScale; // multiplier applied to every server's retryTime
+        float m_meanScore; // of the active servers, as last computed
+        unsigned int m_scoreRefreshCountdown; // reschedules until it's recomputed
+        bool m_demandMode;
         string m_randomDevice;
+        string m_peerDatabasePath;
+        string m_identityKeyPath; // empty to generate one at startup
         bool m_forkDaemon;
-        bool m_enableIp4Peers;
-        bool m_enableIp6Peers;
-        mutex m_activeMutex;
-        mutex m_probationaryMutex;
+        // Guards m_peers, the schedules, and the records in m_peers
+        mutex m_peerMutex;
         bool m_clientEnableIp4;
         bool m_clientEnableIp6;
         bool m_serverEnableIp4;
         bool m_serverEnableIp6;
 
-        int m_clientRequestIntervalSeconds;
-        int m_clientReceiveTimeout;
-        int m_defaultEntropySize;
+        // Only accessed with atomic_load and atomic_store
+        shared_ptr<const NrpdTuning> m_tuning;
+
+        // Add a server to the probationary list, and schedule it to be
+        // contacted immediately. If the server is already on probation,
+        // count the report instead. reporterBits identifies the reporting
+        // server in the reporters bloom filter; 0 if unknown. Neither
+        // reporter nor the selected server is evicted to make room, as
+        // their records are in use and their slots would be reused.
+        void AddProbationaryServer(ServerRecord const& rec, uint64_t reporterBits = 0, ServerRecord const* reporter = nullptr);
+
+        // The bits that identify reporter in ServerRecord::reporters
+        static uint64_t ReporterBits(ServerRecord const* reporter);
+
+        // GetServerList for one address family
+        template<nrpd_msg_type Type>
+        unique_ptr<unsigned char[]> GetFamilyServerList(int count, int& outSize);
+
+        // AddServersFromMessage for one address family
+        template<nrpd_msg_type Type>
+        void AddFamilyServers(pNrp_Header_Message msg, uint64_t reporterBits, ServerRecord const* reporter);
+
+        // Stop tracking a server entirely. Requires m_peerMutex to be held.
+        void RemoveServer(PeerHandle handle, ServerRecord& serv);
+
+        // Choose among the first CLIENT_SELECTION_CANDIDATES eligible active
+        // servers, weighted by score. Requires m_peerMutex to be held,
+        // and at least one active server to be eligible.
+        PeerHandle SelectWeightedServer(chrono::steady_clock::time_point now);
+
+        // The retry time of serv, scaled by m_retryScale and, if it's
+        // active, by the mean score over its own, within
+        // CLIENT_SCORE_MAX_WEIGHT. Requires m_peerMutex to be held.
+        chrono::steady_clock::duration ScaledRetryTime(ServerRecord const& serv);
+
+        // The mean score of the active servers. Recomputed once every
+        // active server's worth of calls, so it's O(1) per call.
+        // Requires m_peerMutex to be held.
+        float MeanActiveScore();
+
+        // The schedule for servers in the same state as serv
+        IndexedHeap<PeerHandle, chrono::steady_clock::time_point>& ScheduleFor(ServerRecord const& serv);
 
+        // Find the handle of serv, if serv is a record in m_peers.
+        // Requires m_peerMutex to be held.
+        PeerHandle FindServer(ServerRecord& serv);
 
+        // Schedule serv to be contacted again at lastaccessTime + retryTime.
+        // Requires m_peerMutex to be held.
+        void RescheduleServer(PeerHandle handle, ServerRecord& serv);
     };
 }
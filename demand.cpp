@@ -0,0 +1,149 @@
+#include "demand.h"
+#include "log.h"
+
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    EntropyDemand::EntropyDemand() : m_availfd(-1), m_wakeupfd(-1), m_poolSize(0)
+    {
+    }
+
+
+    EntropyDemand::~EntropyDemand()
+    {
+        if(m_availfd >= 0)
+        {
+            close(m_availfd);
+        }
+
+        if(m_wakeupfd >= 0)
+        {
+            close(m_wakeupfd);
+        }
+    }
+
+
+    int EntropyDemand::Initialize(const char* availPath, const char* poolSizePath, const char* wakeupPath)
+    {
+        int poolSizefd;
+
+        if((m_availfd = open(availPath, O_RDONLY)) < 0)
+        {
+            return errno;
+        }
+
+        if((poolSizefd = open(poolSizePath, O_RDONLY)) < 0)
+        {
+            return errno;
+        }
+
+        // The pool size doesn't change while running
+        m_poolSize = ReadValue(poolSizefd);
+        close(poolSizefd);
+
+        if(m_poolSize <= 0)
+        {
+            return EINVAL;
+        }
+
+        // Writers are woken when the kernel wants entropy: below the write
+        // wakeup threshold on older kernels, or until the CRNG is seeded on
+        // newer ones.
+        if((m_wakeupfd = open(wakeupPath, O_WRONLY | O_NONBLOCK)) < 0)
+        {
+            // Not fatal; fall back to checking the level when servers are due.
+            NrpdLog::LogString("Demand: failed to open random device for wakeups");
+        }
+
+        return 0;
+    }
+
+
+    nrpd_demand_level EntropyDemand::Level()
+    {
+        int avail = ReadValue(m_availfd);
+        int percent;
+
+        if(avail < 0 || m_poolSize <= 0)
+        {
+            return demand_normal;
+        }
+
+        if(m_poolSize == DEMAND_FIXED_POOL_SIZE && avail >= m_poolSize)
+        {
+            return demand_normal;
+        }
+
+        percent = (avail * 100) / m_poolSize;
+
+        if(percent < DEMAND_LOW_PERCENT)
+        {
+            return demand_high;
+        }
+        else if(percent >= DEMAND_FULL_PERCENT)
+        {
+            return demand_low;
+        }
+
+        return demand_normal;
+    }
+
+
+    bool EntropyDemand::WaitUntil(chrono::steady_clock::time_point dueTime)
+    {
+        auto remaining = chrono::duration_cast<chrono::milliseconds>(dueTime - chrono::steady_clock::now());
+
+        if(remaining <= chrono::milliseconds::zero())
+        {
+            return false;
+        }
+
+        if(m_wakeupfd < 0 || chrono::steady_clock::now() < m_lastWakeup + chrono::milliseconds(DEMAND_WAKEUP_INTERVAL_MS))
+        {
+            this_thread::sleep_until(dueTime);
+            return false;
+        }
+
+        pollfd wakeup = {m_wakeupfd, POLLOUT, 0};
+
+        // Round up so the caller isn't woken just before dueTime
+        int result = poll(&wakeup, 1, remaining.count() + 1);
+
+        if(result > 0 && (wakeup.revents & POLLOUT))
+        {
+            m_lastWakeup = chrono::steady_clock::now();
+            return true;
+        }
+
+        return false;
+    }
+
+
+    int EntropyDemand::ReadValue(int fd)
+    {
+        char buffer[32] = {0};
+        ssize_t count;
+
+        if(fd < 0)
+        {
+            return -1;
+        }
+
+        // proc files regenerate their contents on every read from offset 0
+        if((count = pread(fd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+        {
+            return -1;
+        }
+
+        return atoi(buffer);
+    }
+}
@@ -0,0 +1,63 @@
+#include <chrono>
+
+#pragma once
+
+#define ENTROPY_AVAIL_PATH "/proc/sys/kernel/random/entropy_avail"
+#define ENTROPY_POOLSIZE_PATH "/proc/sys/kernel/random/poolsize"
+#define ENTROPY_WAKEUP_DEVICE "/dev/random"
+#define DEMAND_LOW_PERCENT (25) // pool fill below which entropy is in demand
+#define DEMAND_FULL_PERCENT (75) // pool fill at or above which the pool is full
+#define DEMAND_SPEEDUP_FACTOR (4) // request rate multiplier when demand is high
+#define DEMAND_BACKOFF_FACTOR (4) // request interval multiplier when the pool is full
+#define DEMAND_FIXED_POOL_SIZE (256) // poolsize since Linux 5.18, which reads full once seeded
+#define DEMAND_WAKEUP_INTERVAL_MS (1000) // least time between wakeups by the kernel
+
+using namespace std;
+
+namespace nrpd
+{
+    enum nrpd_demand_level
+    {
+        demand_low = 0,     // pool is full; back off
+        demand_normal,      // pool is neither starved nor full
+        demand_high,        // pool is starved; request more, more often
+    };
+
+    // Tracks how much entropy the kernel wants, from the fill level of its
+    // pool and from write-wakeups on the random device.
+    class EntropyDemand
+    {
+    public:
+        EntropyDemand();
+        ~EntropyDemand();
+
+        // Open the pool level files and the wakeup device.
+        // Returns 0 on success, or errno on failure.
+        int Initialize(const char* availPath = ENTROPY_AVAIL_PATH,
+                       const char* poolSizePath = ENTROPY_POOLSIZE_PATH,
+                       const char* wakeupPath = ENTROPY_WAKEUP_DEVICE);
+
+        // Read the current demand level from the pool fill level.
+        // Returns demand_normal if the level can't be read, or says
+        // nothing: since Linux 5.18 the pool is DEMAND_FIXED_POOL_SIZE bits
+        // and reads full for good once the CRNG is seeded, so only a pool
+        // short of that is worth acting on.
+        nrpd_demand_level Level();
+
+        // Sleep until dueTime, or until the kernel signals it wants entropy
+        // written to the random device, whichever comes first. The kernel
+        // may go on signalling, so it wakes the caller at most once per
+        // DEMAND_WAKEUP_INTERVAL_MS.
+        // Returns true if woken by the kernel.
+        bool WaitUntil(chrono::steady_clock::time_point dueTime);
+
+    private:
+        int m_availfd;
+        int m_wakeupfd;
+        int m_poolSize;
+        chrono::steady_clock::time_point m_lastWakeup;
+
+        // Read an integer from the start of a proc file. Returns -1 on error.
+        static int ReadValue(int fd);
+    };
+}
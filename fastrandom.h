@@ -0,0 +1,78 @@
+#include <random>
+#include <stdint.h>
+
+#pragma once
+
+using namespace std;
+
+namespace nrpd
+{
+    // Small, fast, non-cryptographic PRNG (xoshiro256**) for load spreading
+    // decisions such as peer selection and sampling.
+    // Never use this for anything that must be unpredictable to an attacker;
+    // read from the random device for that.
+    class FastRandom
+    {
+    public:
+        FastRandom()
+        {
+            random_device rd;
+
+            for(auto& word : m_state)
+            {
+                word = (((uint64_t) rd()) << 32) | rd();
+            }
+
+            // All-zero state is the one invalid state for xoshiro
+            if((m_state[0] | m_state[1] | m_state[2] | m_state[3]) == 0)
+            {
+                m_state[0] = 1;
+            }
+        }
+
+        uint64_t Next()
+        {
+            uint64_t result = Rotl(m_state[1] * 5, 7) * 9;
+            uint64_t t = m_state[1] << 17;
+
+            m_state[2] ^= m_state[0];
+            m_state[3] ^= m_state[1];
+            m_state[1] ^= m_state[2];
+            m_state[0] ^= m_state[3];
+
+            m_state[2] ^= t;
+            m_state[3] = Rotl(m_state[3], 45);
+
+            return result;
+        }
+
+        // Uniformly distributed value in [0, bound).
+        // Uses a multiply-shift instead of modulo; the bias is negligible for
+        // the bounds used here (peer counts).
+        uint32_t Below(uint32_t bound)
+        {
+            return (uint32_t) (((Next() >> 32) * bound) >> 32);
+        }
+
+        // Uniformly distributed value in [0, 1).
+        float NextFloat()
+        {
+            return (Next() >> 40) * (1.0f / (1ull << 24));
+        }
+
+        // Per-thread generator, so callers never contend on a lock.
+        static FastRandom& ThreadLocal()
+        {
+            static thread_local FastRandom s_random;
+            return s_random;
+        }
+
+    private:
+        uint64_t m_state[4];
+
+        static inline uint64_t Rotl(uint64_t x, int k)
+        {
+            return (x << k) | (x >> (64 - k));
+        }
+    };
+}
@@ -0,0 +1,381 @@
+#include "health.h"
+#include "scramble.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NRPD_X86 1
+#endif
+
+using namespace std;
+
+namespace nrpd
+{
+    HealthTest::HealthTest()
+        : m_runByte(0),
+        m_runLength(0),
+        m_windowByte(0),
+        m_windowCount(0),
+        m_windowSize(0),
+        m_frequencySize(0)
+    {
+        memset(m_counts, 0, sizeof(m_counts));
+    }
+
+
+    int HealthTest::Test(const unsigned char* data, size_t size)
+    {
+        int result = health_ok;
+
+        if(!RepetitionCount(data, size))
+        {
+            result |= health_repetition;
+        }
+
+        if(!AdaptiveProportion(data, size))
+        {
+            result |= health_proportion;
+        }
+
+        if(!ByteFrequency(data, size))
+        {
+            result |= health_frequency;
+        }
+
+        return result;
+    }
+
+
+    bool HealthTest::RepetitionCount(const unsigned char* data, size_t size)
+    {
+        size_t idx = 0;
+
+        while(idx < size)
+        {
+            if(m_runLength != 0 && data[idx] == m_runByte)
+            {
+                if(++m_runLength >= HEALTH_REPETITION_CUTOFF)
+                {
+                    m_runLength = 0;
+                    return false;
+                }
+
+                idx++;
+                continue;
+            }
+
+            // A new run starts here. Every byte up to the next repeat is a
+            // run of one, so skip straight to it.
+            idx += FindRepeat(data + idx, size - idx);
+            m_runByte = data[idx - 1];
+            m_runLength = 1;
+        }
+
+        return true;
+    }
+
+
+    bool HealthTest::AdaptiveProportion(const unsigned char* data, size_t size)
+    {
+        size_t idx = 0;
+        size_t span;
+
+        while(idx < size)
+        {
+            // The first sample of a window is the one counted in the rest
+            if(m_windowSize == 0)
+            {
+                m_windowByte = data[idx++];
+                m_windowCount = 1;
+                m_windowSize = 1;
+                continue;
+            }
+
+            span = min(size - idx, (size_t) (HEALTH_PROPORTION_WINDOW - m_windowSize));
+            m_windowCount += CountByte(data + idx, span, m_windowByte);
+            m_windowSize += span;
+            idx += span;
+
+            if(m_windowCount >= HEALTH_PROPORTION_CUTOFF)
+            {
+                m_windowSize = 0;
+                return false;
+            }
+
+            if(m_windowSize == HEALTH_PROPORTION_WINDOW)
+            {
+                m_windowSize = 0;
+            }
+        }
+
+        return true;
+    }
+
+
+    bool HealthTest::ByteFrequency(const unsigned char* data, size_t size)
+    {
+        const double expected = HEALTH_FREQUENCY_WINDOW / 256.0;
+        size_t idx = 0;
+        size_t end;
+        uint64_t sumSquares;
+        bool passed = true;
+
+        while(idx < size)
+        {
+            end = idx + min(size - idx, (size_t) (HEALTH_FREQUENCY_WINDOW - m_frequencySize));
+            m_frequencySize += end - idx;
+
+            for(; idx + 4 <= end; idx += 4)
+            {
+                m_counts[0][data[idx]]++;
+                m_counts[1][data[idx + 1]]++;
+                m_counts[2][data[idx + 2]]++;
+                m_counts[3][data[idx + 3]]++;
+            }
+
+            for(; idx < end; idx++)
+            {
+                m_counts[0][data[idx]]++;
+            }
+
+            if(m_frequencySize < HEALTH_FREQUENCY_WINDOW)
+            {
+                break;
+            }
+
+            // Sum of (count - expected)^2 / expected, which is the sum of
+            // count^2 / expected, less the window size
+            sumSquares = 0;
+
+            for(int value = 0; value < 256; value++)
+            {
+                uint64_t count = m_counts[0][value] + m_counts[1][value] + m_counts[2][value] + m_counts[3][value];
+
+                sumSquares += count * count;
+            }
+
+            if((sumSquares / expected) - HEALTH_FREQUENCY_WINDOW > HEALTH_FREQUENCY_CUTOFF)
+            {
+                passed = false;
+            }
+
+            memset(m_counts, 0, sizeof(m_counts));
+            m_frequencySize = 0;
+        }
+
+        return passed;
+    }
+
+
+    typedef size_t (*FindRepeatFunction)(const unsigned char*, size_t);
+    typedef size_t (*CountByteFunction)(const unsigned char*, size_t, unsigned char);
+
+    // Pick the implementations once, the first time each is used
+    static FindRepeatFunction SelectFindRepeat()
+    {
+        if(CpuSupportsAvx2())
+        {
+            return FindRepeatAvx2;
+        }
+
+        if(CpuSupportsSse2())
+        {
+            return FindRepeatSse2;
+        }
+
+        return FindRepeatScalar;
+    }
+
+    static CountByteFunction SelectCountByte()
+    {
+        if(CpuSupportsAvx2())
+        {
+            return CountByteAvx2;
+        }
+
+        if(CpuSupportsSse2())
+        {
+            return CountByteSse2;
+        }
+
+        return CountByteScalar;
+    }
+
+    size_t FindRepeat(const unsigned char* data, size_t size)
+    {
+        static const FindRepeatFunction s_findRepeat = SelectFindRepeat();
+
+        return s_findRepeat(data, size);
+    }
+
+    size_t CountByte(const unsigned char* data, size_t size, unsigned char value)
+    {
+        static const CountByteFunction s_countByte = SelectCountByte();
+
+        return s_countByte(data, size, value);
+    }
+
+    size_t FindRepeatScalar(const unsigned char* data, size_t size)
+    {
+        for(size_t idx = 1; idx < size; idx++)
+        {
+            if(data[idx] == data[idx - 1])
+            {
+                return idx;
+            }
+        }
+
+        return size;
+    }
+
+    size_t CountByteScalar(const unsigned char* data, size_t size, unsigned char value)
+    {
+        size_t count = 0;
+
+        for(size_t idx = 0; idx < size; idx++)
+        {
+            count += (data[idx] == value);
+        }
+
+        return count;
+    }
+
+#ifdef NRPD_X86
+
+    // Byte lanes count matches by subtracting the all-ones compare result,
+    // and are summed into 64-bit lanes before any can pass 255
+    #define COUNT_BLOCKS (255)
+
+    size_t FindRepeatSse2(const unsigned char* data, size_t size)
+    {
+        size_t idx = 1;
+
+        // Compare each byte with the one before it, 16 at a time
+        for(; idx + 16 <= size; idx += 16)
+        {
+            __m128i current = _mm_loadu_si128((const __m128i*) (data + idx));
+            __m128i previous = _mm_loadu_si128((const __m128i*) (data + idx - 1));
+            int repeats = _mm_movemask_epi8(_mm_cmpeq_epi8(current, previous));
+
+            if(repeats != 0)
+            {
+                return idx + __builtin_ctz(repeats);
+            }
+        }
+
+        return (idx - 1) + FindRepeatScalar(data + idx - 1, size - (idx - 1));
+    }
+
+    __attribute__((target("avx2")))
+    size_t FindRepeatAvx2(const unsigned char* data, size_t size)
+    {
+        size_t idx = 1;
+
+        for(; idx + 32 <= size; idx += 32)
+        {
+            __m256i current = _mm256_loadu_si256((const __m256i*) (data + idx));
+            __m256i previous = _mm256_loadu_si256((const __m256i*) (data + idx - 1));
+            unsigned int repeats = _mm256_movemask_epi8(_mm256_cmpeq_epi8(current, previous));
+
+            if(repeats != 0)
+            {
+                _mm256_zeroupper();
+                return idx + __builtin_ctz(repeats);
+            }
+        }
+
+        // Avoid the AVX to SSE transition penalty in the tail
+        _mm256_zeroupper();
+
+        return (idx - 1) + FindRepeatSse2(data + idx - 1, size - (idx - 1));
+    }
+
+    size_t CountByteSse2(const unsigned char* data, size_t size, unsigned char value)
+    {
+        const __m128i needle = _mm_set1_epi8(value);
+        const __m128i zero = _mm_setzero_si128();
+        __m128i total = zero;
+        uint64_t sums[2];
+        size_t idx = 0;
+
+        while(size - idx >= 16)
+        {
+            size_t blocks = min((size - idx) / 16, (size_t) COUNT_BLOCKS);
+            __m128i counts = zero;
+
+            for(; blocks > 0; blocks--, idx += 16)
+            {
+                __m128i lanes = _mm_loadu_si128((const __m128i*) (data + idx));
+
+                counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(lanes, needle));
+            }
+
+            total = _mm_add_epi64(total, _mm_sad_epu8(counts, zero));
+        }
+
+        _mm_storeu_si128((__m128i*) sums, total);
+
+        return sums[0] + sums[1] + CountByteScalar(data + idx, size - idx, value);
+    }
+
+    __attribute__((target("avx2")))
+    size_t CountByteAvx2(const unsigned char* data, size_t size, unsigned char value)
+    {
+        const __m256i needle = _mm256_set1_epi8(value);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i total = zero;
+        uint64_t sums[4];
+        size_t idx = 0;
+
+        while(size - idx >= 32)
+        {
+            size_t blocks = min((size - idx) / 32, (size_t) COUNT_BLOCKS);
+            __m256i counts = zero;
+
+            for(; blocks > 0; blocks--, idx += 32)
+            {
+                __m256i lanes = _mm256_loadu_si256((const __m256i*) (data + idx));
+
+                counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(lanes, needle));
+            }
+
+            total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+        }
+
+        _mm256_storeu_si256((__m256i*) sums, total);
+
+        // Avoid the AVX to SSE transition penalty in the tail
+        _mm256_zeroupper();
+
+        return sums[0] + sums[1] + sums[2] + sums[3] + CountByteSse2(data + idx, size - idx, value);
+    }
+
+    #undef COUNT_BLOCKS
+
+#else
+
+    size_t FindRepeatSse2(const unsigned char* data, size_t size)
+    {
+        return FindRepeatScalar(data, size);
+    }
+
+    size_t FindRepeatAvx2(const unsigned char* data, size_t size)
+    {
+        return FindRepeatScalar(data, size);
+    }
+
+    size_t CountByteSse2(const unsigned char* data, size_t size, unsigned char value)
+    {
+        return CountByteScalar(data, size, value);
+    }
+
+    size_t CountByteAvx2(const unsigned char* data, size_t size, unsigned char value)
+    {
+        return CountByteScalar(data, size, value);
+    }
+
+#endif
+}
@@ -0,0 +1,93 @@
+#include <stddef.h>
+
+#pragma once
+
+// Cutoffs for the credit of CLIENT_ENTROPY_CREDIT_BITS_PER_BYTE, one bit of
+// min-entropy per byte, with a false alarm rate of 2^-20 (SP 800-90B 4.4)
+#define HEALTH_REPETITION_CUTOFF (21) // 1 + ceil(20 / H)
+#define HEALTH_PROPORTION_WINDOW (512)
+#define HEALTH_PROPORTION_CUTOFF (410)
+// Bytes per chi-square test of byte frequencies, and the statistic, with
+// 255 degrees of freedom, that uniform bytes exceed with p < 1e-9
+#define HEALTH_FREQUENCY_WINDOW (4096)
+#define HEALTH_FREQUENCY_CUTOFF (415)
+
+namespace nrpd
+{
+    // Tests a HealthTest failed, as bits
+    enum nrpd_health_result
+    {
+        health_ok = 0,
+        health_repetition = 1,  // one byte repeated too many times in a row
+        health_proportion = 2,  // one byte too common in a window
+        health_frequency = 4    // bytes too far from uniform in a window
+    };
+
+    // Continuous health tests of one server's entropy: the repetition
+    // count and adaptive proportion tests of NIST SP 800-90B, taking each
+    // byte as a sample, and a chi-square test of how often each byte value
+    // turns up. They catch a server that is stuck or badly biased, not one
+    // that is lying well.
+    //
+    // Entropy is tested as it arrives; state carries over from one call to
+    // the next, so runs and windows may span messages.
+    class HealthTest
+    {
+    public:
+        HealthTest();
+
+        // Test size more bytes of the server's entropy.
+        // Returns the tests failed, as nrpd_health_result bits.
+        int Test(const unsigned char* data, size_t size);
+
+    private:
+        // Repetition count test
+        unsigned char m_runByte;
+        unsigned int m_runLength; // 0 before the first sample
+
+        // Adaptive proportion test
+        unsigned char m_windowByte;
+        unsigned int m_windowCount; // of m_windowByte, including the first
+        unsigned int m_windowSize; // samples so far; 0 to start a window
+
+        // Chi-square test, counting into four tables in turn so
+        // consecutive bytes don't wait on each other's increments
+        unsigned short m_counts[4][256];
+        unsigned int m_frequencySize;
+
+        bool RepetitionCount(const unsigned char* data, size_t size);
+        bool AdaptiveProportion(const unsigned char* data, size_t size);
+        bool ByteFrequency(const unsigned char* data, size_t size);
+    };
+
+    // Tests run and failed across servers
+    struct HealthStats
+    {
+        unsigned long long bytesTested;
+        unsigned long long repetitionFailures;
+        unsigned long long proportionFailures;
+        unsigned long long frequencyFailures;
+    };
+
+    // Offset of the first byte of data that repeats the byte before it,
+    // or size if none does.
+    //
+    // Dispatches to the fastest implementation the CPU supports.
+    size_t FindRepeat(const unsigned char* data, size_t size);
+
+    // Number of bytes of data equal to value.
+    //
+    // Dispatches to the fastest implementation the CPU supports.
+    size_t CountByte(const unsigned char* data, size_t size, unsigned char value);
+
+    // Portable implementations, one byte at a time
+    size_t FindRepeatScalar(const unsigned char* data, size_t size);
+    size_t CountByteScalar(const unsigned char* data, size_t size, unsigned char value);
+
+    // Vectorized implementations; only call these if the CPU supports them,
+    // per CpuSupportsSse2() and CpuSupportsAvx2().
+    size_t FindRepeatSse2(const unsigned char* data, size_t size);
+    size_t FindRepeatAvx2(const unsigned char* data, size_t size);
+    size_t CountByteSse2(const unsigned char* data, size_t size, unsigned char value);
+    size_t CountByteAvx2(const unsigned char* data, size_t size, unsigned char value);
+}
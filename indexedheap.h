@@ -0,0 +1,219 @@
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <utility>
+
+#pragma once
+
+using namespace std;
+
+namespace nrpd
+{
+    // Binary min-heap of keys ordered by priority, with an index from key to
+    // heap position so that any key can be re-prioritized or removed in
+    // O(log n) without searching the heap.
+    //
+    // Keys must be unique; scheduling a key that is already present updates
+    // its priority in place.
+    template<typename Key, typename Priority, typename Compare = less<Priority>, typename Hash = hash<Key>>
+    class IndexedHeap
+    {
+    public:
+        struct Entry
+        {
+            Priority priority;
+            Key key;
+        };
+
+        bool Empty() const
+        {
+            return m_heap.empty();
+        }
+
+        size_t Size() const
+        {
+            return m_heap.size();
+        }
+
+        bool Contains(Key const& key) const
+        {
+            return m_index.find(key) != m_index.end();
+        }
+
+        // The entry with the smallest priority. Undefined if the heap is empty.
+        Entry const& Top() const
+        {
+            return m_heap.front();
+        }
+
+        // Insert key with priority, or update the priority of key if it is
+        // already in the heap.
+        void Push(Key const& key, Priority const& priority)
+        {
+            auto item = m_index.find(key);
+
+            if(item == m_index.end())
+            {
+                m_heap.push_back({priority, key});
+                m_index.emplace(key, m_heap.size() - 1);
+                SiftUp(m_heap.size() - 1);
+            }
+            else
+            {
+                size_t pos = item->second;
+                bool decreased = m_compare(priority, m_heap[pos].priority);
+
+                m_heap[pos].priority = priority;
+
+                if(decreased)
+                {
+                    SiftUp(pos);
+                }
+                else
+                {
+                    SiftDown(pos);
+                }
+            }
+        }
+
+        // Remove and return the entry with the smallest priority.
+        // Undefined if the heap is empty.
+        Entry Pop()
+        {
+            Entry top = m_heap.front();
+
+            RemoveAt(0);
+
+            return top;
+        }
+
+        // Remove key from the heap.
+        // Returns false if key was not in the heap.
+        bool Remove(Key const& key)
+        {
+            auto item = m_index.find(key);
+
+            if(item == m_index.end())
+            {
+                return false;
+            }
+
+            RemoveAt(item->second);
+
+            return true;
+        }
+
+        // Look up the priority of key.
+        // Returns false if key is not in the heap.
+        bool GetPriority(Key const& key, Priority& outPriority) const
+        {
+            auto item = m_index.find(key);
+
+            if(item == m_index.end())
+            {
+                return false;
+            }
+
+            outPriority = m_heap[item->second].priority;
+            return true;
+        }
+
+        // Apply a transformation to every priority in the heap.
+        // The transformation MUST be monotonic (preserve the relative order of
+        // priorities), otherwise the heap invariant is broken.
+        template<typename Transform>
+        void TransformPriorities(Transform transform)
+        {
+            for(auto& entry : m_heap)
+            {
+                entry.priority = transform(entry.priority);
+            }
+        }
+
+        void Clear()
+        {
+            m_heap.clear();
+            m_index.clear();
+        }
+
+    private:
+        vector<Entry> m_heap;
+        unordered_map<Key, size_t, Hash> m_index;
+        Compare m_compare;
+
+        void RemoveAt(size_t pos)
+        {
+            size_t last = m_heap.size() - 1;
+
+            m_index.erase(m_heap[pos].key);
+
+            if(pos != last)
+            {
+                m_heap[pos] = move(m_heap[last]);
+                m_index[m_heap[pos].key] = pos;
+                m_heap.pop_back();
+
+                // The moved entry may need to go either direction
+                SiftUp(pos);
+                SiftDown(pos);
+            }
+            else
+            {
+                m_heap.pop_back();
+            }
+        }
+
+        void Swap(size_t a, size_t b)
+        {
+            swap(m_heap[a], m_heap[b]);
+            m_index[m_heap[a].key] = a;
+            m_index[m_heap[b].key] = b;
+        }
+
+        void SiftUp(size_t pos)
+        {
+            while(pos > 0)
+            {
+                size_t parent = (pos - 1) / 2;
+
+                if(!m_compare(m_heap[pos].priority, m_heap[parent].priority))
+                {
+                    break;
+                }
+
+                Swap(pos, parent);
+                pos = parent;
+            }
+        }
+
+        void SiftDown(size_t pos)
+        {
+            size_t size = m_heap.size();
+
+            while(true)
+            {
+                size_t left = (2 * pos) + 1;
+                size_t right = left + 1;
+                size_t smallest = pos;
+
+                if(left < size && m_compare(m_heap[left].priority, m_heap[smallest].priority))
+                {
+                    smallest = left;
+                }
+
+                if(right < size && m_compare(m_heap[right].priority, m_heap[smallest].priority))
+                {
+                    smallest = right;
+                }
+
+                if(smallest == pos)
+                {
+                    break;
+                }
+
+                Swap(pos, smallest);
+                pos = smallest;
+            }
+        }
+    };
+}
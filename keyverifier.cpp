@@ -0,0 +1,194 @@
+#include "keyverifier.h"
+#include "log.h"
+
+#include <string.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    KeyVerifier::KeyVerifier(int workers) : m_busy(0), m_stopping(false)
+    {
+        for(int index = 0; index < workers; index++)
+        {
+            m_workers.emplace_back(&KeyVerifier::WorkerLoop, this);
+        }
+    }
+
+
+    KeyVerifier::~KeyVerifier()
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+
+        m_jobReady.notify_all();
+
+        for(thread& worker : m_workers)
+        {
+            worker.join();
+        }
+    }
+
+
+    void KeyVerifier::Submit(KeyJob const& job)
+    {
+        if(m_workers.empty())
+        {
+            VerifiedKeys result = Verify(job);
+            lock_guard<mutex> lock(m_mutex);
+            m_results.push_back(result);
+            return;
+        }
+
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_jobs.push_back(job);
+        }
+
+        m_jobReady.notify_one();
+    }
+
+
+    void KeyVerifier::Collect(vector<VerifiedKeys>& outResults)
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        outResults.insert(outResults.end(), m_results.begin(), m_results.end());
+        m_results.clear();
+    }
+
+
+    void KeyVerifier::Drain()
+    {
+        unique_lock<mutex> lock(m_mutex);
+
+        m_jobsDone.wait(lock, [this] { return m_jobs.empty() && m_busy == 0; });
+    }
+
+
+    size_t KeyVerifier::Pending()
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        return m_jobs.size() + m_busy + m_results.size();
+    }
+
+
+    void KeyVerifier::WorkerLoop()
+    {
+        vector<KeyJob> batch;
+        vector<VerifiedKeys> results;
+
+        for(;;)
+        {
+            {
+                unique_lock<mutex> lock(m_mutex);
+
+                m_jobReady.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+
+                if(m_stopping)
+                {
+                    return;
+                }
+
+                while(!m_jobs.empty() && batch.size() < CLIENT_VERIFY_BATCH)
+                {
+                    batch.push_back(m_jobs.front());
+                    m_jobs.pop_front();
+                }
+
+                m_busy += batch.size();
+            } // End of lock scope
+
+            for(KeyJob const& job : batch)
+            {
+                results.push_back(Verify(job));
+            }
+
+            {
+                lock_guard<mutex> lock(m_mutex);
+
+                m_results.insert(m_results.end(), results.begin(), results.end());
+                m_busy -= batch.size();
+            } // End of lock scope
+
+            m_jobsDone.notify_all();
+            batch.clear();
+            results.clear();
+        }
+    }
+
+
+    VerifiedKeys KeyVerifier::Verify(KeyJob const& job)
+    {
+        VerifiedKeys result = VerifiedKeys();
+        pNrp_Message_SignKey_Response record;
+        KeyPair clientKey;
+
+        result.server = job.server;
+        memcpy(result.identity, job.identity, sizeof(result.identity));
+
+        if(job.hasSignKeyRecord)
+        {
+            record = (pNrp_Message_SignKey_Response) job.signKeyRecord;
+
+            // Signed by the identity, which it carries ahead of the signature
+            if(memcmp(record->signature, job.identity, SECURE_PUBLIC_KEY_SIZE) != 0
+               || !ParseExpiry(record->expiryTime, result.expiry)
+               || !VerifyKeyRecord(signkey, record, job.identity, record->signature + SECURE_PUBLIC_KEY_SIZE))
+            {
+                NrpdLog::LogString("KeyVerifier: sign key failed verification");
+                return result;
+            }
+
+            memcpy(result.signKey, record->key, sizeof(result.signKey));
+            result.keyId = record->keyId;
+        }
+        else
+        {
+            memcpy(result.signKey, job.signKey, sizeof(result.signKey));
+            result.keyId = job.keyId;
+            result.expiry = job.expiry;
+        }
+
+        result.hasSignKey = true;
+
+        if(!job.hasEncryptionKeyRecord)
+        {
+            return result;
+        }
+
+        // Only the epoch's sign key can vouch for its encryption key
+        record = (pNrp_Message_SignKey_Response) job.encryptionKeyRecord;
+
+        if(record->keyId != result.keyId || !VerifyKeyRecord(encryptionkey, record, result.signKey, record->signature))
+        {
+            NrpdLog::LogString("KeyVerifier: encryption key failed verification");
+            return result;
+        }
+
+        memcpy(result.encryptionKey, record->key, sizeof(result.encryptionKey));
+
+        // One key of ours per epoch, so the server can cache the agreement,
+        // and so can we; each response has its own nonce.
+        if(!clientKey.Generate(EVP_PKEY_X25519))
+        {
+            NrpdLog::LogString("KeyVerifier: failed to generate secure entropy key");
+            return result;
+        }
+
+        memcpy(result.secureRequest.clientKey, clientKey.PublicKey(), sizeof(result.secureRequest.clientKey));
+        result.secureRequest.keyId = result.keyId;
+
+        if(!DeriveSessionKey(clientKey, result.encryptionKey, &result.secureRequest, result.session.key))
+        {
+            NrpdLog::LogString("KeyVerifier: failed to agree on a session key");
+            return result;
+        }
+
+        result.hasSession = true;
+        return result;
+    }
+}
@@ -0,0 +1,98 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "securekeys.h"
+
+#pragma once
+
+#define CLIENT_VERIFY_WORKERS (2) // threads verifying servers' keys
+#define CLIENT_VERIFY_BATCH (16) // most jobs a worker takes at once
+
+using namespace std;
+
+namespace nrpd
+{
+    // Keys a server sent in one response, waiting to be verified
+    struct KeyJob
+    {
+        ServerRecord server;
+        // Pinned, or else claimed by the sign key record
+        unsigned char identity[SECURE_PUBLIC_KEY_SIZE];
+        // The epoch's sign key, as a record to verify if hasSignKeyRecord,
+        // or else as verified from an earlier response
+        unsigned char signKeyRecord[SIGNKEY_RESPONSE_SIZE];
+        unsigned char signKey[SECURE_PUBLIC_KEY_SIZE];
+        unsigned char keyId;
+        time_t expiry;
+        unsigned char encryptionKeyRecord[ENCRYPTIONKEY_RESPONSE_SIZE];
+        bool hasSignKeyRecord;
+        bool hasEncryptionKeyRecord;
+    };
+
+    // What came of a KeyJob. Nothing is set unless its flag is.
+    struct VerifiedKeys
+    {
+        ServerRecord server;
+        unsigned char identity[SECURE_PUBLIC_KEY_SIZE];
+        unsigned char signKey[SECURE_PUBLIC_KEY_SIZE];
+        unsigned char encryptionKey[SECURE_PUBLIC_KEY_SIZE];
+        unsigned char keyId;
+        time_t expiry;
+        // Our key for the epoch, in the request it's sent in, and the
+        // session key agreed with it
+        Nrp_Message_SecureEntropy_Request secureRequest;
+        SessionKey session;
+        bool hasSignKey; // the sign key was signed by identity
+        bool hasSession; // the encryption key was signed by the sign key, and a session agreed
+    };
+
+    // The client's verification stage. Every signature a server sends, and
+    // the agreement that follows, is checked here, on worker threads, so
+    // the client loop never waits on public key work. Nothing from a
+    // server is sealed under a session key until its job has come out of
+    // the stage, so no secure entropy is consumed on unverified keys.
+    //
+    // Workers take queued jobs in batches, up to CLIENT_VERIFY_BATCH at a
+    // time, and publish their results together, so a burst of servers
+    // costs a lock per batch rather than per job.
+    class KeyVerifier
+    {
+    public:
+        // Verify on workers threads, or in Submit if workers is 0
+        KeyVerifier(int workers);
+        ~KeyVerifier();
+
+        KeyVerifier(KeyVerifier const&) = delete;
+        KeyVerifier& operator=(KeyVerifier const&) = delete;
+
+        void Submit(KeyJob const& job);
+
+        // Append the results finished since the last call to outResults
+        void Collect(vector<VerifiedKeys>& outResults);
+
+        // Wait until every job submitted so far is finished
+        void Drain();
+
+        // Jobs submitted and not yet collected
+        size_t Pending();
+
+        // Verify job on the calling thread
+        static VerifiedKeys Verify(KeyJob const& job);
+
+    private:
+        mutex m_mutex;
+        condition_variable m_jobReady;
+        condition_variable m_jobsDone;
+        deque<KeyJob> m_jobs;
+        vector<VerifiedKeys> m_results;
+        size_t m_busy; // jobs taken by workers, and not yet finished
+        bool m_stopping;
+        vector<thread> m_workers;
+
+        void WorkerLoop();
+    };
+}
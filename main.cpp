@@ -17,6 +17,8 @@
 #include "server.h"
 #include "config.h"
 #include "client.h"
+#include "peerdatabase.h"
+#include "log.h"
 
 using namespace std;
 using namespace nrpd;
@@ -28,20 +30,51 @@ int main(int argc, char* argv[])
     shared_ptr<NrpdConfig> config;
     shared_ptr<NrpdServer> server;
     shared_ptr<NrpdClient> client;
+    sigset_t signals;
+
+    // Block SIGHUP in every thread, so only the reload thread receives it.
+    // Threads inherit the mask when they're created, and initialization
+    // starts some (e.g. the client's key verifiers), so this must come
+    // before anything else; don't start threads above it.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    // Usage: nrpd [config file]
+    if(argc > 1)
+    {
+        string configPath(argv[1]);
+
+        config = make_shared<NrpdConfig>(&configPath);
 
-    config = make_shared<NrpdConfig>();
+        if(config != nullptr && !config->LoadConfigFile(true))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        config = make_shared<NrpdConfig>();
+    }
 
     if(config == nullptr)
     {
         return 254;
     }
 
+    // Start from the servers known to be good before the last shutdown.
+    // Not fatal; without it, the client relearns its peers by probing.
+    if((retCode = config->OpenPeerDatabase(config->peerDatabasePath().c_str())) != 0)
+    {
+        NrpdLog::LogString("Main: failed to open peer database " + config->peerDatabasePath() + ", error " + to_string(retCode) + " (" + strerror(retCode) + ")");
+        retCode = 0;
+    }
+
     server = make_shared<NrpdServer>(config);
     client = make_shared<NrpdClient>(config);
 
 
-    // TODO: make this configurable
-    if(false) // daemonize == true
+    if(config->daemonize())
     {
         // Fork in the background to daemonize
         pid = fork();
@@ -57,8 +90,7 @@ int main(int argc, char* argv[])
 
     //TODO: start logging here
 
-    // TODO: make this configurable
-    if(false) // daemonize == true
+    if(config->daemonize())
     {
         // Set filemask
         umask(0);
@@ -97,6 +129,16 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
+    if(argc > 1)
+    {
+        // Reload the config file on SIGHUP for as long as the daemon runs
+        thread reloadThread(NrpdConfig::ReloadThread, config);
+        reloadThread.detach();
+    }
+
+    // Keys are rotated ahead of time, off the server thread
+    thread keyThread(NrpdServer::KeyThread, server);
+    keyThread.detach();
 
     thread serverThread(NrpdServer::ServerThread, server);
     thread clientThread(NrpdClient::ClientThread, client);
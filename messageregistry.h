@@ -0,0 +1,98 @@
+#include "protocol.h"
+
+#pragma once
+
+using namespace std;
+
+namespace nrpd
+{
+    // How many records a message may hold, per its countOrSize
+    enum nrpd_count_rule
+    {
+        anycount,       // any count, including none
+        onecount,       // exactly one record
+        nonzerocount    // at least one
+    };
+
+    // How a message type may appear in one direction of the protocol
+    struct MessageRule
+    {
+        bool allowed;
+        bool sized;                 // length must be header + (count * recordSize)
+        unsigned char recordSize;
+        nrpd_count_rule count;
+        bool (*validate)(pNrp_Header_Message hdr); // further checks of content, or nullptr
+
+        // Never sent in this direction
+        static constexpr MessageRule Never() { return {false, false, 0, anycount, nullptr}; }
+
+        // Accepted as-is; for types not implemented yet, which servers let
+        // newer clients request
+        static constexpr MessageRule Unchecked() { return {true, false, 0, anycount, nullptr}; }
+
+        // count records of recordSize bytes; 0 for a count with no content
+        static constexpr MessageRule Records(unsigned char recordSize, nrpd_count_rule count = anycount, bool (*validate)(pNrp_Header_Message) = nullptr) { return {true, true, recordSize, count, validate}; }
+
+        // Sized by validate, for records too large for recordSize
+        static constexpr MessageRule Checked(bool (*validate)(pNrp_Header_Message), nrpd_count_rule count = anycount) { return {true, false, 0, count, validate}; }
+    };
+
+    // Everything validation needs to know about a message type
+    struct MessageDescriptor
+    {
+        nrpd_msg_type type;
+        MessageRule request;
+        MessageRule response;
+    };
+
+    // Every message type, indexed by type. Adding a type means adding its
+    // row here, and its handlers to the server's and client's dispatch
+    // tables; validation and dispatch of the others don't change.
+    static constexpr MessageDescriptor c_messageDescriptors[] =
+    {
+        { nrpd_msg_type_min, MessageRule::Never(), MessageRule::Never() },
+        { request, MessageRule::Never(), MessageRule::Never() },
+        { response, MessageRule::Never(), MessageRule::Never() },
+        // Request messages can't reject
+        { reject, MessageRule::Never(), MessageRule::Records(sizeof(Nrp_Message_Reject), anycount, ValidateRejectMessage) },
+        // Requests are just a header, with the count of peers wanted
+        { ip4peers, MessageRule::Records(0), MessageRule::Records(sizeof(Nrp_Message_Ip4Peer)) },
+        { entropy, MessageRule::Records(0), MessageRule::Records(sizeof(unsigned char)) },
+        { ip6peers, MessageRule::Records(0), MessageRule::Records(sizeof(Nrp_Message_Ip6Peer)) },
+        // Clients ask for any number of chunks; each is sent in its own
+        // message, sized for the client's address family
+        { certchain, MessageRule::Records(sizeof(Nrp_Message_CertChain_Request), nonzerocount), MessageRule::Checked(ValidateCertChainMessage, onecount) },
+        // Keys are requested with a bare header, and sent one per message
+        { signkey, MessageRule::Records(0), MessageRule::Records(SIGNKEY_RESPONSE_SIZE, onecount) },
+        { encryptionkey, MessageRule::Records(0), MessageRule::Records(ENCRYPTIONKEY_RESPONSE_SIZE, onecount) },
+        { secureentropy, MessageRule::Records(sizeof(Nrp_Message_SecureEntropy_Request), onecount), MessageRule::Records(sizeof(Nrp_Message_SecureEntropy_Response), onecount) },
+        // Only clients send it, and only one record of it
+        { receivesize, MessageRule::Records(sizeof(Nrp_Message_ReceiveSize_Request), onecount), MessageRule::Never() },
+        // Only clients send it; the train is made of entropy messages
+        { bulkentropy, MessageRule::Records(0, nonzerocount), MessageRule::Never() },
+        // Sent by clients, and echoed by servers
+        { transactionid, MessageRule::Records(sizeof(Nrp_Message_TransactionId), onecount), MessageRule::Records(sizeof(Nrp_Message_TransactionId), onecount) },
+    };
+
+    static constexpr bool DescriptorsInOrder()
+    {
+        for(int type = 0; type < nrpd_msg_type_max; type++)
+        {
+            if(c_messageDescriptors[type].type != type)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static_assert(sizeof(c_messageDescriptors) / sizeof(c_messageDescriptors[0]) == nrpd_msg_type_max, "Every message type needs a descriptor");
+    static_assert(DescriptorsInOrder(), "Message descriptors must be indexed by type");
+
+    // Descriptor of a known message type; check type < nrpd_msg_type_max
+    constexpr MessageDescriptor const& DescribeMessage(unsigned char type)
+    {
+        return c_messageDescriptors[type];
+    }
+}
@@ -1,3 +1,4 @@
+#include <list>
 #include <memory>
 #include <unordered_map>
 #include <chrono>
@@ -15,19 +16,27 @@ using namespace std;
 
 namespace nrpd
 {
-    template<typename Key>
-    class MruCache : public std::enable_shared_from_this<MruCache<Key>>
+    // Remembers keys, and optionally a value for each, for lifetimeSeconds
+    // after they were added. Safe to use from several threads.
+    //
+    // Entries are kept in the order they were added or renewed, so the
+    // oldest, which expires first, is always at the tail.
+    template<typename Key, typename Value = bool>
+    class MruCache : public std::enable_shared_from_this<MruCache<Key, Value>>
     {
     public:
-        MruCache(int lifetimeSeconds)
+        // capacity of 0 is unbounded; otherwise, Add(key, value) doesn't
+        // add keys while the cache holds capacity unexpired ones.
+        MruCache(int lifetimeSeconds, size_t capacity = 0)
             : m_lifetimeSeconds(lifetimeSeconds),
             m_cleanIntervalSeconds(lifetimeSeconds),
-            m_lastCleanTime(s_clock.now())
+            m_lastCleanTime(s_clock.now()),
+            m_capacity(capacity)
         {
         }
 
         // Thread procedure to run the Clean member function on an instance
-        static void CleanerThread(shared_ptr<MruCache<Key>> target)
+        static void CleanerThread(shared_ptr<MruCache<Key, Value>> target)
         {
             if(!target->Clean())
             {
@@ -42,22 +51,8 @@ namespace nrpd
             {
                 // Hold the lock for the duration of the iterator
                 lock_guard<mutex> lock(m_mutex);
-                int count = 0;
 
-                auto item = m_recentClients.begin();
-
-                while(item != m_recentClients.end())
-                {
-                    if(s_clock.now() > ((*item).second + m_lifetimeSeconds))
-                    {
-                        count++;
-                        item = m_recentClients.erase(item);
-                    }
-                    else
-                    {
-                        item = next(item);
-                    }
-                }
+                RemoveExpired();
             } // End of lock scope
 
             // TODO: Compute better heuristic for cleaning frequency
@@ -78,18 +73,17 @@ namespace nrpd
                 // Hold lock for duration of iterator
                 lock_guard<mutex> lock(m_mutex);
 
-                // attempt to insert address
-                auto const& result = m_recentClients.emplace(addr, s_clock.now());
+                auto iter = m_recentClients.find(addr);
 
-                // Failed to insert because it is already inserted
-                if(!result.second)
+                // Already inserted
+                if(iter != m_recentClients.end())
                 {
                     // check whether client is expired or not
-                    if(s_clock.now() >= (result.first->second + m_lifetimeSeconds))
+                    if(IsExpired(iter->second))
                     {
                         // Expired: return false, update time
                         response = false;
-                        result.first->second = s_clock.now();
+                        Renew(iter);
                     }
                     else
                     {
@@ -99,8 +93,9 @@ namespace nrpd
                 }
                 else
                 {
-                    // new client was inserted successfully
-                    // therefore, they weren't already present
+                    // new client is inserted, so they weren't already
+                    // present
+                    Insert(addr, Value());
                     response = false;
                 }
             } // End of lock scope
@@ -124,9 +119,11 @@ namespace nrpd
 
                 if(iter != m_recentClients.end())
                 {
-                    if(s_clock.now() >= ((*iter).second + m_lifetimeSeconds))
+                    if(IsExpired(iter->second))
                     {
-                        // It's expired
+                        // It's expired; drop it now rather than wait for
+                        // the cleaner
+                        Erase(iter);
                         found = false;
                     }
                     else
@@ -146,17 +143,173 @@ namespace nrpd
         void Add(Key& addr)
         {
             lock_guard<mutex> lock(m_mutex);
-            // Don't check whether the insertion succeeded or not because it's not
-            // important in this case.
-            m_recentClients.emplace(addr, s_clock.now());
+
+            // Keep the existing entry, if there is one
+            if(m_recentClients.find(addr) == m_recentClients.end())
+            {
+                Insert(addr, Value());
+            }
+        }
+
+        // Look up the value of key.
+        // Returns true, and sets outValue, if it exists and hasn't expired.
+        bool Find(Key const& key, Value& outValue)
+        {
+            bool found = false;
+            {
+                lock_guard<mutex> lock(m_mutex);
+
+                auto iter = m_recentClients.find(key);
+
+                if(iter != m_recentClients.end())
+                {
+                    if(IsExpired(iter->second))
+                    {
+                        Erase(iter);
+                    }
+                    else
+                    {
+                        outValue = iter->second.value;
+                        found = true;
+                    }
+                }
+            } // End of lock scope
+
+            ScheduleCleaning();
+
+            return found;
+        }
+
+        // Add key with value, or renew it if it's already present.
+        // Returns false if the cache is full of unexpired entries. Entries
+        // already present are kept in preference to new ones, so a flood
+        // of new keys can't push out the ones in use; only the oldest is
+        // checked for expiry, so a full cache costs the same as any other.
+        bool Add(Key const& key, Value const& value)
+        {
+            bool added = false;
+            {
+                lock_guard<mutex> lock(m_mutex);
+
+                auto iter = m_recentClients.find(key);
+
+                if(iter != m_recentClients.end())
+                {
+                    iter->second.value = value;
+                    Renew(iter);
+                    added = true;
+                }
+                else if(m_capacity == 0 || m_recentClients.size() < m_capacity
+                        || RemoveOldestExpired())
+                {
+                    Insert(key, value);
+                    added = true;
+                }
+            } // End of lock scope
+
+            ScheduleCleaning();
+
+            return added;
+        }
+
+        // Remove every entry
+        void Clear()
+        {
+            lock_guard<mutex> lock(m_mutex);
+
+            m_recentClients.clear();
+            m_order.clear();
+        }
+
+        // Entries held, including expired ones not yet cleaned
+        size_t Size()
+        {
+            lock_guard<mutex> lock(m_mutex);
+
+            return m_recentClients.size();
         }
     private:
+        struct Entry
+        {
+            chrono::time_point<chrono::steady_clock> time; // when added
+            Value value;
+            typename list<Key>::iterator order; // in m_order
+        };
+
+        typedef typename unordered_map<Key, Entry>::iterator EntryIterator;
+
         mutex m_mutex;
         static chrono::steady_clock s_clock;
-        unordered_map<Key, chrono::time_point<chrono::steady_clock>> m_recentClients;
+        unordered_map<Key, Entry> m_recentClients;
+        list<Key> m_order; // keys, most recently added or renewed first
         chrono::seconds m_lifetimeSeconds; // entry lifetime
         chrono::seconds m_cleanIntervalSeconds; // time between cleanings
         chrono::time_point<chrono::steady_clock> m_lastCleanTime; // time of last cleaning
+        size_t m_capacity; // most entries held; 0 if unbounded
+
+        bool IsExpired(Entry const& entry) const
+        {
+            return s_clock.now() >= (entry.time + m_lifetimeSeconds);
+        }
+
+        // Add an entry for a key that isn't present, as the most recent.
+        // Requires m_mutex to be held.
+        void Insert(Key const& key, Value const& value)
+        {
+            m_order.push_front(key);
+            m_recentClients.emplace(key, Entry{s_clock.now(), value, m_order.begin()});
+        }
+
+        // Restart an entry's lifetime, making it the most recent.
+        // Requires m_mutex to be held.
+        void Renew(EntryIterator item)
+        {
+            item->second.time = s_clock.now();
+            m_order.splice(m_order.begin(), m_order, item->second.order);
+        }
+
+        // Requires m_mutex to be held.
+        void Erase(EntryIterator item)
+        {
+            m_order.erase(item->second.order);
+            m_recentClients.erase(item);
+        }
+
+        // Remove the oldest entry, if it has expired.
+        // Requires m_mutex to be held.
+        bool RemoveOldestExpired()
+        {
+            if(m_order.empty())
+            {
+                return false;
+            }
+
+            auto item = m_recentClients.find(m_order.back());
+
+            if(!IsExpired(item->second))
+            {
+                return false;
+            }
+
+            Erase(item);
+
+            return true;
+        }
+
+        // Remove expired entries, oldest first, stopping at the first that
+        // hasn't expired. Requires m_mutex to be held.
+        // Returns the number removed.
+        int RemoveExpired()
+        {
+            int count = 0;
+
+            while(RemoveOldestExpired())
+            {
+                count++;
+            }
+
+            return count;
+        }
 
         // Schedules a cleaning if it's been at least m_cleanIntervalSeconds
         // since m_lastCleanTime.
@@ -167,7 +320,7 @@ namespace nrpd
             {
                 // Note: we use shared_from_this() in order to keep the object alive
                 // until this thread exits.
-                thread cleaningThread(MruCache<Key>::CleanerThread, this->shared_from_this());
+                thread cleaningThread(MruCache<Key, Value>::CleanerThread, this->shared_from_this());
 
                 // Let the cleaner do its job and continue executing
                 cleaningThread.detach();
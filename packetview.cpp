@@ -0,0 +1,108 @@
+#include "packetview.h"
+
+using namespace std;
+
+namespace nrpd
+{
+    PacketView::PacketView(unsigned char* buffer, size_t size, bool isRequest)
+        : m_pkt((pNrp_Header_Packet) buffer),
+        m_count(0),
+        m_valid(false),
+        m_receiveSize(nullptr),
+        m_transactionId(nullptr)
+    {
+        size_t length;
+        size_t offset = sizeof(Nrp_Header_Packet);
+
+        if(buffer == nullptr || size < sizeof(Nrp_Header_Packet))
+        {
+            return;
+        }
+
+        length = ntohs(m_pkt->length);
+
+        // The packet can't claim more than was received
+        if(length > size || length < sizeof(Nrp_Header_Packet)
+           || length > (size_t) ((isRequest) ? MAX_REQUEST_MESSAGE_SIZE : MAX_RESPONSE_MESSAGE_SIZE))
+        {
+            return;
+        }
+
+        // Must be a request or response
+        if(m_pkt->msgType != ((isRequest) ? nrpd_msg_type::request : nrpd_msg_type::response))
+        {
+            return;
+        }
+
+        // Can't request or respond with nothing
+        if(m_pkt->msgCount == 0)
+        {
+            return;
+        }
+
+        while(offset < length)
+        {
+            pNrp_Header_Message msg = (pNrp_Header_Message) (buffer + offset);
+            size_t msgLength;
+
+            // The header must be there before it's read, and a message must
+            // end within the packet, and after its own header.
+            if(length - offset < sizeof(Nrp_Header_Message) || m_count == m_pkt->msgCount)
+            {
+                return;
+            }
+
+            msgLength = ntohs(msg->length);
+
+            if(msgLength < sizeof(Nrp_Header_Message) || msgLength > length - offset)
+            {
+                return;
+            }
+
+            // Validate message header is appropriate for packet type
+            if(!ValidateMessageHeader(msg, isRequest))
+            {
+                return;
+            }
+
+            if(msg->msgType == nrpd_msg_type::receivesize && m_receiveSize == nullptr)
+            {
+                m_receiveSize = (pNrp_Message_ReceiveSize_Request) msg->content;
+            }
+            else if(msg->msgType == nrpd_msg_type::transactionid && m_transactionId == nullptr)
+            {
+                m_transactionId = (pNrp_Message_TransactionId) msg->content;
+            }
+
+            m_offsets[m_count++] = offset;
+            offset += msgLength;
+        }
+
+        // Verify message count matches
+        m_valid = (m_count == m_pkt->msgCount);
+    }
+
+
+    bool PacketView::Rejects(nrpd_msg_type type) const
+    {
+        for(MessageView msg : *this)
+        {
+            pNrp_Message_Reject rej;
+
+            if(msg.Type() != nrpd_msg_type::reject || (rej = msg.Records<Nrp_Message_Reject>(msg.CountOrSize())) == nullptr)
+            {
+                continue;
+            }
+
+            for(int idx = 0; idx < msg.CountOrSize(); idx++)
+            {
+                if(rej[idx].msgType == type)
+                {
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+}
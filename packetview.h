@@ -0,0 +1,100 @@
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#pragma once
+
+using namespace std;
+
+namespace nrpd
+{
+    // One message of a valid PacketView. Its content is bounded by the
+    // message's length, which the view already checked against the bytes
+    // received, so handlers can't read past the datagram through it.
+    class MessageView
+    {
+    public:
+        MessageView(pNrp_Header_Message hdr) : m_hdr(hdr) {}
+
+        // Raw, since requests from newer clients may carry unknown types
+        unsigned char Type() const { return m_hdr->msgType; }
+        unsigned char CountOrSize() const { return m_hdr->countOrSize; }
+        size_t Length() const { return ntohs(m_hdr->length); }
+        size_t ContentSize() const { return Length() - sizeof(Nrp_Header_Message); }
+        unsigned char* Content() const { return m_hdr->content; }
+        pNrp_Header_Message Header() const { return m_hdr; }
+
+        // Content as count records of T, or nullptr if the message is too
+        // small to hold them.
+        template<typename T>
+        T* Records(size_t count = 1) const
+        {
+            return (ContentSize() >= count * sizeof(T)) ? (T*) m_hdr->content : nullptr;
+        }
+
+    private:
+        pNrp_Header_Message m_hdr;
+    };
+
+    // Walks the messages of a valid PacketView, in the order sent, using
+    // the offsets recorded when the packet was validated.
+    class MessageIterator
+    {
+    public:
+        MessageIterator(unsigned char* base, const unsigned short* offset) : m_base(base), m_offset(offset) {}
+
+        MessageView operator*() const { return MessageView((pNrp_Header_Message) (m_base + *m_offset)); }
+        MessageIterator& operator++() { m_offset++; return *this; }
+        bool operator==(MessageIterator const& other) const { return m_offset == other.m_offset; }
+        bool operator!=(MessageIterator const& other) const { return m_offset != other.m_offset; }
+
+    private:
+        unsigned char* m_base;
+        const unsigned short* m_offset;
+    };
+
+    // A request or response packet, validated in a single pass over the
+    // bytes actually received, without copying it.
+    //
+    // Every message header is checked to lie within the received bytes
+    // before it's read, and every message to end within the packet, so a
+    // short datagram or a lying length can't lead a reader past the end.
+    // The same pass records where each message starts, and the messages
+    // that shape the rest of the response (receive size, transaction ID),
+    // so handlers never walk the packet again.
+    class PacketView
+    {
+    public:
+        PacketView() : m_pkt(nullptr), m_count(0), m_valid(false), m_receiveSize(nullptr), m_transactionId(nullptr) {}
+
+        // View the first size bytes of buffer as a request or response.
+        // Check Valid() before using anything else.
+        PacketView(unsigned char* buffer, size_t size, bool isRequest);
+
+        bool Valid() const { return m_valid; }
+        pNrp_Header_Packet Packet() const { return m_pkt; }
+        size_t Length() const { return ntohs(m_pkt->length); }
+        int MessageCount() const { return m_count; }
+
+        MessageIterator begin() const { return MessageIterator((unsigned char*) m_pkt, m_offsets); }
+        MessageIterator end() const { return MessageIterator((unsigned char*) m_pkt, m_offsets + m_count); }
+
+        // The packet's receive size message, or nullptr if it has none
+        pNrp_Message_ReceiveSize_Request ReceiveSize() const { return m_receiveSize; }
+
+        // The packet's transaction ID, or nullptr if it has none
+        pNrp_Message_TransactionId TransactionId() const { return m_transactionId; }
+
+        // Test if the packet rejects a message type
+        bool Rejects(nrpd_msg_type type) const;
+
+    private:
+        pNrp_Header_Packet m_pkt;
+        unsigned short m_offsets[MAX_BYTE]; // from the start of the packet
+        int m_count;
+        bool m_valid;
+        pNrp_Message_ReceiveSize_Request m_receiveSize;
+        pNrp_Message_TransactionId m_transactionId;
+    };
+}
@@ -0,0 +1,178 @@
+#include "pathmtu.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <netinet/ip.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    // Convert an IPv4-mapped IPv6 address to IPv4, so it's probed and keyed
+    // the same as the IPv4 address.
+    static sockaddr_storage Unmap(sockaddr_storage const& addr)
+    {
+        sockaddr_storage result = addr;
+
+        if(addr.ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((sockaddr_in6 const&) addr).sin6_addr))
+        {
+            sockaddr_in6 const& addr6 = (sockaddr_in6 const&) addr;
+            sockaddr_in& addr4 = (sockaddr_in&) result;
+
+            memset(&result, 0, sizeof(result));
+            addr4.sin_family = AF_INET;
+            addr4.sin_port = addr6.sin6_port;
+            memcpy(&addr4.sin_addr, &addr6.sin6_addr.s6_addr[12], sizeof(addr4.sin_addr));
+        }
+
+        return result;
+    }
+
+
+    PathMtuCache::PathMtuCache(size_t capacity, int lifetimeSeconds)
+        : m_capacity(capacity),
+        m_lifetime(lifetimeSeconds)
+    {
+    }
+
+
+    int PathMtuCache::MaxPayload(sockaddr_storage const& addr)
+    {
+        sockaddr_storage target = Unmap(addr);
+        PathMtuKey key = PrefixOf(target);
+        auto now = chrono::steady_clock::now();
+        bool ipv6 = (target.ss_family == AF_INET6);
+        int payload = ipv6 ? MAX_IP6_PACKET_SIZE : MAX_IP4_PACKET_SIZE;
+        int mtu;
+
+        auto item = m_entries.find(key);
+
+        if(item != m_entries.end() && item->second.expiry > now)
+        {
+            return item->second.payload;
+        }
+
+        if((mtu = ProbeMtu(target)) > 0)
+        {
+            payload = max(payload, mtu - (ipv6 ? IP6_UDP_HEADER_SIZE : IP4_UDP_HEADER_SIZE));
+            payload = min(payload, MAX_RESPONSE_MESSAGE_SIZE);
+        }
+
+        if(item != m_entries.end())
+        {
+            // Expired; added again as the newest
+            Erase(item);
+        }
+        else if(m_entries.size() >= m_capacity && !m_order.empty())
+        {
+            // Evict the oldest, expired or not, so a flood of new prefixes
+            // costs one entry each rather than the whole cache
+            Erase(m_entries.find(m_order.back()));
+        }
+
+        m_order.push_front(key);
+        m_entries[key] = {payload, now + m_lifetime, m_order.begin()};
+
+        return payload;
+    }
+
+
+    int PathMtuCache::CachedPayload(sockaddr_storage const& addr)
+    {
+        auto item = m_entries.find(PrefixOf(addr));
+
+        if(item == m_entries.end() || item->second.expiry <= chrono::steady_clock::now())
+        {
+            return 0;
+        }
+
+        return item->second.payload;
+    }
+
+
+    void PathMtuCache::Invalidate(sockaddr_storage const& addr)
+    {
+        auto item = m_entries.find(PrefixOf(Unmap(addr)));
+
+        if(item != m_entries.end())
+        {
+            Erase(item);
+        }
+    }
+
+
+    PathMtuKey PathMtuCache::PrefixOf(sockaddr_storage const& addr)
+    {
+        sockaddr_storage target = Unmap(addr);
+        PathMtuKey key;
+
+        memset(&key, 0, sizeof(key));
+
+        if(target.ss_family == AF_INET6)
+        {
+            key.ipv6 = true;
+            memcpy(key.prefix, ((sockaddr_in6&) target).sin6_addr.s6_addr, PATH_MTU_IP6_PREFIX_BYTES);
+        }
+        else if(target.ss_family == AF_INET)
+        {
+            key.ipv6 = false;
+            memcpy(key.prefix, &((sockaddr_in&) target).sin_addr, PATH_MTU_IP4_PREFIX_BYTES);
+        }
+
+        return key;
+    }
+
+
+    int PathMtuCache::ProbeMtu(sockaddr_storage const& addr)
+    {
+        sockaddr_storage target = Unmap(addr);
+        socklen_t addrSize;
+        socklen_t mtuSize = sizeof(int);
+        int level;
+        int option;
+        int mtu = 0;
+        int probefd;
+
+        if(target.ss_family == AF_INET6)
+        {
+            addrSize = sizeof(sockaddr_in6);
+            level = IPPROTO_IPV6;
+            option = IPV6_MTU;
+        }
+        else if(target.ss_family == AF_INET)
+        {
+            addrSize = sizeof(sockaddr_in);
+            level = IPPROTO_IP;
+            option = IP_MTU;
+        }
+        else
+        {
+            return 0;
+        }
+
+        if((probefd = socket(target.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP)) < 0)
+        {
+            return 0;
+        }
+
+        // Connecting a UDP socket sends nothing; it only looks up the route
+        if(connect(probefd, (sockaddr*) &target, addrSize) != 0
+           || getsockopt(probefd, level, option, &mtu, &mtuSize) != 0)
+        {
+            mtu = 0;
+        }
+
+        close(probefd);
+
+        return mtu;
+    }
+
+
+    void PathMtuCache::Erase(unordered_map<PathMtuKey, Entry, PathMtuKeyHash>::iterator item)
+    {
+        m_order.erase(item->second.order);
+        m_entries.erase(item);
+    }
+}
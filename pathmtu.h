@@ -0,0 +1,101 @@
+#include <unordered_map>
+#include <list>
+#include <chrono>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+
+#pragma once
+
+#define PATH_MTU_CACHE_CAPACITY (4096) // client prefixes remembered
+#define PATH_MTU_LIFETIME_SECONDS (600) // same as the kernel's learned PMTU expiry
+#define PATH_MTU_IP4_PREFIX_BYTES (3) // clients in a /24 share a path
+#define PATH_MTU_IP6_PREFIX_BYTES (8) // clients in a /64 share a path
+#define IP4_UDP_HEADER_SIZE (20 + 8)
+#define IP6_UDP_HEADER_SIZE (40 + 8)
+
+using namespace std;
+
+namespace nrpd
+{
+    // The network prefix of a client; all clients in a prefix are assumed
+    // to be reached over the same path.
+    struct PathMtuKey
+    {
+        bool ipv6;
+        unsigned char prefix[PATH_MTU_IP6_PREFIX_BYTES];
+
+        bool operator==(PathMtuKey const& other) const
+        {
+            return ipv6 == other.ipv6 && memcmp(prefix, other.prefix, sizeof(prefix)) == 0;
+        }
+    };
+
+    struct PathMtuKeyHash
+    {
+        size_t operator()(PathMtuKey const& key) const
+        {
+            // FNV-1a
+            size_t result = 14695981039346656037ull ^ key.ipv6;
+
+            for(unsigned char byte : key.prefix)
+            {
+                result = (result ^ byte) * 1099511628211ull;
+            }
+
+            return result;
+        }
+    };
+
+    // Largest UDP payload the path to each client prefix can carry without
+    // fragmentation, as reported by the kernel for a socket connected to the
+    // client (IP_MTU/IPV6_MTU). That is the route's MTU: the outgoing
+    // interface's MTU, lowered by any path MTU learned from ICMP.
+    //
+    // Not thread-safe; the owner must serialize access.
+    class PathMtuCache
+    {
+    public:
+        PathMtuCache(size_t capacity = PATH_MTU_CACHE_CAPACITY, int lifetimeSeconds = PATH_MTU_LIFETIME_SECONDS);
+
+        // Largest UDP payload to send to addr, probing the path if it isn't
+        // cached. Never less than MAX_IP4_PACKET_SIZE or MAX_IP6_PACKET_SIZE,
+        // which every path is assumed to carry, nor more than
+        // MAX_RESPONSE_MESSAGE_SIZE.
+        int MaxPayload(sockaddr_storage const& addr);
+
+        // The cached payload for addr, without probing, or 0 if the path
+        // isn't cached.
+        int CachedPayload(sockaddr_storage const& addr);
+
+        // Forget the path to addr, so the next MaxPayload probes it again.
+        // Call when a send fails with EMSGSIZE; the kernel has learned a
+        // smaller MTU than the one cached.
+        void Invalidate(sockaddr_storage const& addr);
+
+        size_t Size() const { return m_entries.size(); }
+
+        // Prefix of addr; IPv4-mapped IPv6 addresses are treated as IPv4
+        static PathMtuKey PrefixOf(sockaddr_storage const& addr);
+
+        // MTU of the route to addr, or 0 if it can't be determined
+        static int ProbeMtu(sockaddr_storage const& addr);
+
+    private:
+        struct Entry
+        {
+            int payload;
+            chrono::steady_clock::time_point expiry;
+            list<PathMtuKey>::iterator order; // position in m_order
+        };
+
+        unordered_map<PathMtuKey, Entry, PathMtuKeyHash> m_entries;
+        // Newest first; every entry lives as long, so the oldest, at the
+        // tail, expires first and is the one evicted when the cache is full
+        list<PathMtuKey> m_order;
+        size_t m_capacity;
+        chrono::seconds m_lifetime;
+
+        void Erase(unordered_map<PathMtuKey, Entry, PathMtuKeyHash>::iterator item);
+    };
+}
@@ -0,0 +1,259 @@
+#include "peerdatabase.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    PeerDatabase::PeerDatabase()
+        : m_fd(-1),
+        m_mappingSize(0),
+        m_mapping(MAP_FAILED),
+        m_header(nullptr),
+        m_records(nullptr)
+    {
+    }
+
+
+    PeerDatabase::~PeerDatabase()
+    {
+        Close();
+    }
+
+
+    int PeerDatabase::Open(const char* path, unsigned int capacity)
+    {
+        struct stat fileStat;
+        bool reset;
+        int error;
+
+        Close();
+
+        if(path == nullptr || capacity == 0)
+        {
+            return EINVAL;
+        }
+
+        if((m_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        {
+            return errno;
+        }
+
+        if(fstat(m_fd, &fileStat) != 0)
+        {
+            error = errno;
+            Close();
+            return error;
+        }
+
+        m_mappingSize = sizeof(PeerDatabaseHeader) + (capacity * sizeof(PeerDatabaseRecord));
+        reset = ((size_t) fileStat.st_size != m_mappingSize);
+
+        if(reset && ftruncate(m_fd, m_mappingSize) != 0)
+        {
+            error = errno;
+            Close();
+            return error;
+        }
+
+        m_mapping = mmap(nullptr, m_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+        if(m_mapping == MAP_FAILED)
+        {
+            error = errno;
+            Close();
+            return error;
+        }
+
+        m_header = (PeerDatabaseHeader*) m_mapping;
+        m_records = (PeerDatabaseRecord*) (m_header + 1);
+
+        if(reset
+           || m_header->magic != PEER_DATABASE_MAGIC
+           || m_header->version != PEER_DATABASE_VERSION
+           || m_header->capacity != capacity
+           || m_header->recordSize != sizeof(PeerDatabaseRecord))
+        {
+            // Not ours, or from another version; start over
+            NrpdLog::LogString("PeerDatabase: resetting peer database");
+
+            memset(m_mapping, 0, m_mappingSize);
+            m_header->magic = PEER_DATABASE_MAGIC;
+            m_header->version = PEER_DATABASE_VERSION;
+            m_header->capacity = capacity;
+            m_header->recordSize = sizeof(PeerDatabaseRecord);
+        }
+
+        // Hand out low slots first, so live records stay packed together
+        for(uint32_t slot = capacity; slot > 0; slot--)
+        {
+            if(!m_records[slot - 1].used)
+            {
+                m_freeSlots.push_back(slot - 1);
+            }
+        }
+
+        return 0;
+    }
+
+
+    vector<ServerRecord> PeerDatabase::Load(chrono::seconds maxAge)
+    {
+        vector<ServerRecord> result;
+        int64_t oldest = chrono::duration_cast<chrono::seconds>((chrono::system_clock::now() - maxAge).time_since_epoch()).count();
+
+        if(!IsOpen())
+        {
+            return result;
+        }
+
+        for(uint32_t slot = 0; slot < m_header->capacity; slot++)
+        {
+            PeerDatabaseRecord& stored = m_records[slot];
+
+            if(!stored.used)
+            {
+                continue;
+            }
+
+            ServerRecord rec(stored.host, stored.ipv6, stored.port);
+
+            if(stored.checksum != Checksum(stored))
+            {
+                NrpdLog::LogString("PeerDatabase: dropping torn record in slot " + to_string(slot));
+                rec.databaseSlot = slot;
+                Erase(rec);
+                continue;
+            }
+
+            if(stored.lastSuccess < oldest)
+            {
+                rec.databaseSlot = slot;
+                Erase(rec);
+                continue;
+            }
+
+            rec.probationary = false;
+            rec.ip4Peers = stored.ip4Peers;
+            rec.ip6Peers = stored.ip6Peers;
+            rec.signkey = stored.signkey;
+            rec.failureCount = stored.failureCount;
+            rec.rttMs = stored.rttMs;
+            rec.successRate = stored.successRate;
+            rec.databaseSlot = slot;
+
+            result.push_back(rec);
+        }
+
+        return result;
+    }
+
+
+    bool PeerDatabase::Store(ServerRecord& rec, bool success)
+    {
+        if(!IsOpen())
+        {
+            return false;
+        }
+
+        if(rec.databaseSlot < 0)
+        {
+            if(m_freeSlots.empty())
+            {
+                return false;
+            }
+
+            rec.databaseSlot = m_freeSlots.back();
+            m_freeSlots.pop_back();
+
+            memset(&m_records[rec.databaseSlot], 0, sizeof(PeerDatabaseRecord));
+        }
+
+        PeerDatabaseRecord& stored = m_records[rec.databaseSlot];
+
+        if(rec.ipv6)
+        {
+            memcpy(stored.host, rec.host6, sizeof(rec.host6));
+        }
+        else
+        {
+            memcpy(stored.host, rec.host4, sizeof(rec.host4));
+        }
+
+        stored.port = rec.port;
+        stored.ipv6 = rec.ipv6;
+        stored.ip4Peers = rec.ip4Peers;
+        stored.ip6Peers = rec.ip6Peers;
+        stored.signkey = rec.signkey;
+        stored.failureCount = rec.failureCount;
+        stored.rttMs = rec.rttMs;
+        stored.successRate = rec.successRate;
+
+        if(success)
+        {
+            stored.lastSuccess = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        stored.used = true;
+        stored.checksum = Checksum(stored);
+
+        return true;
+    }
+
+
+    void PeerDatabase::Erase(ServerRecord& rec)
+    {
+        if(!IsOpen() || rec.databaseSlot < 0)
+        {
+            return;
+        }
+
+        memset(&m_records[rec.databaseSlot], 0, sizeof(PeerDatabaseRecord));
+        m_freeSlots.push_back(rec.databaseSlot);
+        rec.databaseSlot = -1;
+    }
+
+
+    uint64_t PeerDatabase::Checksum(PeerDatabaseRecord const& stored)
+    {
+        const unsigned char* bytes = (const unsigned char*) &stored;
+        uint64_t result = 14695981039346656037ull;
+
+        for(size_t i = 0; i < offsetof(PeerDatabaseRecord, checksum); i++)
+        {
+            result ^= bytes[i];
+            result *= 1099511628211ull;
+        }
+
+        return result;
+    }
+
+
+    void PeerDatabase::Close()
+    {
+        if(m_mapping != MAP_FAILED)
+        {
+            msync(m_mapping, m_mappingSize, MS_ASYNC);
+            munmap(m_mapping, m_mappingSize);
+            m_mapping = MAP_FAILED;
+        }
+
+        if(m_fd >= 0)
+        {
+            close(m_fd);
+            m_fd = -1;
+        }
+
+        m_header = nullptr;
+        m_records = nullptr;
+        m_freeSlots.clear();
+    }
+}
@@ -0,0 +1,95 @@
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "config.h"
+
+#pragma once
+
+#define PEER_DATABASE_DEFAULT_PATH "/var/lib/nrpd/peers.db"
+#define PEER_DATABASE_MAGIC (0x524545504450524eull) // "NRPDPEER" in little-endian
+#define PEER_DATABASE_VERSION (2)
+#define PEER_DATABASE_CAPACITY (4096) // peers remembered across restarts
+#define PEER_DATABASE_MAX_AGE_SECONDS (60*60*24*7) // forget peers unheard from for a week
+
+using namespace std;
+
+namespace nrpd
+{
+    // On-disk layout of the database; host byte order, never shared
+    // between machines.
+    struct PeerDatabaseHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t capacity;
+        uint32_t recordSize;
+        uint32_t reserved;
+    };
+
+    struct PeerDatabaseRecord
+    {
+        unsigned char host[16]; // In network byte order; ip4 uses the first 4
+        uint16_t port; // In network byte order
+        uint16_t used : 1;
+        uint16_t ipv6 : 1;
+        uint16_t ip4Peers : 1;
+        uint16_t ip6Peers : 1;
+        uint16_t signkey : 1;
+        uint16_t reserved : 11;
+        uint32_t failureCount;
+        float rttMs;
+        float successRate;
+        int64_t lastSuccess; // seconds since the epoch
+        uint64_t checksum; // of the fields above, so torn records aren't loaded
+    };
+
+    // Fixed-layout, memory-mapped file of proven peers, so a restarted
+    // daemon can contact the servers it knew immediately instead of
+    // relearning them through probing.
+    //
+    // Records are updated in place; the kernel writes them back, so a
+    // crash of the daemon loses nothing. Writeback isn't ordered, so a
+    // crash of the machine can tear a record; each carries a checksum, and
+    // Load drops any that don't match it.
+    // Not thread-safe; the owner must serialize access.
+    class PeerDatabase
+    {
+    public:
+        PeerDatabase();
+        ~PeerDatabase();
+
+        // Map the database at path, creating or resetting it if it's
+        // missing, the wrong version, or the wrong capacity.
+        // Returns 0 on success, or errno on failure.
+        int Open(const char* path, unsigned int capacity = PEER_DATABASE_CAPACITY);
+
+        // Records of peers that succeeded within maxAge, as active servers
+        // with databaseSlot set. Older records, and records that fail their
+        // checksum, are erased.
+        vector<ServerRecord> Load(chrono::seconds maxAge = chrono::seconds(PEER_DATABASE_MAX_AGE_SECONDS));
+
+        // Write rec to its slot, allocating one if it has none.
+        // lastSuccess is updated if success is true.
+        // Returns false if the database is closed or full.
+        bool Store(ServerRecord& rec, bool success);
+
+        // Free the slot of rec, if it has one.
+        void Erase(ServerRecord& rec);
+
+        bool IsOpen() const { return m_records != nullptr; }
+
+    private:
+        int m_fd;
+        size_t m_mappingSize;
+        void* m_mapping;
+        PeerDatabaseHeader* m_header;
+        PeerDatabaseRecord* m_records;
+        vector<uint32_t> m_freeSlots;
+
+        void Close();
+
+        // FNV-1a of every field of stored before its checksum
+        static uint64_t Checksum(PeerDatabaseRecord const& stored);
+    };
+}
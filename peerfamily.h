@@ -0,0 +1,63 @@
+#include <string.h>
+#include <stddef.h>
+
+#include "protocol.h"
+#include "config.h"
+
+#pragma once
+
+using namespace std;
+
+namespace nrpd
+{
+    // Compile-time description of how peers of one address family are held
+    // in a ServerRecord and encoded in peers messages.
+    //
+    // Loops over peers are written once as templates on the family, and
+    // dispatched on the message type once per call, so the loop bodies are
+    // fixed-size copies with no per-peer branching on the family.
+    template<nrpd_msg_type Type>
+    struct PeerFamily;
+
+    template<>
+    struct PeerFamily<ip4peers>
+    {
+        typedef Nrp_Message_Ip4Peer Message;
+        static constexpr bool ipv6 = false;
+        static constexpr size_t addressSize = sizeof(Message::ip);
+        static constexpr size_t messageSize = sizeof(Message);
+
+        static unsigned char* Address(ServerRecord& rec) { return rec.host4; }
+        static const unsigned char* Address(ServerRecord const& rec) { return rec.host4; }
+    };
+
+    template<>
+    struct PeerFamily<ip6peers>
+    {
+        typedef Nrp_Message_Ip6Peer Message;
+        static constexpr bool ipv6 = true;
+        static constexpr size_t addressSize = sizeof(Message::ip);
+        static constexpr size_t messageSize = sizeof(Message);
+
+        static unsigned char* Address(ServerRecord& rec) { return rec.host6; }
+        static const unsigned char* Address(ServerRecord const& rec) { return rec.host6; }
+    };
+
+    static_assert(PeerFamily<ip4peers>::addressSize == sizeof(ServerRecord::host4), "IPv4 address size mismatch");
+    static_assert(PeerFamily<ip6peers>::addressSize == sizeof(ServerRecord::host6), "IPv6 address size mismatch");
+
+    // Write rec into a peers message entry of its family
+    template<nrpd_msg_type Type>
+    inline void EncodePeer(ServerRecord const& rec, typename PeerFamily<Type>::Message* msg)
+    {
+        memcpy(msg->ip, PeerFamily<Type>::Address(rec), PeerFamily<Type>::addressSize);
+        msg->port = rec.port;
+    }
+
+    // Read a peers message entry into rec, as a new probationary server
+    template<nrpd_msg_type Type>
+    inline void DecodePeer(typename PeerFamily<Type>::Message const* msg, ServerRecord& rec)
+    {
+        rec = ServerRecord(msg->ip, PeerFamily<Type>::ipv6, msg->port);
+    }
+}
@@ -0,0 +1,277 @@
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+
+#pragma once
+
+#define PEER_INVALID_HANDLE (~0ull)
+#define PEER_STORE_CHUNK_SIZE (1024) // records per slab chunk
+
+using namespace std;
+
+namespace nrpd
+{
+    // Opaque reference to a record in a PeerStore.
+    // The low 32 bits are the record's slot, and the high 32 bits are the
+    // generation of the slot, so a handle to a removed record never resolves
+    // to whichever record reuses the slot.
+    typedef uint64_t PeerHandle;
+
+    // Storage for peer records, with O(1) lookup by address, promotion,
+    // demotion and removal.
+    //
+    // Records live in a slab of fixed-size chunks, so a record never moves
+    // once added, and references to it stay valid until it is removed.
+    // Records in each state (probationary or active) and address family are
+    // also listed in dense arrays, for counting and for iterating or
+    // sampling one state and family without touching the others.
+    //
+    // Record must have 'probationary' and 'ipv6' fields, and Hash and
+    // operator== must only consider the address.
+    // Not thread-safe; the owner must serialize access.
+    template<typename Record, typename Hash = hash<Record>>
+    class PeerStore
+    {
+    public:
+        PeerStore() : m_slotCount(0)
+        {
+        }
+
+        // Add a copy of rec, in the state given by rec.probationary.
+        // Returns the handle of the new record, or PEER_INVALID_HANDLE if a
+        // record with the same address is already in the store.
+        PeerHandle Add(Record const& rec)
+        {
+            uint32_t index;
+
+            if(m_index.find(rec) != m_index.end())
+            {
+                return PEER_INVALID_HANDLE;
+            }
+
+            if(!m_freeSlots.empty())
+            {
+                index = m_freeSlots.back();
+                m_freeSlots.pop_back();
+            }
+            else
+            {
+                if(m_slotCount % PEER_STORE_CHUNK_SIZE == 0)
+                {
+                    m_chunks.push_back(make_unique<Slot[]>(PEER_STORE_CHUNK_SIZE));
+                }
+
+                index = m_slotCount++;
+            }
+
+            Slot& slot = GetSlot(index);
+
+            slot.record = rec;
+            slot.used = true;
+
+            m_index.emplace(rec, index);
+            AddMember(slot, index);
+
+            return MakeHandle(slot.generation, index);
+        }
+
+        // Handle of the record with the same address as rec, or
+        // PEER_INVALID_HANDLE if there isn't one.
+        PeerHandle Find(Record const& rec) const
+        {
+            auto item = m_index.find(rec);
+
+            if(item == m_index.end())
+            {
+                return PEER_INVALID_HANDLE;
+            }
+
+            return MakeHandle(GetSlot(item->second).generation, item->second);
+        }
+
+        // The record for handle, or nullptr if it has been removed.
+        Record* Get(PeerHandle handle)
+        {
+            Slot* slot = Resolve(handle);
+
+            return (slot == nullptr) ? nullptr : &slot->record;
+        }
+
+        // Remove the record for handle. Returns false if it was already
+        // removed.
+        bool Remove(PeerHandle handle)
+        {
+            Slot* slot = Resolve(handle);
+
+            if(slot == nullptr)
+            {
+                return false;
+            }
+
+            RemoveMember(*slot);
+            m_index.erase(slot->record);
+
+            // Retire every outstanding handle to this slot
+            slot->used = false;
+            slot->generation += 1;
+            m_freeSlots.push_back(HandleIndex(handle));
+
+            return true;
+        }
+
+        // Move the record for handle to the probationary or active state.
+        // Returns false if it was removed.
+        bool SetProbationary(PeerHandle handle, bool probationary)
+        {
+            Slot* slot = Resolve(handle);
+
+            if(slot == nullptr)
+            {
+                return false;
+            }
+
+            if(slot->record.probationary != probationary)
+            {
+                RemoveMember(*slot);
+                slot->record.probationary = probationary;
+                AddMember(*slot, HandleIndex(handle));
+            }
+
+            return true;
+        }
+
+        // Number of records in a state and address family
+        size_t Count(bool probationary, bool ipv6) const
+        {
+            return m_members[probationary][ipv6].size();
+        }
+
+        // Number of records in the store
+        size_t Size() const
+        {
+            return m_index.size();
+        }
+
+        // The record at position (0 <= position < Count()) among the records
+        // of a state and address family.
+        // Positions change as records are added and removed.
+        Record& At(bool probationary, bool ipv6, size_t position)
+        {
+            return GetSlot(m_members[probationary][ipv6][position]).record;
+        }
+
+        // Move a uniformly random sample of count records of a state and
+        // address family to positions 0 through count - 1, using a partial
+        // Fisher-Yates shuffle. O(count); the other positions are permuted.
+        // random must provide Below(bound), returning a value in [0, bound).
+        template<typename Random>
+        void SampleToFront(bool probationary, bool ipv6, size_t count, Random& random)
+        {
+            auto& members = m_members[probationary][ipv6];
+
+            count = min(count, members.size());
+
+            for(size_t i = 0; i < count; i++)
+            {
+                size_t j = i + random.Below(members.size() - i);
+
+                swap(members[i], members[j]);
+                GetSlot(members[i]).position = i;
+                GetSlot(members[j]).position = j;
+            }
+        }
+
+        void Clear()
+        {
+            for(auto& state : m_members)
+            {
+                for(auto& family : state)
+                {
+                    family.clear();
+                }
+            }
+
+            m_index.clear();
+            m_freeSlots.clear();
+            m_chunks.clear();
+            m_slotCount = 0;
+        }
+
+    private:
+        struct Slot
+        {
+            Record record;
+            uint32_t generation = 0;
+            uint32_t position = 0; // in the members array for its state and family
+            bool used = false;
+        };
+
+        vector<unique_ptr<Slot[]>> m_chunks;
+        uint32_t m_slotCount; // slots ever allocated
+        vector<uint32_t> m_freeSlots;
+        unordered_map<Record, uint32_t, Hash> m_index;
+        vector<uint32_t> m_members[2][2]; // [probationary][ipv6]
+
+        static PeerHandle MakeHandle(uint32_t generation, uint32_t index)
+        {
+            return (((PeerHandle) generation) << 32) | index;
+        }
+
+        static uint32_t HandleIndex(PeerHandle handle)
+        {
+            return (uint32_t) handle;
+        }
+
+        Slot& GetSlot(uint32_t index)
+        {
+            return m_chunks[index / PEER_STORE_CHUNK_SIZE][index % PEER_STORE_CHUNK_SIZE];
+        }
+
+        Slot const& GetSlot(uint32_t index) const
+        {
+            return m_chunks[index / PEER_STORE_CHUNK_SIZE][index % PEER_STORE_CHUNK_SIZE];
+        }
+
+        Slot* Resolve(PeerHandle handle)
+        {
+            uint32_t index = HandleIndex(handle);
+
+            if(handle == PEER_INVALID_HANDLE || index >= m_slotCount)
+            {
+                return nullptr;
+            }
+
+            Slot& slot = GetSlot(index);
+
+            if(!slot.used || slot.generation != (uint32_t) (handle >> 32))
+            {
+                return nullptr;
+            }
+
+            return &slot;
+        }
+
+        void AddMember(Slot& slot, uint32_t index)
+        {
+            auto& members = m_members[slot.record.probationary][slot.record.ipv6];
+
+            slot.position = members.size();
+            members.push_back(index);
+        }
+
+        // Swap the last member into the slot's position, so removal is O(1)
+        void RemoveMember(Slot& slot)
+        {
+            auto& members = m_members[slot.record.probationary][slot.record.ipv6];
+            uint32_t last = members.back();
+
+            members[slot.position] = last;
+            GetSlot(last).position = slot.position;
+            members.pop_back();
+        }
+    };
+}
@@ -2,6 +2,8 @@
 
 
 #include "protocol.h"
+#include "packetview.h"
+#include "messageregistry.h"
 
 #include <string.h>
 
@@ -53,147 +55,46 @@ namespace nrpd
             return false;
         }
 
-        // Validate message type is appropriate for type of packet.
-        if(hdr->msgType < (
-                   (isRequest) ? nrpd_msg_type::request_msg_min
-                                : nrpd_msg_type::response_msg_min))
-        {
-            return false;
-        }
-
         if(hdr->msgType >= nrpd_msg_type::nrpd_msg_type_max)
         {
-            if(!isRequest)
-            {
-                return false;
-            }
-            // Servers are more permissive than clients, since servers may receive
-            // requests from newer clients.
-        }
-
-        // Validate size and count agree
-        switch(hdr->msgType)
-        {
-        case nrpd_msg_type::reject:
-            // Request messages can't reject
-            if (isRequest)
-            {
-                return false;
-            }
-            else if(!ValidateMessageSize(hdr, sizeof(Nrp_Message_Reject))
-                    || !ValidateRejectMessage(hdr))
-            {
-                return false;
-            }
-            break;
-        case nrpd_msg_type::ip4peers:
-            // Request messages have no content, just header
-            if (isRequest && !ValidateMessageSize(hdr, 0))
-            {
-                return false;
-            }
-            else if(!isRequest && !ValidateMessageSize(hdr, sizeof(Nrp_Message_Ip4Peer)))
-            {
-                return false;
-            }
-            break;
-        case nrpd_msg_type::entropy:
-            // Request messages have no content, just header
-            if (isRequest && !ValidateMessageSize(hdr, 0))
-            {
-                return false;
-            }
-            else if(!isRequest && !ValidateMessageSize(hdr, sizeof(unsigned char)))
-            {
-                return false;
-            }
-            break;
-        case nrpd_msg_type::ip6peers:
-            // Request messages have no content, just header
-            if (isRequest && !ValidateMessageSize(hdr, 0))
-            {
-                return false;
-            }
-            else if(!isRequest && !ValidateMessageSize(hdr, sizeof(Nrp_Message_Ip6Peer)))
-            {
-                return false;
-            }
-            break;
-        case nrpd_msg_type::certchain:
-        case nrpd_msg_type::signkey:
-        case nrpd_msg_type::encryptionkey:
-        case nrpd_msg_type::secureentropy:
-        default:
             // Servers are more permissive than clients, since servers may receive
             // requests from newer clients.
-            if(!isRequest)
-            {
-                // Not a valid type, fail.
-                return false;
-            }
+            return isRequest;
         }
 
-        return true;
-    }
-
+        MessageDescriptor const& desc = DescribeMessage(hdr->msgType);
+        MessageRule const& rule = (isRequest) ? desc.request : desc.response;
 
-    bool ValidatePacket(pNrp_Header_Packet pkt, bool isRequest)
-    {
-        if(pkt == nullptr)
-        {
-            return false;
-        }
-
-        if(ntohs(pkt->length)
-           > ((isRequest) ? MAX_REQUEST_MESSAGE_SIZE
-                          : MAX_RESPONSE_MESSAGE_SIZE))
+        // Validate message type is appropriate for type of packet.
+        if(!rule.allowed)
         {
             return false;
         }
 
-        // Must be a response or response
-        if(pkt->msgType
-           != ((isRequest) ? nrpd_msg_type::request : nrpd_msg_type::response))
+        // Validate size and count agree
+        if(rule.sized && !ValidateMessageSize(hdr, rule.recordSize))
         {
             return false;
         }
 
-        // Can't request or respond with nothing
-        if(pkt->msgCount == 0)
+        if((rule.count == onecount && hdr->countOrSize != 1)
+           || (rule.count == nonzerocount && hdr->countOrSize == 0))
         {
             return false;
         }
 
-        // Verify count of messages and packet size
-        pNrp_Header_Message msgPtr = pkt->messages;
-        int msgCount = 0;
-
-        while(msgPtr < EndOfPacket(pkt))
-        {
-            // Validate message header is appropriate for packet type
-            if(!ValidateMessageHeader(msgPtr, isRequest))
-            {
-                return false;
-            }
-
-            // Go to next message
-            msgPtr = NextMessage(msgPtr);
-            ++msgCount;
-        }
+        return rule.validate == nullptr || rule.validate(hdr);
+    }
 
-        // Verify message count matches
-        if(pkt->msgCount != msgCount)
-        {
-            return false;
-        }
 
-        // Verify packet length matches
-        if(msgPtr > EndOfPacket(pkt))
+    bool ValidatePacket(pNrp_Header_Packet pkt, bool isRequest)
+    {
+        if(pkt == nullptr)
         {
             return false;
         }
 
-        return true;
+        return PacketView((unsigned char*) pkt, ntohs(pkt->length), isRequest).Valid();
     }
 
 
@@ -268,6 +169,30 @@ namespace nrpd
     }
 
 
+    bool ValidateCertChainMessage(pNrp_Header_Message hdr)
+    {
+        pNrp_Message_CertChain_Response4 chunk;
+        size_t contentSize;
+
+        if(hdr == nullptr)
+        {
+            return false;
+        }
+
+        // The two families' chunks share their layout up to data
+        contentSize = ntohs(hdr->length) - sizeof(*hdr);
+
+        if(contentSize != sizeof(Nrp_Message_CertChain_Response4) && contentSize != sizeof(Nrp_Message_CertChain_Response6))
+        {
+            return false;
+        }
+
+        chunk = (pNrp_Message_CertChain_Response4) hdr->content;
+
+        return ntohs(chunk->chunk) < ntohs(chunk->totalChunks);
+    }
+
+
     pNrp_Header_Message GenerateRequestEntropyMessage(unsigned char requestedEntropy, pNrp_Header_Message hdr)
     {
         if(hdr == nullptr)
@@ -315,6 +240,115 @@ namespace nrpd
     }
 
 
+    pNrp_Header_Message GenerateRequestReceiveSizeMessage(unsigned short maxDatagramSize, unsigned short preferredEntropy, pNrp_Header_Message buffer)
+    {
+        pNrp_Message_ReceiveSize_Request content;
+
+        if(buffer == nullptr)
+        {
+            return nullptr;
+        }
+
+        buffer->length = htons(sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_ReceiveSize_Request));
+        buffer->msgType = nrpd_msg_type::receivesize;
+        buffer->countOrSize = 1;
+
+        content = (pNrp_Message_ReceiveSize_Request) buffer->content;
+        content->maxDatagramSize = htons(maxDatagramSize);
+        content->preferredEntropy = htons(preferredEntropy);
+
+        return NextMessage(buffer->content, sizeof(Nrp_Message_ReceiveSize_Request));
+    }
+
+
+    pNrp_Header_Message GenerateRequestBulkEntropyMessage(unsigned char segments, pNrp_Header_Message buffer)
+    {
+        if(buffer == nullptr || segments == 0)
+        {
+            return nullptr;
+        }
+
+        buffer->length = htons(sizeof(Nrp_Header_Message));
+        buffer->msgType = nrpd_msg_type::bulkentropy;
+        buffer->countOrSize = segments;
+
+        return (pNrp_Header_Message) buffer->content;
+    }
+
+
+    pNrp_Header_Message GenerateTransactionIdMessage(const unsigned char* id, pNrp_Header_Message buffer)
+    {
+        if(id == nullptr || buffer == nullptr)
+        {
+            return nullptr;
+        }
+
+        buffer->length = htons(sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_TransactionId));
+        buffer->msgType = nrpd_msg_type::transactionid;
+        buffer->countOrSize = 1;
+
+        memcpy(buffer->content, id, sizeof(Nrp_Message_TransactionId));
+
+        return NextMessage(buffer->content, sizeof(Nrp_Message_TransactionId));
+    }
+
+
+    pNrp_Header_Message GenerateRequestKeyMessage(nrpd_msg_type keyType, pNrp_Header_Message buffer)
+    {
+        if(buffer == nullptr || (keyType != nrpd_msg_type::signkey && keyType != nrpd_msg_type::encryptionkey))
+        {
+            return nullptr;
+        }
+
+        buffer->length = htons(sizeof(Nrp_Header_Message));
+        buffer->msgType = keyType;
+        buffer->countOrSize = 0;
+
+        return (pNrp_Header_Message) buffer->content;
+    }
+
+
+    pNrp_Header_Message GenerateRequestSecureEntropyMessage(pNrp_Message_SecureEntropy_Request request, pNrp_Header_Message buffer)
+    {
+        if(request == nullptr || buffer == nullptr)
+        {
+            return nullptr;
+        }
+
+        buffer->length = htons(sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_SecureEntropy_Request));
+        buffer->msgType = nrpd_msg_type::secureentropy;
+        buffer->countOrSize = 1;
+
+        memcpy(buffer->content, request, sizeof(Nrp_Message_SecureEntropy_Request));
+
+        return NextMessage(buffer->content, sizeof(Nrp_Message_SecureEntropy_Request));
+    }
+
+
+    pNrp_Header_Message GenerateRequestCertChainMessage(const unsigned short* chunks, unsigned char count, pNrp_Header_Message buffer)
+    {
+        pNrp_Message_CertChain_Request request;
+
+        if(chunks == nullptr || count == 0 || buffer == nullptr)
+        {
+            return nullptr;
+        }
+
+        buffer->length = htons(sizeof(Nrp_Header_Message) + (count * sizeof(Nrp_Message_CertChain_Request)));
+        buffer->msgType = nrpd_msg_type::certchain;
+        buffer->countOrSize = count;
+
+        request = (pNrp_Message_CertChain_Request) buffer->content;
+
+        for(int idx = 0; idx < count; idx++)
+        {
+            request[idx].requestChunk = htons(chunks[idx]);
+        }
+
+        return NextMessage(buffer->content, count * sizeof(Nrp_Message_CertChain_Request));
+    }
+
+
     pNrp_Header_Message GenerateRequestPeersMessage(nrpd_msg_type ipType, unsigned char countOfPeers, pNrp_Header_Message buffer)
     {
         if(buffer == nullptr)
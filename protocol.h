@@ -19,6 +19,9 @@ namespace nrpd
         signkey = 8,            // Server's public key for signing secure entropy.
         encryptionkey = 9,      // Server's public key for encrypting secure entropy.
         secureentropy = 10,     // Entropy encrypted with a one-time key.
+        receivesize = 11,       // Largest response the client accepts, and entropy it prefers.
+        bulkentropy = 12,       // Train of path-MTU-sized entropy packets; count is how many.
+        transactionid = 13,     // Opaque ID that servers echo, to match responses to requests.
         nrpd_msg_type_max
     };
 
@@ -28,6 +31,7 @@ namespace nrpd
         busy,               // congestion control; clients should back off 1.25x
         shuttingdown,       // server is shutting down
         unsupported,        // requested option not configured; don't request again
+        stalekey,           // key ID unknown or expired; fetch the server's keys again
         nrpd_reject_reason_max
     };
 
@@ -72,6 +76,25 @@ namespace nrpd
         unsigned short port;
     } Nrp_Message_Ip6Peer, *pNrp_Message_Ip6Peer;
 
+    // Request only; a server without support rejects it as unsupported, and
+    // sizes the response as it would have otherwise.
+    typedef struct _NRP_MESSAGE_RECEIVESIZE_REQUEST
+    {
+        unsigned short maxDatagramSize; // In network byte order
+        unsigned short preferredEntropy; // In network byte order; total across entropy messages
+    } Nrp_Message_ReceiveSize_Request, *pNrp_Message_ReceiveSize_Request;
+
+    // Chosen by the client, and echoed unchanged as the first message of the
+    // response. A server without support rejects it as unsupported.
+    typedef struct _NRP_MESSAGE_TRANSACTIONID
+    {
+        unsigned char id[8];
+    } Nrp_Message_TransactionId, *pNrp_Message_TransactionId;
+
+    // The server's certificate chain, as concatenated DER, is sent in
+    // chunks sized for the client's address family, one per message. The
+    // last chunk is padded with zeros. Chunk numbers are in network order,
+    // and hash is the SHA-256 of chunk, totalChunks and data.
     typedef struct _NRP_MESSAGE_CERTCHAIN_REQUEST
     {
         unsigned short requestChunk;
@@ -93,14 +116,20 @@ namespace nrpd
         unsigned char hash[32];
     } Nrp_Message_CertChain_Response6, *pNrp_Message_CertChain_Response6;
 
+    // Requests for keys are just a header. Both keys of an epoch share its
+    // key ID and expiry, and are signed over the message type, key, expiry
+    // and key ID.
+
+    // An epoch's Ed25519 key, signed by the server's long-term identity key
     typedef struct _NRP_MESSAGE_SIGNKEY_RESPONSE
     {
         unsigned char key[32];
-        char epiryTime[21];
+        char expiryTime[21]; // UTC, "YYYY-MM-DDTHH:MM:SSZ" and a NUL
         unsigned char keyId;
-        unsigned char signature[];
+        unsigned char signature[]; // identity public key, then its signature
     } Nrp_Message_SignKey_Response, *pNrp_Message_SignKey_Response;
 
+    // An epoch's X25519 key, signed by the epoch's sign key
     typedef struct _NRP_MESSAGE_ENCRYPTIONKEY_RESPONSE
     {
         unsigned char key[32];
@@ -109,16 +138,20 @@ namespace nrpd
         unsigned char signature[];
     } Nrp_Message_EncryptionKey_Response, *pNrp_Message_EncryptionKey_Response;
 
+    // clientKey is a fresh X25519 key; keyId names the server's epoch
     typedef struct _NRP_MESSAGE_SECUREENTROPY_REQUEST
     {
         unsigned char clientKey[32];
         unsigned char keyId;
     } Nrp_Message_SecureEntropy_Request, *pNrp_Message_SecureEntropy_Request;
 
+    // Entropy sealed with ChaCha20-Poly1305, under a key agreed between the
+    // request's client key and the epoch's encryption key
     typedef struct _NRP_MESSAGE_SECUREENTROPY_RESPONSE
     {
         unsigned char entropy[128];
-        unsigned char signature[];
+        unsigned char nonce[12];
+        unsigned char tag[16];
     } Nrp_Message_SecureEntropy_Response, *pNrp_Message_SecureEntropy_Response;
 
 
@@ -128,12 +161,37 @@ namespace nrpd
 #define MAX_REJECT_MESSAGE_SIZE sizeof(Nrp_Header_Message) + (MAX_BYTE * sizeof(Nrp_Message_Reject))
 #define DEFAULT_ENTROPY_SIZE (8)
 #define MAX_ENTROPY_SIZE (512)
+#define MAX_PREFERRED_ENTROPY_SIZE (16384) // most entropy a server sends in one response
 #define NRP_PACKET_HEADER_SIZE ((int) sizeof(Nrp_Header_Packet))
 #define NRP_MESSAGE_HEADER_SIZE ((int) sizeof(Nrp_Header_Message))
 #define RESPONSE_HEADER_SIZE NRP_PACKET_HEADER_SIZE
 #define CLIENT_MIN_RETRY_SECONDS (60)
 #define CLIENT_RESPONSE_TIMEOUT_SECONDS (30)
 #define CLIENT_MAX_SERVER_TIMEOUT_COUNT (5)
+#define CLIENT_RTT_EWMA_WEIGHT (0.125f) // weight of newest sample in smoothed RTT
+#define CLIENT_SUCCESS_EWMA_WEIGHT (0.125f) // weight of newest sample in success rate
+#define CLIENT_DEFAULT_RTT_MS (250) // assumed RTT of servers not yet measured
+#define CLIENT_SELECTION_CANDIDATES (4) // eligible active servers weighed per selection
+#define CLIENT_SCORE_MAX_WEIGHT (4.0f) // most an active server's request rate is scaled by its score, either way
+#define CLIENT_SCORE_REFRESH_MIN (16) // least reschedules between recomputing the mean score
+#define CLIENT_PROBATIONARY_BUDGET_PERCENT (25) // max share of requests to unproven servers
+#define CLIENT_MAX_PROBATIONARY_SERVERS (1024) // unproven servers remembered at once
+#define CLIENT_HIGH_DEMAND_ENTROPY_SIZE (4096) // entropy preferred per response when the kernel is low
+#define CLIENT_BULK_ENTROPY_SEGMENTS (32) // packets of a bulk train requested when the kernel is low
+#define CLIENT_BULK_TIMEOUT_MS (200) // wait for the rest of a bulk train after the response
+#define SERVER_MAX_BULK_BYTES (256 * 1024) // most entropy sent in one bulk train
+#define CLIENT_ENTROPY_CREDIT_BITS_PER_BYTE (1) // entropy credited per byte from a server
+#define CLIENT_TIMING_CREDIT_BITS (1) // entropy credited per response timing sample
+#define CLIENT_HEALTH_PRUNE_SIZE (64) // servers with health test state before pruning forgotten ones
+#define SECURE_PUBLIC_KEY_SIZE (32) // Ed25519 and X25519
+#define SECURE_SIGNATURE_SIZE (64) // Ed25519
+#define SECURE_SESSION_KEY_SIZE (32) // ChaCha20-Poly1305
+#define SECURE_KEY_LIFETIME_SECONDS (3600) // life of a server's key epoch
+#define SECURE_KEY_OVERLAP_SECONDS (300) // an epoch is still accepted this long after it's replaced
+#define SECURE_KEY_RETRY_SECONDS (10) // wait before trying again to create an epoch
+#define SERVER_SESSION_CACHE_SIZE (4096) // session keys a server remembers
+#define SIGNKEY_RESPONSE_SIZE (sizeof(Nrp_Message_SignKey_Response) + SECURE_PUBLIC_KEY_SIZE + SECURE_SIGNATURE_SIZE)
+#define ENCRYPTIONKEY_RESPONSE_SIZE (sizeof(Nrp_Message_EncryptionKey_Response) + SECURE_SIGNATURE_SIZE)
 #define MAX_IP6_PACKET_SIZE (1236)
 #define MAX_IP4_PACKET_SIZE (532)
 
@@ -150,14 +208,19 @@ namespace nrpd
     bool ValidateMessageHeader(pNrp_Header_Message hdr, bool isRequest);
 
     // Validate the request packet headers
+    // Trusts the packet's own length; use PacketView on received bytes.
     bool ValidateRequestPacket(pNrp_Header_Request pkt);
 
     // Validate the response packet headers
+    // Trusts the packet's own length; use PacketView on received bytes.
     bool ValidateResponsePacket(pNrp_Header_Response pkt);
 
     // Validate the reject message
     bool ValidateRejectMessage(pNrp_Header_Message hdr);
 
+    // Validate a cert chain response message, of either family's size
+    bool ValidateCertChainMessage(pNrp_Header_Message hdr);
+
     // Generates an entropy request message
     // Returns a pointer to the end of message on success, nullptr otherwise.
     pNrp_Header_Message GenerateRequestEntropyMessage(unsigned char requestedEntropy, pNrp_Header_Message msg);
@@ -166,6 +229,30 @@ namespace nrpd
     // Returns a pointer to the end of the message on success, nullptr otherwise.
     pNrp_Header_Message GenerateResponseEntropyMessage(unsigned char entropyLength, unsigned char* entropy, unsigned int bufferSize, pNrp_Header_Message buffer);
 
+    // Generates a receive size request message
+    // Returns a pointer to the end of the message on success, nullptr otherwise.
+    pNrp_Header_Message GenerateRequestReceiveSizeMessage(unsigned short maxDatagramSize, unsigned short preferredEntropy, pNrp_Header_Message buffer);
+
+    // Generates a bulk entropy request message
+    // Returns a pointer to the end of the message on success, nullptr otherwise.
+    pNrp_Header_Message GenerateRequestBulkEntropyMessage(unsigned char segments, pNrp_Header_Message buffer);
+
+    // Generates a transaction ID message, for a request or its response
+    // Returns a pointer to the end of the message on success, nullptr otherwise.
+    pNrp_Header_Message GenerateTransactionIdMessage(const unsigned char* id, pNrp_Header_Message buffer);
+
+    // Generates a sign key or encryption key request message
+    // Returns a pointer to the end of the message on success, nullptr otherwise.
+    pNrp_Header_Message GenerateRequestKeyMessage(nrpd_msg_type keyType, pNrp_Header_Message buffer);
+
+    // Generates a secure entropy request message
+    // Returns a pointer to the end of the message on success, nullptr otherwise.
+    pNrp_Header_Message GenerateRequestSecureEntropyMessage(pNrp_Message_SecureEntropy_Request request, pNrp_Header_Message buffer);
+
+    // Generates a cert chain request message, for count chunks
+    // Returns a pointer to the end of the message on success, nullptr otherwise.
+    pNrp_Header_Message GenerateRequestCertChainMessage(const unsigned short* chunks, unsigned char count, pNrp_Header_Message buffer);
+
     // Generates a peer request message
     // Returns a pointer to the end of the message on success, nullptr otherwise.
     pNrp_Header_Message GenerateRequestPeersMessage(nrpd_msg_type ipType, unsigned char countOfPeers, pNrp_Header_Message buffer);
@@ -0,0 +1,88 @@
+#include "randombuffer.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nrpd
+{
+    RandomBuffer::RandomBuffer(int randomfd, size_t size)
+        : m_randomfd(randomfd),
+        m_size(size),
+        m_position(size),
+        m_buffer(make_unique<unsigned char[]>(size))
+    {
+    }
+
+
+    RandomBuffer::~RandomBuffer()
+    {
+        // Clear secret memory
+        memset(m_buffer.get(), 0, m_size);
+    }
+
+
+    bool RandomBuffer::Read(unsigned char* out, size_t count)
+    {
+        size_t copied = 0;
+
+        if(out == nullptr)
+        {
+            return false;
+        }
+
+        while(copied < count)
+        {
+            if(m_position >= m_size && !Refill())
+            {
+                return false;
+            }
+
+            size_t chunk = min(count - copied, m_size - m_position);
+
+            memcpy(out + copied, m_buffer.get() + m_position, chunk);
+
+            // Don't leave handed-out bytes lying around
+            memset(m_buffer.get() + m_position, 0, chunk);
+
+            m_position += chunk;
+            copied += chunk;
+        }
+
+        return true;
+    }
+
+
+    bool RandomBuffer::Refill()
+    {
+        size_t filled = 0;
+        ssize_t count;
+
+        while(filled < m_size)
+        {
+            count = read(m_randomfd, m_buffer.get() + filled, m_size - filled);
+
+            if(count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if(count <= 0)
+            {
+                // Discard the partial fill; the caller will try again later
+                memset(m_buffer.get(), 0, filled);
+                m_position = m_size;
+                return false;
+            }
+
+            filled += count;
+        }
+
+        m_position = 0;
+        return true;
+    }
+}
@@ -0,0 +1,37 @@
+#include <memory>
+#include <stddef.h>
+
+#pragma once
+
+#define RANDOM_BUFFER_DEFAULT_SIZE (4096)
+
+using namespace std;
+
+namespace nrpd
+{
+    // Buffers reads from the random device, so callers that need a few
+    // random bytes per packet don't make a syscall per packet.
+    //
+    // Bytes are handed out once, and cleared from the buffer as they are
+    // handed out.
+    class RandomBuffer
+    {
+    public:
+        // randomfd must be open for reading; it is not owned by the buffer.
+        RandomBuffer(int randomfd, size_t size = RANDOM_BUFFER_DEFAULT_SIZE);
+        ~RandomBuffer();
+
+        // Copy count random bytes to out, refilling from the random device
+        // as needed.
+        // Returns false if the random device couldn't be read.
+        bool Read(unsigned char* out, size_t count);
+
+    private:
+        int m_randomfd;
+        size_t m_size;
+        size_t m_position; // next unused byte; m_size when empty
+        unique_ptr<unsigned char[]> m_buffer;
+
+        bool Refill();
+    };
+}
@@ -0,0 +1,137 @@
+#include "scramble.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NRPD_X86 1
+#endif
+
+namespace nrpd
+{
+    typedef void (*MaskEntropyFunction)(size_t, unsigned char*, const unsigned char*);
+
+    bool CpuSupportsSse2()
+    {
+#ifdef NRPD_X86
+        return __builtin_cpu_supports("sse2");
+#else
+        return false;
+#endif
+    }
+
+    bool CpuSupportsAvx2()
+    {
+#ifdef NRPD_X86
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+
+    // Pick the implementation once, the first time entropy is masked
+    static MaskEntropyFunction SelectMaskEntropy()
+    {
+        if(CpuSupportsAvx2())
+        {
+            return MaskEntropyAvx2;
+        }
+
+        if(CpuSupportsSse2())
+        {
+            return MaskEntropySse2;
+        }
+
+        return MaskEntropyScalar;
+    }
+
+    void MaskEntropy(size_t size, unsigned char* entropy, const unsigned char* mask)
+    {
+        static const MaskEntropyFunction s_maskEntropy = SelectMaskEntropy();
+
+        s_maskEntropy(size, entropy, mask);
+    }
+
+    void MaskEntropyScalar(size_t size, unsigned char* entropy, const unsigned char* mask)
+    {
+        for(size_t idx = 0; idx < size; idx++)
+        {
+            entropy[idx] *= ((mask[idx / 8] >> (idx % 8)) & 0x1);
+        }
+    }
+
+#ifdef NRPD_X86
+
+    // Each lane holds the bit that selects it from its mask byte.
+    // Comparing (mask & bits) against bits expands each mask bit to a byte
+    // of all ones or all zeroes.
+    #define MASK_BITS 1, 2, 4, 8, 16, 32, 64, -128
+
+    void MaskEntropySse2(size_t size, unsigned char* entropy, const unsigned char* mask)
+    {
+        const __m128i bits = _mm_setr_epi8(MASK_BITS, MASK_BITS);
+        size_t idx = 0;
+
+        // 16 bytes of entropy per 2 bytes of mask
+        for(; idx + 16 <= size; idx += 16)
+        {
+            __m128i lanes = _mm_unpacklo_epi64(_mm_set1_epi8(mask[idx / 8]),
+                                               _mm_set1_epi8(mask[(idx / 8) + 1]));
+            __m128i keep = _mm_cmpeq_epi8(_mm_and_si128(lanes, bits), bits);
+            __m128i data = _mm_loadu_si128((const __m128i*) (entropy + idx));
+
+            _mm_storeu_si128((__m128i*) (entropy + idx), _mm_and_si128(data, keep));
+        }
+
+        MaskEntropyScalar(size - idx, entropy + idx, mask + (idx / 8));
+    }
+
+    __attribute__((target("avx2")))
+    void MaskEntropyAvx2(size_t size, unsigned char* entropy, const unsigned char* mask)
+    {
+        const __m256i bits = _mm256_setr_epi8(MASK_BITS, MASK_BITS, MASK_BITS, MASK_BITS);
+        // Spread mask byte n across lanes 8n..8n+7. The shuffle works
+        // within each 128-bit half, so each half picks its own two bytes out
+        // of the broadcast 32-bit mask.
+        const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                                1, 1, 1, 1, 1, 1, 1, 1,
+                                                2, 2, 2, 2, 2, 2, 2, 2,
+                                                3, 3, 3, 3, 3, 3, 3, 3);
+        size_t idx = 0;
+        uint32_t maskWord;
+
+        // 32 bytes of entropy per 4 bytes of mask
+        for(; idx + 32 <= size; idx += 32)
+        {
+            memcpy(&maskWord, mask + (idx / 8), sizeof(maskWord));
+
+            __m256i lanes = _mm256_shuffle_epi8(_mm256_set1_epi32(maskWord), spread);
+            __m256i keep = _mm256_cmpeq_epi8(_mm256_and_si256(lanes, bits), bits);
+            __m256i data = _mm256_loadu_si256((const __m256i*) (entropy + idx));
+
+            _mm256_storeu_si256((__m256i*) (entropy + idx), _mm256_and_si256(data, keep));
+        }
+
+        // Avoid the AVX to SSE transition penalty in the tail
+        _mm256_zeroupper();
+
+        MaskEntropySse2(size - idx, entropy + idx, mask + (idx / 8));
+    }
+
+    #undef MASK_BITS
+
+#else
+
+    void MaskEntropySse2(size_t size, unsigned char* entropy, const unsigned char* mask)
+    {
+        MaskEntropyScalar(size, entropy, mask);
+    }
+
+    void MaskEntropyAvx2(size_t size, unsigned char* entropy, const unsigned char* mask)
+    {
+        MaskEntropyScalar(size, entropy, mask);
+    }
+
+#endif
+}
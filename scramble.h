@@ -0,0 +1,25 @@
+#include <stddef.h>
+
+#pragma once
+
+namespace nrpd
+{
+    // Zero out each byte of entropy whose bit in mask is 0, and keep each
+    // byte whose bit is 1. Bit (idx % 8) of mask[idx / 8] selects byte idx,
+    // so mask must hold at least ceil(size / 8) bytes.
+    //
+    // Dispatches to the fastest implementation the CPU supports.
+    void MaskEntropy(size_t size, unsigned char* entropy, const unsigned char* mask);
+
+    // Portable implementation, one byte at a time
+    void MaskEntropyScalar(size_t size, unsigned char* entropy, const unsigned char* mask);
+
+    // Vectorized implementations; only call these if the CPU supports them.
+    // Both fall back to the scalar implementation for the tail of entropy.
+    void MaskEntropySse2(size_t size, unsigned char* entropy, const unsigned char* mask);
+    void MaskEntropyAvx2(size_t size, unsigned char* entropy, const unsigned char* mask);
+
+    // Whether the vectorized implementations can run on this CPU
+    bool CpuSupportsSse2();
+    bool CpuSupportsAvx2();
+}
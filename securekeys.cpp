@@ -0,0 +1,338 @@
+#include "securekeys.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <openssl/kdf.h>
+#include <openssl/pem.h>
+
+#define SECURE_SESSION_INFO "nrpd secureentropy"
+
+using namespace std;
+
+namespace nrpd
+{
+    KeyPair::~KeyPair()
+    {
+        EVP_PKEY_free(m_key);
+    }
+
+
+    bool KeyPair::SetKey(EVP_PKEY* key)
+    {
+        size_t size = sizeof(m_public);
+
+        if(key == nullptr || EVP_PKEY_get_raw_public_key(key, m_public, &size) != 1 || size != sizeof(m_public))
+        {
+            EVP_PKEY_free(key);
+            return false;
+        }
+
+        EVP_PKEY_free(m_key);
+        m_key = key;
+        return true;
+    }
+
+
+    bool KeyPair::Generate(int type)
+    {
+        EVP_PKEY_CTX* context = EVP_PKEY_CTX_new_id(type, nullptr);
+        EVP_PKEY* key = nullptr;
+        bool result = false;
+
+        if(context != nullptr && EVP_PKEY_keygen_init(context) == 1 && EVP_PKEY_keygen(context, &key) == 1)
+        {
+            result = SetKey(key);
+        }
+
+        EVP_PKEY_CTX_free(context);
+        return result;
+    }
+
+
+    bool KeyPair::Load(const char* path)
+    {
+        FILE* file = fopen(path, "r");
+        EVP_PKEY* key;
+
+        if(file == nullptr)
+        {
+            return false;
+        }
+
+        key = PEM_read_PrivateKey(file, nullptr, nullptr, nullptr);
+        fclose(file);
+
+        if(key != nullptr && EVP_PKEY_id(key) != EVP_PKEY_ED25519)
+        {
+            EVP_PKEY_free(key);
+            return false;
+        }
+
+        return SetKey(key);
+    }
+
+
+    bool KeyPair::Sign(const unsigned char* data, size_t size, unsigned char* outSignature) const
+    {
+        EVP_MD_CTX* context = EVP_MD_CTX_new();
+        size_t signatureSize = SECURE_SIGNATURE_SIZE;
+        bool result;
+
+        result = context != nullptr && m_key != nullptr
+                 && EVP_DigestSignInit(context, nullptr, nullptr, nullptr, m_key) == 1
+                 && EVP_DigestSign(context, outSignature, &signatureSize, data, size) == 1
+                 && signatureSize == SECURE_SIGNATURE_SIZE;
+
+        EVP_MD_CTX_free(context);
+        return result;
+    }
+
+
+    bool KeyPair::Agree(const unsigned char* peerKey, unsigned char* outSecret) const
+    {
+        EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, nullptr, peerKey, SECURE_PUBLIC_KEY_SIZE);
+        EVP_PKEY_CTX* context = (m_key != nullptr) ? EVP_PKEY_CTX_new(m_key, nullptr) : nullptr;
+        size_t secretSize = SECURE_SESSION_KEY_SIZE;
+        unsigned char check = 0;
+        bool result;
+
+        result = peer != nullptr && context != nullptr
+                 && EVP_PKEY_derive_init(context) == 1
+                 && EVP_PKEY_derive_set_peer(context, peer) == 1
+                 && EVP_PKEY_derive(context, outSecret, &secretSize) == 1
+                 && secretSize == SECURE_SESSION_KEY_SIZE;
+
+        EVP_PKEY_CTX_free(context);
+        EVP_PKEY_free(peer);
+
+        // A low-order peer key makes the secret all zeroes, whatever our key
+        for(size_t idx = 0; result && idx < secretSize; idx++)
+        {
+            check |= outSecret[idx];
+        }
+
+        return result && check != 0;
+    }
+
+
+    bool VerifySignature(const unsigned char* publicKey, const unsigned char* data, size_t size, const unsigned char* signature)
+    {
+        EVP_PKEY* key = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, publicKey, SECURE_PUBLIC_KEY_SIZE);
+        EVP_MD_CTX* context = EVP_MD_CTX_new();
+        bool result;
+
+        result = key != nullptr && context != nullptr
+                 && EVP_DigestVerifyInit(context, nullptr, nullptr, nullptr, key) == 1
+                 && EVP_DigestVerify(context, signature, SECURE_SIGNATURE_SIZE, data, size) == 1;
+
+        EVP_MD_CTX_free(context);
+        EVP_PKEY_free(key);
+        return result;
+    }
+
+
+    // The bytes a key record's signature covers: the message type, then
+    // the record up to its signature. Returns the size written.
+    static size_t KeyRecordSignedData(nrpd_msg_type type, pNrp_Message_SignKey_Response record, unsigned char* outData)
+    {
+        outData[0] = type;
+        memcpy(outData + 1, record, sizeof(Nrp_Message_SignKey_Response));
+        return 1 + sizeof(Nrp_Message_SignKey_Response);
+    }
+
+    static_assert(sizeof(Nrp_Message_SignKey_Response) == sizeof(Nrp_Message_EncryptionKey_Response), "Key records must share a layout");
+
+
+    bool SignKeyRecord(nrpd_msg_type type, pNrp_Message_SignKey_Response record, KeyPair const& signer, unsigned char* outSignature)
+    {
+        unsigned char data[1 + sizeof(Nrp_Message_SignKey_Response)];
+
+        return signer.Sign(data, KeyRecordSignedData(type, record, data), outSignature);
+    }
+
+
+    bool VerifyKeyRecord(nrpd_msg_type type, pNrp_Message_SignKey_Response record, const unsigned char* signerKey, const unsigned char* signature)
+    {
+        unsigned char data[1 + sizeof(Nrp_Message_SignKey_Response)];
+
+        return VerifySignature(signerKey, data, KeyRecordSignedData(type, record, data), signature);
+    }
+
+
+    bool FormatExpiry(time_t expiry, char* outExpiry)
+    {
+        tm utc;
+
+        memset(outExpiry, 0, SECURE_EXPIRY_SIZE);
+
+        return gmtime_r(&expiry, &utc) != nullptr
+               && strftime(outExpiry, SECURE_EXPIRY_SIZE, SECURE_EXPIRY_FORMAT, &utc) == SECURE_EXPIRY_SIZE - 1;
+    }
+
+
+    bool ParseExpiry(const char* expiry, time_t& outExpiry)
+    {
+        char terminated[SECURE_EXPIRY_SIZE];
+        const char* end;
+        tm utc = {0};
+
+        memcpy(terminated, expiry, sizeof(terminated));
+        terminated[SECURE_EXPIRY_SIZE - 1] = '\0';
+
+        end = strptime(terminated, SECURE_EXPIRY_FORMAT, &utc);
+
+        if(end == nullptr || *end != '\0')
+        {
+            return false;
+        }
+
+        outExpiry = timegm(&utc);
+        return outExpiry != (time_t) -1;
+    }
+
+
+    bool DeriveSessionKey(KeyPair const& ownKey, const unsigned char* serverKey, pNrp_Message_SecureEntropy_Request request, unsigned char* outKey)
+    {
+        bool isServer = memcmp(ownKey.PublicKey(), serverKey, SECURE_PUBLIC_KEY_SIZE) == 0;
+        unsigned char secret[SECURE_SESSION_KEY_SIZE];
+        unsigned char info[sizeof(SECURE_SESSION_INFO) - 1 + (2 * SECURE_PUBLIC_KEY_SIZE) + 1];
+        size_t keySize = SECURE_SESSION_KEY_SIZE;
+        EVP_PKEY_CTX* context;
+        bool result;
+
+        if(!ownKey.Agree((isServer) ? request->clientKey : serverKey, secret))
+        {
+            return false;
+        }
+
+        // Bind the key to both public keys and the epoch, so it can't be
+        // replayed against another server or epoch.
+        memcpy(info, SECURE_SESSION_INFO, sizeof(SECURE_SESSION_INFO) - 1);
+        memcpy(info + sizeof(SECURE_SESSION_INFO) - 1, request->clientKey, SECURE_PUBLIC_KEY_SIZE);
+        memcpy(info + sizeof(SECURE_SESSION_INFO) - 1 + SECURE_PUBLIC_KEY_SIZE, serverKey, SECURE_PUBLIC_KEY_SIZE);
+        info[sizeof(info) - 1] = request->keyId;
+
+        context = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+
+        result = context != nullptr
+                 && EVP_PKEY_derive_init(context) == 1
+                 && EVP_PKEY_CTX_set_hkdf_md(context, EVP_sha256()) == 1
+                 && EVP_PKEY_CTX_set1_hkdf_key(context, secret, sizeof(secret)) == 1
+                 && EVP_PKEY_CTX_add1_hkdf_info(context, info, sizeof(info)) == 1
+                 && EVP_PKEY_derive(context, outKey, &keySize) == 1;
+
+        EVP_PKEY_CTX_free(context);
+        memset(secret, 0, sizeof(secret));
+        return result;
+    }
+
+
+    bool SealEntropy(const unsigned char* sessionKey, pNrp_Message_SecureEntropy_Request request, const unsigned char* nonce, pNrp_Message_SecureEntropy_Response response)
+    {
+        EVP_CIPHER_CTX* context = EVP_CIPHER_CTX_new();
+        int size = 0;
+        bool result;
+
+        memcpy(response->nonce, nonce, sizeof(response->nonce));
+
+        result = context != nullptr
+                 && EVP_EncryptInit_ex(context, EVP_chacha20_poly1305(), nullptr, sessionKey, response->nonce) == 1
+                 && EVP_EncryptUpdate(context, nullptr, &size, (unsigned char*) request, sizeof(*request)) == 1
+                 && EVP_EncryptUpdate(context, response->entropy, &size, response->entropy, sizeof(response->entropy)) == 1
+                 && EVP_EncryptFinal_ex(context, response->entropy + size, &size) == 1
+                 && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_GET_TAG, sizeof(response->tag), response->tag) == 1;
+
+        EVP_CIPHER_CTX_free(context);
+        return result;
+    }
+
+
+    bool OpenEntropy(const unsigned char* sessionKey, pNrp_Message_SecureEntropy_Request request, pNrp_Message_SecureEntropy_Response response, unsigned char* outEntropy)
+    {
+        EVP_CIPHER_CTX* context = EVP_CIPHER_CTX_new();
+        int size = 0;
+        bool result;
+
+        result = context != nullptr
+                 && EVP_DecryptInit_ex(context, EVP_chacha20_poly1305(), nullptr, sessionKey, response->nonce) == 1
+                 && EVP_DecryptUpdate(context, nullptr, &size, (unsigned char*) request, sizeof(*request)) == 1
+                 && EVP_DecryptUpdate(context, outEntropy, &size, response->entropy, sizeof(response->entropy)) == 1
+                 && EVP_CIPHER_CTX_ctrl(context, EVP_CTRL_AEAD_SET_TAG, sizeof(response->tag), response->tag) == 1
+                 && EVP_DecryptFinal_ex(context, outEntropy + size, &size) == 1;
+
+        EVP_CIPHER_CTX_free(context);
+
+        if(!result)
+        {
+            // Don't let a forgery be mistaken for entropy
+            memset(outEntropy, 0, sizeof(response->entropy));
+        }
+
+        return result;
+    }
+
+
+    // Fill in a key message's header, and its record of key in epoch.
+    // Returns where its signature goes, or nullptr on failure.
+    static unsigned char* BuildKeyMessage(nrpd_msg_type type, int size, KeyPair const& key, KeyEpoch const& epoch, unsigned char* buffer)
+    {
+        pNrp_Header_Message hdr = (pNrp_Header_Message) buffer;
+        pNrp_Message_SignKey_Response record = (pNrp_Message_SignKey_Response) hdr->content;
+
+        hdr->length = htons(size);
+        hdr->msgType = type;
+        hdr->countOrSize = 1;
+
+        memcpy(record->key, key.PublicKey(), SECURE_PUBLIC_KEY_SIZE);
+        record->keyId = epoch.keyId;
+
+        return (FormatExpiry(epoch.expiry, record->expiryTime)) ? record->signature : nullptr;
+    }
+
+
+    unique_ptr<KeyEpoch> CreateKeyEpoch(KeyPair const& identity, unsigned char keyId, time_t expiry)
+    {
+        unique_ptr<KeyEpoch> epoch = make_unique<KeyEpoch>();
+        unsigned char* signature;
+
+        epoch->keyId = keyId;
+        epoch->expiry = expiry;
+
+        if(!epoch->signKey.Generate(EVP_PKEY_ED25519) || !epoch->encryptionKey.Generate(EVP_PKEY_X25519))
+        {
+            NrpdLog::LogString("Keys: failed to generate epoch keys");
+            return nullptr;
+        }
+
+        // The sign key carries the identity that signed it, for clients to
+        // check against the one they pinned.
+        signature = BuildKeyMessage(signkey, sizeof(epoch->signKeyMessage), epoch->signKey, *epoch, epoch->signKeyMessage);
+
+        if(signature == nullptr)
+        {
+            return nullptr;
+        }
+
+        memcpy(signature, identity.PublicKey(), SECURE_PUBLIC_KEY_SIZE);
+
+        if(!SignKeyRecord(signkey, (pNrp_Message_SignKey_Response) ((pNrp_Header_Message) epoch->signKeyMessage)->content, identity, signature + SECURE_PUBLIC_KEY_SIZE))
+        {
+            NrpdLog::LogString("Keys: failed to sign epoch sign key");
+            return nullptr;
+        }
+
+        signature = BuildKeyMessage(encryptionkey, sizeof(epoch->encryptionKeyMessage), epoch->encryptionKey, *epoch, epoch->encryptionKeyMessage);
+
+        if(signature == nullptr
+           || !SignKeyRecord(encryptionkey, (pNrp_Message_SignKey_Response) ((pNrp_Header_Message) epoch->encryptionKeyMessage)->content, epoch->signKey, signature))
+        {
+            NrpdLog::LogString("Keys: failed to sign epoch encryption key");
+            return nullptr;
+        }
+
+        return epoch;
+    }
+}
@@ -0,0 +1,161 @@
+#include <memory>
+#include <functional>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+
+#include "protocol.h"
+
+#pragma once
+
+#define SECURE_NONCE_SIZE (12) // ChaCha20-Poly1305
+#define SECURE_TAG_SIZE (16)
+#define SECURE_EXPIRY_SIZE (21)
+#define SECURE_EXPIRY_FORMAT "%Y-%m-%dT%H:%M:%SZ"
+
+using namespace std;
+
+namespace nrpd
+{
+    // Secure entropy rests on three levels of keys:
+    //
+    // - The server's long-term Ed25519 identity key, which clients pin.
+    // - An epoch of keys, lasting SECURE_KEY_LIFETIME_SECONDS: an Ed25519
+    //   sign key signed by the identity, and an X25519 encryption key
+    //   signed by the sign key. Both are signed once, when the epoch is
+    //   created ahead of its use, and sent as prebuilt messages. Each is
+    //   replaced SECURE_KEY_OVERLAP_SECONDS before it expires, so clients
+    //   holding its keys can finish with them.
+    // - A session key per client key and epoch, agreed between the
+    //   client's X25519 key and the epoch's encryption key.
+    //
+    // So the only public key work per response is one X25519 agreement,
+    // which both sides cache for the epoch, and the entropy itself is
+    // sealed with ChaCha20-Poly1305 under a fresh nonce, not signed.
+
+    // An Ed25519 or X25519 key pair
+    class KeyPair
+    {
+    public:
+        KeyPair() : m_key(nullptr), m_public{0} {}
+        ~KeyPair();
+
+        KeyPair(KeyPair const&) = delete;
+        KeyPair& operator=(KeyPair const&) = delete;
+
+        // Replace the key with a new one of type EVP_PKEY_ED25519 or
+        // EVP_PKEY_X25519. Returns false on failure.
+        bool Generate(int type);
+
+        // Replace the key with the Ed25519 private key in the PEM file at
+        // path. Returns false if it can't be read, or isn't Ed25519.
+        bool Load(const char* path);
+
+        bool Valid() const { return m_key != nullptr; }
+
+        // SECURE_PUBLIC_KEY_SIZE bytes
+        const unsigned char* PublicKey() const { return m_public; }
+
+        // Sign size bytes of data with an Ed25519 key.
+        // outSignature must hold SECURE_SIGNATURE_SIZE bytes.
+        bool Sign(const unsigned char* data, size_t size, unsigned char* outSignature) const;
+
+        // Agree on a secret with the X25519 public key peerKey.
+        // outSecret must hold SECURE_SESSION_KEY_SIZE bytes.
+        // Returns false on failure, or if peerKey contributes nothing.
+        bool Agree(const unsigned char* peerKey, unsigned char* outSecret) const;
+
+    private:
+        EVP_PKEY* m_key;
+        unsigned char m_public[SECURE_PUBLIC_KEY_SIZE];
+
+        bool SetKey(EVP_PKEY* key);
+    };
+
+    // Verify an Ed25519 signature of size bytes of data by publicKey
+    bool VerifySignature(const unsigned char* publicKey, const unsigned char* data, size_t size, const unsigned char* signature);
+
+    // Sign or verify a sign key or encryption key record; both are laid
+    // out the same up to their signature. type is the message type the
+    // record is sent in, so one can't be passed off as the other.
+    bool SignKeyRecord(nrpd_msg_type type, pNrp_Message_SignKey_Response record, KeyPair const& signer, unsigned char* outSignature);
+    bool VerifyKeyRecord(nrpd_msg_type type, pNrp_Message_SignKey_Response record, const unsigned char* signerKey, const unsigned char* signature);
+
+    // Write expiry as an expiry time field. Returns false on failure.
+    bool FormatExpiry(time_t expiry, char* outExpiry);
+
+    // Read an expiry time field, which may not be NUL terminated.
+    // Returns false if it's malformed.
+    bool ParseExpiry(const char* expiry, time_t& outExpiry);
+
+    // Derive the key that seals the response to request. ownKey is either
+    // the client's key in request, or the server's encryption key,
+    // serverKey; the other side's public key is the peer's.
+    // outKey must hold SECURE_SESSION_KEY_SIZE bytes.
+    bool DeriveSessionKey(KeyPair const& ownKey, const unsigned char* serverKey, pNrp_Message_SecureEntropy_Request request, unsigned char* outKey);
+
+    // Encrypt response->entropy in place, under sessionKey and nonce, and
+    // authenticate it along with request. Sets response's nonce and tag.
+    bool SealEntropy(const unsigned char* sessionKey, pNrp_Message_SecureEntropy_Request request, const unsigned char* nonce, pNrp_Message_SecureEntropy_Response response);
+
+    // Decrypt response into outEntropy, which must hold
+    // sizeof(response->entropy) bytes. Returns false if response wasn't
+    // sealed under sessionKey for request, or was altered.
+    bool OpenEntropy(const unsigned char* sessionKey, pNrp_Message_SecureEntropy_Request request, pNrp_Message_SecureEntropy_Response response, unsigned char* outEntropy);
+
+    // A derived session key, as cached by servers and clients
+    struct SessionKey
+    {
+        unsigned char key[SECURE_SESSION_KEY_SIZE];
+    };
+
+    // Requests with the same client key and key ID share a session key
+    inline bool operator==(Nrp_Message_SecureEntropy_Request const& lhs, Nrp_Message_SecureEntropy_Request const& rhs)
+    {
+        return lhs.keyId == rhs.keyId && memcmp(lhs.clientKey, rhs.clientKey, sizeof(lhs.clientKey)) == 0;
+    }
+
+    // One epoch of a server's keys, with its key messages prebuilt
+    struct KeyEpoch
+    {
+        unsigned char keyId;
+        time_t expiry;
+        KeyPair signKey;
+        KeyPair encryptionKey;
+
+        // Whole messages, headers included, ready to copy into responses
+        unsigned char signKeyMessage[NRP_MESSAGE_HEADER_SIZE + SIGNKEY_RESPONSE_SIZE];
+        unsigned char encryptionKeyMessage[NRP_MESSAGE_HEADER_SIZE + ENCRYPTIONKEY_RESPONSE_SIZE];
+    };
+
+    // Generate an epoch of keys, expiring at expiry, and sign them.
+    // Returns nullptr on failure.
+    unique_ptr<KeyEpoch> CreateKeyEpoch(KeyPair const& identity, unsigned char keyId, time_t expiry);
+}
+
+namespace std
+{
+    // Clients choose their keys, so they can choose colliding ones; caches
+    // keyed on them must be bounded, which caps the length of a chain well
+    // below the cost of the agreement a hit saves.
+    template<>
+    struct hash<nrpd::Nrp_Message_SecureEntropy_Request>
+    {
+        typedef nrpd::Nrp_Message_SecureEntropy_Request argument_type;
+        typedef std::size_t result_type;
+        result_type operator()(argument_type const& r) const
+        {
+            // FNV-1a
+            result_type result = 14695981039346656037ull;
+
+            for(unsigned int i = 0; i < sizeof(r.clientKey); i++)
+            {
+                result = (result ^ r.clientKey[i]) * 1099511628211ull;
+            }
+
+            return (result ^ r.keyId) * 1099511628211ull;
+        }
+    };
+}
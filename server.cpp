@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <chrono>
+#include <thread>
 
 
 #include <errno.h>
@@ -29,7 +31,7 @@ namespace nrpd
         //TODO: Eventually make this private.
     }
 
-    NrpdServer::NrpdServer(shared_ptr<NrpdConfig> cfg) : m_config(cfg), m_state(notinitialized)
+    NrpdServer::NrpdServer(shared_ptr<NrpdConfig> cfg) : m_config(cfg), m_state(notinitialized), m_bulkSegments(0), m_bulkSegmentSize(0), m_useGso(true), m_fastEntropySize(-1), m_nextKeyId(0), m_clientIpv6(false), m_fastSlice(nullptr), m_fastSliceSize(0)
     {
     }
 
@@ -112,7 +114,13 @@ namespace nrpd
             return errno;
         }
 
-        // TODO: Get MTU from the interface
+        // Responses are sized to the path MTU, so have the kernel refuse
+        // (EMSGSIZE) rather than fragment any that turn out too big.
+        if(!SetDontFragment(m_socketfd))
+        {
+            NrpdLog::LogString("Server: failed to disable fragmentation");
+        }
+
         m_mtu = MAX_IP6_PACKET_SIZE;
 
         // TODO: Make random device configurable
@@ -122,14 +130,59 @@ namespace nrpd
             return errno;
         }
 
+        m_bulkBuffer = make_unique<unsigned char[]>(SERVER_MAX_BULK_BYTES);
+        m_entropyPool = make_unique<RandomBuffer>(m_randomfd);
+
+        // Clients pin the identity, so a generated one only lasts as long
+        // as the server runs.
+        if(!m_config->identityKeyPath().empty())
+        {
+            if(!m_identity.Load(m_config->identityKeyPath().c_str()))
+            {
+                NrpdLog::LogString("Server: failed to load identity key " + m_config->identityKeyPath());
+                return EINVAL;
+            }
+        }
+        else if(!m_identity.Generate(EVP_PKEY_ED25519))
+        {
+            NrpdLog::LogString("Server: failed to generate identity key");
+            return EINVAL;
+        }
+
         // Create recent clients hashmap
         m_recentClients = make_shared<MruCache<sockaddr_storage>>(CLIENT_MIN_RETRY_SECONDS);
+        m_sessionKeys = make_shared<MruCache<Nrp_Message_SecureEntropy_Request, SessionKey>>(SECURE_KEY_LIFETIME_SECONDS, SERVER_SESSION_CACHE_SIZE);
+
+        // The first epoch, and the next, are made before any client asks
+        RotateKeys(time(nullptr));
 
         m_state = initialized;
         return EXIT_SUCCESS;
     }
 
 
+    bool NrpdServer::SetDontFragment(int socketfd)
+    {
+        int pmtudisc = IP_PMTUDISC_DO;
+        int pmtudisc6 = IPV6_PMTUDISC_DO;
+        bool result = false;
+
+        // A dual-stack socket uses the IPv4 option for IPv4-mapped clients,
+        // so set both and succeed if either applies.
+        if(setsockopt(socketfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)) == 0)
+        {
+            result = true;
+        }
+
+        if(setsockopt(socketfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &pmtudisc6, sizeof(pmtudisc6)) == 0)
+        {
+            result = true;
+        }
+
+        return result;
+    }
+
+
     unsigned int NrpdServer::CalculateMessageSize(unsigned int availableBytes, int messageSize, int& messageCount)
     {
         unsigned int responseSize = 0;
@@ -174,12 +227,9 @@ namespace nrpd
         }
     }
 
-    unique_ptr<unsigned char[]> NrpdServer::GeneratePeersResponse(nrpd_msg_type type, int msgCount, int availableBytes, int& outResponseSize)
+    int NrpdServer::CalculatePeersResponseSize(nrpd_msg_type type, int& msgCount, int availableBytes)
     {
         int size = 0;
-        int dataSize = 0;
-        unique_ptr<unsigned char[]> tempMsgBuffer;
-        unique_ptr<unsigned char[]> data;
 
         if(type == ip6peers)
         {
@@ -190,8 +240,6 @@ namespace nrpd
             size = sizeof(Nrp_Message_Ip4Peer);
         }
 
-        outResponseSize = 0;
-
         if(msgCount <= 0)
         {
             // Client didn't specify, so give them as many as will fit
@@ -202,19 +250,31 @@ namespace nrpd
             msgCount = min(m_config->ActiveServerCount(type), msgCount);
         }
 
+        // countOrSize can't say more than that, however large the path MTU
+        msgCount = min(msgCount, MAX_BYTE);
+
         if(msgCount == 0)
         {
             // No servers of requested type, fail
             // Note: this should be caught by GenenerateResponsePeersMessage, but
             // failing here saves the work of allocating/deallocating tempMsgBuffer
-            return nullptr;
+            return 0;
         }
 
         // Calculate size of response
-        outResponseSize = CalculateMessageSize(availableBytes, size, msgCount);
+        return CalculateMessageSize(availableBytes, size, msgCount);
+    }
+
+    unique_ptr<unsigned char[]> NrpdServer::GeneratePeersResponse(nrpd_msg_type type, int msgCount, int availableBytes, int& outResponseSize)
+    {
+        int dataSize = 0;
+        unique_ptr<unsigned char[]> tempMsgBuffer;
+        unique_ptr<unsigned char[]> data;
+
+        outResponseSize = CalculatePeersResponseSize(type, msgCount, availableBytes);
         if(outResponseSize == 0)
         {
-            // Not enough room for this message
+            // No peers to send, or no room for them
             return nullptr;
         }
 
@@ -303,84 +363,99 @@ namespace nrpd
     }
 
 
-    bool NrpdServer::ParseMessages(pNrp_Header_Request pkt, int& outMessageLength, std::list<unique_ptr<unsigned char[]>>& msgs)
+    // Indexed by message type; see c_messageDescriptors
+    const NrpdServer::RequestHandler NrpdServer::s_requestHandlers[] =
+    {
+        &NrpdServer::HandleUnsupportedRequest,  // nrpd_msg_type_min
+        &NrpdServer::HandleUnsupportedRequest,  // request
+        &NrpdServer::HandleUnsupportedRequest,  // response
+        &NrpdServer::HandleUnsupportedRequest,  // reject
+        &NrpdServer::HandlePeersRequest,        // ip4peers
+        &NrpdServer::HandleEntropyRequest,      // entropy
+        &NrpdServer::HandlePeersRequest,        // ip6peers
+        &NrpdServer::HandleCertChainRequest,    // certchain
+        &NrpdServer::HandleKeyRequest,          // signkey
+        &NrpdServer::HandleKeyRequest,          // encryptionkey
+        &NrpdServer::HandleSecureEntropyRequest, // secureentropy
+        &NrpdServer::HandleAppliedRequest,      // receivesize
+        &NrpdServer::HandleBulkEntropyRequest,  // bulkentropy
+        &NrpdServer::HandleAppliedRequest,      // transactionid
+    };
+
+
+    bool NrpdServer::ParseMessages(PacketView const& pkt, int& outMessageLength, std::list<unique_ptr<unsigned char[]>>& msgs)
     {
-        std::list<Nrp_Message_Reject> rejections;
-        pNrp_Header_Message currentMsg;
         unique_ptr<unsigned char[]> tempMsgBuffer;
 
         // Only send as much data as will fit in one packet. Client can request more later.
-        int bytesRemaining = m_mtu;
+        ResponseState state = { msgs, {}, m_mtu, 0, 0 };
+        int echoSize = 0;
         int responseSize;
         int msgCount;
 
-        if(bytesRemaining <= NRP_PACKET_HEADER_SIZE)
+        static_assert(sizeof(s_requestHandlers) / sizeof(s_requestHandlers[0]) == nrpd_msg_type_max, "Every message type needs a request handler");
+
+        if(!pkt.Valid())
         {
             return false;
         }
 
-        if(pkt == nullptr)
+        // The client may advertise how much it can receive, and how much
+        // entropy it wants, before asking for anything; honor it within the
+        // path MTU and server limits.
+        pNrp_Message_ReceiveSize_Request receiveSize = pkt.ReceiveSize();
+
+        if(receiveSize != nullptr)
         {
-            return false;
+            state.bytesRemaining = min<int>(state.bytesRemaining, ntohs(receiveSize->maxDatagramSize));
+            state.preferredEntropy = min<int>(MAX_PREFERRED_ENTROPY_SIZE, ntohs(receiveSize->preferredEntropy));
         }
 
-        outMessageLength = 0;
-
-        bytesRemaining -= NRP_PACKET_HEADER_SIZE;
+        // Room for echoing the client's transaction ID is set aside first;
+        // without it the client can't match the response.
+        pNrp_Message_TransactionId transactionId = pkt.TransactionId();
 
-        currentMsg = pkt->messages;
+        if(transactionId != nullptr)
+        {
+            echoSize = NRP_MESSAGE_HEADER_SIZE + sizeof(Nrp_Message_TransactionId);
+        }
 
-        // Iterate through all messages
-        while(currentMsg < EndOfPacket(pkt) && CalculateRemainingBytes(bytesRemaining, rejections.size()) > 0)
+        if(state.bytesRemaining <= NRP_PACKET_HEADER_SIZE + echoSize)
         {
-            responseSize = 0;
+            return false;
+        }
+
+        m_bulkSegments = 0;
+        m_bulkSegmentSize = state.bytesRemaining;
 
-            switch(currentMsg->msgType)
+        state.bytesRemaining -= NRP_PACKET_HEADER_SIZE + echoSize;
+
+        // Dispatch each message to its handler
+        for(MessageView currentMsg : pkt)
+        {
+            if(CalculateRemainingBytes(state.bytesRemaining, state.rejections.size()) <= 0)
             {
-            case ip4peers:
-            case ip6peers:
-                if(m_config->enablePeersResponse((nrpd_msg_type) currentMsg->msgType))
-                {
-                    tempMsgBuffer = GeneratePeersResponse((nrpd_msg_type) currentMsg->msgType, currentMsg->countOrSize, CalculateRemainingBytes(bytesRemaining, rejections.size()), responseSize);
-                }
-                else
-                {
-                    rejections.push_back({currentMsg->msgType, unsupported});
-                }
-                break;
-            case entropy:
-                tempMsgBuffer = GenerateEntropyResponse(currentMsg->countOrSize, CalculateRemainingBytes(bytesRemaining, rejections.size()), responseSize);
-                break;
-            case certchain:
-            case signkey:
-            case encryptionkey:
-            case secureentropy:
-                // TODO: check if configured for signcert
-                rejections.push_back({currentMsg->msgType, unsupported});
-                break;
-            default:
-                // Unknown message type; reject
-                rejections.push_back({currentMsg->msgType, unsupported});
                 break;
             }
 
-            if(tempMsgBuffer != nullptr)
+            if(currentMsg.Type() < nrpd_msg_type_max)
             {
-                msgs.push_back(move(tempMsgBuffer));
-                bytesRemaining -= responseSize;
-                outMessageLength += responseSize;
+                (this->*s_requestHandlers[currentMsg.Type()])(currentMsg, state);
+            }
+            else
+            {
+                // Unknown message type; reject
+                HandleUnsupportedRequest(currentMsg, state);
             }
-
-            currentMsg = NextMessage(currentMsg);
         }
 
         // check for any rejections and add them to the list of messages
-        if(!rejections.empty())
+        if(!state.rejections.empty())
         {
-            msgCount = rejections.size();
+            msgCount = state.rejections.size();
 
             // Calculate if we can fit the entire rejection message
-            responseSize = CalculateMessageSize(bytesRemaining, sizeof(Nrp_Message_Reject), msgCount);
+            responseSize = CalculateMessageSize(state.bytesRemaining, sizeof(Nrp_Message_Reject), msgCount);
             if(responseSize > 0)
             {
                 // Allocate buffer for rejection messages
@@ -390,7 +465,7 @@ namespace nrpd
                 if(tempMsgBuffer != nullptr)
                 {
                     pNrp_Message_Reject rejectMsg = GenerateRejectHeader(msgCount, (pNrp_Header_Message) tempMsgBuffer.get());
-                    for(Nrp_Message_Reject& rej : rejections)
+                    for(Nrp_Message_Reject& rej : state.rejections)
                     {
                         if((void*)rejectMsg >= NextMessage(tempMsgBuffer.get(), NRP_MESSAGE_HEADER_SIZE + (msgCount * sizeof(Nrp_Message_Reject))))
                         {
@@ -406,16 +481,550 @@ namespace nrpd
 
                     // Put rejections first
                     msgs.push_front(move(tempMsgBuffer));
-                    outMessageLength += responseSize;
+                    state.messageLength += responseSize;
                 }
             }
         }
 
+        // Echo the transaction ID ahead of everything, so clients can match
+        // or drop the response without parsing the rest.
+        if(transactionId != nullptr)
+        {
+            tempMsgBuffer = make_unique<unsigned char[]>(echoSize);
+            GenerateTransactionIdMessage(transactionId->id, (pNrp_Header_Message) tempMsgBuffer.get());
+            msgs.push_front(move(tempMsgBuffer));
+            state.messageLength += echoSize;
+        }
+
+        outMessageLength = state.messageLength;
+
         return true;
     }
 
+
+    void NrpdServer::AddResponseMessage(ResponseState& state, unique_ptr<unsigned char[]> msg, int size)
+    {
+        if(msg != nullptr)
+        {
+            state.msgs.push_back(move(msg));
+            state.bytesRemaining -= size;
+            state.messageLength += size;
+        }
+    }
+
+
+    void NrpdServer::HandlePeersRequest(MessageView const& msg, ResponseState& state)
+    {
+        nrpd_msg_type type = (nrpd_msg_type) msg.Type();
+        unique_ptr<unsigned char[]> tempMsgBuffer;
+        int responseSize = 0;
+
+        if(!m_config->enablePeersResponse(type))
+        {
+            state.rejections.push_back({msg.Type(), unsupported});
+            return;
+        }
+
+        tempMsgBuffer = GeneratePeersResponse(type, msg.CountOrSize(), CalculateRemainingBytes(state.bytesRemaining, state.rejections.size()), responseSize);
+        AddResponseMessage(state, move(tempMsgBuffer), responseSize);
+    }
+
+
+    void NrpdServer::HandleEntropyRequest(MessageView const& msg, ResponseState& state)
+    {
+        unique_ptr<unsigned char[]> tempMsgBuffer;
+        int responseSize = 0;
+
+        // A client that prefers more entropy than one message holds gets as
+        // many messages as it takes, and fit.
+        int entropyWanted = max<int>(msg.CountOrSize(), state.preferredEntropy);
+
+        do
+        {
+            tempMsgBuffer = GenerateEntropyResponse(min(entropyWanted, MAX_BYTE), CalculateRemainingBytes(state.bytesRemaining, state.rejections.size()), responseSize);
+            entropyWanted -= responseSize - NRP_MESSAGE_HEADER_SIZE;
+
+            AddResponseMessage(state, move(tempMsgBuffer), responseSize);
+        } while(responseSize > 0 && entropyWanted > 0);
+    }
+
+
+    void NrpdServer::HandleBulkEntropyRequest(MessageView const& msg, ResponseState& state)
+    {
+        // Sent after the response, so it can't crowd anything out
+        if(m_config->enableBulkEntropy())
+        {
+            m_bulkSegments = msg.CountOrSize();
+        }
+        else
+        {
+            state.rejections.push_back({msg.Type(), unsupported});
+        }
+    }
+
+
+    time_t NrpdServer::RotateKeys(time_t now)
+    {
+        shared_ptr<const KeyEpochs> epochs = atomic_load(&m_keyEpochs);
+        shared_ptr<KeyEpochs> published;
+        time_t rotation;
+
+        // Signed as soon as the one before it is published; it replaces
+        // that one an overlap before it expires, and lasts a lifetime
+        if(m_nextEpoch == nullptr)
+        {
+            rotation = (epochs != nullptr) ? max(now, epochs->current->expiry - SECURE_KEY_OVERLAP_SECONDS) : now;
+            m_nextEpoch = CreateKeyEpoch(m_identity, m_nextKeyId, rotation + SECURE_KEY_LIFETIME_SECONDS);
+
+            if(m_nextEpoch == nullptr)
+            {
+                NrpdLog::LogString("Server: failed to create the next key epoch");
+                return now + SECURE_KEY_RETRY_SECONDS;
+            }
+
+            m_nextKeyId++;
+        }
+
+        rotation = m_nextEpoch->expiry - SECURE_KEY_LIFETIME_SECONDS;
+
+        if(now < rotation)
+        {
+            return rotation;
+        }
+
+        published = make_shared<KeyEpochs>();
+        published->current = move(m_nextEpoch);
+        published->previous = (epochs != nullptr) ? epochs->current : nullptr;
+        atomic_store(&m_keyEpochs, shared_ptr<const KeyEpochs>(published));
+
+        NrpdLog::LogString("Server: rotated keys");
+
+        // Sign the one after it now, rather than at its rotation
+        return RotateKeys(now);
+    }
+
+
+    shared_ptr<const KeyEpoch> NrpdServer::CurrentKeyEpoch()
+    {
+        shared_ptr<const KeyEpochs> epochs = atomic_load(&m_keyEpochs);
+
+        // Only if the key thread has fallen behind
+        if(epochs == nullptr || time(nullptr) >= epochs->current->expiry)
+        {
+            return nullptr;
+        }
+
+        return epochs->current;
+    }
+
+
+    shared_ptr<const KeyEpoch> NrpdServer::FindKeyEpoch(unsigned char keyId)
+    {
+        shared_ptr<const KeyEpochs> epochs = atomic_load(&m_keyEpochs);
+        time_t now = time(nullptr);
+
+        if(epochs == nullptr)
+        {
+            return nullptr;
+        }
+
+        if(epochs->current->keyId == keyId && now < epochs->current->expiry)
+        {
+            return epochs->current;
+        }
+
+        // Clients keep the keys they have until they expire
+        if(epochs->previous != nullptr && epochs->previous->keyId == keyId && now < epochs->previous->expiry)
+        {
+            return epochs->previous;
+        }
+
+        return nullptr;
+    }
+
+
+    void NrpdServer::HandleKeyRequest(MessageView const& msg, ResponseState& state)
+    {
+        unique_ptr<unsigned char[]> tempMsgBuffer;
+        const unsigned char* keyMessage;
+        shared_ptr<const KeyEpoch> epoch;
+        int size;
+
+        if(!m_config->enableSecureEntropy())
+        {
+            state.rejections.push_back({msg.Type(), unsupported});
+            return;
+        }
+
+        if((epoch = CurrentKeyEpoch()) == nullptr)
+        {
+            state.rejections.push_back({msg.Type(), unspecified});
+            return;
+        }
+
+        // Signed when the epoch began; only copied here
+        if(msg.Type() == signkey)
+        {
+            keyMessage = epoch->signKeyMessage;
+            size = sizeof(epoch->signKeyMessage);
+        }
+        else
+        {
+            keyMessage = epoch->encryptionKeyMessage;
+            size = sizeof(epoch->encryptionKeyMessage);
+        }
+
+        if(CalculateRemainingBytes(state.bytesRemaining, state.rejections.size()) < size)
+        {
+            return;
+        }
+
+        tempMsgBuffer = make_unique<unsigned char[]>(size);
+        memcpy(tempMsgBuffer.get(), keyMessage, size);
+        AddResponseMessage(state, move(tempMsgBuffer), size);
+    }
+
+
+    void NrpdServer::HandleSecureEntropyRequest(MessageView const& msg, ResponseState& state)
+    {
+        pNrp_Message_SecureEntropy_Request request = msg.Records<Nrp_Message_SecureEntropy_Request>();
+        int size = NRP_MESSAGE_HEADER_SIZE + sizeof(Nrp_Message_SecureEntropy_Response);
+        SessionKey session;
+        unsigned char nonce[SECURE_NONCE_SIZE];
+        unique_ptr<unsigned char[]> tempMsgBuffer;
+        pNrp_Message_SecureEntropy_Response response;
+        pNrp_Header_Message hdr;
+        shared_ptr<const KeyEpoch> epoch;
+
+        if(!m_config->enableSecureEntropy())
+        {
+            state.rejections.push_back({msg.Type(), unsupported});
+            return;
+        }
+
+        if(request == nullptr)
+        {
+            state.rejections.push_back({msg.Type(), unspecified});
+            return;
+        }
+
+        // The client has keys from an earlier epoch, or none of ours
+        if((epoch = FindKeyEpoch(request->keyId)) == nullptr)
+        {
+            state.rejections.push_back({msg.Type(), stalekey});
+            return;
+        }
+
+        if(CalculateRemainingBytes(state.bytesRemaining, state.rejections.size()) < size)
+        {
+            return;
+        }
+
+        tempMsgBuffer = make_unique<unsigned char[]>(size);
+        hdr = (pNrp_Header_Message) tempMsgBuffer.get();
+        hdr->length = htons(size);
+        hdr->msgType = secureentropy;
+        hdr->countOrSize = 1;
+        response = (pNrp_Message_SecureEntropy_Response) hdr->content;
+
+        // Repeat clients skip the agreement; their key ID pins the entry
+        // to this epoch
+        if(!m_sessionKeys->Find(*request, session))
+        {
+            if(!DeriveSessionKey(epoch->encryptionKey, epoch->encryptionKey.PublicKey(), request, session.key))
+            {
+                state.rejections.push_back({msg.Type(), unspecified});
+                return;
+            }
+
+            // When full, new clients pay for the agreement every time
+            m_sessionKeys->Add(*request, session);
+        }
+
+        // Nothing is signed per response, and the nonce keeps a cached
+        // session key from sealing twice alike
+        if(!m_entropyPool->Read(response->entropy, sizeof(response->entropy))
+           || !m_entropyPool->Read(nonce, sizeof(nonce))
+           || !SealEntropy(session.key, request, nonce, response))
+        {
+            state.rejections.push_back({msg.Type(), unspecified});
+            return;
+        }
+
+        AddResponseMessage(state, move(tempMsgBuffer), size);
+    }
+
+
+    CertChainBlob const* NrpdServer::CurrentCertChain()
+    {
+        // A fast path response is sent straight from the chain, so keep it
+        // even if a reload replaces it before then
+        m_certChain = m_config->Tuning()->certChain;
+
+        return m_certChain.get();
+    }
+
+
+    void NrpdServer::HandleCertChainRequest(MessageView const& msg, ResponseState& state)
+    {
+        pNrp_Message_CertChain_Request request = msg.Records<Nrp_Message_CertChain_Request>(msg.CountOrSize());
+        CertChainBlob const* chain = CurrentCertChain();
+        unique_ptr<unsigned char[]> tempMsgBuffer;
+        const unsigned char* chunk;
+        int size;
+
+        if(chain == nullptr)
+        {
+            state.rejections.push_back({msg.Type(), unsupported});
+            return;
+        }
+
+        if(request == nullptr)
+        {
+            state.rejections.push_back({msg.Type(), unspecified});
+            return;
+        }
+
+        size = chain->ChunkMessageSize(m_clientIpv6);
+
+        for(int idx = 0; idx < msg.CountOrSize(); idx++)
+        {
+            // Chunks past the end are skipped; every chunk carries the count
+            if((chunk = chain->ChunkMessage(m_clientIpv6, ntohs(request[idx].requestChunk))) == nullptr)
+            {
+                continue;
+            }
+
+            // The client asks again for what doesn't fit
+            if(CalculateRemainingBytes(state.bytesRemaining, state.rejections.size()) < size)
+            {
+                return;
+            }
+
+            tempMsgBuffer = make_unique<unsigned char[]>(size);
+            memcpy(tempMsgBuffer.get(), chunk, size);
+            AddResponseMessage(state, move(tempMsgBuffer), size);
+        }
+    }
+
+
+    void NrpdServer::HandleAppliedRequest(MessageView const& msg, ResponseState& state)
+    {
+        // Applied by ParseMessages before any handler runs
+    }
+
+
+    void NrpdServer::HandleUnsupportedRequest(MessageView const& msg, ResponseState& state)
+    {
+        state.rejections.push_back({msg.Type(), unsupported});
+    }
+
+
+    int NrpdServer::FastPathResponse(PacketView const& pkt, unsigned char* buffer)
+    {
+        pNrp_Message_TransactionId transactionId = pkt.TransactionId();
+        int entropySize = m_config->defaultEntropySize();
+        int echo = (transactionId != nullptr) ? 1 : 0;
+        nrpd_msg_type peersType = nrpd_msg_type_min;
+        int peersCount = 0;
+        int dataSize = 0;
+        int peersSize;
+        int size;
+        unique_ptr<unsigned char[]> data;
+        MessageIterator msg = pkt.begin();
+
+        m_fastSlice = nullptr;
+        m_fastSliceSize = 0;
+
+        if(!pkt.Valid() || pkt.ReceiveSize() != nullptr || pkt.MessageCount() > echo + 2)
+        {
+            return 0;
+        }
+
+        // [transactionid] entropy [ip4peers | ip6peers], in that order
+        if(echo)
+        {
+            if((*msg).Type() != transactionid)
+            {
+                return 0;
+            }
+
+            ++msg;
+        }
+
+        // Or [transactionid] certchain, for one chunk, as clients fetch the
+        // chain when they start
+        if(msg != pkt.end() && (*msg).Type() == certchain)
+        {
+            return (pkt.MessageCount() == echo + 1) ? FastCertChainResponse(*msg, transactionId, buffer) : 0;
+        }
+
+        if(msg == pkt.end() || (*msg).Type() != entropy
+           || ((*msg).CountOrSize() != 0 && (*msg).CountOrSize() != entropySize))
+        {
+            return 0;
+        }
+
+        if(++msg != pkt.end())
+        {
+            peersType = (nrpd_msg_type) (*msg).Type();
+            peersCount = (*msg).CountOrSize();
+
+            // A disabled peers type needs a rejection
+            if((peersType != ip4peers && peersType != ip6peers) || !m_config->enablePeersResponse(peersType))
+            {
+                return 0;
+            }
+        }
+
+        // The default entropy size is tunable at runtime
+        if(entropySize != m_fastEntropySize)
+        {
+            BuildResponseTemplates(entropySize);
+        }
+
+        size = m_fastTemplateSize[echo];
+
+        if(size > m_mtu)
+        {
+            return 0;
+        }
+
+        memcpy(buffer, m_fastTemplate[echo], size);
+
+        if(echo)
+        {
+            memcpy(((pNrp_Header_Packet) buffer)->messages[0].content, transactionId->id, sizeof(transactionId->id));
+        }
+
+        if(!m_entropyPool->Read(buffer + size, entropySize))
+        {
+            return 0;
+        }
+
+        size += entropySize;
+
+        // Peers are sent if there are any, and room for them, as
+        // ParseMessages would
+        if(peersType != nrpd_msg_type_min
+           && (peersSize = CalculatePeersResponseSize(peersType, peersCount, m_mtu - size)) > 0)
+        {
+            data = m_config->GetServerList(peersType, peersCount, dataSize);
+
+            if(GenerateResponsePeersMessage(peersType, peersCount, data.get(), peersSize, (pNrp_Header_Message) (buffer + size)) != nullptr)
+            {
+                size += peersSize;
+                ((pNrp_Header_Packet) buffer)->length = htons(size);
+                ((pNrp_Header_Packet) buffer)->msgCount++;
+            }
+        }
+
+        // Only ParseMessages grants bulk entropy
+        m_bulkSegments = 0;
+
+        return size;
+    }
+
+
+    int NrpdServer::FastCertChainResponse(MessageView const& msg, pNrp_Message_TransactionId transactionId, unsigned char* buffer)
+    {
+        CertChainBlob const* chain = CurrentCertChain();
+        int echo = (transactionId != nullptr) ? 1 : 0;
+        int size = NRP_PACKET_HEADER_SIZE + (echo * (NRP_MESSAGE_HEADER_SIZE + sizeof(Nrp_Message_TransactionId)));
+        const unsigned char* chunk;
+        int chunkSize;
+
+        // Anything to reject, skip or batch needs ParseMessages
+        if(chain == nullptr || msg.CountOrSize() != 1)
+        {
+            return 0;
+        }
+
+        chunk = chain->ChunkMessage(m_clientIpv6, ntohs(msg.Records<Nrp_Message_CertChain_Request>()->requestChunk));
+        chunkSize = chain->ChunkMessageSize(m_clientIpv6);
+
+        if(chunk == nullptr || size + chunkSize > m_mtu)
+        {
+            return 0;
+        }
+
+        GeneratePacketHeader(size + chunkSize, response, 1 + echo, (pNrp_Header_Packet) buffer);
+
+        if(echo)
+        {
+            GenerateTransactionIdMessage(transactionId->id, ((pNrp_Header_Packet) buffer)->messages);
+        }
+
+        // Sent from the blob; nothing of the chunk is copied
+        m_fastSlice = chunk;
+        m_fastSliceSize = chunkSize;
+        m_bulkSegments = 0;
+
+        return size + chunkSize;
+    }
+
+
+    void NrpdServer::BuildResponseTemplates(int entropySize)
+    {
+        const unsigned char unsetId[sizeof(Nrp_Message_TransactionId)] = {0};
+
+        for(int echo = 0; echo < 2; echo++)
+        {
+            pNrp_Header_Packet pkt = (pNrp_Header_Packet) m_fastTemplate[echo];
+            pNrp_Header_Message msg = pkt->messages;
+            int size = NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE;
+
+            memset(m_fastTemplate[echo], 0, sizeof(m_fastTemplate[echo]));
+
+            if(echo)
+            {
+                // The ID is filled in per response
+                msg = GenerateTransactionIdMessage(unsetId, msg);
+                size += NRP_MESSAGE_HEADER_SIZE + sizeof(Nrp_Message_TransactionId);
+            }
+
+            msg->length = htons(NRP_MESSAGE_HEADER_SIZE + entropySize);
+            msg->msgType = entropy;
+            msg->countOrSize = entropySize;
+
+            GeneratePacketHeader(size + entropySize, response, 1 + echo, pkt);
+            m_fastTemplateSize[echo] = size;
+        }
+
+        m_fastEntropySize = entropySize;
+    }
+
+
+    int NrpdServer::SendBulkEntropy(sockaddr_storage const& addr, socklen_t addrSize)
+    {
+        int segments = min(m_bulkSegments, SERVER_MAX_BULK_BYTES / m_bulkSegmentSize);
+        int syscalls = 0;
+        int size;
+        int error;
+
+        if((size = BuildEntropyTrain(m_randomfd, m_bulkSegmentSize, segments, m_bulkBuffer.get())) == 0)
+        {
+            return EIO;
+        }
+
+        error = SendSegments(m_socketfd, m_bulkBuffer.get(), size, m_bulkSegmentSize, (const sockaddr*) &addr, addrSize, m_useGso, syscalls);
+
+        if(error == EMSGSIZE)
+        {
+            // The path shrank; the next request from this client is sized anew
+            m_pathMtu.Invalidate(addr);
+        }
+
+        return error;
+    }
+
+
     int NrpdServer::ServerLoop()
     {
+        // Separate from the request, which is parsed again if a response
+        // must be rebuilt smaller
+        unique_ptr<unsigned char[]> responseBuffer = make_unique<unsigned char[]>(MAX_RESPONSE_MESSAGE_SIZE);
+
         if(m_state == initialized)
         {
             m_state = running;
@@ -434,6 +1043,9 @@ namespace nrpd
             // TODO: make sure this is cleared every iteration, even on failure
             std::list<unique_ptr<unsigned char[]>> msgs;
             pNrp_Header_Message msg;
+            iovec iov[2];
+            msghdr sendHdr;
+            bool sized;
 
             unsigned char buffer[MAX_RESPONSE_MESSAGE_SIZE];
 
@@ -447,13 +1059,15 @@ namespace nrpd
                 continue;
             }
 
-            pNrp_Header_Request req = (pNrp_Header_Request) buffer;
+            // Bounded by what was received, not by the buffer
+            PacketView req(buffer, count, true);
+            m_clientIpv6 = !IsAddressIp4(srcAddr);
 
             NrpdLog::LogString("Server: packet received");
 
 
             // validate packet
-            if(!ValidateRequestPacket(req))
+            if(!req.Valid())
             {
                 // ignore malformed packets
                 NrpdLog::LogString("Server: packet failed validation");
@@ -468,58 +1082,108 @@ namespace nrpd
                 continue;
             }
 
-            // Set the "MTU" based on the IP protocol of the client.
-            // This controls the number and size of messages in the response.
-            if(IsAddressIp4(srcAddr))
-            {
-                m_mtu = MAX_IP4_PACKET_SIZE;
-            }
-            else
+            // Size the response to what the path to the client can carry.
+            // Probing an uncached path costs a socket, so it's only done if
+            // the response, or bulk entropy, would exceed what every path
+            // carries; most responses don't. If the path has shrunk since it
+            // was cached, the send fails with EMSGSIZE; probe again and
+            // build a smaller response.
+            sized = ((m_mtu = m_pathMtu.CachedPayload(srcAddr)) != 0);
+
+            if(!sized)
             {
-                m_mtu = MAX_IP6_PACKET_SIZE;
+                m_mtu = MAX_RESPONSE_MESSAGE_SIZE;
             }
 
-            // parse messages in request
-            if(!ParseMessages(req, messageLength, msgs))
+            for(int attempt = 0; attempt < 3; attempt++)
             {
-                // TODO: log error
-                NrpdLog::LogString("Server: failed to parse client request");
-                continue;
-            }
+                // Most requests are answered straight from a template
+                if((messageLength = FastPathResponse(req, responseBuffer.get())) == 0)
+                {
+                    // parse messages in request
+                    if(!ParseMessages(req, messageLength, msgs))
+                    {
+                        // TODO: log error
+                        NrpdLog::LogString("Server: failed to parse client request");
+                        break;
+                    }
 
-            // Add the packet header to the length.
-            messageLength += sizeof(Nrp_Header_Packet);
+                    // Add the packet header to the length.
+                    messageLength += sizeof(Nrp_Header_Packet);
 
-            assert(messageLength <= m_mtu);
+                    // generate packet header
+                    msg = GeneratePacketHeader(messageLength, response, msgs.size(), (pNrp_Header_Packet) responseBuffer.get());
 
-            // generate packet header
-            msg = GeneratePacketHeader(messageLength, response, msgs.size(), (pNrp_Header_Packet) buffer);
+                    // copy messages into buffer
+                    // Note: Potential perf improvement could be had by using sendmsg
+                    for(auto& buf : msgs)
+                    {
+                        pNrp_Header_Message msgptr = (pNrp_Header_Message) buf.get();
+                        count = ntohs(msgptr->length);
 
-            // copy messages into buffer
-            // Note: Potential perf improvement could be had by using sendmsg
-            for(auto& buf : msgs)
-            {
-                pNrp_Header_Message msgptr = (pNrp_Header_Message) buf.get();
-                count = ntohs(msgptr->length);
+                        memcpy(msg, buf.get(), count);
 
-                memcpy(msg, buf.get(), count);
+                        // advance the pointer to the end of the message
+                        msg = NextMessage(msg);
+                    }
 
-                // advance the pointer to the end of the message
-                msg = NextMessage(msg);
-            }
+                    // Clean up the list
+                    msgs.clear();
+                }
 
-            NrpdLog::LogString("Server: sending response");
+                assert(messageLength <= m_mtu);
 
-            // send generated packet
-            if( (count = sendto(m_socketfd, buffer, messageLength, 0, (sockaddr*) &srcAddr, srcAddrLen)) < 0)
-            {
-                // TODO: log some error
-                NrpdLog::LogString("Server: failed to send to client");
-                continue;
-            }
+                if(!sized && (messageLength > (m_clientIpv6 ? MAX_IP6_PACKET_SIZE : MAX_IP4_PACKET_SIZE) || m_bulkSegments > 0))
+                {
+                    sized = true;
 
-            // Clean up the list
-            msgs.clear();
+                    // Build it again if the path can't carry it, or the
+                    // bulk segments sized for the largest path
+                    if((m_mtu = m_pathMtu.MaxPayload(srcAddr)) < messageLength
+                       || (m_bulkSegments > 0 && m_mtu < MAX_RESPONSE_MESSAGE_SIZE))
+                    {
+                        continue;
+                    }
+                }
+
+                NrpdLog::LogString("Server: sending response");
+
+                // The fast path may leave the end of the response where it
+                // lies, to be gathered by the send
+                iov[0].iov_base = responseBuffer.get();
+                iov[0].iov_len = messageLength - m_fastSliceSize;
+                iov[1].iov_base = (void*) m_fastSlice;
+                iov[1].iov_len = m_fastSliceSize;
+
+                memset(&sendHdr, 0, sizeof(sendHdr));
+                sendHdr.msg_name = &srcAddr;
+                sendHdr.msg_namelen = srcAddrLen;
+                sendHdr.msg_iov = iov;
+                sendHdr.msg_iovlen = (m_fastSliceSize > 0) ? 2 : 1;
+
+                // send generated packet
+                if( (count = sendmsg(m_socketfd, &sendHdr, 0)) >= 0)
+                {
+                    if(m_bulkSegments > 0 && SendBulkEntropy(srcAddr, srcAddrLen) != 0)
+                    {
+                        NrpdLog::LogString("Server: failed to send bulk entropy");
+                    }
+
+                    break;
+                }
+
+                if(errno != EMSGSIZE)
+                {
+                    // TODO: log some error
+                    NrpdLog::LogString("Server: failed to send to client");
+                    break;
+                }
+
+                NrpdLog::LogString("Server: response exceeded path MTU");
+                m_pathMtu.Invalidate(srcAddr);
+                m_mtu = m_pathMtu.MaxPayload(srcAddr);
+                sized = true;
+            }
         }
 
         return EXIT_SUCCESS;
@@ -530,4 +1194,15 @@ namespace nrpd
         // TODO: Do something with the return value here
         server->ServerLoop();
     }
+
+    void NrpdServer::KeyThread(shared_ptr<NrpdServer> server)
+    {
+        for(;;)
+        {
+            time_t now = time(nullptr);
+            time_t next = server->RotateKeys(now);
+
+            this_thread::sleep_for(chrono::seconds(max<time_t>(1, next - now)));
+        }
+    }
 }
@@ -1,6 +1,12 @@
 #include "config.h"
 #include "protocol.h"
 #include "mrucache.h"
+#include "pathmtu.h"
+#include "bulkentropy.h"
+#include "packetview.h"
+#include "randombuffer.h"
+#include "securekeys.h"
+#include "certchain.h"
 #include <memory>
 #include <list>
 
@@ -19,6 +25,10 @@ namespace nrpd
         int InitializeServer();
         int ServerLoop();
         static void ServerThread(shared_ptr<NrpdServer> server);
+
+        // Thread procedure that rotates the keys of server for as long as
+        // the process runs, so no key is made or signed on the packet path
+        static void KeyThread(shared_ptr<NrpdServer> server);
     private:
         enum NrpdServerState
         {
@@ -33,14 +43,116 @@ namespace nrpd
         NrpdServerState m_state;
         int m_socketfd;
         int m_randomfd;
-        int m_mtu;
+        int m_mtu; // largest response payload for the current client
+        PathMtuCache m_pathMtu;
+        int m_bulkSegments; // packets of bulk entropy the current client asked for
+        int m_bulkSegmentSize; // size of each, within the path MTU and receive size
+        bool m_useGso; // false once UDP_SEGMENT sends have failed
+        unique_ptr<unsigned char[]> m_bulkBuffer;
+        unique_ptr<RandomBuffer> m_entropyPool; // entropy for fast path responses
+
+        // Fast path responses, prebuilt up to the entropy: the packet
+        // header, the transaction ID echo if any, and the header of a
+        // default-size entropy message. Indexed by whether there's an echo.
+        unsigned char m_fastTemplate[2][NRP_PACKET_HEADER_SIZE + (2 * NRP_MESSAGE_HEADER_SIZE) + sizeof(Nrp_Message_TransactionId)];
+        int m_fastTemplateSize[2];
+        int m_fastEntropySize; // default entropy size the templates were built for
+        KeyPair m_identity; // long-term key that signs each epoch's sign key
+
+        // The epochs of keys requests are answered from, replaced whole by
+        // the key thread
+        struct KeyEpochs
+        {
+            shared_ptr<const KeyEpoch> current; // handed out to clients
+            shared_ptr<const KeyEpoch> previous; // still accepted until it expires, or nullptr
+        };
+        shared_ptr<const KeyEpochs> m_keyEpochs;
+        unique_ptr<KeyEpoch> m_nextEpoch; // signed ahead of its rotation; key thread only
+        unsigned char m_nextKeyId;
+        // Session keys of recent clients, by client key and key ID; none
+        // outlives the epoch it was agreed in
+        shared_ptr<MruCache<Nrp_Message_SecureEntropy_Request, SessionKey>> m_sessionKeys;
+        shared_ptr<const CertChainBlob> m_certChain; // chain last served; fast path slices point into it
+        bool m_clientIpv6; // whether the current client gets IPv6-sized chunks
+
+        // The end of a fast path response, sent from where it lies instead
+        // of being copied into the response buffer; 0 bytes if none
+        const unsigned char* m_fastSlice;
+        int m_fastSliceSize;
 
         // Parse incoming request messages from a client and generate responses
         // as appropriate.
         // outMessageLength is only the length of messages contained in msgs,
         // it does not include the packet header length (because the packet
         // header is not generated in ParseMessages).
-        bool ParseMessages(pNrp_Header_Request pkt, int& outMessageLength, std::list<unique_ptr<unsigned char[]>>& msgs);
+        bool ParseMessages(PacketView const& pkt, int& outMessageLength, std::list<unique_ptr<unsigned char[]>>& msgs);
+
+        // The response ParseMessages is building, passed to the handler of
+        // each message in the request
+        struct ResponseState
+        {
+            std::list<unique_ptr<unsigned char[]>>& msgs;
+            std::list<Nrp_Message_Reject> rejections;
+            int bytesRemaining;
+            int preferredEntropy; // across all entropy messages
+            int messageLength; // of msgs
+        };
+
+        // Handles one message of a request, adding its response to state
+        typedef void (NrpdServer::*RequestHandler)(MessageView const& msg, ResponseState& state);
+
+        // Handler of each message type, indexed by type
+        static const RequestHandler s_requestHandlers[];
+
+        // Add msg, of size bytes, to the response, unless it's nullptr
+        void AddResponseMessage(ResponseState& state, unique_ptr<unsigned char[]> msg, int size);
+
+        void HandlePeersRequest(MessageView const& msg, ResponseState& state);
+        void HandleEntropyRequest(MessageView const& msg, ResponseState& state);
+        void HandleBulkEntropyRequest(MessageView const& msg, ResponseState& state);
+        void HandleKeyRequest(MessageView const& msg, ResponseState& state);
+        void HandleSecureEntropyRequest(MessageView const& msg, ResponseState& state);
+        void HandleCertChainRequest(MessageView const& msg, ResponseState& state);
+        void HandleAppliedRequest(MessageView const& msg, ResponseState& state);
+        void HandleUnsupportedRequest(MessageView const& msg, ResponseState& state);
+
+        // Build the whole response to the request shapes nearly every
+        // client sends: default-size entropy, optionally preceded by a
+        // transaction ID and followed by one peers request. Skips
+        // ParseMessages' lists and allocations by copying a prebuilt
+        // template, and filling it from the entropy pool.
+        // Returns the size of the response, with its packet header, or 0
+        // if the request must go through ParseMessages.
+        // A response ending in m_fastSliceSize bytes of m_fastSlice holds
+        // all but those in buffer.
+        int FastPathResponse(PacketView const& pkt, unsigned char* buffer);
+
+        // Fast path response to a request for one chunk of the cert chain,
+        // msg, after the transaction ID if any. The chunk is left in
+        // m_fastSlice. Returns 0 if it must go through ParseMessages.
+        int FastCertChainResponse(MessageView const& msg, pNrp_Message_TransactionId transactionId, unsigned char* buffer);
+
+        // Prebuild the fast path templates for entropySize bytes of entropy
+        void BuildResponseTemplates(int entropySize);
+
+        // The epoch of keys to hand out, or of keyId to accept from a
+        // client, or nullptr if it has expired or been replaced. Only reads
+        // what the key thread published.
+        shared_ptr<const KeyEpoch> CurrentKeyEpoch();
+        shared_ptr<const KeyEpoch> FindKeyEpoch(unsigned char keyId);
+
+        // Publish the next epoch of keys if it's due at now, and create
+        // the one after it if it doesn't exist yet.
+        // Returns when it should next be called.
+        time_t RotateKeys(time_t now);
+
+        // The configured cert chain, as built when the config was loaded,
+        // held until the next call. Returns nullptr if there's none.
+        CertChainBlob const* CurrentCertChain();
+
+        // Have the kernel fail sends larger than the path MTU, instead of
+        // fragmenting them. Returns false if it can't be set.
+        static bool SetDontFragment(int socketfd);
 
         // Calculate maximal byte size for a message, given remaining space
         // in the response packet.
@@ -54,11 +166,21 @@ namespace nrpd
         // rejection messages already generated.
         int CalculateRemainingBytes(int availableBytes, int rejCount);
 
+        // Size a peers response to a request for msgCount peers of type,
+        // within availableBytes. msgCount is updated with how many fit.
+        // Returns 0 if there are none to send, or no room for them.
+        int CalculatePeersResponseSize(nrpd_msg_type type, int& msgCount, int availableBytes);
+
         // Parse a peers request message and generate a peers response
         unique_ptr<unsigned char[]> GeneratePeersResponse(nrpd_msg_type type, int msgCount, int availableBytes, int& outResponseSize);
 
         // Parse an entropy request message and generate an entropy response
         unique_ptr<unsigned char[]> GenerateEntropyResponse(int size, int bytesRemaining, int& outResponseSize);
 
+        // Send the bulk entropy train requested by the current client, in
+        // packets of m_bulkSegmentSize bytes.
+        // Returns 0 on success, or errno on failure.
+        int SendBulkEntropy(sockaddr_storage const& addr, socklen_t addrSize);
+
     };
 }
@@ -0,0 +1,939 @@
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <list>
+#include <memory>
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+// Reach the server's response builders, as the functional tests do
+#define private public
+
+#include "../server.h"
+#include "../randombuffer.h"
+#include "../scramble.h"
+#include "../health.h"
+#include "../peerfamily.h"
+#include "../bulkentropy.h"
+#include "../keyverifier.h"
+
+#define BENCH_MAX_ENTROPY_SIZE (MAX_ENTROPY_SIZE)
+#define BENCH_ITERATIONS (200000)
+#define BENCH_PEER_COUNT (64) // peers per list
+#define BENCH_PEER_ITERATIONS (20000)
+#define BENCH_ENTROPY_TOTAL (1024 * 1024) // entropy fetched per transfer benchmark
+#define BENCH_SEGMENT_SIZE (1500 - 28) // an Ethernet path MTU, less IPv4 and UDP headers
+#define BENCH_RESPONSE_ITERATIONS (200000)
+#define BENCH_SECURE_ITERATIONS (20000)
+#define BENCH_SECURE_ENTROPY_SIZE (128) // as much as a secure entropy response holds
+#define BENCH_CERT_COUNT (4) // certificates in the chain served
+#define BENCH_VERIFY_JOBS (2000) // servers' keys verified per run
+
+using namespace std;
+using namespace nrpd;
+
+typedef void (*MaskFunction)(size_t, unsigned char*, const unsigned char*);
+typedef size_t (*FindRepeatFunction)(const unsigned char*, size_t);
+typedef size_t (*CountByteFunction)(const unsigned char*, size_t, unsigned char);
+
+// Stops the compiler from discarding the work being measured
+static volatile unsigned char s_sink;
+
+static double BenchmarkMask(MaskFunction function, size_t size)
+{
+    array<unsigned char, BENCH_MAX_ENTROPY_SIZE> entropy;
+    array<unsigned char, BENCH_MAX_ENTROPY_SIZE / 8> mask;
+    mt19937 engine(1);
+
+    for(auto& byte : mask)
+    {
+        byte = engine();
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        // Refill so masked-out bytes don't make later passes trivial
+        memset(entropy.data(), iteration | 1, size);
+        function(size, entropy.data(), mask.data());
+        s_sink ^= entropy[size / 2];
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_ITERATIONS;
+}
+
+// The counting the health tests do per response: finding each repeat, as
+// the repetition count test does, and counting one byte, as the adaptive
+// proportion test does
+static double BenchmarkHealthCounting(FindRepeatFunction findRepeat, CountByteFunction countByte, size_t size)
+{
+    array<unsigned char, BENCH_MAX_ENTROPY_SIZE> entropy;
+    mt19937 engine(1);
+
+    for(auto& byte : entropy)
+    {
+        byte = engine();
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        size_t idx = 0;
+
+        while(idx < size)
+        {
+            idx += findRepeat(entropy.data() + idx, size - idx);
+        }
+
+        s_sink ^= idx + countByte(entropy.data(), size, entropy[iteration % size]);
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_ITERATIONS;
+}
+
+// All of the health tests, as run on each response
+static double BenchmarkHealthTest(size_t size)
+{
+    array<unsigned char, BENCH_MAX_ENTROPY_SIZE> entropy;
+    HealthTest health;
+    mt19937 engine(1);
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        // New bytes each time, so the tests keep passing
+        if((iteration % 64) == 0)
+        {
+            for(auto& byte : entropy)
+            {
+                byte = engine();
+            }
+        }
+
+        s_sink ^= health.Test(entropy.data(), size);
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_ITERATIONS;
+}
+
+static double BenchmarkDirectRead(int fd, size_t size)
+{
+    array<unsigned char, BENCH_MAX_ENTROPY_SIZE / 8> secret;
+    int bytes = ceil(size / 8.0f);
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        if(read(fd, secret.data(), bytes) != bytes)
+        {
+            return -1;
+        }
+
+        s_sink ^= secret[0];
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_ITERATIONS;
+}
+
+static double BenchmarkBufferedRead(int fd, size_t size)
+{
+    array<unsigned char, BENCH_MAX_ENTROPY_SIZE / 8> secret;
+    RandomBuffer buffer(fd);
+    int bytes = ceil(size / 8.0f);
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_ITERATIONS; iteration++)
+    {
+        if(!buffer.Read(secret.data(), bytes))
+        {
+            return -1;
+        }
+
+        s_sink ^= secret[0];
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_ITERATIONS;
+}
+
+static vector<ServerRecord> MakePeers(bool ipv6)
+{
+    vector<ServerRecord> peers;
+    unsigned char ip[16];
+    mt19937 engine(1);
+
+    for(int i = 0; i < BENCH_PEER_COUNT; i++)
+    {
+        for(auto& byte : ip)
+        {
+            byte = engine();
+        }
+
+        peers.emplace_back(ip, ipv6, engine());
+    }
+
+    return peers;
+}
+
+// How peers messages were encoded and decoded before PeerFamily: the family
+// is checked, and the entry size worked out, for every peer.
+static double BenchmarkEncodeBranching(vector<ServerRecord> const& peers, nrpd_msg_type type)
+{
+    vector<unsigned char> list(peers.size() * sizeof(Nrp_Message_Ip6Peer));
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_PEER_ITERATIONS; iteration++)
+    {
+        unsigned char* entry = list.data();
+
+        for(auto& rec : peers)
+        {
+            if(type == ip6peers && rec.ipv6)
+            {
+                pNrp_Message_Ip6Peer msg = (pNrp_Message_Ip6Peer) entry;
+
+                memcpy(msg->ip, rec.host6, sizeof(msg->ip));
+                msg->port = rec.port;
+                entry += sizeof(*msg);
+            }
+            else if(type == ip4peers && !rec.ipv6)
+            {
+                pNrp_Message_Ip4Peer msg = (pNrp_Message_Ip4Peer) entry;
+
+                memcpy(msg->ip, rec.host4, sizeof(msg->ip));
+                msg->port = rec.port;
+                entry += sizeof(*msg);
+            }
+        }
+
+        s_sink ^= list[iteration % list.size()];
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_PEER_ITERATIONS;
+}
+
+template<nrpd_msg_type Type>
+static double BenchmarkEncodeFamily(vector<ServerRecord> const& peers)
+{
+    vector<typename PeerFamily<Type>::Message> list(peers.size());
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_PEER_ITERATIONS; iteration++)
+    {
+        auto entry = list.data();
+
+        for(auto& rec : peers)
+        {
+            EncodePeer<Type>(rec, entry++);
+        }
+
+        s_sink ^= list[iteration % list.size()].ip[0];
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_PEER_ITERATIONS;
+}
+
+static double BenchmarkDecodeBranching(vector<ServerRecord> const& peers, nrpd_msg_type type)
+{
+    vector<unsigned char> list(peers.size() * sizeof(Nrp_Message_Ip6Peer));
+    size_t size = (type == ip6peers) ? sizeof(Nrp_Message_Ip6Peer) : sizeof(Nrp_Message_Ip4Peer);
+    ServerRecord rec;
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_PEER_ITERATIONS; iteration++)
+    {
+        for(size_t i = 0; i < peers.size(); i++)
+        {
+            if(type == ip4peers)
+            {
+                rec = ServerRecord((pNrp_Message_Ip4Peer) &list[i * size]);
+            }
+            else
+            {
+                rec = ServerRecord((pNrp_Message_Ip6Peer) &list[i * size]);
+            }
+
+            s_sink ^= rec.port;
+        }
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_PEER_ITERATIONS;
+}
+
+template<nrpd_msg_type Type>
+static double BenchmarkDecodeFamily(vector<ServerRecord> const& peers)
+{
+    vector<typename PeerFamily<Type>::Message> list(peers.size());
+    ServerRecord rec;
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_PEER_ITERATIONS; iteration++)
+    {
+        for(auto& entry : list)
+        {
+            DecodePeer<Type>(&entry, rec);
+            s_sink ^= rec.port;
+        }
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_PEER_ITERATIONS;
+}
+
+// Build a request of shape [transactionid] entropy [peers], returning its size
+static int BuildShapeRequest(bool withId, nrpd_msg_type peersType, unsigned char* buffer)
+{
+    const unsigned char id[sizeof(Nrp_Message_TransactionId)] = {0};
+    pNrp_Header_Message msg = ((pNrp_Header_Packet) buffer)->messages;
+    int size = NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE;
+    int count = 1;
+
+    if(withId)
+    {
+        msg = GenerateTransactionIdMessage(id, msg);
+        size += NRP_MESSAGE_HEADER_SIZE + sizeof(Nrp_Message_TransactionId);
+        count++;
+    }
+
+    msg = GenerateRequestEntropyMessage(0, msg);
+
+    if(peersType != nrpd_msg_type_min)
+    {
+        GenerateRequestPeersMessage(peersType, 8, msg);
+        size += NRP_MESSAGE_HEADER_SIZE;
+        count++;
+    }
+
+    GeneratePacketHeader(size, request, count, (pNrp_Header_Packet) buffer);
+
+    return size;
+}
+
+// The server's work from a validated request to a response ready to send,
+// either through ParseMessages and assembly, as ServerLoop did before the
+// fast path, or through the fast path.
+// clearSessions makes every secure entropy request look like a new client's.
+static double BenchmarkResponse(NrpdServer& server, PacketView const& req, bool fastPath, int iterations = BENCH_RESPONSE_ITERATIONS, bool clearSessions = false)
+{
+    unique_ptr<unsigned char[]> buffer = make_unique<unsigned char[]>(MAX_RESPONSE_MESSAGE_SIZE);
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    int messageLength;
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < iterations; iteration++)
+    {
+        if(fastPath)
+        {
+            messageLength = server.FastPathResponse(req, buffer.get());
+        }
+        else
+        {
+            pNrp_Header_Message msg;
+
+            if(clearSessions)
+            {
+                server.m_sessionKeys->Clear();
+            }
+
+            server.ParseMessages(req, messageLength, msgs);
+            messageLength += NRP_PACKET_HEADER_SIZE;
+            msg = GeneratePacketHeader(messageLength, response, msgs.size(), (pNrp_Header_Packet) buffer.get());
+
+            for(auto& buf : msgs)
+            {
+                memcpy(msg, buf.get(), ntohs(((pNrp_Header_Message) buf.get())->length));
+                msg = NextMessage(msg);
+            }
+
+            msgs.clear();
+        }
+
+        s_sink ^= buffer[messageLength - 1];
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / iterations;
+}
+
+// A client's cost to open one secure entropy response, in nanoseconds,
+// with its session key agreed each time, or once per epoch
+static double BenchmarkOpenSecure(KeyPair const& clientKey, const unsigned char* serverKey, pNrp_Message_SecureEntropy_Request request, pNrp_Message_SecureEntropy_Response response, bool cached)
+{
+    unsigned char sessionKey[SECURE_SESSION_KEY_SIZE];
+    unsigned char entropy[sizeof(response->entropy)];
+
+    DeriveSessionKey(clientKey, serverKey, request, sessionKey);
+
+    auto start = chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < BENCH_SECURE_ITERATIONS; iteration++)
+    {
+        if((cached || DeriveSessionKey(clientKey, serverKey, request, sessionKey)) && OpenEntropy(sessionKey, request, response, entropy))
+        {
+            s_sink ^= entropy[0];
+        }
+    }
+
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+    return elapsed.count() / BENCH_SECURE_ITERATIONS;
+}
+
+// Compare plain and secure responses of the same amount of entropy. The
+// secure response to a new client costs the server one X25519 agreement,
+// a key derivation and a seal; a repeat client's costs only the seal. The
+// signatures on its keys are made once per epoch.
+static void BenchmarkSecureEntropy(shared_ptr<NrpdConfig> config, NrpdServer& server)
+{
+    shared_ptr<NrpdTuning> tuning = make_shared<NrpdTuning>(*config->Tuning());
+    unsigned char plain[64];
+    unsigned char secure[64];
+    Nrp_Message_SecureEntropy_Request secureRequest;
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    pNrp_Header_Message msg;
+    shared_ptr<const KeyEpoch> epoch;
+    KeyPair clientKey;
+    int messageLength;
+
+    tuning->enableSecureEntropy = true;
+    atomic_store(&config->m_tuning, shared_ptr<const NrpdTuning>(tuning));
+
+    if(!clientKey.Generate(EVP_PKEY_X25519) || (epoch = server.CurrentKeyEpoch()) == nullptr)
+    {
+        cout << endl << "Failed to create keys; skipping secure entropy benchmark" << endl;
+        return;
+    }
+
+    memcpy(secureRequest.clientKey, clientKey.PublicKey(), sizeof(secureRequest.clientKey));
+    secureRequest.keyId = epoch->keyId;
+
+    GenerateRequestEntropyMessage(BENCH_SECURE_ENTROPY_SIZE, ((pNrp_Header_Packet) plain)->messages);
+    GeneratePacketHeader(NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE, request, 1, (pNrp_Header_Packet) plain);
+
+    GenerateRequestSecureEntropyMessage(&secureRequest, ((pNrp_Header_Packet) secure)->messages);
+    GeneratePacketHeader(NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE + sizeof(secureRequest), request, 1, (pNrp_Header_Packet) secure);
+
+    PacketView plainReq(plain, sizeof(plain), true);
+    PacketView secureReq(secure, sizeof(secure), true);
+
+    if(!server.ParseMessages(secureReq, messageLength, msgs) || msgs.empty()
+       || (msg = (pNrp_Header_Message) msgs.front().get())->msgType != secureentropy)
+    {
+        cout << endl << "Server didn't send secure entropy; skipping secure entropy benchmark" << endl;
+        return;
+    }
+
+    const char* names[] = {"plain", "secure new", "secure rep", "open new", "open rep"};
+    double costs[] =
+    {
+        BenchmarkResponse(server, plainReq, false, BENCH_SECURE_ITERATIONS),
+        BenchmarkResponse(server, secureReq, false, BENCH_SECURE_ITERATIONS, true),
+        BenchmarkResponse(server, secureReq, false, BENCH_SECURE_ITERATIONS),
+        BenchmarkOpenSecure(clientKey, epoch->encryptionKey.PublicKey(), &secureRequest, (pNrp_Message_SecureEntropy_Response) msg->content, false),
+        BenchmarkOpenSecure(clientKey, epoch->encryptionKey.PublicKey(), &secureRequest, (pNrp_Message_SecureEntropy_Response) msg->content, true),
+    };
+
+    cout << endl << "Responses of " << BENCH_SECURE_ENTROPY_SIZE << " bytes of entropy, per second of one core" << endl;
+    cout << setw(12) << "response"
+         << setw(12) << "ns each"
+         << setw(12) << "per second" << endl;
+
+    for(int row = 0; row < 5; row++)
+    {
+        cout << setw(12) << names[row]
+             << setw(12) << costs[row]
+             << setw(12) << (long) (1e9 / costs[row]) << endl;
+    }
+}
+
+// Write a chain of BENCH_CERT_COUNT copies of one self-signed certificate
+// to the PEM file at path
+static bool WriteBenchCertChain(const char* path)
+{
+    X509* cert = X509_new();
+    EVP_PKEY* key = EVP_PKEY_Q_keygen(nullptr, nullptr, "ED25519");
+    FILE* file = fopen(path, "w");
+    bool result = cert != nullptr && key != nullptr && file != nullptr
+                  && ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) == 1
+                  && X509_gmtime_adj(X509_getm_notBefore(cert), 0) != nullptr
+                  && X509_gmtime_adj(X509_getm_notAfter(cert), 60*60) != nullptr
+                  && X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char*) "nrpd benchmark", -1, -1, 0) == 1
+                  && X509_set_issuer_name(cert, X509_get_subject_name(cert)) == 1
+                  && X509_set_pubkey(cert, key) == 1
+                  && X509_sign(cert, key, nullptr) > 0;
+
+    for(int index = 0; result && index < BENCH_CERT_COUNT; index++)
+    {
+        result = (PEM_write_X509(file, cert) == 1);
+    }
+
+    if(file != nullptr)
+    {
+        fclose(file);
+    }
+
+    EVP_PKEY_free(key);
+    X509_free(cert);
+    return result;
+}
+
+// Compare a cert chain chunk with an entropy response, both to a request
+// with a transaction ID, as a client sends when it starts. The fast path
+// sends the chunk straight from the chain's blob, and copies nothing of it.
+static void BenchmarkCertChain(shared_ptr<NrpdConfig> config, NrpdServer& server, PacketView const& entropyReq)
+{
+    shared_ptr<NrpdTuning> tuning = make_shared<NrpdTuning>(*config->Tuning());
+    const unsigned char id[sizeof(Nrp_Message_TransactionId)] = {0};
+    const unsigned short chunk = 1;
+    char path[] = "/tmp/nrpdbenchXXXXXX";
+    unsigned char cert[64];
+    int size = NRP_PACKET_HEADER_SIZE + (2 * NRP_MESSAGE_HEADER_SIZE) + sizeof(Nrp_Message_TransactionId) + sizeof(Nrp_Message_CertChain_Request);
+    int fd;
+
+    if((fd = mkstemp(path)) < 0)
+    {
+        cout << endl << "Failed to create a chain file; skipping cert chain benchmark" << endl;
+        return;
+    }
+
+    close(fd);
+
+    // Built where the config is loaded
+    if(!WriteBenchCertChain(path) || (tuning->certChain = CertChainBlob::Load(path)) == nullptr)
+    {
+        unlink(path);
+        cout << endl << "Failed to load a chain; skipping cert chain benchmark" << endl;
+        return;
+    }
+
+    unlink(path);
+
+    tuning->certChainPath = path;
+    atomic_store(&config->m_tuning, shared_ptr<const NrpdTuning>(tuning));
+
+    GenerateRequestCertChainMessage(&chunk, 1, GenerateTransactionIdMessage(id, ((pNrp_Header_Packet) cert)->messages));
+    GeneratePacketHeader(size, request, 2, (pNrp_Header_Packet) cert);
+
+    PacketView certReq(cert, size, true);
+
+    const char* names[] = {"entropy", "cert chunk"};
+    PacketView const* reqs[] = {&entropyReq, &certReq};
+
+    cout << endl << "Cert chain chunk of " << tuning->certChain->ChainSize() << " byte chain, against entropy, in nanoseconds" << endl;
+    cout << setw(12) << "response"
+         << setw(10) << "parse"
+         << setw(10) << "fast" << endl;
+
+    for(int row = 0; row < 2; row++)
+    {
+        cout << setw(12) << names[row]
+             << setw(10) << BenchmarkResponse(server, *reqs[row], false)
+             << setw(10) << BenchmarkResponse(server, *reqs[row], true) << endl;
+    }
+}
+
+// Servers' keys verified per second by a KeyVerifier with workers threads,
+// or inline if none. Each job is two signatures, a key generation and an
+// agreement, as a client pays once per server per epoch.
+static double BenchmarkKeyVerifier(KeyJob const& job, int workers)
+{
+    KeyVerifier verifier(workers);
+    vector<VerifiedKeys> results;
+
+    auto start = chrono::steady_clock::now();
+
+    for(int index = 0; index < BENCH_VERIFY_JOBS; index++)
+    {
+        verifier.Submit(job);
+    }
+
+    verifier.Drain();
+    verifier.Collect(results);
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    s_sink ^= results.back().session.key[0];
+
+    return results.size() / elapsed.count();
+}
+
+static void BenchmarkKeyVerification()
+{
+    const int workerCounts[] = {0, 1, 2, 4};
+    unique_ptr<KeyEpoch> epoch;
+    KeyPair identity;
+    KeyJob job = KeyJob();
+
+    if(!identity.Generate(EVP_PKEY_ED25519)
+       || (epoch = CreateKeyEpoch(identity, 0, time(nullptr) + SECURE_KEY_LIFETIME_SECONDS)) == nullptr)
+    {
+        cout << endl << "Failed to create keys; skipping key verification benchmark" << endl;
+        return;
+    }
+
+    memcpy(job.identity, identity.PublicKey(), sizeof(job.identity));
+    memcpy(job.signKeyRecord, ((pNrp_Header_Message) epoch->signKeyMessage)->content, sizeof(job.signKeyRecord));
+    memcpy(job.encryptionKeyRecord, ((pNrp_Header_Message) epoch->encryptionKeyMessage)->content, sizeof(job.encryptionKeyRecord));
+    job.hasSignKeyRecord = true;
+    job.hasEncryptionKeyRecord = true;
+
+    cout << endl << "Servers' keys verified per second, across " << thread::hardware_concurrency() << " cores" << endl;
+    cout << setw(10) << "workers"
+         << setw(12) << "per second" << endl;
+
+    for(int workers : workerCounts)
+    {
+        cout << setw(10) << workers
+             << setw(12) << (long) BenchmarkKeyVerifier(job, workers) << endl;
+    }
+}
+
+struct TransferCost
+{
+    int requests;
+    int syscalls;
+    double milliseconds;
+};
+
+// A client and server socket pair on loopback; each end sends to the other
+struct LoopbackPair
+{
+    int client;
+    int server;
+    sockaddr_in clientAddr;
+    sockaddr_in serverAddr;
+
+    bool Open()
+    {
+        socklen_t size = sizeof(sockaddr_in);
+
+        client = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        memset(&clientAddr, 0, sizeof(clientAddr));
+        clientAddr.sin_family = AF_INET;
+        clientAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        serverAddr = clientAddr;
+
+        return client >= 0 && server >= 0
+               && bind(client, (sockaddr*) &clientAddr, size) == 0
+               && bind(server, (sockaddr*) &serverAddr, size) == 0
+               && getsockname(client, (sockaddr*) &clientAddr, &size) == 0
+               && getsockname(server, (sockaddr*) &serverAddr, &size) == 0;
+    }
+
+    void Close()
+    {
+        close(client);
+        close(server);
+    }
+};
+
+// The request and single response every request costs: the client sends,
+// the server receives, reads entropy and responds, and the client receives.
+static int ExchangeResponse(LoopbackPair& pair, int randomfd, unsigned char* buffer, int entropySize)
+{
+    int responseSize = NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE + entropySize;
+
+    sendto(pair.client, buffer, NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE, 0, (sockaddr*) &pair.serverAddr, sizeof(sockaddr_in));
+    recv(pair.server, buffer, MAX_REQUEST_MESSAGE_SIZE, 0);
+    read(randomfd, buffer, entropySize);
+    sendto(pair.server, buffer, responseSize, 0, (sockaddr*) &pair.clientAddr, sizeof(sockaddr_in));
+    recv(pair.client, buffer, MAX_RESPONSE_MESSAGE_SIZE, 0);
+
+    return 5;
+}
+
+static TransferCost BenchmarkSingleMessage(int randomfd)
+{
+    vector<unsigned char> buffer(MAX_RESPONSE_MESSAGE_SIZE);
+    TransferCost cost = {0, 0, 0};
+    LoopbackPair pair;
+
+    if(!pair.Open())
+    {
+        return cost;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for(int received = 0; received < BENCH_ENTROPY_TOTAL; received += MAX_BYTE)
+    {
+        cost.syscalls += ExchangeResponse(pair, randomfd, buffer.data(), MAX_BYTE);
+        cost.requests++;
+    }
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cost.milliseconds = elapsed.count();
+
+    pair.Close();
+
+    return cost;
+}
+
+static TransferCost BenchmarkBulkEntropy(int randomfd)
+{
+    vector<unsigned char> train(BULK_MAX_SEGMENTS * BENCH_SEGMENT_SIZE);
+    vector<unsigned char> buffer(MAX_RESPONSE_MESSAGE_SIZE);
+    TransferCost cost = {0, 0, 0};
+    int segments = 32; // as requested by clients
+    int messagesPerSegment = (BENCH_SEGMENT_SIZE - NRP_PACKET_HEADER_SIZE + BULK_MAX_MESSAGE_SIZE - 1) / BULK_MAX_MESSAGE_SIZE;
+    bool useGso = true;
+    LoopbackPair pair;
+
+    if(!pair.Open() || !EnableGro(pair.client))
+    {
+        return cost;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for(int received = 0; received < BENCH_ENTROPY_TOTAL;)
+    {
+        int size;
+        int bytes = 0;
+
+        cost.syscalls += ExchangeResponse(pair, randomfd, buffer.data(), MAX_BYTE);
+        cost.requests++;
+        received += MAX_BYTE;
+
+        size = BuildEntropyTrain(randomfd, BENCH_SEGMENT_SIZE, segments, train.data());
+        cost.syscalls++;
+
+        SendSegments(pair.server, train.data(), size, BENCH_SEGMENT_SIZE, (sockaddr*) &pair.clientAddr, sizeof(sockaddr_in), useGso, cost.syscalls);
+
+        while(bytes < size)
+        {
+            int segmentSize;
+            int count = ReceiveSegments(pair.client, buffer.data(), buffer.size(), 0, segmentSize);
+
+            cost.syscalls++;
+
+            if(count <= 0)
+            {
+                return cost;
+            }
+
+            bytes += count;
+        }
+
+        // Count only the entropy, not the headers between it
+        received += size - (segments * (NRP_PACKET_HEADER_SIZE + (NRP_MESSAGE_HEADER_SIZE * messagesPerSegment)));
+    }
+
+    chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+    cost.milliseconds = elapsed.count();
+
+    pair.Close();
+
+    return cost;
+}
+
+int main(int argc, char* argv[])
+{
+    const size_t sizes[] = {8, 64, 255, BENCH_MAX_ENTROPY_SIZE};
+    int fd;
+
+    if((fd = open("/dev/urandom", O_RDONLY)) < 0)
+    {
+        cout << "Failed to open /dev/urandom. Error: " << errno << endl;
+        return 1;
+    }
+
+    cout << "ScrambleEntropy cost per response, in nanoseconds" << endl;
+    cout << setw(6) << "size"
+         << setw(10) << "scalar"
+         << setw(10) << "sse2"
+         << setw(10) << "avx2"
+         << setw(10) << "read()"
+         << setw(10) << "buffered" << endl;
+
+    cout << fixed << setprecision(1);
+
+    for(size_t size : sizes)
+    {
+        cout << setw(6) << size;
+        cout << setw(10) << BenchmarkMask(MaskEntropyScalar, size);
+
+        if(CpuSupportsSse2())
+        {
+            cout << setw(10) << BenchmarkMask(MaskEntropySse2, size);
+        }
+        else
+        {
+            cout << setw(10) << "-";
+        }
+
+        if(CpuSupportsAvx2())
+        {
+            cout << setw(10) << BenchmarkMask(MaskEntropyAvx2, size);
+        }
+        else
+        {
+            cout << setw(10) << "-";
+        }
+
+        cout << setw(10) << BenchmarkDirectRead(fd, size);
+        cout << setw(10) << BenchmarkBufferedRead(fd, size) << endl;
+    }
+
+    cout << endl << "Health test cost per response, in nanoseconds" << endl;
+    cout << setw(6) << "size"
+         << setw(10) << "scalar"
+         << setw(10) << "sse2"
+         << setw(10) << "avx2"
+         << setw(10) << "tests" << endl;
+
+    for(size_t size : sizes)
+    {
+        cout << setw(6) << size;
+        cout << setw(10) << BenchmarkHealthCounting(FindRepeatScalar, CountByteScalar, size);
+
+        if(CpuSupportsSse2())
+        {
+            cout << setw(10) << BenchmarkHealthCounting(FindRepeatSse2, CountByteSse2, size);
+        }
+        else
+        {
+            cout << setw(10) << "-";
+        }
+
+        if(CpuSupportsAvx2())
+        {
+            cout << setw(10) << BenchmarkHealthCounting(FindRepeatAvx2, CountByteAvx2, size);
+        }
+        else
+        {
+            cout << setw(10) << "-";
+        }
+
+        cout << setw(10) << BenchmarkHealthTest(size) << endl;
+    }
+
+    TransferCost single = BenchmarkSingleMessage(fd);
+    TransferCost bulk = BenchmarkBulkEntropy(fd);
+
+    cout << endl << "Cost of " << BENCH_ENTROPY_TOTAL / 1024 << " KiB of entropy over loopback" << endl;
+    cout << setw(10) << "protocol"
+         << setw(10) << "requests"
+         << setw(10) << "syscalls"
+         << setw(10) << "ms" << endl;
+    cout << setw(10) << "single"
+         << setw(10) << single.requests
+         << setw(10) << single.syscalls
+         << setw(10) << single.milliseconds << endl;
+    cout << setw(10) << "bulk"
+         << setw(10) << bulk.requests
+         << setw(10) << bulk.syscalls
+         << setw(10) << bulk.milliseconds << endl;
+
+    close(fd);
+
+    vector<ServerRecord> peers4 = MakePeers(false);
+    vector<ServerRecord> peers6 = MakePeers(true);
+    shared_ptr<NrpdConfig> config = make_shared<NrpdConfig>();
+    NrpdServer server(config);
+    unsigned char requests[3][64];
+    const char* shapes[] = {"entropy", "+id", "+id+ip4"};
+    int requestSizes[3];
+
+    for(auto& rec : peers4)
+    {
+        rec.probationary = false;
+        config->m_peers.Add(rec);
+    }
+
+    requestSizes[0] = BuildShapeRequest(false, nrpd_msg_type_min, requests[0]);
+    requestSizes[1] = BuildShapeRequest(true, nrpd_msg_type_min, requests[1]);
+    requestSizes[2] = BuildShapeRequest(true, ip4peers, requests[2]);
+
+    if(server.InitializeServer() == EXIT_SUCCESS)
+    {
+        // As ServerLoop sizes responses for an IPv4 client on Ethernet
+        server.m_mtu = BENCH_SEGMENT_SIZE;
+
+        cout << endl << "Response building cost per request, in nanoseconds" << endl;
+        cout << setw(10) << "shape"
+             << setw(10) << "parse"
+             << setw(10) << "fast"
+             << setw(10) << "speedup" << endl;
+
+        for(int shape = 0; shape < 3; shape++)
+        {
+            PacketView req(requests[shape], requestSizes[shape], true);
+            double parse = BenchmarkResponse(server, req, false);
+            double fast = BenchmarkResponse(server, req, true);
+
+            cout << setw(10) << shapes[shape]
+                 << setw(10) << parse
+                 << setw(10) << fast
+                 << setw(9) << parse / fast << "x" << endl;
+        }
+
+        BenchmarkSecureEntropy(config, server);
+        BenchmarkCertChain(config, server, PacketView(requests[1], requestSizes[1], true));
+        BenchmarkKeyVerification();
+    }
+    else
+    {
+        cout << endl << "Failed to initialize server; skipping response benchmark" << endl;
+    }
+
+    cout << endl << "Peers list of " << BENCH_PEER_COUNT << " cost, in nanoseconds" << endl;
+    cout << setw(8) << "family"
+         << setw(12) << "enc branch"
+         << setw(12) << "enc family"
+         << setw(12) << "dec branch"
+         << setw(12) << "dec family" << endl;
+
+    cout << setw(8) << "ip4"
+         << setw(12) << BenchmarkEncodeBranching(peers4, ip4peers)
+         << setw(12) << BenchmarkEncodeFamily<ip4peers>(peers4)
+         << setw(12) << BenchmarkDecodeBranching(peers4, ip4peers)
+         << setw(12) << BenchmarkDecodeFamily<ip4peers>(peers4) << endl;
+
+    cout << setw(8) << "ip6"
+         << setw(12) << BenchmarkEncodeBranching(peers6, ip6peers)
+         << setw(12) << BenchmarkEncodeFamily<ip6peers>(peers6)
+         << setw(12) << BenchmarkDecodeBranching(peers6, ip6peers)
+         << setw(12) << BenchmarkDecodeFamily<ip6peers>(peers6) << endl;
+
+    return 0;
+}
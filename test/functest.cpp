@@ -1,12 +1,21 @@
 #include <iostream>
+#include <fstream>
 #include <memory>
 #include <list>
+#include <array>
 #include <string.h>
 #include <arpa/inet.h>
 #include <random>
 #include <time.h>
 #include <math.h>
 #include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
 
 #include "../protocol.h"
 
@@ -17,6 +26,21 @@
 #include "../server.h"
 #include "../config.h"
 #include "../mrucache.h"
+#include "../indexedheap.h"
+#include "../peerstore.h"
+#include "../peerdatabase.h"
+#include "../pathmtu.h"
+#include "../bulkentropy.h"
+#include "../packetview.h"
+#include "../messageregistry.h"
+#include "../accumulator.h"
+#include "../demand.h"
+#include "../randombuffer.h"
+#include "../securekeys.h"
+#include "../certchain.h"
+#include "../keyverifier.h"
+#include "../scramble.h"
+#include "../health.h"
 #include "../stdhelpers.h"
 
 #undef private
@@ -86,6 +110,13 @@ struct TestCaseGetNextServer
     list<shared_ptr<ServerRecord>> expectedOrder;
 };
 
+// Adds rec to the config's active server list
+void AddActiveServer(shared_ptr<NrpdConfig>& config, ServerRecord rec)
+{
+    rec.probationary = false;
+    config->m_peers.Add(rec);
+}
+
 void GenerateConfigFakeActiveServers(shared_ptr<NrpdConfig>& config, int ip4Count, int ip6Count)
 {
     std::mt19937 mt(time(nullptr));
@@ -98,12 +129,12 @@ void GenerateConfigFakeActiveServers(shared_ptr<NrpdConfig>& config, int ip4Coun
     {
         if(i < ip4Count)
         {
-            config->m_activeServers.emplace(ServerRecord({dis(mt), dis(mt), dis(mt), dis(mt)}, dis2(mt)));
+            AddActiveServer(config, ServerRecord({dis(mt), dis(mt), dis(mt), dis(mt)}, dis2(mt)));
         }
 
         if(i < ip6Count)
         {
-            config->m_activeServers.emplace(ServerRecord({dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt)}, dis2(mt)));
+            AddActiveServer(config, ServerRecord({dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt), dis(mt)}, dis2(mt)));
         }
     }
 }
@@ -741,6 +772,29 @@ bool TestServerGeneratePeersResponse()
         }
     }
 
+    /// More servers than a message can count, and room for all of them
+    tempConfig = make_shared<NrpdConfig>();
+    GenerateConfigFakeActiveServers(tempConfig, 300, 0);
+    tempServer = make_shared<NrpdServer>(tempConfig);
+    msgCount = 0;
+
+    if(tempConfig->ActiveServerCount(ip4peers) <= MAX_BYTE
+       || tempServer->CalculatePeersResponseSize(ip4peers, msgCount, MAX_RESPONSE_MESSAGE_SIZE) != (int) (sizeof(Nrp_Header_Message) + (MAX_BYTE * sizeof(Nrp_Message_Ip4Peer)))
+       || msgCount != MAX_BYTE)
+    {
+        cout << "CalculatePeersResponseSize counted " << msgCount << " peers. Expected: " << MAX_BYTE << endl;
+        return false;
+    }
+
+    result = tempServer->GeneratePeersResponse(ip4peers, 0, MAX_RESPONSE_MESSAGE_SIZE, temp);
+
+    if(result == nullptr || ((pNrp_Header_Message) result.get())->countOrSize != MAX_BYTE
+       || !ValidateMessageHeader((pNrp_Header_Message) result.get(), false))
+    {
+        cout << "GeneratePeersResponse miscounted more than " << MAX_BYTE << " peers." << endl;
+        return false;
+    }
+
     cout << "NrpdServer::GeneratePeersResponse passed all tests!" << endl << endl;
     return true;
 }
@@ -815,229 +869,2121 @@ bool TestServerGenerateEntropyResponse()
     return true;
 }
 
-bool TestConfigGetServerList()
+// Build a request for default entropy, preceded by a receive size message
+// unless maxDatagramSize is 0.
+static int BuildReceiveSizeRequest(unsigned short maxDatagramSize, unsigned short preferredEntropy, unsigned char* buffer)
 {
-    unique_ptr<unsigned char[]> result;
+    pNrp_Header_Message msg = ((pNrp_Header_Packet) buffer)->messages;
+    int size = sizeof(Nrp_Header_Packet) + sizeof(Nrp_Header_Message);
+    int count = 1;
+
+    if(maxDatagramSize != 0)
+    {
+        msg = GenerateRequestReceiveSizeMessage(maxDatagramSize, preferredEntropy, msg);
+        size += sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_ReceiveSize_Request);
+        count++;
+    }
+
+    GenerateRequestEntropyMessage(0, msg);
+    GeneratePacketHeader(size, request, count, (pNrp_Header_Packet) buffer);
+
+    return size;
+}
+
+bool TestServerParseMessagesReceiveSize()
+{
+    unsigned char buffer[256];
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    shared_ptr<NrpdServer> tempServer;
     shared_ptr<NrpdConfig> tempConfig;
-    std::list<TestCaseGetServerList> cases;
-    pNrp_Message_Ip4Peer ip4Msg;
-    pNrp_Message_Ip6Peer ip6Msg;
-    ServerRecord tempRec;
-    int count;
+    int messageLength;
+    int entropyTotal;
+    int err;
 
-    /// Negative test cases
     tempConfig = make_shared<NrpdConfig>();
-    cases.push_back({tempConfig, ip4peers, 1, 0, true, 0}); // no active ip4 servers
-    cases.push_back({tempConfig, ip6peers, 1, 0, true, 0}); // no active ip6 servers
-    cases.push_back({tempConfig, entropy, 1, 0, true, 0}); // bad type
-    cases.push_back({tempConfig, ip4peers, -1, 0, true, 0}); // bad count value
+    tempServer = make_shared<NrpdServer>(tempConfig);
 
-    /// ip4 test cases
-    tempConfig = make_shared<NrpdConfig>();
-    tempRec = ServerRecord({1,2,3,4}, 1234);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({5,6,7,8}, 5678);
-    tempConfig->m_activeServers.emplace(tempRec);
+    if((err = tempServer->InitializeServer()) != EXIT_SUCCESS)
+    {
+        cout << "Failed to initialize server. Error: " << err << endl;
+        return false;
+    }
 
-    cases.push_back({tempConfig, ip4peers, 1, 0 ,false, sizeof(Nrp_Message_Ip4Peer)});
-    cases.push_back({tempConfig, ip4peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip4Peer)});
-    cases.push_back({tempConfig, ip6peers, 1, 0, true, 0}); // no ip6 servers
+    // A path that carries jumbo frames
+    tempServer->m_mtu = 9000 - IP4_UDP_HEADER_SIZE;
 
-    /// ip6 test cases
-    tempConfig = make_shared<NrpdConfig>();
-    tempRec = ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({0xf,0xe,0xd,0xc,0xb,0xa,9,8,7,6,5,4,3,2,1,0}, 1234);
-    tempConfig->m_activeServers.emplace(tempRec);
+    // 1. Without a receive size, only the requested entropy is sent
+    BuildReceiveSizeRequest(0, 0, buffer);
 
-    cases.push_back({tempConfig, ip6peers, 1, 0, false, sizeof(Nrp_Message_Ip6Peer)});
-    cases.push_back({tempConfig, ip6peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip6Peer)});
-    cases.push_back({tempConfig, ip4peers, 1, 0, true, 0}); // no ip4 servers
+    if(!tempServer->ParseMessages(PacketView(buffer, sizeof(buffer), true), messageLength, msgs)
+       || msgs.size() != 1
+       || messageLength != NRP_MESSAGE_HEADER_SIZE + tempConfig->defaultEntropySize())
+    {
+        cout << "ParseMessages without receive size returned " << msgs.size() << " messages, " << messageLength << " bytes" << endl;
+        return false;
+    }
 
-    /// Mixed test cases
-    tempConfig = make_shared<NrpdConfig>();
-    tempRec = ServerRecord({1,2,3,4}, 1234);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({5,6,7,8}, 5678);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({0xf,0xe,0xd,0xc,0xb,0xa,9,8,7,6,5,4,3,2,1,0}, 1234);
-    tempConfig->m_activeServers.emplace(tempRec);
+    msgs.clear();
 
-    cases.push_back({tempConfig, ip4peers, 1, 0 ,false, sizeof(Nrp_Message_Ip4Peer)});
-    cases.push_back({tempConfig, ip4peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip4Peer)});
-    cases.push_back({tempConfig, ip6peers, 1, 0, false, sizeof(Nrp_Message_Ip6Peer)});
-    cases.push_back({tempConfig, ip6peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip6Peer)});
+    // 2. The preferred entropy is split across as many messages as it takes
+    BuildReceiveSizeRequest(MAX_RESPONSE_MESSAGE_SIZE, 2000, buffer);
+
+    if(!ValidateRequestPacket((pNrp_Header_Request) buffer))
+    {
+        cout << "Request with receive size failed validation" << endl;
+        return false;
+    }
 
+    if(!tempServer->ParseMessages(PacketView(buffer, sizeof(buffer), true), messageLength, msgs))
+    {
+        cout << "ParseMessages failed with receive size" << endl;
+        return false;
+    }
 
+    entropyTotal = 0;
 
-    for(auto& test : cases)
+    for(auto& msg : msgs)
     {
-        count = 0;
-        result = test.config->GetServerList(test.type, test.count, test.outSize);
+        pNrp_Header_Message hdr = (pNrp_Header_Message) msg.get();
 
-        if(test.expectedNullptr)
+        if(hdr->msgType != entropy || !ValidateMessageHeader(hdr, false))
         {
-            if(result.get() != nullptr)
-            {
-                cout << "GetServerList returned memory. Expected nullptr" << endl;
-                return false;
-            }
+            cout << "ParseMessages returned an invalid entropy message" << endl;
+            return false;
         }
-        else
-        {
-            if(result.get() == nullptr)
-            {
-                cout << "GetServerList returned nullptr. Expected memory" << endl;
-                return false;
-            }
 
-            if(test.outSize != test.expectedSize)
-            {
-                cout << "GetServerList output size: " << test.outSize << ". Expected: " << test.expectedSize << endl;
-                return false;
-            }
+        entropyTotal += hdr->countOrSize;
+    }
 
-            /// Validate the data copied correctly
-            if(test.type == ip4peers)
-            {
-                ip4Msg = (pNrp_Message_Ip4Peer) result.get();
+    if(entropyTotal != 2000 || msgs.size() != 8)
+    {
+        cout << "ParseMessages returned " << entropyTotal << " bytes of entropy in " << msgs.size() << " messages. Expected 2000 in 8" << endl;
+        return false;
+    }
 
-                for(auto& rec : test.config->m_activeServers)
-                {
-                    if((test.type == ip6peers) == rec.ipv6)
-                    {
-                        if(ip4Msg->port != rec.port)
-                        {
-                            cout << "Copied port is: " << ip4Msg->port << ". Expected: " << rec.port << endl;
-                            return false;
-                        }
-
-                        if(memcmp(ip4Msg->ip, rec.host4, sizeof(ip4Msg->ip)))
-                        {
-                            cout << "Copied IPv4 address doesn't match! Fail." << endl;
-                            return false;
-                        }
-
-                        // increment pointer and counter
-                        ip4Msg++;
-                        count++;
-                    }
+    msgs.clear();
 
-                    // Exit the loop when all messages have been compared
-                    if(count >= test.count)
-                    {
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                ip6Msg = (pNrp_Message_Ip6Peer) result.get();
+    // 3. The client's maximum datagram size bounds the response
+    BuildReceiveSizeRequest(600, MAX_PREFERRED_ENTROPY_SIZE, buffer);
 
-                for(auto& rec : test.config->m_activeServers)
-                {
-                    if((test.type == ip6peers) == rec.ipv6)
-                    {
-                        if(ip6Msg->port != rec.port)
-                        {
-                            cout << "Copied port is: " << ip6Msg->port << ". Expected: " << rec.port << endl;
-                            return false;
-                        }
-
-                        if(memcmp(ip6Msg->ip, rec.host6, sizeof(ip6Msg->ip)))
-                        {
-                            cout << "Copied IPv6 address doesn't match! Fail." << endl;
-                            return false;
-                        }
-
-                        // increment pointer and counter
-                        ip6Msg++;
-                        count++;
-                    }
+    if(!tempServer->ParseMessages(PacketView(buffer, sizeof(buffer), true), messageLength, msgs)
+       || messageLength != 600 - NRP_PACKET_HEADER_SIZE)
+    {
+        cout << "ParseMessages returned " << messageLength << " bytes for a 600 byte datagram" << endl;
+        return false;
+    }
 
-                    // Exit the loop when all messages have been compared
-                    if(count >= test.count)
-                    {
-                        break;
-                    }
-                }
-            }
-        }
+    msgs.clear();
+
+    // 4. Malformed receive size messages are rejected
+    BuildReceiveSizeRequest(1000, 1000, buffer);
+    ((pNrp_Header_Packet) buffer)->messages[0].countOrSize = 2;
+
+    if(ValidateRequestPacket((pNrp_Header_Request) buffer))
+    {
+        cout << "Failed to reject receive size message with a count of 2" << endl;
+        return false;
     }
 
-    cout << "NrpdConfig::GetServerList passed all tests!" << endl << endl;
+    cout << "NrpdServer::ParseMessages with receive size passed all tests!" << endl << endl;
     return true;
 }
 
-bool TestConfigActiveServerCount()
+bool TestServerParseMessagesTransactionId()
 {
+    const unsigned char id[sizeof(Nrp_Message_TransactionId)] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    unsigned char buffer[256];
+    unsigned char rejection[256];
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    shared_ptr<NrpdServer> tempServer;
     shared_ptr<NrpdConfig> tempConfig;
-    std::list<TestCaseActiveServerCount> cases;
-    ServerRecord tempRec;
-    int count;
+    pNrp_Header_Message msg;
+    pNrp_Header_Message echo;
+    int messageLength;
+    int size;
+    int err;
 
-    /// Test with empty active server list
     tempConfig = make_shared<NrpdConfig>();
-    cases.push_back({tempConfig, ip4peers, 0});
-    cases.push_back({tempConfig, ip6peers, 0});
-    cases.push_back({tempConfig, entropy, 0});
+    tempServer = make_shared<NrpdServer>(tempConfig);
 
-    /// Test with some fake servers
-    tempConfig = make_shared<NrpdConfig>();
-    tempRec = ServerRecord({1,2,3,4}, 1234);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321);
-    tempConfig->m_activeServers.emplace(tempRec);
-    tempRec = ServerRecord({5,6,7,8}, 1234);
-    tempConfig->m_activeServers.emplace(tempRec);
+    if((err = tempServer->InitializeServer()) != EXIT_SUCCESS)
+    {
+        cout << "Failed to initialize server. Error: " << err << endl;
+        return false;
+    }
 
-    cases.push_back({tempConfig, ip4peers, 2});
-    cases.push_back({tempConfig, ip6peers, 1});
+    // 1. A request carrying a transaction ID and an entropy request
+    msg = ((pNrp_Header_Packet) buffer)->messages;
+    msg = GenerateTransactionIdMessage(id, msg);
+    GenerateRequestEntropyMessage(0, msg);
+    size = sizeof(Nrp_Header_Packet) + (2 * sizeof(Nrp_Header_Message)) + sizeof(Nrp_Message_TransactionId);
+    GeneratePacketHeader(size, request, 2, (pNrp_Header_Packet) buffer);
 
+    if(!ValidateRequestPacket((pNrp_Header_Request) buffer))
+    {
+        cout << "Request with transaction ID failed validation" << endl;
+        return false;
+    }
 
-    for(auto& test : cases)
+    if(PacketView(buffer, size, true).TransactionId() == nullptr
+       || memcmp(PacketView(buffer, size, true).TransactionId()->id, id, sizeof(id)) != 0)
     {
-        count = test.config->ActiveServerCount(test.type);
-        if(count != test.expectedCount)
-        {
-            cout << "ActiveServerCount returned: " << count << ". Expected: " << test.expectedCount << endl;
-            return false;
-        }
+        cout << "PacketView failed to find the request's ID" << endl;
+        return false;
     }
 
-    cout << "NrpdConfig::ActiveServerCount passed all tests!" << endl << endl;
+    // 2. The server echoes it, unchanged, as the first message
+    if(!tempServer->ParseMessages(PacketView(buffer, sizeof(buffer), true), messageLength, msgs) || msgs.size() != 2)
+    {
+        cout << "ParseMessages with transaction ID returned " << msgs.size() << " messages" << endl;
+        return false;
+    }
+
+    echo = (pNrp_Header_Message) msgs.front().get();
+
+    if(echo->msgType != transactionid
+       || !ValidateMessageHeader(echo, false)
+       || memcmp(((pNrp_Message_TransactionId) echo->content)->id, id, sizeof(id)) != 0)
+    {
+        cout << "ParseMessages didn't echo the transaction ID first" << endl;
+        return false;
+    }
+
+    if((size_t) messageLength != NRP_MESSAGE_HEADER_SIZE + sizeof(Nrp_Message_TransactionId) + NRP_MESSAGE_HEADER_SIZE + tempConfig->defaultEntropySize())
+    {
+        cout << "ParseMessages returned " << messageLength << " bytes with transaction ID" << endl;
+        return false;
+    }
+
+    msgs.clear();
+
+    // 3. A response rejecting transaction IDs is recognized as such
+    msg = ((pNrp_Header_Packet) rejection)->messages;
+    GenerateRejectMessage(unsupported, transactionid, GenerateRejectHeader(1, msg));
+    size = sizeof(Nrp_Header_Packet) + sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_Reject);
+    GeneratePacketHeader(size, nrpd_msg_type::response, 1, (pNrp_Header_Packet) rejection);
+
+    if(!PacketView(rejection, size, false).Rejects(transactionid)
+       || PacketView(rejection, size, false).Rejects(entropy)
+       || PacketView(rejection, size, false).TransactionId() != nullptr)
+    {
+        cout << "PacketView failed to find the transaction ID rejection" << endl;
+        return false;
+    }
+
+    // 4. Malformed transaction ID messages are rejected
+    ((pNrp_Header_Packet) buffer)->messages[0].countOrSize = 2;
+
+    if(ValidateRequestPacket((pNrp_Header_Request) buffer))
+    {
+        cout << "Failed to reject transaction ID message with a count of 2" << endl;
+        return false;
+    }
+
+    cout << "NrpdServer::ParseMessages with transaction ID passed all tests!" << endl << endl;
     return true;
 }
 
-bool TestConfigAddServersFromMessage()
+bool TestMessageRegistry()
 {
-    // construct a message with v4 servers to parse
-    // construct a message with v6 servers to parse
-    // construct a message with v4 and v6 servers to parse
-    return false;
-}
+    unsigned char buffer[sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_TransactionId)];
+    pNrp_Header_Message msg = (pNrp_Header_Message) buffer;
 
-bool TestConfigGetNextServer()
-{
-    // Probationary list is empty
-    // Active servers list is empty
-    // Probationary and active servers are both empty
-    // Verify alternation between active and probationary lists
-    // Verify end of list behavior
-    return false;
+    // Peers requests are only a count; responses are records of peers
+    if(DescribeMessage(ip4peers).request.recordSize != 0
+       || DescribeMessage(ip4peers).response.recordSize != sizeof(Nrp_Message_Ip4Peer)
+       || DescribeMessage(reject).request.allowed)
+    {
+        cout << "Message descriptors don't match the protocol" << endl;
+        return false;
+    }
+
+    // Cert chain requests are sized by their chunks, and their responses by
+    // validate, so a request never passes as a response
+    msg->length = htons(sizeof(Nrp_Header_Message) + (3 * sizeof(Nrp_Message_CertChain_Request)));
+    msg->msgType = certchain;
+    msg->countOrSize = 3;
+
+    if(!ValidateMessageHeader(msg, true) || ValidateMessageHeader(msg, false))
+    {
+        cout << "Failed to validate a cert chain request" << endl;
+        return false;
+    }
+
+    msg->countOrSize = 2;
+
+    if(ValidateMessageHeader(msg, true))
+    {
+        cout << "Failed to reject a cert chain request of the wrong size" << endl;
+        return false;
+    }
+
+    // Unknown types are accepted from newer clients, never from servers
+    msg->msgType = nrpd_msg_type_max;
+
+    if(!ValidateMessageHeader(msg, true) || ValidateMessageHeader(msg, false))
+    {
+        cout << "Failed to validate an unknown message type" << endl;
+        return false;
+    }
+
+    // Transaction IDs go both ways, one at a time
+    GenerateTransactionIdMessage(buffer, msg);
+
+    if(!ValidateMessageHeader(msg, true) || !ValidateMessageHeader(msg, false))
+    {
+        cout << "Failed to validate a transaction ID" << endl;
+        return false;
+    }
+
+    msg->countOrSize = 0;
+
+    if(ValidateMessageHeader(msg, true))
+    {
+        cout << "Failed to reject a transaction ID with a count of 0" << endl;
+        return false;
+    }
+
+    cout << "Message registry passed all tests!" << endl << endl;
+    return true;
 }
 
-bool TestConfigIncrementServerFailCount()
+// Build a request of shape [transactionid] entropy [peers], returning its size
+static int BuildFastPathRequest(const unsigned char* id, unsigned char entropySize, nrpd_msg_type peersType, unsigned char* buffer)
 {
-    // Verify multiple calls remove server from active list
-    // verify multiple calls remove server from probationary list
-    // Test with the servers pointed to by the iterator and not pointed to by the iterator
-    return false;
+    pNrp_Header_Message msg = ((pNrp_Header_Packet) buffer)->messages;
+    int size = sizeof(Nrp_Header_Packet) + sizeof(Nrp_Header_Message);
+    int count = 1;
+
+    if(id != nullptr)
+    {
+        msg = GenerateTransactionIdMessage(id, msg);
+        size += sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_TransactionId);
+        count++;
+    }
+
+    msg = GenerateRequestEntropyMessage(entropySize, msg);
+
+    if(peersType != nrpd_msg_type_min)
+    {
+        GenerateRequestPeersMessage(peersType, 4, msg);
+        size += sizeof(Nrp_Header_Message);
+        count++;
+    }
+
+    GeneratePacketHeader(size, request, count, (pNrp_Header_Packet) buffer);
+
+    return size;
 }
 
-bool TestConfigMarkServerSuccessful()
+bool TestServerFastPath()
+{
+    const unsigned char id[sizeof(Nrp_Message_TransactionId)] = { 1, 1, 2, 3, 5, 8, 13, 21 };
+    const nrpd_msg_type peersTypes[] = { nrpd_msg_type_min, ip4peers, ip6peers };
+    unsigned char request[256];
+    unique_ptr<unsigned char[]> fast = make_unique<unsigned char[]>(MAX_RESPONSE_MESSAGE_SIZE);
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    shared_ptr<NrpdServer> tempServer;
+    shared_ptr<NrpdConfig> tempConfig;
+    int messageLength;
+    int size;
+    int err;
+
+    tempConfig = make_shared<NrpdConfig>();
+    GenerateConfigFakeActiveServers(tempConfig, 16, 16);
+    tempServer = make_shared<NrpdServer>(tempConfig);
+
+    if((err = tempServer->InitializeServer()) != EXIT_SUCCESS)
+    {
+        cout << "Failed to initialize server. Error: " << err << endl;
+        return false;
+    }
+
+    // 1. Every common shape gets the same messages ParseMessages would send
+    for(int echo = 0; echo < 2; echo++)
+    {
+        for(nrpd_msg_type peersType : peersTypes)
+        {
+            size = BuildFastPathRequest((echo) ? id : nullptr, 0, peersType, request);
+
+            PacketView req(request, size, true);
+
+            if((size = tempServer->FastPathResponse(req, fast.get())) == 0)
+            {
+                cout << "FastPathResponse declined a common request shape" << endl;
+                return false;
+            }
+
+            PacketView resp(fast.get(), size, false);
+
+            if(!resp.Valid() || !tempServer->ParseMessages(req, messageLength, msgs)
+               || size != NRP_PACKET_HEADER_SIZE + messageLength
+               || resp.MessageCount() != (int) msgs.size())
+            {
+                cout << "FastPathResponse returned " << size << " bytes, ParseMessages " << NRP_PACKET_HEADER_SIZE + messageLength << endl;
+                return false;
+            }
+
+            auto expected = msgs.begin();
+
+            for(MessageView msg : resp)
+            {
+                pNrp_Header_Message hdr = (pNrp_Header_Message) (expected++)->get();
+
+                if(msg.Type() != hdr->msgType || msg.Length() != ntohs(hdr->length))
+                {
+                    cout << "FastPathResponse returned a message unlike ParseMessages" << endl;
+                    return false;
+                }
+            }
+
+            if(echo && (resp.TransactionId() == nullptr || memcmp(resp.TransactionId()->id, id, sizeof(id)) != 0))
+            {
+                cout << "FastPathResponse didn't echo the transaction ID" << endl;
+                return false;
+            }
+
+            msgs.clear();
+        }
+    }
+
+    // 2. Other shapes are left to ParseMessages
+    size = BuildFastPathRequest(id, tempConfig->defaultEntropySize() + 1, nrpd_msg_type_min, request);
+
+    if(tempServer->FastPathResponse(PacketView(request, size, true), fast.get()) != 0)
+    {
+        cout << "FastPathResponse accepted a non-default entropy size" << endl;
+        return false;
+    }
+
+    BuildReceiveSizeRequest(1000, 1000, request);
+
+    if(tempServer->FastPathResponse(PacketView(request, sizeof(request), true), fast.get()) != 0)
+    {
+        cout << "FastPathResponse accepted a receive size" << endl;
+        return false;
+    }
+
+    cout << "NrpdServer::FastPathResponse passed all tests!" << endl << endl;
+    return true;
+}
+
+// Request the types in order, each a bare header except secure entropy,
+// which carries secureRequest.
+static int BuildSecureRequest(initializer_list<nrpd_msg_type> types, pNrp_Message_SecureEntropy_Request secureRequest, unsigned char* buffer)
+{
+    pNrp_Header_Message msg = ((pNrp_Header_Packet) buffer)->messages;
+    int size = sizeof(Nrp_Header_Packet);
+
+    for(nrpd_msg_type type : types)
+    {
+        if(type == secureentropy)
+        {
+            msg = GenerateRequestSecureEntropyMessage(secureRequest, msg);
+            size += sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_SecureEntropy_Request);
+        }
+        else
+        {
+            msg = (type == entropy) ? GenerateRequestEntropyMessage(0, msg) : GenerateRequestKeyMessage(type, msg);
+            size += sizeof(Nrp_Header_Message);
+        }
+    }
+
+    GeneratePacketHeader(size, request, types.size(), (pNrp_Header_Packet) buffer);
+
+    return size;
+}
+
+// The first message of type in a response built by ParseMessages, or
+// nullptr if there isn't one.
+static pNrp_Header_Message FindResponseMessage(std::list<unique_ptr<unsigned char[]>> const& msgs, nrpd_msg_type type)
+{
+    for(auto const& msg : msgs)
+    {
+        if(((pNrp_Header_Message) msg.get())->msgType == type)
+        {
+            return (pNrp_Header_Message) msg.get();
+        }
+    }
+
+    return nullptr;
+}
+
+bool TestSecureEntropy()
+{
+    unsigned char request[256];
+    unsigned char sessionKey[SECURE_SESSION_KEY_SIZE];
+    unsigned char opened[sizeof(Nrp_Message_SecureEntropy_Response::entropy)];
+    Nrp_Message_SecureEntropy_Request secureRequest;
+    Nrp_Message_SecureEntropy_Response sealed;
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    shared_ptr<NrpdServer> tempServer;
+    shared_ptr<NrpdConfig> tempConfig;
+    shared_ptr<NrpdTuning> tuning;
+    pNrp_Message_SignKey_Response signKey;
+    pNrp_Message_SignKey_Response encryptionKey;
+    pNrp_Message_SecureEntropy_Response response;
+    pNrp_Header_Message msg;
+    shared_ptr<const KeyEpoch> epoch;
+    KeyPair clientKey;
+    int messageLength;
+    int size;
+    int err;
+
+    tempConfig = make_shared<NrpdConfig>();
+    tempServer = make_shared<NrpdServer>(tempConfig);
+
+    if((err = tempServer->InitializeServer()) != EXIT_SUCCESS)
+    {
+        cout << "Failed to initialize server. Error: " << err << endl;
+        return false;
+    }
+
+    // 1. Servers don't serve keys unless configured to
+    size = BuildSecureRequest({signkey, encryptionkey}, nullptr, request);
+
+    if(!tempServer->ParseMessages(PacketView(request, size, true), messageLength, msgs)
+       || (msg = FindResponseMessage(msgs, reject)) == nullptr
+       || ((pNrp_Message_Reject) msg->content)->reason != unsupported
+       || FindResponseMessage(msgs, signkey) != nullptr)
+    {
+        cout << "ParseMessages served keys without secure entropy enabled" << endl;
+        return false;
+    }
+
+    tuning = make_shared<NrpdTuning>(*tempConfig->Tuning());
+    tuning->enableSecureEntropy = true;
+    atomic_store(&tempConfig->m_tuning, shared_ptr<const NrpdTuning>(tuning));
+    msgs.clear();
+
+    // 2. The sign key is signed by the identity, and the encryption key by
+    // the sign key
+    if(!tempServer->ParseMessages(PacketView(request, size, true), messageLength, msgs)
+       || (msg = FindResponseMessage(msgs, signkey)) == nullptr || !ValidateMessageHeader(msg, false))
+    {
+        cout << "ParseMessages didn't send a valid sign key" << endl;
+        return false;
+    }
+
+    signKey = (pNrp_Message_SignKey_Response) msg->content;
+
+    if((msg = FindResponseMessage(msgs, encryptionkey)) == nullptr || !ValidateMessageHeader(msg, false))
+    {
+        cout << "ParseMessages didn't send a valid encryption key" << endl;
+        return false;
+    }
+
+    encryptionKey = (pNrp_Message_SignKey_Response) msg->content;
+
+    if(memcmp(signKey->signature, tempServer->m_identity.PublicKey(), SECURE_PUBLIC_KEY_SIZE) != 0
+       || !VerifyKeyRecord(signkey, signKey, signKey->signature, signKey->signature + SECURE_PUBLIC_KEY_SIZE)
+       || !VerifyKeyRecord(encryptionkey, encryptionKey, signKey->key, encryptionKey->signature)
+       || encryptionKey->keyId != signKey->keyId)
+    {
+        cout << "Epoch keys failed verification" << endl;
+        return false;
+    }
+
+    // Signatures cover the message type, and every field
+    if(VerifyKeyRecord(signkey, encryptionKey, signKey->key, encryptionKey->signature))
+    {
+        cout << "Encryption key verified as a sign key" << endl;
+        return false;
+    }
+
+    encryptionKey->expiryTime[0] ^= 1;
+
+    if(VerifyKeyRecord(encryptionkey, encryptionKey, signKey->key, encryptionKey->signature))
+    {
+        cout << "Altered encryption key passed verification" << endl;
+        return false;
+    }
+
+    encryptionKey->expiryTime[0] ^= 1;
+
+    // 3. Secure entropy opens only under the client's own session key
+    if(!clientKey.Generate(EVP_PKEY_X25519))
+    {
+        cout << "Failed to generate client key" << endl;
+        return false;
+    }
+
+    memcpy(secureRequest.clientKey, clientKey.PublicKey(), sizeof(secureRequest.clientKey));
+    secureRequest.keyId = signKey->keyId;
+    size = BuildSecureRequest({secureentropy, entropy}, &secureRequest, request);
+
+    std::list<unique_ptr<unsigned char[]>> secureMsgs;
+
+    if(!tempServer->ParseMessages(PacketView(request, size, true), messageLength, secureMsgs)
+       || (msg = FindResponseMessage(secureMsgs, secureentropy)) == nullptr || !ValidateMessageHeader(msg, false)
+       || FindResponseMessage(secureMsgs, entropy) == nullptr)
+    {
+        cout << "ParseMessages didn't send secure entropy" << endl;
+        return false;
+    }
+
+    response = (pNrp_Message_SecureEntropy_Response) msg->content;
+
+    if(!DeriveSessionKey(clientKey, encryptionKey->key, &secureRequest, sessionKey)
+       || !OpenEntropy(sessionKey, &secureRequest, response, opened))
+    {
+        cout << "Client couldn't open secure entropy" << endl;
+        return false;
+    }
+
+    memcpy(&sealed, response, sizeof(sealed));
+    sealed.entropy[0] ^= 1;
+
+    if(OpenEntropy(sessionKey, &secureRequest, &sealed, opened))
+    {
+        cout << "Altered secure entropy passed authentication" << endl;
+        return false;
+    }
+
+    // Bound to the request; a different client key can't claim it
+    memcpy(&sealed, response, sizeof(sealed));
+    secureRequest.clientKey[0] ^= 1;
+
+    if(OpenEntropy(sessionKey, &secureRequest, &sealed, opened))
+    {
+        cout << "Secure entropy opened for a different request" << endl;
+        return false;
+    }
+
+    secureRequest.clientKey[0] ^= 1;
+
+    // 4. The next epoch is signed ahead, and published an overlap before
+    // the current one expires; keys of the one replaced are still accepted
+    epoch = tempServer->CurrentKeyEpoch();
+
+    if(tempServer->m_nextEpoch == nullptr
+       || tempServer->RotateKeys(epoch->expiry - SECURE_KEY_OVERLAP_SECONDS - 1) != epoch->expiry - SECURE_KEY_OVERLAP_SECONDS)
+    {
+        cout << "RotateKeys didn't sign the next epoch ahead of its rotation" << endl;
+        return false;
+    }
+
+    tempServer->RotateKeys(epoch->expiry - SECURE_KEY_OVERLAP_SECONDS);
+    secureMsgs.clear();
+
+    if(tempServer->CurrentKeyEpoch()->keyId == signKey->keyId
+       || tempServer->m_nextEpoch == nullptr
+       || !tempServer->ParseMessages(PacketView(request, size, true), messageLength, secureMsgs)
+       || (msg = FindResponseMessage(secureMsgs, secureentropy)) == nullptr
+       || !OpenEntropy(sessionKey, &secureRequest, (pNrp_Message_SecureEntropy_Response) msg->content, opened))
+    {
+        cout << "Keys of the previous epoch weren't accepted during the overlap" << endl;
+        return false;
+    }
+
+    // 5. Keys of an epoch replaced twice are stale
+    tempServer->RotateKeys(tempServer->CurrentKeyEpoch()->expiry - SECURE_KEY_OVERLAP_SECONDS);
+    secureMsgs.clear();
+
+    if(!tempServer->ParseMessages(PacketView(request, size, true), messageLength, secureMsgs)
+       || (msg = FindResponseMessage(secureMsgs, reject)) == nullptr
+       || ((pNrp_Message_Reject) msg->content)->msgType != secureentropy
+       || ((pNrp_Message_Reject) msg->content)->reason != stalekey
+       || FindResponseMessage(secureMsgs, secureentropy) != nullptr)
+    {
+        cout << "ParseMessages didn't reject a stale key ID" << endl;
+        return false;
+    }
+
+    cout << "Secure entropy passed all tests!" << endl << endl;
+    return true;
+}
+
+bool TestSessionKeyCache()
+{
+    typedef MruCache<Nrp_Message_SecureEntropy_Request, SessionKey> SessionCache;
+    shared_ptr<SessionCache> cache = make_shared<SessionCache>(1, 2);
+    Nrp_Message_SecureEntropy_Request requests[3] = {0};
+    Nrp_Message_SecureEntropy_Request secureRequest;
+    SessionKey session = {0};
+    SessionKey found;
+    unsigned char request[256];
+    unsigned char opened[sizeof(Nrp_Message_SecureEntropy_Response::entropy)];
+    unsigned char nonces[2][SECURE_NONCE_SIZE];
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    shared_ptr<NrpdServer> tempServer;
+    shared_ptr<NrpdConfig> tempConfig;
+    shared_ptr<NrpdTuning> tuning;
+    pNrp_Header_Message msg;
+    KeyPair clientKey;
+    shared_ptr<const KeyEpoch> epoch;
+    int messageLength;
+    int size;
+    int err;
+
+    // 1. Keys differ by client key or key ID
+    requests[1].clientKey[31] = 1;
+    requests[2].keyId = 1;
+
+    for(int index = 0; index < 2; index++)
+    {
+        session.key[0] = index;
+
+        if(!cache->Add(requests[index], session))
+        {
+            cout << "MruCache::Add refused a key with room for it" << endl;
+            return false;
+        }
+    }
+
+    if(!cache->Find(requests[1], found) || found.key[0] != 1 || cache->Find(requests[2], found))
+    {
+        cout << "MruCache::Find didn't return the value added" << endl;
+        return false;
+    }
+
+    // 2. A full cache keeps what it has, but renews it
+    session.key[0] = 2;
+
+    if(cache->Add(requests[2], session) || !cache->Add(requests[0], session)
+       || !cache->Find(requests[0], found) || found.key[0] != 2 || cache->Size() != 2)
+    {
+        cout << "MruCache::Add didn't keep to its capacity" << endl;
+        return false;
+    }
+
+    // 3. Expired entries are dropped when looked up, and the oldest makes
+    // room in a full cache
+    std::this_thread::sleep_for(1100ms);
+
+    if(cache->Find(requests[0], found) || cache->Size() != 1 || !cache->Add(requests[2], session)
+       || !cache->Add(requests[0], session) || cache->Size() != 2 || cache->Find(requests[1], found))
+    {
+        cout << "MruCache::Add didn't make room from expired entries" << endl;
+        return false;
+    }
+
+    // 4. A repeat client is answered from the cache, under fresh nonces
+    tempConfig = make_shared<NrpdConfig>();
+    tempServer = make_shared<NrpdServer>(tempConfig);
+
+    if((err = tempServer->InitializeServer()) != EXIT_SUCCESS)
+    {
+        cout << "Failed to initialize server. Error: " << err << endl;
+        return false;
+    }
+
+    tuning = make_shared<NrpdTuning>(*tempConfig->Tuning());
+    tuning->enableSecureEntropy = true;
+    atomic_store(&tempConfig->m_tuning, shared_ptr<const NrpdTuning>(tuning));
+
+    if(!clientKey.Generate(EVP_PKEY_X25519) || (epoch = tempServer->CurrentKeyEpoch()) == nullptr)
+    {
+        cout << "Failed to generate keys" << endl;
+        return false;
+    }
+
+    memcpy(secureRequest.clientKey, clientKey.PublicKey(), sizeof(secureRequest.clientKey));
+    secureRequest.keyId = epoch->keyId;
+    size = BuildSecureRequest({secureentropy}, &secureRequest, request);
+
+    if(!DeriveSessionKey(clientKey, epoch->encryptionKey.PublicKey(), &secureRequest, session.key))
+    {
+        cout << "Client failed to derive a session key" << endl;
+        return false;
+    }
+
+    for(int index = 0; index < 2; index++)
+    {
+        msgs.clear();
+
+        if(!tempServer->ParseMessages(PacketView(request, size, true), messageLength, msgs)
+           || (msg = FindResponseMessage(msgs, secureentropy)) == nullptr
+           || !OpenEntropy(session.key, &secureRequest, (pNrp_Message_SecureEntropy_Response) msg->content, opened))
+        {
+            cout << "Repeat client couldn't open secure entropy" << endl;
+            return false;
+        }
+
+        memcpy(nonces[index], ((pNrp_Message_SecureEntropy_Response) msg->content)->nonce, SECURE_NONCE_SIZE);
+    }
+
+    if(tempServer->m_sessionKeys->Size() != 1 || !tempServer->m_sessionKeys->Find(secureRequest, found)
+       || memcmp(found.key, session.key, sizeof(found.key)) != 0)
+    {
+        cout << "Server didn't cache the session key" << endl;
+        return false;
+    }
+
+    if(memcmp(nonces[0], nonces[1], SECURE_NONCE_SIZE) == 0)
+    {
+        cout << "Server reused a nonce under a cached session key" << endl;
+        return false;
+    }
+
+    cout << "Session key cache passed all tests!" << endl << endl;
+    return true;
+}
+
+// A job for the keys of epoch, as a server sends them in one response
+static KeyJob BuildKeyJob(KeyPair const& identity, KeyEpoch const& epoch, unsigned short port)
+{
+    KeyJob job = KeyJob();
+
+    job.server = ServerRecord({127, 0, 0, 1}, port);
+    memcpy(job.identity, identity.PublicKey(), sizeof(job.identity));
+    memcpy(job.signKeyRecord, ((pNrp_Header_Message) epoch.signKeyMessage)->content, sizeof(job.signKeyRecord));
+    memcpy(job.encryptionKeyRecord, ((pNrp_Header_Message) epoch.encryptionKeyMessage)->content, sizeof(job.encryptionKeyRecord));
+    job.hasSignKeyRecord = true;
+    job.hasEncryptionKeyRecord = true;
+
+    return job;
+}
+
+bool TestKeyVerifier()
+{
+    const int jobCount = 40;
+    unsigned char sessionKey[SECURE_SESSION_KEY_SIZE];
+    vector<VerifiedKeys> results;
+    unique_ptr<KeyEpoch> epoch;
+    VerifiedKeys verified;
+    KeyPair identity;
+    KeyPair other;
+    KeyJob job;
+
+    if(!identity.Generate(EVP_PKEY_ED25519) || !other.Generate(EVP_PKEY_ED25519)
+       || (epoch = CreateKeyEpoch(identity, 7, time(nullptr) + SECURE_KEY_LIFETIME_SECONDS)) == nullptr)
+    {
+        cout << "Failed to generate keys" << endl;
+        return false;
+    }
+
+    // 1. Both keys verify, and the session agreed is the server's
+    job = BuildKeyJob(identity, *epoch, 1);
+    verified = KeyVerifier::Verify(job);
+
+    if(!verified.hasSignKey || !verified.hasSession || verified.keyId != 7 || verified.expiry != epoch->expiry
+       || memcmp(verified.signKey, epoch->signKey.PublicKey(), SECURE_PUBLIC_KEY_SIZE) != 0
+       || !DeriveSessionKey(epoch->encryptionKey, epoch->encryptionKey.PublicKey(), &verified.secureRequest, sessionKey)
+       || memcmp(sessionKey, verified.session.key, sizeof(sessionKey)) != 0)
+    {
+        cout << "KeyVerifier didn't verify a server's keys" << endl;
+        return false;
+    }
+
+    // 2. An encryption key alone is verified by the sign key verified before
+    job.hasSignKeyRecord = false;
+    memcpy(job.signKey, verified.signKey, sizeof(job.signKey));
+    job.keyId = verified.keyId;
+    job.expiry = verified.expiry;
+
+    if(!KeyVerifier::Verify(job).hasSession)
+    {
+        cout << "KeyVerifier didn't verify an encryption key with a known sign key" << endl;
+        return false;
+    }
+
+    // 3. Nothing is verified under another identity, and no session is
+    // agreed on a tampered encryption key
+    job = BuildKeyJob(identity, *epoch, 1);
+    memcpy(job.identity, other.PublicKey(), sizeof(job.identity));
+
+    if(KeyVerifier::Verify(job).hasSignKey)
+    {
+        cout << "KeyVerifier verified a sign key under another identity" << endl;
+        return false;
+    }
+
+    job = BuildKeyJob(identity, *epoch, 1);
+    ((pNrp_Message_EncryptionKey_Response) job.encryptionKeyRecord)->key[0] ^= 1;
+    verified = KeyVerifier::Verify(job);
+
+    if(!verified.hasSignKey || verified.hasSession)
+    {
+        cout << "KeyVerifier agreed a session on a tampered encryption key" << endl;
+        return false;
+    }
+
+    // 4. Workers verify every job submitted, inline if there are none
+    for(int workers = 0; workers <= CLIENT_VERIFY_WORKERS; workers += CLIENT_VERIFY_WORKERS)
+    {
+        KeyVerifier verifier(workers);
+
+        results.clear();
+
+        for(int index = 0; index < jobCount; index++)
+        {
+            job = BuildKeyJob(identity, *epoch, index);
+
+            if(index % 2 == 1)
+            {
+                ((pNrp_Message_EncryptionKey_Response) job.encryptionKeyRecord)->signature[0] ^= 1;
+            }
+
+            verifier.Submit(job);
+        }
+
+        verifier.Drain();
+        verifier.Collect(results);
+
+        if(results.size() != jobCount || verifier.Pending() != 0)
+        {
+            cout << "KeyVerifier with " << workers << " workers returned " << results.size() << " of " << jobCount << " jobs" << endl;
+            return false;
+        }
+
+        for(VerifiedKeys const& result : results)
+        {
+            if(result.hasSession != (ntohs(result.server.port) % 2 == 0))
+            {
+                cout << "KeyVerifier with " << workers << " workers mixed up results" << endl;
+                return false;
+            }
+        }
+    }
+
+    cout << "KeyVerifier passed all tests!" << endl << endl;
+    return true;
+}
+
+// Write count self-signed certificates to the PEM file at path, appending
+// their DER to outChain
+static bool WriteTestCertChain(const char* path, int count, vector<unsigned char>& outChain)
+{
+    FILE* file = fopen(path, "w");
+    bool result = (file != nullptr);
+
+    for(int index = 0; result && index < count; index++)
+    {
+        X509* cert = X509_new();
+        EVP_PKEY* key = EVP_PKEY_Q_keygen(nullptr, nullptr, "ED25519");
+        unsigned char* der;
+        int size = 0;
+
+        result = cert != nullptr && key != nullptr
+                 && ASN1_INTEGER_set(X509_get_serialNumber(cert), index + 1) == 1
+                 && X509_gmtime_adj(X509_getm_notBefore(cert), 0) != nullptr
+                 && X509_gmtime_adj(X509_getm_notAfter(cert), 60*60) != nullptr
+                 && X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char*) "nrpd test certificate", -1, -1, 0) == 1
+                 && X509_set_issuer_name(cert, X509_get_subject_name(cert)) == 1
+                 && X509_set_pubkey(cert, key) == 1
+                 && X509_sign(cert, key, nullptr) > 0
+                 && PEM_write_X509(file, cert) == 1
+                 && (size = i2d_X509(cert, nullptr)) > 0;
+
+        if(result)
+        {
+            outChain.resize(outChain.size() + size);
+            der = outChain.data() + outChain.size() - size;
+            i2d_X509(cert, &der);
+        }
+
+        EVP_PKEY_free(key);
+        X509_free(cert);
+    }
+
+    if(file != nullptr)
+    {
+        fclose(file);
+    }
+
+    return result;
+}
+
+// Check each of the family's chunks of blob against chain
+static bool CheckCertChainChunks(CertChainBlob const& blob, bool ipv6, vector<unsigned char> const& chain)
+{
+    size_t dataSize = (ipv6) ? sizeof(Nrp_Message_CertChain_Response6::data) : sizeof(Nrp_Message_CertChain_Response4::data);
+    unsigned char hash[32];
+    vector<unsigned char> joined;
+
+    if(blob.ChunkCount(ipv6) != (chain.size() + dataSize - 1) / dataSize || blob.ChunkMessage(ipv6, blob.ChunkCount(ipv6)) != nullptr)
+    {
+        cout << "CertChainBlob has the wrong number of chunks" << endl;
+        return false;
+    }
+
+    for(unsigned short index = 0; index < blob.ChunkCount(ipv6); index++)
+    {
+        pNrp_Header_Message msg = (pNrp_Header_Message) blob.ChunkMessage(ipv6, index);
+        pNrp_Message_CertChain_Response4 chunk = (pNrp_Message_CertChain_Response4) msg->content;
+
+        if(ntohs(msg->length) != blob.ChunkMessageSize(ipv6) || !ValidateMessageHeader(msg, false)
+           || ntohs(chunk->chunk) != index || ntohs(chunk->totalChunks) != blob.ChunkCount(ipv6))
+        {
+            cout << "CertChainBlob built an invalid chunk message" << endl;
+            return false;
+        }
+
+        EVP_Digest(chunk, 2 * sizeof(unsigned short) + dataSize, hash, nullptr, EVP_sha256(), nullptr);
+
+        if(memcmp(hash, chunk->data + dataSize, sizeof(hash)) != 0)
+        {
+            cout << "CertChainBlob chunk hash doesn't match its data" << endl;
+            return false;
+        }
+
+        joined.insert(joined.end(), chunk->data, chunk->data + dataSize);
+    }
+
+    // The last chunk is padded with zeros
+    if(memcmp(joined.data(), chain.data(), chain.size()) != 0
+       || std::any_of(joined.begin() + chain.size(), joined.end(), [](unsigned char c) { return c != 0; }))
+    {
+        cout << "CertChainBlob chunks don't join up to the chain" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool CheckCertChain(const char* path)
+{
+    const unsigned short chunks[] = { 1, 200, 0 };
+    const unsigned char id[sizeof(Nrp_Message_TransactionId)] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    unsigned char request[64];
+    unique_ptr<unsigned char[]> fast = make_unique<unsigned char[]>(MAX_RESPONSE_MESSAGE_SIZE);
+    std::list<unique_ptr<unsigned char[]>> msgs;
+    vector<unsigned char> chain;
+    unique_ptr<CertChainBlob> blob;
+    shared_ptr<NrpdServer> tempServer;
+    shared_ptr<NrpdConfig> tempConfig;
+    shared_ptr<NrpdTuning> tuning;
+    pNrp_Header_Message msg;
+    int messageLength;
+    int size;
+    int err;
+
+    // 1. Anything but PEM certificates fails to load
+    if(CertChainBlob::Load("/nonexistent/chain.pem") != nullptr || CertChainBlob::Load(path) != nullptr)
+    {
+        cout << "CertChainBlob loaded a missing or empty chain" << endl;
+        return false;
+    }
+
+    // 2. Chunks of both families join up to the DER chain
+    if(!WriteTestCertChain(path, 8, chain))
+    {
+        cout << "Failed to write a certificate chain" << endl;
+        return false;
+    }
+
+    if((blob = CertChainBlob::Load(path)) == nullptr || blob->ChainSize() != chain.size()
+       || blob->ChunkCount(false) < 2 || blob->ChunkCount(true) < 2)
+    {
+        cout << "CertChainBlob failed to load the chain" << endl;
+        return false;
+    }
+
+    if(!CheckCertChainChunks(*blob, false, chain) || !CheckCertChainChunks(*blob, true, chain))
+    {
+        return false;
+    }
+
+    // 3. Loading a config builds the chain, off the packet path
+    {
+        string configPath = string(path) + ".conf";
+        ofstream file(configPath, ios::trunc);
+
+        file << "cert_chain = " << path << endl;
+        file.close();
+
+        tempConfig = make_shared<NrpdConfig>(&configPath);
+
+        if(!tempConfig->LoadConfigFile(true) || tempConfig->Tuning()->certChain == nullptr
+           || tempConfig->Tuning()->certChain->ChainSize() != chain.size())
+        {
+            unlink(configPath.c_str());
+            cout << "Loading the config didn't build the cert chain" << endl;
+            return false;
+        }
+
+        unlink(configPath.c_str());
+    }
+
+    // 4. A malformed certificate fails the chain, rather than ending it
+    {
+        FILE* file = fopen(path, "a");
+
+        if(file == nullptr || fputs("-----BEGIN CERTIFICATE-----\nnot a certificate\n-----END CERTIFICATE-----\n", file) < 0)
+        {
+            cout << "Failed to append to the certificate chain" << endl;
+            return false;
+        }
+
+        fclose(file);
+
+        if(CertChainBlob::Load(path) != nullptr)
+        {
+            cout << "CertChainBlob loaded a chain with a malformed certificate" << endl;
+            return false;
+        }
+    }
+
+    // 5. Servers without a chain reject requests for it
+    tempConfig = make_shared<NrpdConfig>();
+    tempServer = make_shared<NrpdServer>(tempConfig);
+
+    if((err = tempServer->InitializeServer()) != EXIT_SUCCESS)
+    {
+        cout << "Failed to initialize server. Error: " << err << endl;
+        return false;
+    }
+
+    msg = GenerateTransactionIdMessage(id, ((pNrp_Header_Packet) request)->messages);
+    GenerateRequestCertChainMessage(chunks, 1, msg);
+    size = sizeof(Nrp_Header_Packet) + sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_TransactionId) + sizeof(Nrp_Header_Message) + sizeof(Nrp_Message_CertChain_Request);
+    GeneratePacketHeader(size, nrpd_msg_type::request, 2, (pNrp_Header_Packet) request);
+
+    if(tempServer->FastPathResponse(PacketView(request, size, true), fast.get()) != 0
+       || !tempServer->ParseMessages(PacketView(request, size, true), messageLength, msgs)
+       || (msg = FindResponseMessage(msgs, reject)) == nullptr
+       || ((pNrp_Message_Reject) msg->content)->msgType != certchain)
+    {
+        cout << "Server without a chain didn't reject a request for it" << endl;
+        return false;
+    }
+
+    tuning = make_shared<NrpdTuning>(*tempConfig->Tuning());
+    tuning->certChainPath = path;
+    tuning->certChain = move(blob);
+    atomic_store(&tempConfig->m_tuning, shared_ptr<const NrpdTuning>(tuning));
+
+    // 6. One chunk is sent from the blob, with the same bytes as
+    // ParseMessages would send
+    for(int ipv6 = 0; ipv6 < 2; ipv6++)
+    {
+        PacketView req(request, size, true);
+        int fastSize;
+
+        tempServer->m_clientIpv6 = ipv6;
+        msgs.clear();
+
+        if((fastSize = tempServer->FastPathResponse(req, fast.get())) == 0
+           || tempServer->m_fastSliceSize != tempServer->m_certChain->ChunkMessageSize(ipv6)
+           || tempServer->m_fastSlice != tempServer->m_certChain->ChunkMessage(ipv6, chunks[0]))
+        {
+            cout << "FastPathResponse didn't send the chunk from the blob" << endl;
+            return false;
+        }
+
+        memcpy(fast.get() + fastSize - tempServer->m_fastSliceSize, tempServer->m_fastSlice, tempServer->m_fastSliceSize);
+
+        if(!tempServer->ParseMessages(req, messageLength, msgs)
+           || NRP_PACKET_HEADER_SIZE + messageLength != fastSize
+           || (msg = FindResponseMessage(msgs, certchain)) == nullptr
+           || memcmp(msg, fast.get() + fastSize - tempServer->m_fastSliceSize, tempServer->m_fastSliceSize) != 0
+           || !PacketView(fast.get(), fastSize, false).Valid())
+        {
+            cout << "FastPathResponse chunk differs from ParseMessages" << endl;
+            return false;
+        }
+    }
+
+    // 7. Several chunks go through ParseMessages, skipping those past the
+    // end; two fit in a default response only at the IPv4 size
+    tempServer->m_clientIpv6 = false;
+    GenerateRequestCertChainMessage(chunks, 3, ((pNrp_Header_Packet) request)->messages);
+    size = sizeof(Nrp_Header_Packet) + sizeof(Nrp_Header_Message) + (3 * sizeof(Nrp_Message_CertChain_Request));
+    GeneratePacketHeader(size, nrpd_msg_type::request, 1, (pNrp_Header_Packet) request);
+    msgs.clear();
+
+    if(tempServer->FastPathResponse(PacketView(request, size, true), fast.get()) != 0
+       || !tempServer->ParseMessages(PacketView(request, size, true), messageLength, msgs)
+       || msgs.size() != 2 || messageLength != 2 * tempServer->m_certChain->ChunkMessageSize(false)
+       || ntohs(((pNrp_Message_CertChain_Response4) ((pNrp_Header_Message) msgs.back().get())->content)->chunk) != chunks[2])
+    {
+        cout << "ParseMessages didn't send the chunks requested" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool TestCertChain()
+{
+    char path[] = "/tmp/nrpdtestXXXXXX";
+    int fd;
+    bool result;
+
+    if((fd = mkstemp(path)) < 0)
+    {
+        cout << "Failed to create temporary file. Error: " << errno << endl;
+        return false;
+    }
+
+    close(fd);
+
+    result = CheckCertChain(path);
+
+    unlink(path);
+
+    if(result)
+    {
+        cout << "Cert chain passed all tests!" << endl << endl;
+    }
+
+    return result;
+}
+
+bool TestPacketView()
+{
+    const unsigned char id[sizeof(Nrp_Message_TransactionId)] = { 8, 7, 6, 5, 4, 3, 2, 1 };
+    const unsigned char types[] = { transactionid, entropy, ip4peers };
+    unsigned char buffer[256];
+    pNrp_Header_Message msg;
+    int index;
+    int size;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    msg = ((pNrp_Header_Packet) buffer)->messages;
+    msg = GenerateTransactionIdMessage(id, msg);
+    msg = GenerateRequestEntropyMessage(0, msg);
+    GenerateRequestPeersMessage(ip4peers, 4, msg);
+    size = sizeof(Nrp_Header_Packet) + (3 * sizeof(Nrp_Header_Message)) + sizeof(Nrp_Message_TransactionId);
+    GeneratePacketHeader(size, request, 3, (pNrp_Header_Packet) buffer);
+
+    // 1. Messages are visited once each, in order
+    PacketView view(buffer, size, true);
+
+    if(!view.Valid() || view.MessageCount() != 3 || view.TransactionId() == nullptr || view.ReceiveSize() != nullptr)
+    {
+        cout << "Failed to view a valid request" << endl;
+        return false;
+    }
+
+    index = 0;
+
+    for(MessageView msgView : view)
+    {
+        if(index >= 3 || msgView.Type() != types[index])
+        {
+            cout << "PacketView returned message " << index << " out of order" << endl;
+            return false;
+        }
+
+        index++;
+    }
+
+    if(index != 3)
+    {
+        cout << "PacketView returned " << index << " messages. Expected 3" << endl;
+        return false;
+    }
+
+    // 2. The packet can't claim more than was received
+    if(PacketView(buffer, size - 1, true).Valid() || PacketView(buffer, 2, true).Valid())
+    {
+        cout << "Failed to reject a truncated datagram" << endl;
+        return false;
+    }
+
+    // 3. A zero-length message from a newer client can't stall the walk
+    msg = ((pNrp_Header_Packet) buffer)->messages;
+    msg->length = 0;
+    msg->msgType = nrpd_msg_type_max + 1;
+
+    if(PacketView(buffer, size, true).Valid())
+    {
+        cout << "Failed to reject a zero-length message" << endl;
+        return false;
+    }
+
+    // 4. A message can't run past the end of the packet
+    msg->length = htons(size);
+
+    if(PacketView(buffer, sizeof(buffer), true).Valid())
+    {
+        cout << "Failed to reject a message longer than its packet" << endl;
+        return false;
+    }
+
+    cout << "PacketView passed all tests!" << endl << endl;
+    return true;
+}
+
+// Count the entropy in a train of segmentSize-byte packets, or return -1
+// if any packet is invalid.
+static int CountTrainEntropy(unsigned char* buffer, int size, int segmentSize, int& outPackets)
+{
+    int total = 0;
+
+    for(int offset = 0; offset < size; offset += segmentSize)
+    {
+        pNrp_Header_Packet pkt = (pNrp_Header_Packet) (buffer + offset);
+        pNrp_Header_Message msg = pkt->messages;
+
+        if(ntohs(pkt->length) != min(segmentSize, size - offset) || !ValidateResponsePacket(pkt))
+        {
+            return -1;
+        }
+
+        for(int i = 0; i < pkt->msgCount; i++, msg = NextMessage(msg))
+        {
+            if(msg->msgType != entropy)
+            {
+                return -1;
+            }
+
+            total += msg->countOrSize;
+        }
+
+        outPackets++;
+    }
+
+    return total;
+}
+
+bool TestBulkEntropyLoopback()
+{
+    const int segmentSize = 1500 - IP4_UDP_HEADER_SIZE;
+    const int segments = 16;
+    unique_ptr<unsigned char[]> train = make_unique<unsigned char[]>(segments * segmentSize);
+    unique_ptr<unsigned char[]> received = make_unique<unsigned char[]>(MAX_RESPONSE_MESSAGE_SIZE);
+    sockaddr_storage stor = {0};
+    sockaddr_in& addr = (sockaddr_in&) stor;
+    socklen_t addrSize = sizeof(addr);
+    int randomfd = open("/dev/urandom", O_RDONLY);
+    int receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int expectedEntropy;
+    int receivedEntropy = 0;
+    int packets = 0;
+    int reads = 0;
+    int sends = 0;
+    bool useGso = true;
+    bool result = false;
+    int error;
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(randomfd < 0 || receiver < 0 || sender < 0
+       || bind(receiver, (sockaddr*) &stor, addrSize) != 0
+       || getsockname(receiver, (sockaddr*) &stor, &addrSize) != 0)
+    {
+        cout << "Failed to set up loopback sockets. Error: " << errno << endl;
+        goto done;
+    }
+
+    // GRO is an optimization; the train must arrive intact either way
+    EnableGro(receiver);
+
+    // 1. Too small to hold a packet and an entropy message
+    if(BuildEntropyTrain(randomfd, NRP_PACKET_HEADER_SIZE + NRP_MESSAGE_HEADER_SIZE, 1, train.get()) != 0)
+    {
+        cout << "BuildEntropyTrain built segments too small for entropy" << endl;
+        goto done;
+    }
+
+    // 2. Every segment is a full, valid packet of entropy
+    if(BuildEntropyTrain(randomfd, segmentSize, segments, train.get()) != segments * segmentSize)
+    {
+        cout << "BuildEntropyTrain failed" << endl;
+        goto done;
+    }
+
+    if((expectedEntropy = CountTrainEntropy(train.get(), segments * segmentSize, segmentSize, packets)) <= 0 || packets != segments)
+    {
+        cout << "BuildEntropyTrain built an invalid train" << endl;
+        goto done;
+    }
+
+    // 3. The train crosses loopback intact
+    if((error = SendSegments(sender, train.get(), segments * segmentSize, segmentSize, (sockaddr*) &stor, addrSize, useGso, sends)) != 0)
+    {
+        cout << "SendSegments failed. Error: " << error << endl;
+        goto done;
+    }
+
+    packets = 0;
+
+    while(packets < segments)
+    {
+        pollfd waitfd = { receiver, POLLIN, 0 };
+        int receivedSegmentSize;
+        int count;
+        int entropy;
+
+        if(poll(&waitfd, 1, 1000) <= 0
+           || (count = ReceiveSegments(receiver, received.get(), MAX_RESPONSE_MESSAGE_SIZE, MSG_DONTWAIT, receivedSegmentSize)) <= 0)
+        {
+            cout << "Received " << packets << " of " << segments << " bulk entropy packets" << endl;
+            goto done;
+        }
+
+        reads++;
+
+        if(receivedSegmentSize != segmentSize || (entropy = CountTrainEntropy(received.get(), count, receivedSegmentSize, packets)) < 0)
+        {
+            cout << "Received an invalid bulk entropy packet" << endl;
+            goto done;
+        }
+
+        receivedEntropy += entropy;
+    }
+
+    if(receivedEntropy != expectedEntropy)
+    {
+        cout << "Received " << receivedEntropy << " bytes of bulk entropy. Expected " << expectedEntropy << endl;
+        goto done;
+    }
+
+    cout << segments << " packets in " << sends << (useGso ? " GSO" : "") << " sends and " << reads << " reads" << endl;
+    cout << "Bulk entropy passed all tests!" << endl << endl;
+    result = true;
+
+done:
+    close(sender);
+    close(receiver);
+    close(randomfd);
+
+    return result;
+}
+
+bool TestConfigGetServerList()
+{
+    unique_ptr<unsigned char[]> result;
+    shared_ptr<NrpdConfig> tempConfig;
+    std::list<TestCaseGetServerList> cases;
+    pNrp_Message_Ip4Peer ip4Msg;
+    pNrp_Message_Ip6Peer ip6Msg;
+    ServerRecord tempRec;
+    int count;
+
+    /// Negative test cases
+    tempConfig = make_shared<NrpdConfig>();
+    cases.push_back({tempConfig, ip4peers, 1, 0, true, 0}); // no active ip4 servers
+    cases.push_back({tempConfig, ip6peers, 1, 0, true, 0}); // no active ip6 servers
+    cases.push_back({tempConfig, entropy, 1, 0, true, 0}); // bad type
+    cases.push_back({tempConfig, ip4peers, -1, 0, true, 0}); // bad count value
+
+    /// ip4 test cases
+    tempConfig = make_shared<NrpdConfig>();
+    tempRec = ServerRecord({1,2,3,4}, 1234);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({5,6,7,8}, 5678);
+    AddActiveServer(tempConfig, tempRec);
+
+    cases.push_back({tempConfig, ip4peers, 1, 0 ,false, sizeof(Nrp_Message_Ip4Peer)});
+    cases.push_back({tempConfig, ip4peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip4Peer)});
+    cases.push_back({tempConfig, ip6peers, 1, 0, true, 0}); // no ip6 servers
+
+    /// ip6 test cases
+    tempConfig = make_shared<NrpdConfig>();
+    tempRec = ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({0xf,0xe,0xd,0xc,0xb,0xa,9,8,7,6,5,4,3,2,1,0}, 1234);
+    AddActiveServer(tempConfig, tempRec);
+
+    cases.push_back({tempConfig, ip6peers, 1, 0, false, sizeof(Nrp_Message_Ip6Peer)});
+    cases.push_back({tempConfig, ip6peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip6Peer)});
+    cases.push_back({tempConfig, ip4peers, 1, 0, true, 0}); // no ip4 servers
+
+    /// Mixed test cases
+    tempConfig = make_shared<NrpdConfig>();
+    tempRec = ServerRecord({1,2,3,4}, 1234);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({5,6,7,8}, 5678);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({0xf,0xe,0xd,0xc,0xb,0xa,9,8,7,6,5,4,3,2,1,0}, 1234);
+    AddActiveServer(tempConfig, tempRec);
+
+    cases.push_back({tempConfig, ip4peers, 1, 0 ,false, sizeof(Nrp_Message_Ip4Peer)});
+    cases.push_back({tempConfig, ip4peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip4Peer)});
+    cases.push_back({tempConfig, ip6peers, 1, 0, false, sizeof(Nrp_Message_Ip6Peer)});
+    cases.push_back({tempConfig, ip6peers, 2, 0, false, 2 * sizeof(Nrp_Message_Ip6Peer)});
+
+
+
+    for(auto& test : cases)
+    {
+        count = 0;
+        result = test.config->GetServerList(test.type, test.count, test.outSize);
+
+        if(test.expectedNullptr)
+        {
+            if(result.get() != nullptr)
+            {
+                cout << "GetServerList returned memory. Expected nullptr" << endl;
+                return false;
+            }
+        }
+        else
+        {
+            if(result.get() == nullptr)
+            {
+                cout << "GetServerList returned nullptr. Expected memory" << endl;
+                return false;
+            }
+
+            if(test.outSize != test.expectedSize)
+            {
+                cout << "GetServerList output size: " << test.outSize << ". Expected: " << test.expectedSize << endl;
+                return false;
+            }
+
+            /// Validate the data copied correctly
+            if(test.type == ip4peers)
+            {
+                ip4Msg = (pNrp_Message_Ip4Peer) result.get();
+
+                for(size_t i = 0; i < test.config->m_peers.Count(false, false); i++)
+                {
+                    ServerRecord& rec = test.config->m_peers.At(false, false, i);
+
+                    if(ip4Msg->port != rec.port)
+                    {
+                        cout << "Copied port is: " << ip4Msg->port << ". Expected: " << rec.port << endl;
+                        return false;
+                    }
+
+                    if(memcmp(ip4Msg->ip, rec.host4, sizeof(ip4Msg->ip)))
+                    {
+                        cout << "Copied IPv4 address doesn't match! Fail." << endl;
+                        return false;
+                    }
+
+                    // increment pointer and counter
+                    ip4Msg++;
+                    count++;
+
+                    // Exit the loop when all messages have been compared
+                    if(count >= test.count)
+                    {
+                        break;
+                    }
+                }
+            }
+            else
+            {
+                ip6Msg = (pNrp_Message_Ip6Peer) result.get();
+
+                for(size_t i = 0; i < test.config->m_peers.Count(false, true); i++)
+                {
+                    ServerRecord& rec = test.config->m_peers.At(false, true, i);
+
+                    if(ip6Msg->port != rec.port)
+                    {
+                        cout << "Copied port is: " << ip6Msg->port << ". Expected: " << rec.port << endl;
+                        return false;
+                    }
+
+                    if(memcmp(ip6Msg->ip, rec.host6, sizeof(ip6Msg->ip)))
+                    {
+                        cout << "Copied IPv6 address doesn't match! Fail." << endl;
+                        return false;
+                    }
+
+                    // increment pointer and counter
+                    ip6Msg++;
+                    count++;
+
+                    // Exit the loop when all messages have been compared
+                    if(count >= test.count)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    /// Verify the returned servers are spread across all active servers
+    {
+        array<int, 64> returned = {};
+        int outSize;
+
+        tempConfig = make_shared<NrpdConfig>();
+
+        for(int i = 0; i < 64; i++)
+        {
+            AddActiveServer(tempConfig, ServerRecord({10, 0, 0, (unsigned char) i}, 1234));
+        }
+
+        for(int i = 0; i < 400; i++)
+        {
+            result = tempConfig->GetServerList(ip4peers, 8, outSize);
+            ip4Msg = (pNrp_Message_Ip4Peer) result.get();
+
+            for(int j = 0; j < 8; j++, ip4Msg++)
+            {
+                returned[ip4Msg->ip[3]] += 1;
+            }
+        }
+
+        // Each server is expected 50 times
+        for(int i = 0; i < 64; i++)
+        {
+            if(returned[i] < 15 || returned[i] > 100)
+            {
+                cout << "GetServerList returned server " << i << " " << returned[i] << " times of 3200. Expected about 50." << endl;
+                return false;
+            }
+        }
+    }
+
+    cout << "NrpdConfig::GetServerList passed all tests!" << endl << endl;
+    return true;
+}
+
+bool TestConfigActiveServerCount()
+{
+    shared_ptr<NrpdConfig> tempConfig;
+    std::list<TestCaseActiveServerCount> cases;
+    ServerRecord tempRec;
+    int count;
+
+    /// Test with empty active server list
+    tempConfig = make_shared<NrpdConfig>();
+    cases.push_back({tempConfig, ip4peers, 0});
+    cases.push_back({tempConfig, ip6peers, 0});
+    cases.push_back({tempConfig, entropy, 0});
+
+    /// Test with some fake servers
+    tempConfig = make_shared<NrpdConfig>();
+    tempRec = ServerRecord({1,2,3,4}, 1234);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321);
+    AddActiveServer(tempConfig, tempRec);
+    tempRec = ServerRecord({5,6,7,8}, 1234);
+    AddActiveServer(tempConfig, tempRec);
+
+    cases.push_back({tempConfig, ip4peers, 2});
+    cases.push_back({tempConfig, ip6peers, 1});
+
+
+    for(auto& test : cases)
+    {
+        count = test.config->ActiveServerCount(test.type);
+        if(count != test.expectedCount)
+        {
+            cout << "ActiveServerCount returned: " << count << ". Expected: " << test.expectedCount << endl;
+            return false;
+        }
+    }
+
+    cout << "NrpdConfig::ActiveServerCount passed all tests!" << endl << endl;
+    return true;
+}
+
+// Fills buffer with an ip4peers message for 10.0.0.first through
+// 10.0.0.(first + count - 1)
+pNrp_Header_Message BuildIp4PeersMessage(unsigned char* buffer, int first, int count)
+{
+    pNrp_Header_Message msg = (pNrp_Header_Message) buffer;
+    pNrp_Message_Ip4Peer peer = (pNrp_Message_Ip4Peer) msg->content;
+
+    msg->msgType = ip4peers;
+    msg->countOrSize = count;
+    msg->length = count * sizeof(Nrp_Message_Ip4Peer);
+
+    for(int i = 0; i < count; i++, peer++)
+    {
+        peer->ip[0] = 10;
+        peer->ip[1] = 0;
+        peer->ip[2] = 0;
+        peer->ip[3] = first + i;
+        peer->port = htons(1234);
+    }
+
+    return msg;
+}
+
+bool TestConfigAddServersFromMessage()
+{
+    unsigned char buffer[sizeof(Nrp_Header_Message) + (MAX_BYTE * sizeof(Nrp_Message_Ip6Peer))];
+    shared_ptr<NrpdConfig> tempConfig;
+    pNrp_Header_Message msg;
+    pNrp_Message_Ip6Peer ip6Peer;
+    ServerRecord reporterA({192,168,0,1}, 1234);
+    ServerRecord reporterB({192,168,0,2}, 1234);
+    PeerHandle handle;
+
+    /// Negative test cases
+    tempConfig = make_shared<NrpdConfig>();
+    msg = BuildIp4PeersMessage(buffer, 1, 1);
+
+    if(tempConfig->AddServersFromMessage(nullptr))
+    {
+        cout << "AddServersFromMessage accepted a null message." << endl;
+        return false;
+    }
+
+    msg->msgType = entropy;
+
+    if(tempConfig->AddServersFromMessage(msg) || tempConfig->m_peers.Size() != 0)
+    {
+        cout << "AddServersFromMessage accepted an entropy message." << endl;
+        return false;
+    }
+
+    /// v4 servers, reported repeatedly
+    msg = BuildIp4PeersMessage(buffer, 1, 3);
+
+    if(!tempConfig->AddServersFromMessage(msg, &reporterA)
+       || !tempConfig->AddServersFromMessage(msg, &reporterA)
+       || tempConfig->m_peers.Count(true, false) != 3)
+    {
+        cout << "AddServersFromMessage didn't add each reported server exactly once." << endl;
+        return false;
+    }
+
+    handle = tempConfig->m_peers.Find(ServerRecord({10,0,0,1}, 1234));
+
+    if(handle == PEER_INVALID_HANDLE || tempConfig->m_peers.Get(handle)->reportCount != 1)
+    {
+        cout << "A server reported twice by the same server was counted twice." << endl;
+        return false;
+    }
+
+    tempConfig->AddServersFromMessage(msg, &reporterB);
+
+    if(tempConfig->m_peers.Get(handle)->reportCount != 2)
+    {
+        cout << "A server reported by a second server wasn't counted." << endl;
+        return false;
+    }
+
+    /// v6 servers
+    msg = (pNrp_Header_Message) buffer;
+    msg->msgType = ip6peers;
+    msg->countOrSize = 2;
+    ip6Peer = (pNrp_Message_Ip6Peer) msg->content;
+
+    for(int i = 0; i < msg->countOrSize; i++, ip6Peer++)
+    {
+        memset(ip6Peer->ip, 0, sizeof(ip6Peer->ip));
+        ip6Peer->ip[0] = 0xfd;
+        ip6Peer->ip[15] = i + 1;
+        ip6Peer->port = htons(1234);
+    }
+
+    if(!tempConfig->AddServersFromMessage(msg, &reporterA) || tempConfig->m_peers.Count(true, true) != 2)
+    {
+        cout << "AddServersFromMessage didn't add IPv6 servers." << endl;
+        return false;
+    }
+
+    /// Banned servers aren't added
+    tempConfig = make_shared<NrpdConfig>();
+    ServerRecord banned({10,0,0,2}, 1234);
+    tempConfig->m_bannedServers->Add(banned);
+    msg = BuildIp4PeersMessage(buffer, 1, 3);
+    tempConfig->AddServersFromMessage(msg, &reporterA);
+
+    if(tempConfig->m_peers.Count(true, false) != 2
+       || tempConfig->m_peers.Find(banned) != PEER_INVALID_HANDLE)
+    {
+        cout << "AddServersFromMessage added a banned server." << endl;
+        return false;
+    }
+
+    /// The probationary list is bounded, and keeps the best-reported servers
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->m_probationaryCapacity = 4;
+
+    msg = BuildIp4PeersMessage(buffer, 1, 4);
+    tempConfig->AddServersFromMessage(msg, &reporterA);
+    msg = BuildIp4PeersMessage(buffer, 1, 1);
+    tempConfig->AddServersFromMessage(msg, &reporterB);
+
+    msg = BuildIp4PeersMessage(buffer, 100, 50);
+    tempConfig->AddServersFromMessage(msg, &reporterA);
+
+    if(tempConfig->m_peers.Size() != 4 || tempConfig->m_probationarySchedule.Size() != 4)
+    {
+        cout << "Probationary list grew to " << tempConfig->m_peers.Size() << " servers. Expected 4." << endl;
+        return false;
+    }
+
+    if(tempConfig->m_peers.Find(ServerRecord({10,0,0,1}, 1234)) == PEER_INVALID_HANDLE)
+    {
+        cout << "The server reported by two servers was evicted." << endl;
+        return false;
+    }
+
+    if(tempConfig->m_peers.Find(ServerRecord({10,0,0,149}, 1234)) == PEER_INVALID_HANDLE)
+    {
+        cout << "The most recently reported server wasn't kept." << endl;
+        return false;
+    }
+
+    /// The server being talked to isn't evicted for the peers it reports,
+    /// so the client's reference to it stays valid
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->m_probationaryCapacity = 1;
+
+    msg = BuildIp4PeersMessage(buffer, 1, 1);
+    tempConfig->AddServersFromMessage(msg);
+
+    {
+        ServerRecord& selected = tempConfig->GetNextServer();
+        ServerRecord seed({10,0,0,1}, 1234);
+
+        msg = BuildIp4PeersMessage(buffer, 100, 1);
+
+        if(!(selected == seed) || !tempConfig->AddServersFromMessage(msg, &selected)
+           || !(selected == seed) || tempConfig->m_peers.Size() != 1)
+        {
+            cout << "The reporting server was evicted for a peer it reported." << endl;
+            return false;
+        }
+
+        tempConfig->MarkServerSuccessful(selected);
+
+        if(tempConfig->m_peers.Count(false, false) != 1 || tempConfig->m_peers.Count(true, false) != 0
+           || tempConfig->m_activeSchedule.Size() != 1)
+        {
+            cout << "MarkServerSuccessful didn't promote the reporting server." << endl;
+            return false;
+        }
+    }
+
+    // Nor is a reporter that wasn't selected
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->m_probationaryCapacity = 1;
+
+    msg = BuildIp4PeersMessage(buffer, 5, 1);
+    tempConfig->AddServersFromMessage(msg);
+
+    {
+        ServerRecord* reporter = tempConfig->m_peers.Get(tempConfig->m_peers.Find(ServerRecord({10,0,0,5}, 1234)));
+
+        msg = BuildIp4PeersMessage(buffer, 100, 1);
+        tempConfig->AddServersFromMessage(msg, reporter);
+
+        if(!(*reporter == ServerRecord({10,0,0,5}, 1234)) || tempConfig->m_peers.Find(ServerRecord({10,0,0,100}, 1234)) != PEER_INVALID_HANDLE)
+        {
+            cout << "A reporter was evicted for a peer it reported." << endl;
+            return false;
+        }
+
+        // Without a reporter in the way, the weaker candidate is replaced
+        tempConfig->AddServersFromMessage(msg);
+
+        if(tempConfig->m_peers.Find(ServerRecord({10,0,0,100}, 1234)) == PEER_INVALID_HANDLE)
+        {
+            cout << "A full probationary list didn't replace its weakest server." << endl;
+            return false;
+        }
+    }
+
+    if(!tempConfig->IsKnownServer(ServerRecord({10,0,0,100}, 1234)) || tempConfig->IsKnownServer(ServerRecord({10,0,0,5}, 1234)))
+    {
+        cout << "IsKnownServer doesn't match the server lists." << endl;
+        return false;
+    }
+
+    cout << "NrpdConfig::AddServersFromMessage passed all tests!" << endl << endl;
+    return true;
+}
+
+static bool CheckConfigLoadFile(string path)
+{
+    shared_ptr<NrpdConfig> tempConfig;
+    shared_ptr<const NrpdTuning> snapshot;
+    ofstream file;
+
+    file.open(path, ios::trunc);
+    file << "# nrpd test config" << endl
+         << "port = 9090" << endl
+         << "daemonize = no" << endl
+         << "  request_interval = 120   # seconds" << endl
+         << "entropy_size=32" << endl
+         << "ip6_peers = off" << endl
+         << "peer = 192.0.2.1 8080" << endl
+         << "peer = 2001:db8::1 8081" << endl;
+    file.close();
+
+    tempConfig = make_shared<NrpdConfig>(&path);
+
+    if(!tempConfig->LoadConfigFile(true))
+    {
+        cout << "LoadConfigFile failed on a valid file." << endl;
+        return false;
+    }
+
+    if(tempConfig->serverPort() != 9090
+       || tempConfig->clientRequestInterval() != 120
+       || tempConfig->defaultEntropySize() != 32
+       || !tempConfig->enablePeersResponse(ip4peers)
+       || tempConfig->enablePeersResponse(ip6peers)
+       || tempConfig->receiveTimeout() != CLIENT_RESPONSE_TIMEOUT_SECONDS)
+    {
+        cout << "LoadConfigFile didn't apply the settings in the file." << endl;
+        return false;
+    }
+
+    if(tempConfig->m_peers.Count(true, false) != 1 || tempConfig->m_peers.Count(true, true) != 1
+       || tempConfig->m_configuredServers.size() != 2)
+    {
+        cout << "LoadConfigFile didn't add the peer seeds." << endl;
+        return false;
+    }
+
+    /// Reloads publish a new snapshot, and skip startup-only settings
+    snapshot = tempConfig->Tuning();
+
+    file.open(path, ios::trunc);
+    file << "port = 9191" << endl
+         << "entropy_size = 64" << endl
+         << "probationary_budget = 10" << endl
+         << "peer = 192.0.2.1 8080" << endl;
+    file.close();
+
+    if(!tempConfig->LoadConfigFile(false))
+    {
+        cout << "LoadConfigFile failed to reload a valid file." << endl;
+        return false;
+    }
+
+    if(tempConfig->defaultEntropySize() != 64 || tempConfig->m_probationaryBudgetPercent != 10
+       || tempConfig->serverPort() != 9090 || tempConfig->m_configuredServers.size() != 2)
+    {
+        cout << "Reload didn't apply only the reloadable settings." << endl;
+        return false;
+    }
+
+    if(snapshot->defaultEntropySize != 32 || snapshot == tempConfig->Tuning())
+    {
+        cout << "Reload changed a snapshot in use." << endl;
+        return false;
+    }
+
+    /// Invalid files change nothing
+    const char* invalid[] = {"entropy_size = 1000", "entropy_size", "bogus = 1", "peer = 192.0.2.300 80", "peer = 192.0.2.3", "probationary_capacity = 0"};
+
+    for(auto line : invalid)
+    {
+        file.open(path, ios::trunc);
+        file << "request_interval = 5" << endl << line << endl;
+        file.close();
+
+        if(tempConfig->LoadConfigFile(false) || tempConfig->clientRequestInterval() != 120)
+        {
+            cout << "LoadConfigFile accepted invalid setting: " << line << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool TestConfigLoadFile()
+{
+    char path[] = "/tmp/nrpdtestXXXXXX";
+    int fd;
+    bool result;
+
+    if((fd = mkstemp(path)) < 0)
+    {
+        cout << "Failed to create temporary file. Error: " << errno << endl;
+        return false;
+    }
+
+    close(fd);
+
+    result = CheckConfigLoadFile(path);
+
+    unlink(path);
+
+    if(result)
+    {
+        cout << "NrpdConfig::LoadConfigFile passed all tests!" << endl << endl;
+    }
+
+    return result;
+}
+
+bool TestConfigGetNextServer()
+{
+    shared_ptr<NrpdConfig> tempConfig;
+    chrono::steady_clock::time_point dueTime;
+    ServerRecord tempRec;
+    ServerRecord* first;
+    ServerRecord* second;
+    int count;
+
+    /// Both lists empty
+    tempConfig = make_shared<NrpdConfig>();
+
+    if(tempConfig->NextServerDueTime(dueTime))
+    {
+        cout << "NextServerDueTime returned true with no servers. Expected false." << endl;
+        return false;
+    }
+
+    /// Active servers list is empty
+    tempConfig->AddProbationaryServer(ServerRecord({1,2,3,4}, 1234));
+    tempConfig->AddProbationaryServer(ServerRecord({5,6,7,8}, 5678));
+
+    if(!tempConfig->NextServerDueTime(dueTime) || dueTime > chrono::steady_clock::now())
+    {
+        cout << "New probationary servers weren't immediately due." << endl;
+        return false;
+    }
+
+    first = &tempConfig->GetNextServer();
+    second = &tempConfig->GetNextServer();
+
+    if(first == second)
+    {
+        cout << "GetNextServer returned the same server twice. Expected a different server." << endl;
+        return false;
+    }
+
+    // Both servers were pushed back by their retry interval
+    if(!tempConfig->NextServerDueTime(dueTime) || dueTime < chrono::steady_clock::now() + chrono::seconds(CLIENT_MIN_RETRY_SECONDS / 2))
+    {
+        cout << "GetNextServer didn't reschedule returned servers." << endl;
+        return false;
+    }
+
+    /// Verify probationary servers stay within their budget
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->AddProbationaryServer(ServerRecord({1,2,3,4}, 1234));
+    tempConfig->AddProbationaryServer(ServerRecord({5,6,7,8}, 5678));
+
+    // Promote one server to the active list, and make it due again
+    first = &tempConfig->GetNextServer();
+    first->retryTime = chrono::seconds(0);
+    tempConfig->MarkServerSuccessful(*first);
+
+    if(tempConfig->m_peers.Count(false, false) != 1 || tempConfig->m_peers.Count(true, false) != 1)
+    {
+        cout << "MarkServerSuccessful didn't move the server to the active list." << endl;
+        return false;
+    }
+
+    // Keep the remaining probationary server always eligible too
+    tempConfig->m_peers.At(true, false, 0).retryTime = chrono::seconds(0);
+    count = 0;
+
+    for(int i = 0; i < 200; i++)
+    {
+        if(tempConfig->GetNextServer().probationary)
+        {
+            count++;
+        }
+    }
+
+    if(count == 0 || count > (200 * CLIENT_PROBATIONARY_BUDGET_PERCENT / 100) + 1)
+    {
+        cout << "GetNextServer returned " << count << " probationary servers of 200. Expected at most " << CLIENT_PROBATIONARY_BUDGET_PERCENT << "%." << endl;
+        return false;
+    }
+
+    /// Verify faster, more reliable servers are preferred
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->AddProbationaryServer(ServerRecord({1,2,3,4}, 1234));
+    tempConfig->AddProbationaryServer(ServerRecord({5,6,7,8}, 5678));
+
+    // Let both servers be contacted while on probation, then never again
+    tempConfig->m_probationaryBudgetPercent = 100;
+
+    for(int i = 0; i < 2; i++)
+    {
+        ServerRecord& rec = tempConfig->GetNextServer();
+        rec.retryTime = chrono::seconds(0);
+        // First server answers in 10ms, second in 500ms
+        tempConfig->MarkServerSuccessful(rec, chrono::milliseconds((rec.host4[0] == 1) ? 10 : 500));
+    }
+
+    tempConfig->m_probationaryBudgetPercent = 0;
+
+    if(tempConfig->m_peers.Count(false, false) != 2)
+    {
+        cout << "MarkServerSuccessful didn't move both servers to the active list." << endl;
+        return false;
+    }
+
+    count = 0;
+
+    for(int i = 0; i < 200; i++)
+    {
+        if(tempConfig->GetNextServer().host4[0] == 1)
+        {
+            count++;
+        }
+    }
+
+    if(count < 150)
+    {
+        cout << "GetNextServer returned the fast server " << count << " times of 200. Expected it to be preferred." << endl;
+        return false;
+    }
+
+    /// Verify each active server is asked in proportion to its score, as
+    /// servers are rescheduled over many rounds
+    tempConfig = make_shared<NrpdConfig>();
+
+    for(unsigned char i = 0; i < 3; i++)
+    {
+        tempRec = ServerRecord({10,0,0,i}, 1234);
+        tempRec.retryTime = chrono::seconds(10);
+        // Scores of 4:2:1
+        tempRec.rttMs = (10 << i) - 1;
+        AddActiveServer(tempConfig, tempRec);
+        tempConfig->m_activeSchedule.Push(tempConfig->m_peers.Find(tempRec), chrono::steady_clock::time_point());
+    }
+
+    {
+        int shares[3] = {0, 0, 0};
+
+        for(int round = 0; round < 7000; round++)
+        {
+            auto entry = tempConfig->m_activeSchedule.Pop();
+            ServerRecord& rec = *tempConfig->m_peers.Get(entry.key);
+
+            shares[rec.host4[3]]++;
+            rec.lastaccessTime = entry.priority;
+            tempConfig->RescheduleServer(entry.key, rec);
+        }
+
+        for(int i = 0; i < 3; i++)
+        {
+            double expected = (4 >> i) / 7.0;
+
+            if(abs(shares[i] / 7000.0 - expected) > 0.02)
+            {
+                cout << "Server " << i << " was asked " << shares[i] << " times of 7000. Expected about " << (int) (expected * 7000) << "." << endl;
+                return false;
+            }
+        }
+    }
+
+    /// Verify failed servers are unscheduled when removed
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->AddProbationaryServer(ServerRecord({1,2,3,4}, 1234));
+
+    for(int i = 0; i < CLIENT_MAX_SERVER_TIMEOUT_COUNT; i++)
+    {
+        if(!tempConfig->NextServerDueTime(dueTime))
+        {
+            break;
+        }
+
+        tempConfig->IncrementServerFailCount(tempConfig->GetNextServer());
+    }
+
+    if(tempConfig->NextServerDueTime(dueTime) || tempConfig->m_peers.Size() != 0)
+    {
+        cout << "IncrementServerFailCount didn't remove the failed server." << endl;
+        return false;
+    }
+
+    cout << "NrpdConfig::GetNextServer passed all tests!" << endl << endl;
+    return true;
+}
+
+bool TestConfigIncrementServerFailCount()
+{
+    // Verify multiple calls remove server from active list
+    // verify multiple calls remove server from probationary list
+    // Test with the servers pointed to by the iterator and not pointed to by the iterator
+    return false;
+}
+
+bool TestConfigMarkServerSuccessful()
 {
     // Verify multiple calls move server from probationary to active list
     // Verify calls reset failure count on a server
@@ -1045,6 +2991,1007 @@ bool TestConfigMarkServerSuccessful()
     return false;
 }
 
+bool TestIndexedHeap()
+{
+    IndexedHeap<int, int> heap;
+    std::mt19937 mt(time(nullptr));
+    std::uniform_int_distribution<int> dis(0, 10000);
+    int previous;
+    int priority;
+
+    // Insert keys with random priorities
+    for(int i = 0; i < 1000; i++)
+    {
+        heap.Push(i, dis(mt));
+    }
+
+    // Re-prioritize some keys in both directions, and remove some others
+    for(int i = 0; i < 1000; i += 7)
+    {
+        heap.Push(i, dis(mt));
+    }
+
+    for(int i = 3; i < 1000; i += 11)
+    {
+        if(!heap.Remove(i))
+        {
+            cout << "IndexedHeap::Remove returned false. Expected true." << endl;
+            return false;
+        }
+    }
+
+    if(heap.Remove(3))
+    {
+        cout << "IndexedHeap::Remove of a removed key returned true. Expected false." << endl;
+        return false;
+    }
+
+    if(!heap.GetPriority(1, priority) || heap.GetPriority(3, priority))
+    {
+        cout << "IndexedHeap::GetPriority returned the wrong presence." << endl;
+        return false;
+    }
+
+    if(heap.Size() != 1000 - 91)
+    {
+        cout << "IndexedHeap size is " << heap.Size() << ". Expected: " << 1000 - 91 << endl;
+        return false;
+    }
+
+    // Entries must come out in priority order
+    previous = -1;
+
+    while(!heap.Empty())
+    {
+        auto entry = heap.Pop();
+
+        if(entry.priority < previous)
+        {
+            cout << "IndexedHeap popped priority " << entry.priority << " after " << previous << endl;
+            return false;
+        }
+
+        if(heap.Contains(entry.key))
+        {
+            cout << "IndexedHeap still contains a popped key." << endl;
+            return false;
+        }
+
+        previous = entry.priority;
+    }
+
+    cout << "IndexedHeap passed all tests!" << endl << endl;
+    return true;
+}
+
+bool TestPeerStore()
+{
+    PeerStore<ServerRecord> store;
+    vector<PeerHandle> handles;
+    ServerRecord* first;
+    ServerRecord tempRec;
+    PeerHandle handle;
+    PeerHandle stale;
+    // Enough records to span several slab chunks
+    const unsigned int count = (PEER_STORE_CHUNK_SIZE * 2) + 10;
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        tempRec = ServerRecord({10, (unsigned char) (i >> 16), (unsigned char) (i >> 8), (unsigned char) i}, 1234);
+
+        if((handle = store.Add(tempRec)) == PEER_INVALID_HANDLE)
+        {
+            cout << "PeerStore failed to add record " << i << endl;
+            return false;
+        }
+
+        handles.push_back(handle);
+    }
+
+    first = store.Get(handles[0]);
+
+    // Duplicate addresses are rejected, and found by address
+    tempRec = ServerRecord({10, 0, 0, 5}, 1234);
+
+    if(store.Add(tempRec) != PEER_INVALID_HANDLE || store.Find(tempRec) != handles[5])
+    {
+        cout << "PeerStore didn't find the existing record for a duplicate address." << endl;
+        return false;
+    }
+
+    if(store.Size() != count || store.Count(true, false) != count || store.Count(false, false) != 0)
+    {
+        cout << "PeerStore counts are wrong after adding " << count << " records." << endl;
+        return false;
+    }
+
+    // Promote every even record
+    for(unsigned int i = 0; i < count; i += 2)
+    {
+        if(!store.SetProbationary(handles[i], false))
+        {
+            cout << "PeerStore failed to promote record " << i << endl;
+            return false;
+        }
+    }
+
+    if(store.Count(false, false) != (count + 1) / 2 || store.Count(true, false) != count / 2)
+    {
+        cout << "PeerStore counts are wrong after promotion." << endl;
+        return false;
+    }
+
+    // Records don't move when the slab grows or their state changes
+    if(store.Get(handles[0]) != first || first->probationary || first->host4[3] != 0)
+    {
+        cout << "PeerStore moved a record." << endl;
+        return false;
+    }
+
+    // Remove every active record; only probationary ones remain
+    for(unsigned int i = 0; i < count; i += 2)
+    {
+        if(!store.Remove(handles[i]))
+        {
+            cout << "PeerStore failed to remove record " << i << endl;
+            return false;
+        }
+    }
+
+    if(store.Count(false, false) != 0 || store.Size() != count / 2)
+    {
+        cout << "PeerStore counts are wrong after removal." << endl;
+        return false;
+    }
+
+    for(size_t i = 0; i < store.Count(true, false); i++)
+    {
+        ServerRecord& rec = store.At(true, false, i);
+
+        if(!rec.probationary || (rec.host4[3] % 2) != 1)
+        {
+            cout << "PeerStore listed the wrong record after removal." << endl;
+            return false;
+        }
+    }
+
+    // Removed handles stay dead, even after their slot is reused
+    stale = handles[0];
+    tempRec = ServerRecord({0xf,0xe,0xd,0xc,0xb,0xa,9,8,7,6,5,4,3,2,1,0}, 1234);
+
+    if((handle = store.Add(tempRec)) == PEER_INVALID_HANDLE || store.Count(true, true) != 1)
+    {
+        cout << "PeerStore failed to add an IPv6 record." << endl;
+        return false;
+    }
+
+    if(store.Get(stale) != nullptr || store.Remove(stale) || store.Get(PEER_INVALID_HANDLE) != nullptr)
+    {
+        cout << "PeerStore resolved a removed handle." << endl;
+        return false;
+    }
+
+    if(store.Find(ServerRecord({10, 0, 0, 0}, 1234)) != PEER_INVALID_HANDLE)
+    {
+        cout << "PeerStore found a removed address." << endl;
+        return false;
+    }
+
+    cout << "PeerStore passed all tests!" << endl << endl;
+    return true;
+}
+
+static bool CheckPeerDatabase(const char* path)
+{
+    shared_ptr<NrpdConfig> tempConfig;
+    chrono::steady_clock::time_point dueTime;
+    PeerDatabase database;
+    PeerHandle handle;
+    ServerRecord* rec;
+
+    /// Prove two servers, fail one of them once, and ban a third
+    tempConfig = make_shared<NrpdConfig>();
+
+    if(tempConfig->OpenPeerDatabase(path) != 0 || tempConfig->m_peers.Size() != 0)
+    {
+        cout << "Failed to open a new peer database." << endl;
+        return false;
+    }
+
+    tempConfig->m_probationaryBudgetPercent = 100;
+    tempConfig->AddProbationaryServer(ServerRecord({1,2,3,4}, 1234));
+    tempConfig->AddProbationaryServer(ServerRecord({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf}, 4321));
+    tempConfig->AddProbationaryServer(ServerRecord({5,6,7,8}, 5678));
+
+    for(int i = 0; i < 3; i++)
+    {
+        ServerRecord& next = tempConfig->GetNextServer();
+        tempConfig->MarkServerSuccessful(next, chrono::milliseconds(20));
+    }
+
+    handle = tempConfig->m_peers.Find(ServerRecord({1,2,3,4}, 1234));
+    tempConfig->IncrementServerFailCount(*tempConfig->m_peers.Get(handle));
+
+    handle = tempConfig->m_peers.Find(ServerRecord({5,6,7,8}, 5678));
+
+    for(int i = 0; i < CLIENT_MAX_SERVER_TIMEOUT_COUNT; i++)
+    {
+        if((rec = tempConfig->m_peers.Get(handle)) != nullptr)
+        {
+            tempConfig->IncrementServerFailCount(*rec);
+        }
+    }
+
+    tempConfig.reset();
+
+    /// A restarted config starts with the proven servers, due immediately
+    tempConfig = make_shared<NrpdConfig>();
+
+    if(tempConfig->OpenPeerDatabase(path) != 0)
+    {
+        cout << "Failed to reopen the peer database." << endl;
+        return false;
+    }
+
+    if(tempConfig->m_peers.Count(false, false) != 1 || tempConfig->m_peers.Count(false, true) != 1)
+    {
+        cout << "Peer database loaded " << tempConfig->m_peers.Size() << " servers. Expected 2." << endl;
+        return false;
+    }
+
+    if(!tempConfig->NextServerDueTime(dueTime) || dueTime > chrono::steady_clock::now())
+    {
+        cout << "Servers loaded from the peer database weren't immediately due." << endl;
+        return false;
+    }
+
+    rec = tempConfig->m_peers.Get(tempConfig->m_peers.Find(ServerRecord({1,2,3,4}, 1234)));
+
+    if(rec == nullptr || rec->probationary || rec->failureCount != 1 || fabs(rec->rttMs - 20.0f) > 0.01f)
+    {
+        cout << "Peer database didn't preserve the server's history." << endl;
+        return false;
+    }
+
+    tempConfig.reset();
+
+    /// Records that fail their checksum, e.g. torn by a crash, are dropped
+    if(database.Open(path) != 0 || database.Load().size() != 2)
+    {
+        cout << "Failed to reload the peer database." << endl;
+        return false;
+    }
+
+    database.m_records[0].rttMs += 1.0f;
+
+    if(database.Open(path) != 0 || database.Load().size() != 1)
+    {
+        cout << "Peer database loaded a record that failed its checksum." << endl;
+        return false;
+    }
+
+    /// Old records are forgotten
+    if(database.Open(path) != 0
+       || database.Load(chrono::seconds(-10)).size() != 0
+       || database.Load().size() != 0)
+    {
+        cout << "Peer database kept records older than the maximum age." << endl;
+        return false;
+    }
+
+    /// Databases of another capacity are reset
+    if(database.Open(path, 16) != 0 || database.Load().size() != 0)
+    {
+        cout << "Peer database loaded records from a mismatched file." << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool TestPeerDatabase()
+{
+    char path[] = "/tmp/nrpdtestXXXXXX";
+    int fd;
+    bool result;
+
+    if((fd = mkstemp(path)) < 0)
+    {
+        cout << "Failed to create temporary file. Error: " << errno << endl;
+        return false;
+    }
+
+    close(fd);
+
+    result = CheckPeerDatabase(path);
+
+    unlink(path);
+
+    if(result)
+    {
+        cout << "PeerDatabase passed all tests!" << endl << endl;
+    }
+
+    return result;
+}
+
+// Size of the file behind fd, or -1 on error
+static off_t FileSize(int fd)
+{
+    struct stat st;
+
+    if(fstat(fd, &st) != 0)
+    {
+        return -1;
+    }
+
+    return st.st_size;
+}
+
+// Exercise an EntropyAccumulator writing to fd, which must be empty
+static bool CheckEntropyAccumulator(int fd)
+{
+    unsigned char data[48];
+
+    memset(data, 0xa5, sizeof(data));
+
+    {
+        EntropyAccumulator accumulator(fd, 64, chrono::seconds(3600), 1);
+
+        // Below the flush size, nothing is written
+        if(!accumulator.Add(data, sizeof(data), sizeof(data) * 8, 1) || FileSize(fd) != 0)
+        {
+            cout << "EntropyAccumulator wrote before reaching the flush size." << endl;
+            return false;
+        }
+
+        if(accumulator.PendingCredit() != sizeof(data) * 8)
+        {
+            cout << "EntropyAccumulator credit is " << accumulator.PendingCredit() << ". Expected: " << sizeof(data) * 8 << endl;
+            return false;
+        }
+
+        // Credit can't exceed 8 bits per byte
+        if(!accumulator.Add(data, 1, 1000, 1) || accumulator.PendingCredit() != (sizeof(data) + 1) * 8)
+        {
+            cout << "EntropyAccumulator credited more than 8 bits per byte." << endl;
+            return false;
+        }
+
+        // The interval hasn't elapsed, so nothing is written
+        if(!accumulator.FlushIfDue() || FileSize(fd) != 0)
+        {
+            cout << "EntropyAccumulator flushed before the flush interval." << endl;
+            return false;
+        }
+
+        // Reaching the flush size writes one digest
+        if(!accumulator.Add(data, sizeof(data), 0, 1) || FileSize(fd) != ACCUMULATOR_DIGEST_SIZE)
+        {
+            cout << "EntropyAccumulator wrote " << FileSize(fd) << " bytes at the flush size. Expected: " << ACCUMULATOR_DIGEST_SIZE << endl;
+            return false;
+        }
+
+        if(accumulator.PendingBytes() != 0 || accumulator.PendingCredit() != 0)
+        {
+            cout << "EntropyAccumulator kept pending input after flushing." << endl;
+            return false;
+        }
+
+        // An elapsed interval flushes a partial block
+        accumulator.SetFlushPolicy(64, chrono::seconds(0), 1);
+
+        if(!accumulator.Add(data, 1, 1, 1) || !accumulator.FlushIfDue() || FileSize(fd) != 2 * ACCUMULATOR_DIGEST_SIZE)
+        {
+            cout << "EntropyAccumulator didn't flush after the flush interval." << endl;
+            return false;
+        }
+
+        // Pending input is flushed on destruction
+        accumulator.Add(data, 1, 1, 1);
+    }
+
+    if(FileSize(fd) != 3 * ACCUMULATOR_DIGEST_SIZE)
+    {
+        cout << "EntropyAccumulator didn't flush on destruction." << endl;
+        return false;
+    }
+
+    // Needing three servers, a block isn't flushed for its size until
+    // they've all contributed, and the largest source isn't credited
+    {
+        EntropyAccumulator accumulator(fd, 64, chrono::seconds(3600), 3);
+
+        if(!accumulator.Add(data, sizeof(data), 200, 1) || !accumulator.Add(data, sizeof(data), 200, 1)
+           || !accumulator.Add(data, 8, 64, ACCUMULATOR_LOCAL_SOURCE) || FileSize(fd) != 3 * ACCUMULATOR_DIGEST_SIZE)
+        {
+            cout << "EntropyAccumulator flushed input from one server." << endl;
+            return false;
+        }
+
+        if(accumulator.PendingServers() != 1 || accumulator.FlushCredit() != 64)
+        {
+            cout << "EntropyAccumulator would credit " << accumulator.FlushCredit() << " bits from one server. Expected: 64" << endl;
+            return false;
+        }
+
+        if(!accumulator.Add(data, 8, 64, 2) || FileSize(fd) != 3 * ACCUMULATOR_DIGEST_SIZE
+           || accumulator.PendingServers() != 2 || accumulator.FlushCredit() != 128)
+        {
+            cout << "EntropyAccumulator mishandled a second server." << endl;
+            return false;
+        }
+
+        if(!accumulator.Add(data, 8, 64, 3) || FileSize(fd) != 4 * ACCUMULATOR_DIGEST_SIZE
+           || accumulator.PendingServers() != 0 || accumulator.PendingCredit() != 0)
+        {
+            cout << "EntropyAccumulator didn't flush once three servers contributed." << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static sockaddr_storage MakeIp4Address(const char* text)
+{
+    sockaddr_storage stor;
+    sockaddr_in& in4 = (sockaddr_in&) stor;
+
+    memset(&stor, 0, sizeof(stor));
+    in4.sin_family = AF_INET;
+    in4.sin_port = htons(1234);
+    inet_pton(AF_INET, text, &in4.sin_addr);
+
+    return stor;
+}
+
+static sockaddr_storage MakeIp6Address(const char* text)
+{
+    sockaddr_storage stor;
+    sockaddr_in6& in6 = (sockaddr_in6&) stor;
+
+    memset(&stor, 0, sizeof(stor));
+    in6.sin6_family = AF_INET6;
+    in6.sin6_port = htons(1234);
+    inet_pton(AF_INET6, text, &in6.sin6_addr);
+
+    return stor;
+}
+
+bool TestPathMtuCache()
+{
+    PathMtuCache cache(2, PATH_MTU_LIFETIME_SECONDS);
+    sockaddr_storage loopback = MakeIp4Address("127.0.0.1");
+    sockaddr_storage neighbor = MakeIp4Address("127.0.0.200");
+    sockaddr_storage mapped = MakeIp6Address("::ffff:127.0.0.1");
+    sockaddr_storage other = MakeIp4Address("127.0.1.1");
+    sockaddr_storage global6 = MakeIp6Address("2001:db8::1");
+    int mtu = PathMtuCache::ProbeMtu(loopback);
+    int payload;
+
+    // 1. The loopback path is probed, and carries more than the fixed cap
+    if(mtu < MAX_IP4_PACKET_SIZE + IP4_UDP_HEADER_SIZE)
+    {
+        cout << "PathMtuCache::ProbeMtu returned " << mtu << " for loopback" << endl;
+        return false;
+    }
+
+    payload = cache.MaxPayload(loopback);
+
+    if(payload != min(mtu - IP4_UDP_HEADER_SIZE, MAX_RESPONSE_MESSAGE_SIZE))
+    {
+        cout << "PathMtuCache::MaxPayload returned " << payload << " for MTU " << mtu << endl;
+        return false;
+    }
+
+    // 2. Clients in the same prefix, and IPv4-mapped clients, share an entry
+    if(cache.MaxPayload(neighbor) != payload || cache.MaxPayload(mapped) != payload || cache.Size() != 1)
+    {
+        cout << "PathMtuCache didn't share an entry within a prefix. Size: " << cache.Size() << endl;
+        return false;
+    }
+
+    if(!(PathMtuCache::PrefixOf(loopback) == PathMtuCache::PrefixOf(mapped))
+       || PathMtuCache::PrefixOf(loopback) == PathMtuCache::PrefixOf(other))
+    {
+        cout << "PathMtuCache::PrefixOf grouped addresses incorrectly" << endl;
+        return false;
+    }
+
+    // 3. Never less than what every path carries, even if unroutable
+    payload = cache.MaxPayload(global6);
+
+    if(payload < MAX_IP6_PACKET_SIZE || payload > MAX_RESPONSE_MESSAGE_SIZE)
+    {
+        cout << "PathMtuCache::MaxPayload returned " << payload << " for IPv6" << endl;
+        return false;
+    }
+
+    // 4. A full cache evicts only its oldest entry for a new prefix
+    cache.MaxPayload(other);
+
+    if(cache.Size() != 2 || cache.CachedPayload(loopback) != 0
+       || cache.CachedPayload(global6) != payload || cache.CachedPayload(other) == 0)
+    {
+        cout << "PathMtuCache didn't evict just the oldest entry. Size: " << cache.Size() << endl;
+        return false;
+    }
+
+    // 5. Invalidate forgets the prefix
+    cache.Invalidate(other);
+
+    if(cache.m_entries.find(PathMtuCache::PrefixOf(other)) != cache.m_entries.end())
+    {
+        cout << "PathMtuCache::Invalidate didn't remove the entry" << endl;
+        return false;
+    }
+
+    cout << "PathMtuCache passed all tests!" << endl << endl;
+
+    return true;
+}
+
+bool TestEntropyAccumulator()
+{
+    char path[] = "/tmp/nrpdtestXXXXXX";
+    int fd;
+    bool result;
+
+    // A regular file stands in for the random device. RNDADDENTROPY fails
+    // on it, so the accumulator must fall back to uncredited writes.
+    if((fd = mkstemp(path)) < 0)
+    {
+        cout << "Failed to create temporary file. Error: " << errno << endl;
+        return false;
+    }
+
+    unlink(path);
+
+    result = CheckEntropyAccumulator(fd);
+
+    close(fd);
+
+    if(result)
+    {
+        cout << "EntropyAccumulator passed all tests!" << endl << endl;
+    }
+
+    return result;
+}
+
+// Overwrite the file at path with value
+static bool WriteValueFile(const char* path, int value)
+{
+    FILE* file = fopen(path, "w");
+
+    if(file == nullptr)
+    {
+        return false;
+    }
+
+    fprintf(file, "%d\n", value);
+    fclose(file);
+
+    return true;
+}
+
+bool TestEntropyDemand()
+{
+    char availPath[] = "/tmp/nrpdavailXXXXXX";
+    char poolPath[] = "/tmp/nrpdpoolXXXXXX";
+    shared_ptr<NrpdConfig> tempConfig;
+    chrono::steady_clock::time_point dueTime;
+    chrono::steady_clock::time_point start;
+    bool result = true;
+    int fd;
+
+    /// Demand level tracks the pool fill level
+    if((fd = mkstemp(availPath)) < 0)
+    {
+        cout << "Failed to create temporary file. Error: " << errno << endl;
+        return false;
+    }
+    close(fd);
+
+    if((fd = mkstemp(poolPath)) < 0)
+    {
+        cout << "Failed to create temporary file. Error: " << errno << endl;
+        unlink(availPath);
+        return false;
+    }
+    close(fd);
+
+    WriteValueFile(poolPath, 4096);
+    WriteValueFile(availPath, 512);
+
+    {
+        EntropyDemand demand;
+
+        if(demand.Initialize(availPath, poolPath, "/nonexistent/random") != 0)
+        {
+            cout << "EntropyDemand failed to initialize." << endl;
+            result = false;
+        }
+        else if(demand.Level() != demand_high)
+        {
+            cout << "EntropyDemand level with an empty pool wasn't high." << endl;
+            result = false;
+        }
+        else if(!WriteValueFile(availPath, 2048) || demand.Level() != demand_normal)
+        {
+            cout << "EntropyDemand level with a half-full pool wasn't normal." << endl;
+            result = false;
+        }
+        else if(!WriteValueFile(availPath, 4096) || demand.Level() != demand_low)
+        {
+            cout << "EntropyDemand level with a full pool wasn't low." << endl;
+            result = false;
+        }
+
+        // Without a wakeup device, waiting sleeps until the due time
+        start = chrono::steady_clock::now();
+
+        if(result && (demand.WaitUntil(start + 50ms) || chrono::steady_clock::now() < start + 50ms))
+        {
+            cout << "EntropyDemand::WaitUntil returned early without a wakeup device." << endl;
+            result = false;
+        }
+    }
+
+    /// A fixed-size pool always reads full once seeded, which says nothing
+    /// about demand; only an unseeded one is acted on
+    WriteValueFile(poolPath, DEMAND_FIXED_POOL_SIZE);
+    WriteValueFile(availPath, DEMAND_FIXED_POOL_SIZE);
+
+    if(result)
+    {
+        EntropyDemand demand;
+
+        if(demand.Initialize(availPath, poolPath, "/nonexistent/random") != 0 || demand.Level() != demand_normal)
+        {
+            cout << "EntropyDemand level with a fixed-size pool wasn't normal." << endl;
+            result = false;
+        }
+        else if(!WriteValueFile(availPath, 32) || demand.Level() != demand_high)
+        {
+            cout << "EntropyDemand level with an unseeded fixed-size pool wasn't high." << endl;
+            result = false;
+        }
+    }
+
+    /// A device that always wants entropy wakes the caller once, then not
+    /// again until the wakeup interval has passed
+    if(result)
+    {
+        EntropyDemand demand;
+
+        start = chrono::steady_clock::now();
+
+        if(demand.Initialize(availPath, poolPath, "/dev/null") != 0
+           || !demand.WaitUntil(start + 1000ms) || chrono::steady_clock::now() >= start + 1000ms)
+        {
+            cout << "EntropyDemand::WaitUntil wasn't woken by a writable device." << endl;
+            result = false;
+        }
+        else if(demand.WaitUntil(start + 50ms) || chrono::steady_clock::now() < start + 50ms)
+        {
+            cout << "EntropyDemand::WaitUntil was woken again within the wakeup interval." << endl;
+            result = false;
+        }
+    }
+
+    unlink(availPath);
+    unlink(poolPath);
+
+    if(!result)
+    {
+        return false;
+    }
+
+    /// Missing proc files fail initialization
+    {
+        EntropyDemand demand;
+
+        if(demand.Initialize("/nonexistent/avail", "/nonexistent/poolsize") == 0)
+        {
+            cout << "EntropyDemand initialized without its proc files." << endl;
+            return false;
+        }
+
+        if(demand.Level() != demand_normal)
+        {
+            cout << "EntropyDemand level without proc files wasn't normal." << endl;
+            return false;
+        }
+    }
+
+    /// Rescaling the schedule brings pending servers forward
+    tempConfig = make_shared<NrpdConfig>();
+    tempConfig->AddProbationaryServer(ServerRecord({1,2,3,4}, 1234));
+    tempConfig->GetNextServer();
+
+    tempConfig->SetRetryScale(1.0f / DEMAND_SPEEDUP_FACTOR);
+
+    if(!tempConfig->NextServerDueTime(dueTime)
+       || dueTime > chrono::steady_clock::now() + chrono::seconds(CLIENT_MIN_RETRY_SECONDS / DEMAND_SPEEDUP_FACTOR))
+    {
+        cout << "SetRetryScale didn't bring the next server forward." << endl;
+        return false;
+    }
+
+    tempConfig->SetRetryScale(DEMAND_BACKOFF_FACTOR);
+
+    if(!tempConfig->NextServerDueTime(dueTime)
+       || dueTime < chrono::steady_clock::now() + chrono::seconds(CLIENT_MIN_RETRY_SECONDS))
+    {
+        cout << "SetRetryScale didn't push the next server back." << endl;
+        return false;
+    }
+
+    cout << "EntropyDemand passed all tests!" << endl << endl;
+    return true;
+}
+
+bool TestMaskEntropy()
+{
+    array<unsigned char, MAX_ENTROPY_SIZE> original;
+    array<unsigned char, MAX_ENTROPY_SIZE> expected;
+    array<unsigned char, MAX_ENTROPY_SIZE> actual;
+    array<unsigned char, MAX_ENTROPY_SIZE / 8> mask;
+    mt19937 engine(42);
+    int fd;
+
+    for(auto& byte : original)
+    {
+        byte = (engine() % 255) + 1; // never 0, so masked bytes are visible
+    }
+
+    for(size_t size = 0; size <= MAX_ENTROPY_SIZE; size++)
+    {
+        for(auto& byte : mask)
+        {
+            byte = engine();
+        }
+
+        expected = original;
+        MaskEntropyScalar(size, expected.data(), mask.data());
+
+        for(size_t idx = 0; idx < size; idx++)
+        {
+            bool keep = (mask[idx / 8] >> (idx % 8)) & 0x1;
+
+            if(expected[idx] != (keep ? original[idx] : 0))
+            {
+                cout << "Scalar mask is wrong at byte " << idx << " of " << size << endl;
+                return false;
+            }
+        }
+
+        // Bytes past the end must not be touched
+        if(memcmp(expected.data() + size, original.data() + size, MAX_ENTROPY_SIZE - size) != 0)
+        {
+            cout << "Scalar mask wrote past " << size << " bytes" << endl;
+            return false;
+        }
+
+        if(CpuSupportsSse2())
+        {
+            actual = original;
+            MaskEntropySse2(size, actual.data(), mask.data());
+
+            if(actual != expected)
+            {
+                cout << "SSE2 mask differs from scalar for size " << size << endl;
+                return false;
+            }
+        }
+
+        if(CpuSupportsAvx2())
+        {
+            actual = original;
+            MaskEntropyAvx2(size, actual.data(), mask.data());
+
+            if(actual != expected)
+            {
+                cout << "AVX2 mask differs from scalar for size " << size << endl;
+                return false;
+            }
+        }
+
+        actual = original;
+        MaskEntropy(size, actual.data(), mask.data());
+
+        if(actual != expected)
+        {
+            cout << "Dispatched mask differs from scalar for size " << size << endl;
+            return false;
+        }
+    }
+
+    // RandomBuffer: reads straddling refills return fresh bytes
+    if((fd = open("/dev/urandom", O_RDONLY)) < 0)
+    {
+        cout << "Failed to open /dev/urandom. Error: " << errno << endl;
+        return false;
+    }
+
+    {
+        RandomBuffer buffer(fd, 16);
+        unsigned char first[24] = {0};
+        unsigned char second[24] = {0};
+
+        if(!buffer.Read(first, sizeof(first)) || !buffer.Read(second, sizeof(second)))
+        {
+            cout << "RandomBuffer failed to read" << endl;
+            close(fd);
+            return false;
+        }
+
+        if(memcmp(first, second, sizeof(first)) == 0)
+        {
+            cout << "RandomBuffer handed out the same bytes twice" << endl;
+            close(fd);
+            return false;
+        }
+    }
+
+    close(fd);
+
+    {
+        // Reads from a closed descriptor must fail, not hand out stale bytes
+        RandomBuffer buffer(-1, 16);
+        unsigned char out[8];
+
+        if(buffer.Read(out, sizeof(out)))
+        {
+            cout << "RandomBuffer read from an invalid descriptor" << endl;
+            return false;
+        }
+    }
+
+    cout << "MaskEntropy passed all tests!" << endl << endl;
+    return true;
+}
+
+bool TestHealthTests()
+{
+    vector<unsigned char> data(HEALTH_FREQUENCY_WINDOW * 16);
+    mt19937 engine(49);
+    int result;
+
+    // Vectorized counting matches the scalar versions at every alignment
+    // and tail, and over enough bytes to carry out of the byte counters
+    for(auto& byte : data)
+    {
+        byte = engine() % 3;
+    }
+
+    for(size_t size = 0; size <= 200; size++)
+    {
+        size_t repeat = FindRepeatScalar(data.data() + 1, size);
+        size_t count = CountByteScalar(data.data() + 1, size, 1);
+
+        if((CpuSupportsSse2() && (FindRepeatSse2(data.data() + 1, size) != repeat || CountByteSse2(data.data() + 1, size, 1) != count))
+           || (CpuSupportsAvx2() && (FindRepeatAvx2(data.data() + 1, size) != repeat || CountByteAvx2(data.data() + 1, size, 1) != count))
+           || FindRepeat(data.data() + 1, size) != repeat || CountByte(data.data() + 1, size, 1) != count)
+        {
+            cout << "Vectorized counting differs from scalar for size " << size << endl;
+            return false;
+        }
+    }
+
+    memset(data.data(), 7, data.size());
+
+    if(CountByte(data.data(), data.size(), 7) != data.size() || CountByte(data.data(), data.size(), 8) != 0)
+    {
+        cout << "CountByte miscounted a constant stream" << endl;
+        return false;
+    }
+
+    for(size_t idx = 0; idx < data.size(); idx++)
+    {
+        data[idx] = idx;
+    }
+
+    if(FindRepeat(data.data(), data.size()) != data.size())
+    {
+        cout << "FindRepeat found a repeat in a stream without one" << endl;
+        return false;
+    }
+
+    data[1000] = data[999];
+
+    if(FindRepeat(data.data(), data.size()) != 1000)
+    {
+        cout << "FindRepeat missed a repeat" << endl;
+        return false;
+    }
+
+    // Uniform bytes pass every test, in messages of any size
+    {
+        HealthTest health;
+
+        for(auto& byte : data)
+        {
+            byte = engine();
+        }
+
+        for(size_t idx = 0; idx < data.size(); idx += 37)
+        {
+            if((result = health.Test(data.data() + idx, min(data.size() - idx, (size_t) 37))) != health_ok)
+            {
+                cout << "Uniform bytes failed health tests: " << result << endl;
+                return false;
+            }
+        }
+    }
+
+    // A run one short of the cutoff passes; a full one fails, even split
+    // across messages
+    {
+        HealthTest health;
+        unsigned char run[HEALTH_REPETITION_CUTOFF];
+
+        memset(run, 0xAA, sizeof(run));
+
+        if(health.Test(run, HEALTH_REPETITION_CUTOFF - 1) != health_ok)
+        {
+            cout << "A short run failed the repetition test" << endl;
+            return false;
+        }
+
+        if(health.Test(run, 1) != health_repetition)
+        {
+            cout << "A run split across messages passed the repetition test" << endl;
+            return false;
+        }
+    }
+
+    // One byte in nine of every ten has no long runs, but fails the
+    // adaptive proportion test within one window
+    {
+        HealthTest health;
+
+        for(size_t idx = 0; idx < HEALTH_PROPORTION_WINDOW; idx++)
+        {
+            data[idx] = ((idx % 10) == 9) ? idx : 0xAA;
+        }
+
+        if((result = health.Test(data.data(), HEALTH_PROPORTION_WINDOW)) != health_proportion)
+        {
+            cout << "A biased window gave " << result << ", not a proportion failure" << endl;
+            return false;
+        }
+    }
+
+    // Half the byte values, uniformly, pass the others, but fail the
+    // chi-square test once its window is full
+    {
+        HealthTest health;
+
+        for(size_t idx = 0; idx < HEALTH_FREQUENCY_WINDOW; idx++)
+        {
+            data[idx] = engine() % 128;
+        }
+
+        if(health.Test(data.data(), HEALTH_FREQUENCY_WINDOW - 1) != health_ok)
+        {
+            cout << "A partial window failed the health tests" << endl;
+            return false;
+        }
+
+        if((result = health.Test(data.data() + HEALTH_FREQUENCY_WINDOW - 1, 1)) != health_frequency)
+        {
+            cout << "Half the byte values gave " << result << ", not a frequency failure" << endl;
+            return false;
+        }
+    }
+
+    cout << "HealthTest passed all tests!" << endl << endl;
+    return true;
+}
+
 bool TestMruCacheSockaddrStorage()
 {
     auto init6 = std::initializer_list<unsigned char>({0,1,2,3,4,5,6,7,8,9,0xa,0xb,0xc,0xd,0xe,0xf});
@@ -1128,7 +4075,7 @@ bool TestMruCacheSockaddrStorage()
             cout << "MruCache cleaner thread didn't clean up! " <<  cache->m_recentClients.size() << " items remain." << endl;
             for(auto& item : cache->m_recentClients)
             {
-                cout << "    Item age " << chrono::duration_cast<chrono::seconds>(cache->s_clock.now() - item.second).count() << " seconds." << endl;
+                cout << "    Item age " << chrono::duration_cast<chrono::seconds>(cache->s_clock.now() - item.second.time).count() << " seconds." << endl;
             }
 
             return false;
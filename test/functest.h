@@ -24,6 +24,69 @@ bool TestConfigActiveServerCount();
 // A test to validate config generation of a flat server list
 bool TestConfigGetServerList();
 
+// A test to validate config parsing of peer messages into probationary servers
+bool TestConfigAddServersFromMessage();
+
+// A test to validate config file loading and reloading
+bool TestConfigLoadFile();
+
+// A test to validate config scheduling of servers to contact
+bool TestConfigGetNextServer();
+
+// A test to validate ordering, update, and removal in IndexedHeap
+bool TestIndexedHeap();
+
+// A test to validate lookup, promotion, and removal in PeerStore
+bool TestPeerStore();
+
+// A test to validate that proven servers persist across restarts
+bool TestPeerDatabase();
+
+// A test to validate ParseMessages honors a client's receive size
+bool TestServerParseMessagesReceiveSize();
+
+// A test to validate ParseMessages echoes a client's transaction ID
+bool TestServerParseMessagesTransactionId();
+
+// A test to validate packets are viewed only within the bytes received
+bool TestPacketView();
+
+// A test to validate message validation follows the message registry
+bool TestMessageRegistry();
+
+// A test to validate fast path responses match ParseMessages
+bool TestServerFastPath();
+
+// A test to validate signed keys and sealed entropy between server and client
+bool TestSecureEntropy();
+
+// A test to validate session keys are cached by client key and key ID
+bool TestSessionKeyCache();
+
+// A test to validate servers' keys are verified on worker threads
+bool TestKeyVerifier();
+
+// A test to validate cert chain chunks, and serving them from the blob
+bool TestCertChain();
+
+// A test to validate bulk entropy trains sent and received over loopback
+bool TestBulkEntropyLoopback();
+
+// A test to validate probing and caching of path MTUs by prefix
+bool TestPathMtuCache();
+
+// A test to validate batching and flushing in EntropyAccumulator
+bool TestEntropyAccumulator();
+
+// A test to validate demand levels and schedule rescaling
+bool TestEntropyDemand();
+
+// A test to validate the vectorized entropy masks against the scalar one
+bool TestMaskEntropy();
+
+// A test to validate the entropy health tests, and their vectorized counting
+bool TestHealthTests();
+
 // A test to validate the functionality of MruCache with sockaddr_storage
 bool TestMruCacheSockaddrStorage();
 
@@ -19,8 +19,29 @@ int main(int argc, char* argv[])
     RUN_TEST(TestServerCalculateMessageSize);
     RUN_TEST(TestConfigActiveServerCount);
     RUN_TEST(TestConfigGetServerList);
+    RUN_TEST(TestConfigAddServersFromMessage);
+    RUN_TEST(TestConfigLoadFile);
+    RUN_TEST(TestConfigGetNextServer);
     RUN_TEST(TestServerGeneratePeersResponse);
     RUN_TEST(TestServerGenerateEntropyResponse);
+    RUN_TEST(TestServerParseMessagesReceiveSize);
+    RUN_TEST(TestServerParseMessagesTransactionId);
+    RUN_TEST(TestPacketView);
+    RUN_TEST(TestMessageRegistry);
+    RUN_TEST(TestServerFastPath);
+    RUN_TEST(TestSecureEntropy);
+    RUN_TEST(TestSessionKeyCache);
+    RUN_TEST(TestKeyVerifier);
+    RUN_TEST(TestCertChain);
+    RUN_TEST(TestBulkEntropyLoopback);
+    RUN_TEST(TestIndexedHeap);
+    RUN_TEST(TestPeerStore);
+    RUN_TEST(TestPeerDatabase);
+    RUN_TEST(TestPathMtuCache);
+    RUN_TEST(TestEntropyAccumulator);
+    RUN_TEST(TestEntropyDemand);
+    RUN_TEST(TestMaskEntropy);
+    RUN_TEST(TestHealthTests);
     RUN_TEST(TestMruCacheSockaddrStorage);
     RUN_TEST(TestOperatorEqualsSockaddrStorage);
     RUN_TEST(TestHashSockaddrStorage);